@@ -1,4 +1,5 @@
 var Node = {
+  crypto: require('crypto'),
   fs: require('fs'),
   path: require('path')
 };
@@ -15,6 +16,8 @@ const FSYNC = 32;
 const O_DIRECT = 64;
 const O_DSYNC = 128;
 const O_SYNC = 256;
+const NATIVE = 512;
+const ENCRYPTED = 1024;
 
 const PATH_DEFAULT = Node.path.resolve(module.filename, '..', 'file');
 
@@ -37,7 +40,7 @@ const BLOCKS = [
   33554432
 ];
 
-const FLAGS = [
+var FLAGS = [
   BUFFERED,
   BUFFERED | ALIGNED,
   O_DIRECT,
@@ -69,7 +72,14 @@ var argsIndex = 0;
 while (argsIndex < args.length) {
   var arg = args[argsIndex];
   if (/^--/.test(arg)) {
-    if (/^--block-(max|min)=\d+$/.test(arg)) {
+    if (arg === '--encryption') {
+      // Compare native writes with and without AES-256-XTS encryption:
+      FLAGS = [
+        O_DIRECT | NATIVE,
+        O_DIRECT | NATIVE | ENCRYPTED
+      ];
+      args.splice(argsIndex, 1);
+    } else if (/^--block-(max|min)=\d+$/.test(arg)) {
       var value = parseInt(arg.split('=')[1], 10);
       if (value < BLOCK_MIN) throw new Error(arg + ' < BLOCK_MIN=' + BLOCK_MIN);
       if (value > BLOCK_MAX) throw new Error(arg + ' > BLOCK_MAX=' + BLOCK_MAX);
@@ -131,6 +141,45 @@ function open(path, options, end) {
   );
 }
 
+function writeNative(fd, buffer, options, blocks, end) {
+  var position = 0;
+  function next() {
+    if (blocks-- === 0) return end(undefined, position);
+    binding.write(fd, buffer, 0, options.block, position, {},
+      function(error, result) {
+        if (error) return end(error);
+        if (result.bytes !== options.block) {
+          return end(new Error('position did not advance by a block'));
+        }
+        position += result.bytes;
+        next();
+      }
+    );
+  }
+  next();
+}
+
+function writeSync(fd, buffer, options, blocks, end) {
+  var position = 0;
+  var previous = 0;
+  while (blocks--) {
+    position += Node.fs.writeSync(
+      fd,
+      buffer,
+      0,
+      options.block,
+      position
+    );
+    if (position - previous !== options.block) {
+      throw new Error('position did not advance by a block');
+    }
+    previous = position;
+    if (options.flags & FDATASYNC) Node.fs.fdatasyncSync(fd);
+    if (options.flags & FSYNC) Node.fs.fsyncSync(fd);
+  }
+  end(undefined, position);
+}
+
 function padL(value, length) {
   var string = String(value);
   while (string.length < length) string = ' ' + string;
@@ -153,6 +202,33 @@ function parseType(path) {
   }
 }
 
+function report(fd, options, position, now) {
+  if (options.flags & AMORTIZED_FDATASYNC) Node.fs.fdatasyncSync(fd);
+  if (options.flags & AMORTIZED_FSYNC) Node.fs.fsyncSync(fd);
+  var time = Date.now() - now;
+  var throughput = ((position / (1024 * 1024)) / (time / 1000)).toFixed(2);
+  Node.fs.fdatasyncSync(fd);
+  Node.fs.closeSync(fd);
+  var result = [];
+  result.push(padL(options.block, 10));
+  result.push(Node.path.basename(path) === 'file' ? 'file' : path);
+  var type = [];
+  if (options.flags & AMORTIZED_FDATASYNC) type.push('AMORTIZED_FDATASYNC');
+  if (options.flags & AMORTIZED_FSYNC) type.push('AMORTIZED_FSYNC');
+  if (options.flags & BUFFERED) type.push('BUFFERED');
+  if (options.flags & FDATASYNC) type.push('FDATASYNC');
+  if (options.flags & FSYNC) type.push('FSYNC');
+  if (options.flags & O_DSYNC) type.push('O_DSYNC');
+  if (options.flags & O_SYNC) type.push('O_SYNC');
+  if (options.flags & O_DIRECT) type.push('O_DIRECT');
+  if (options.flags & ALIGNED) type.push('ALIGNED');
+  if (options.flags & NATIVE) type.push('NATIVE');
+  if (options.flags & ENCRYPTED) type.push('ENCRYPTED');
+  result.push(padR(type.join(' + '), 38));
+  result.push(padL(throughput, 8) + ' MB/s');
+  console.log(result.join(' | '));
+}
+
 var bufferUnaligned = Buffer.alloc(1 + SIZE, 255).slice(1, 1 + SIZE);
 var bufferAligned = binding.getAlignedBuffer(SIZE, 4096);
 var length = bufferAligned.length;
@@ -169,51 +245,27 @@ queue.onData = function(options, end) {
       } else {
         var buffer = bufferUnaligned;
       }
-      var position = 0;
-      var previous = 0;
       var blocks = Math.ceil(SIZE / options.block);
       if (options.flags & (FDATASYNC | FSYNC | O_DSYNC | O_SYNC)) {
         blocks = Math.min(options.block / 32, blocks);
       }
+      if (options.flags & ENCRYPTED) {
+        var key = Node.crypto.randomBytes(64);
+        binding.setEncryption(fd, key, { sectorSize: 4096 });
+      }
       var now = Date.now();
-      while (blocks--) {
-        position += Node.fs.writeSync(
-          fd,
-          buffer,
-          0,
-          options.block,
-          position
-        );
-        if (position - previous !== options.block) {
-          throw new Error('position did not advance by a block');
+      var write = (options.flags & NATIVE) ? writeNative : writeSync;
+      write(fd, buffer, options, blocks,
+        function(error, position) {
+          if (options.flags & ENCRYPTED) binding.setEncryption(fd, null, {});
+          if (error) {
+            Node.fs.closeSync(fd);
+            return end(error);
+          }
+          report(fd, options, position, now);
+          end();
         }
-        previous = position;
-        if (options.flags & FDATASYNC) Node.fs.fdatasyncSync(fd);
-        if (options.flags & FSYNC) Node.fs.fsyncSync(fd);
-      }
-      if (options.flags & AMORTIZED_FDATASYNC) Node.fs.fdatasyncSync(fd);
-      if (options.flags & AMORTIZED_FSYNC) Node.fs.fsyncSync(fd);
-      var time = Date.now() - now;
-      var throughput = ((position / (1024 * 1024)) / (time / 1000)).toFixed(2);
-      Node.fs.fdatasyncSync(fd);
-      Node.fs.closeSync(fd);
-      var result = [];
-      result.push(padL(options.block, 10));
-      result.push(Node.path.basename(path) === 'file' ? 'file' : path);
-      var type = [];
-      if (options.flags & AMORTIZED_FDATASYNC) type.push('AMORTIZED_FDATASYNC');
-      if (options.flags & AMORTIZED_FSYNC) type.push('AMORTIZED_FSYNC');
-      if (options.flags & BUFFERED) type.push('BUFFERED');
-      if (options.flags & FDATASYNC) type.push('FDATASYNC');
-      if (options.flags & FSYNC) type.push('FSYNC');
-      if (options.flags & O_DSYNC) type.push('O_DSYNC');
-      if (options.flags & O_SYNC) type.push('O_SYNC');
-      if (options.flags & O_DIRECT) type.push('O_DIRECT');
-      if (options.flags & ALIGNED) type.push('ALIGNED');
-      result.push(padR(type.join(' + '), 38));
-      result.push(padL(throughput, 8) + ' MB/s');
-      console.log(result.join(' | '));
-      end();
+      );
     }
   );
 };
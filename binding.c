@@ -1,3 +1,7 @@
+#if defined(__linux__)
+// For fallocate() and its hole punching flags:
+#define _GNU_SOURCE
+#endif
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
@@ -16,10 +20,31 @@
 #elif defined(__FreeBSD__) || defined(__FreeBSD_kernel_)
 #include <sys/disk.h>
 #else
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <scsi/sg.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#endif
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(_M_X64)
+#define CPU_X64
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET(features)
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define TARGET(features) __attribute__((target(features)))
+#endif
 #endif
 
 #define RESOURCE_NAME "@ronomon/direct-io"
@@ -80,6 +105,134 @@ void set_method(
   OK(napi_set_named_property(env, object, name, value));
 }
 
+static int arg_int64(napi_env env, napi_value value, int64_t* integer) {
+  assert(*integer == 0);
+  double temp = 0;
+  if (
+    napi_get_value_double(env, value, &temp) != napi_ok ||
+    temp < 0 ||
+    isnan(temp) ||
+    // Number.MAX_SAFE_INTEGER, beyond which positions would lose precision:
+    temp > 9007199254740991.0 ||
+    floor(temp) != temp
+  ) {
+    return 0;
+  }
+  *integer = (int64_t) temp;
+  assert(*integer >= 0);
+  return 1;
+}
+
+static int arg_buffer(
+  napi_env env,
+  napi_value value,
+  uint8_t** data,
+  size_t* length
+) {
+  bool is_buffer = false;
+  if (napi_is_buffer(env, value, &is_buffer) != napi_ok || !is_buffer) {
+    return 0;
+  }
+  OK(napi_get_buffer_info(env, value, (void**) data, length));
+  return 1;
+}
+
+static int arg_function(napi_env env, napi_value value) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  return type == napi_function;
+}
+
+static int arg_object(napi_env env, napi_value value) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  return type == napi_object;
+}
+
+// Options are optional properties of a plain object. Each option_*() helper
+// leaves its output untouched when the property is absent or undefined, and
+// returns 0 only if the property is present but of the wrong type or range.
+static int option_value(
+  napi_env env,
+  napi_value options,
+  const char* name,
+  napi_value* value
+) {
+  bool has = false;
+  OK(napi_has_named_property(env, options, name, &has));
+  if (!has) return 0;
+  OK(napi_get_named_property(env, options, name, value));
+  napi_valuetype type;
+  OK(napi_typeof(env, *value, &type));
+  return type != napi_undefined;
+}
+
+static int option_bool(
+  napi_env env,
+  napi_value options,
+  const char* name,
+  int* flag
+) {
+  napi_value value;
+  if (!option_value(env, options, name, &value)) return 1;
+  bool temp = false;
+  if (napi_get_value_bool(env, value, &temp) != napi_ok) return 0;
+  *flag = temp ? 1 : 0;
+  return 1;
+}
+
+static int option_int64(
+  napi_env env,
+  napi_value options,
+  const char* name,
+  int64_t* integer
+) {
+  napi_value value;
+  if (!option_value(env, options, name, &value)) return 1;
+  int64_t temp = 0;
+  if (!arg_int64(env, value, &temp)) return 0;
+  *integer = temp;
+  return 1;
+}
+
+static int option_uint32(
+  napi_env env,
+  napi_value options,
+  const char* name,
+  int* present,
+  uint32_t* integer
+) {
+  napi_value value;
+  if (!option_value(env, options, name, &value)) return 1;
+  int64_t temp = 0;
+  if (!arg_int64(env, value, &temp) || temp > UINT32_MAX) return 0;
+  *present = 1;
+  *integer = (uint32_t) temp;
+  return 1;
+}
+
+static void* aligned_malloc(size_t size, size_t alignment) {
+  assert(size > 0);
+  assert(alignment >= sizeof(void *));
+  assert((alignment & (alignment - 1)) == 0);
+#if defined(_WIN32)
+  return _aligned_malloc(size, alignment);
+#else
+  void *ptr = NULL;
+  if (posix_memalign(&ptr, alignment, size) != 0) return NULL;
+  return ptr;
+#endif
+}
+
+static void aligned_free(void* ptr) {
+  assert(ptr != NULL);
+#if defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
 struct task_data {
   int fd;
   int value;
@@ -87,6 +240,9 @@ struct task_data {
   int64_t device_sector_logical;
   int64_t device_sector_physical;
   int64_t device_size;
+  int64_t device_atomic_min;
+  int64_t device_atomic_max;
+  int64_t device_io_optimal;
   char device_serial[DEVICE_SERIAL_MAX];
   size_t device_serial_size;
   napi_ref ref_callback;
@@ -101,6 +257,9 @@ void task_assert(struct task_data* task) {
   assert(task->device_sector_logical == 0);
   assert(task->device_sector_physical == 0);
   assert(task->device_size == 0);
+  assert(task->device_atomic_min == 0);
+  assert(task->device_atomic_max == 0);
+  assert(task->device_io_optimal == 0);
   assert(task->device_serial_size == 0);
   assert(task->error == NULL);
 }
@@ -134,6 +293,9 @@ void task_complete(napi_env env, napi_status status, void* data) {
     set_int(env, argv[1], "logicalSectorSize", task->device_sector_logical);
     set_int(env, argv[1], "physicalSectorSize", task->device_sector_physical);
     set_int(env, argv[1], "size", task->device_size);
+    set_int(env, argv[1], "atomicWriteUnitMin", task->device_atomic_min);
+    set_int(env, argv[1], "atomicWriteUnitMax", task->device_atomic_max);
+    set_int(env, argv[1], "optimalIOSize", task->device_io_optimal);
     // Trim leading and trailing space from serial number:
     // On Linux, we saw a serial number with leading space trimmed by smartctl.
     char* serial = task->device_serial;
@@ -178,6 +340,9 @@ static napi_value task_queue(
   task->device_sector_logical = 0;
   task->device_sector_physical = 0;
   task->device_size = 0;
+  task->device_atomic_min = 0;
+  task->device_atomic_max = 0;
+  task->device_io_optimal = 0;
   task->device_serial_size = 0;
   task->error = NULL;
   OK(napi_create_reference(env, callback, 1, &task->ref_callback));
@@ -440,6 +605,99 @@ void task_execute_get_block_device_size(struct task_data* task) {
 #endif 
 }
 
+#if defined(__linux__)
+// Linux 6.11 reports the atomic write unit with statx(), and accepts
+// RWF_ATOMIC, neither of which older headers define. The unit is at offset
+// 0xa8 of struct statx, within the spare space of older headers:
+#if !defined(STATX_WRITE_ATOMIC)
+#define STATX_WRITE_ATOMIC 0x00010000U
+#define STATX_ATOMIC_OFFSET 0xa8
+#endif
+#if !defined(RWF_ATOMIC)
+#define RWF_ATOMIC 0x00000040
+#endif
+#endif
+
+#if defined(__linux__)
+// Reads a number from the queue directory of a block device in sysfs. A
+// partition has no queue directory of its own, and shares the queue of the
+// disk which holds it. Returns 0, or -1 if neither has the attribute:
+static int io_queue_value(dev_t device, const char* name, long long* value) {
+  const char* queues[2] = { "queue", "../queue" };
+  for (int index = 0; index < 2; index++) {
+    char path[128];
+    snprintf(
+      path,
+      sizeof(path),
+      "/sys/dev/block/%u:%u/%s/%s",
+      major(device),
+      minor(device),
+      queues[index],
+      name
+    );
+    FILE* file = fopen(path, "r");
+    if (file == NULL) continue;
+    int scanned = fscanf(file, "%lld", value);
+    fclose(file);
+    return scanned == 1 ? 0 : -1;
+  }
+  return -1;
+}
+#endif
+
+// Finds the minimum and maximum length of an untorn write to a file or block
+// device, or leaves both at 0 if atomic writes are not supported:
+static void io_atomic_units(int fd, int64_t* min, int64_t* max) {
+  *min = 0;
+  *max = 0;
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+  struct statx stx;
+  memset(&stx, 0, sizeof(stx));
+  if (statx(fd, "", AT_EMPTY_PATH, STATX_WRITE_ATOMIC, &stx) == 0) {
+    if (stx.stx_mask & STATX_WRITE_ATOMIC) {
+#if defined(STATX_ATOMIC_OFFSET)
+      uint32_t units[2];
+      memcpy(units, (uint8_t*) &stx + STATX_ATOMIC_OFFSET, sizeof(units));
+      *min = units[0];
+      *max = units[1];
+#else
+      *min = stx.stx_atomic_write_unit_min;
+      *max = stx.stx_atomic_write_unit_max;
+#endif
+      return;
+    }
+  }
+  // Fall back to sysfs for a block device on a kernel without statx() support:
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (st.st_mode & S_IFMT) != S_IFBLK) return;
+  const char* names[2] = {
+    "atomic_write_unit_min_bytes",
+    "atomic_write_unit_max_bytes"
+  };
+  int64_t* units[2] = { min, max };
+  for (int index = 0; index < 2; index++) {
+    long long bytes = 0;
+    if (io_queue_value(st.st_rdev, names[index], &bytes) != 0) return;
+    *units[index] = bytes < 0 ? 0 : (int64_t) bytes;
+  }
+  if (*max == 0) *min = 0;
+#else
+  (void) fd;
+#endif
+}
+
+// Finds the optimal I/O size of a block device, the stripe width of a RAID
+// array for example, or leaves it at 0 if the device does not report one:
+static void io_optimal_size(int fd, int64_t* size) {
+  *size = 0;
+#if defined(__linux__) && defined(BLKIOOPT)
+  unsigned int optimal = 0;
+  if (ioctl(fd, BLKIOOPT, &optimal) == 0) *size = (int64_t) optimal;
+#else
+  (void) fd;
+#endif
+}
+
 void task_execute_get_block_device(napi_env env, void* data) {
   struct task_data* task = data;
   task_assert(task);
@@ -462,6 +720,14 @@ void task_execute_get_block_device(napi_env env, void* data) {
   }
 #endif
   if (!task->error) task_execute_get_block_device_size(task);
+  if (!task->error) {
+    io_atomic_units(
+      task->fd,
+      &task->device_atomic_min,
+      &task->device_atomic_max
+    );
+    io_optimal_size(task->fd, &task->device_io_optimal);
+  }
   if (!task->error) task_execute_get_block_device_serial(task);
 }
 
@@ -537,149 +803,13855 @@ void task_execute_set_fsctl_lock_volume(napi_env env, void* data) {
 }
 #endif
 
-void free_aligned(napi_env env, void* ptr, void* hint) {
-  assert(ptr != NULL);
-#if defined(_WIN32)
-  _aligned_free(ptr);
+struct cpu_features {
+  int aes;
+  int avx2;
+  int avx512;
+  int pclmul;
+  int sse42;
+  int ssse3;
+  int vaes;
+};
+
+static struct cpu_features cpu = { 0 };
+
+#if defined(CPU_X64)
+static void cpu_cpuid(int leaf, int subleaf, unsigned int registers[4]) {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuidex(info, leaf, subleaf);
+  for (int index = 0; index < 4; index++) {
+    registers[index] = (unsigned int) info[index];
+  }
 #else
-  free(ptr);
+  __cpuid_count(
+    leaf,
+    subleaf,
+    registers[0],
+    registers[1],
+    registers[2],
+    registers[3]
+  );
 #endif
-  ptr = NULL;
 }
 
-static napi_value get_aligned_buffer(napi_env env, napi_callback_info info) {
-  size_t argc = 2;
-  napi_value argv[2];
-  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
-  int int_size = 0;
-  int int_alignment = 0;
-  if (
-    argc != 2 ||
-    !arg_int(env, argv[0], &int_size) ||
-    !arg_int(env, argv[1], &int_alignment)
-  ) {
-    THROW(env, "bad arguments, expected: (size, alignment)");
+static uint64_t cpu_xgetbv(void) {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  unsigned int eax = 0;
+  unsigned int edx = 0;
+  __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  return ((uint64_t) edx << 32) | eax;
+#endif
+}
+#endif
+
+static void cpu_init(void) {
+#if defined(CPU_X64)
+  unsigned int registers[4];
+  cpu_cpuid(0, 0, registers);
+  unsigned int leaf_max = registers[0];
+  cpu_cpuid(1, 0, registers);
+  cpu.pclmul = (registers[2] >> 1) & 1;
+  cpu.ssse3 = (registers[2] >> 9) & 1;
+  cpu.sse42 = (registers[2] >> 20) & 1;
+  cpu.aes = (registers[2] >> 25) & 1;
+  // The CPU may support AVX while the OS does not save the wider registers on
+  // a context switch, so we must also check XCR0 for YMM and ZMM state:
+  int osxsave = (registers[2] >> 27) & 1;
+  int avx = (registers[2] >> 28) & 1;
+  uint64_t xcr0 = osxsave ? cpu_xgetbv() : 0;
+  int ymm = avx && (xcr0 & 0x06) == 0x06;
+  int zmm = ymm && (xcr0 & 0xe0) == 0xe0;
+  if (leaf_max >= 7) {
+    cpu_cpuid(7, 0, registers);
+    cpu.avx2 = ymm && ((registers[1] >> 5) & 1);
+    // AVX-512 Foundation and Byte and Word instructions:
+    cpu.avx512 = (
+      zmm &&
+      ((registers[1] >> 16) & 1) &&
+      ((registers[1] >> 30) & 1)
+    );
+    // VAES is only used on ZMM registers, so requires AVX-512 as well:
+    cpu.vaes = cpu.avx512 && ((registers[2] >> 9) & 1);
   }
-  assert(int_size >= 0);
-  assert(int_alignment >= 0);
-  size_t size = (size_t) int_size;
-  size_t alignment = (size_t) int_alignment;
-  if (size == 0) THROW(env, "size must not be 0");
-  if (size > 2147483647) THROW(env, "size must be at most 2147483647 bytes");
-  if (alignment == 0) THROW(env, "alignment must not be 0");
-  if (alignment & (alignment - 1)) THROW(env, "alignment must be a power of 2");
-  // Ensure portability for software tested only on 32-bit systems:
-  if (alignment < 8) THROW(env, "alignment must be at least 8 bytes");
-  // Detect excessive alignment values:
-  if (alignment > 4194304) {
-    THROW(env, "alignment must be at most 4194304 bytes");
+#endif
+}
+
+// CRC32C (Castagnoli) in the reflected representation, where bit 31 of a
+// polynomial is the coefficient of x^0. The crc32 instruction in SSE4.2
+// implements this polynomial, which is why CRC32C is used by iSCSI, ext4 and
+// Btrfs rather than the CRC32 of zlib.
+#define CRC32C_POLY 0x82f63b78
+
+// The crc32 instruction has a latency of 3 cycles but a throughput of 1 cycle.
+// We therefore checksum large buffers as 3 independent lanes to keep the
+// pipeline full, and then fold the lanes together using PCLMULQDQ.
+#define CRC32C_LANE_LONG 8192
+#define CRC32C_LANE_SHORT 256
+
+// The best kernel supported by the CPU, which crc32c() uses:
+static const char* crc32c_name = "table";
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_x2n[64];
+static uint64_t crc32c_lane_long[2];
+static uint64_t crc32c_lane_short[2];
+
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+  assert(a != 0);
+  uint32_t product = 0;
+  for (;;) {
+    if (a & 0x80000000) {
+      product ^= b;
+      if ((a & 0x7fffffff) == 0) break;
+    }
+    a <<= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
   }
-  if (alignment < sizeof(void *)) {
-    THROW(env, "alignment must be at least as large as a pointer");
+  return product;
+}
+
+// Returns x^exponent mod p:
+static uint32_t crc32c_power(uint64_t exponent) {
+  uint32_t power = 0x80000000;
+  int n = 0;
+  while (exponent) {
+    assert(n < 64);
+    if (exponent & 1) power = crc32c_multiply(crc32c_x2n[n], power);
+    exponent >>= 1;
+    n++;
   }
-#if defined(_WIN32)
-  void *ptr = _aligned_malloc(size, alignment);
-  if (ptr == NULL) THROW(env, "insufficient memory");
-#else
-  void *ptr = NULL;
-  int result = posix_memalign(&ptr, alignment, size);
-  if (result == EINVAL) THROW(env, "bad alignment argument");
-  if (result == ENOMEM) THROW(env, "insufficient memory");
-  if (result != 0) THROW(env, "unexpected error, posix_memalign");
+  return power;
+}
+
+static void crc32c_init(void) {
+  for (uint32_t index = 0; index < 256; index++) {
+    uint32_t reg = index;
+    for (int bit = 0; bit < 8; bit++) {
+      reg = reg & 1 ? (reg >> 1) ^ CRC32C_POLY : reg >> 1;
+    }
+    crc32c_table[0][index] = reg;
+  }
+  for (int index = 0; index < 256; index++) {
+    uint32_t reg = crc32c_table[0][index];
+    for (int slice = 1; slice < 8; slice++) {
+      reg = crc32c_table[0][reg & 0xff] ^ (reg >> 8);
+      crc32c_table[slice][index] = reg;
+    }
+  }
+  // x^1, x^2, x^4, x^8 and so on:
+  uint32_t power = 0x40000000;
+  for (int n = 0; n < 64; n++) {
+    crc32c_x2n[n] = power;
+    power = crc32c_multiply(power, power);
+  }
+  // Multiplying two 32-bit reflected polynomials with PCLMULQDQ and reducing
+  // the 64-bit product with the crc32 instruction multiplies by x^33, which
+  // the fold constants must therefore divide out in advance:
+  crc32c_lane_long[0] = crc32c_power(CRC32C_LANE_LONG * 8 - 33);
+  crc32c_lane_long[1] = crc32c_power(CRC32C_LANE_LONG * 16 - 33);
+  crc32c_lane_short[0] = crc32c_power(CRC32C_LANE_SHORT * 8 - 33);
+  crc32c_lane_short[1] = crc32c_power(CRC32C_LANE_SHORT * 16 - 33);
+#if defined(CPU_X64)
+  if (cpu.sse42) crc32c_name = "sse42";
+  if (cpu.sse42 && cpu.pclmul) crc32c_name = "pclmul";
 #endif
-  assert(ptr != NULL);
-  // Check that pointer is aligned as we expect:
-  assert(((uintptr_t)(const void *)(ptr) & (alignment - 1)) == 0);
-  memset(ptr, 0, size);
-  napi_value buffer;
-  OK(napi_create_external_buffer(env, size, ptr, free_aligned, NULL, &buffer));
-  return buffer;
 }
 
-static napi_value get_block_device(napi_env env, napi_callback_info info) {
-  size_t argc = 2;
-  napi_value argv[2];
-  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
-  napi_value callback = argv[1];
-  napi_valuetype callback_type;
-  OK(napi_typeof(env, callback, &callback_type));
-  int fd = 0;
-  if (
-    argc != 2 ||
-    !arg_int(env, argv[0], &fd) ||
-    callback_type != napi_function
-  ) {
-    THROW(env, "bad arguments, expected: (fd, callback)");
+static uint32_t crc32c_update_table(
+  uint32_t reg,
+  const uint8_t* data,
+  size_t length
+) {
+  // Slicing-by-8, reading bytes individually to remain endian-neutral:
+  while (length >= 8) {
+    uint32_t low = reg ^ (
+      (uint32_t) data[0] |
+      (uint32_t) data[1] << 8 |
+      (uint32_t) data[2] << 16 |
+      (uint32_t) data[3] << 24
+    );
+    uint32_t high = (
+      (uint32_t) data[4] |
+      (uint32_t) data[5] << 8 |
+      (uint32_t) data[6] << 16 |
+      (uint32_t) data[7] << 24
+    );
+    reg = (
+      crc32c_table[7][low & 0xff] ^
+      crc32c_table[6][(low >> 8) & 0xff] ^
+      crc32c_table[5][(low >> 16) & 0xff] ^
+      crc32c_table[4][low >> 24] ^
+      crc32c_table[3][high & 0xff] ^
+      crc32c_table[2][(high >> 8) & 0xff] ^
+      crc32c_table[1][(high >> 16) & 0xff] ^
+      crc32c_table[0][high >> 24]
+    );
+    data += 8;
+    length -= 8;
   }
-  return task_queue(env, task_execute_get_block_device, fd, 0, 1, callback);
+  while (length--) reg = crc32c_table[0][(reg ^ *data++) & 0xff] ^ (reg >> 8);
+  return reg;
 }
 
-static napi_value set_f_nocache(napi_env env, napi_callback_info info) {
-#if defined(__APPLE__)
-  return task_args(env, info, task_execute_set_f_nocache);
-#else
-  THROW(env, "only supported on mac os");
-#endif
+#if defined(CPU_X64)
+TARGET("sse4.2")
+static uint32_t crc32c_update_sse42(
+  uint32_t reg,
+  const uint8_t* data,
+  size_t length
+) {
+  while (length > 0 && ((uintptr_t) data & 7)) {
+    reg = _mm_crc32_u8(reg, *data++);
+    length--;
+  }
+  uint64_t reg64 = reg;
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    reg64 = _mm_crc32_u64(reg64, word);
+    data += 8;
+    length -= 8;
+  }
+  reg = (uint32_t) reg64;
+  while (length--) reg = _mm_crc32_u8(reg, *data++);
+  return reg;
 }
 
-static napi_value set_flock(napi_env env, napi_callback_info info) {
-#if defined(_WIN32)
-  THROW(env, "not supported on windows");
-#else
-  return task_args(env, info, task_execute_set_flock);
-#endif
+TARGET("sse4.2,pclmul")
+static uint32_t crc32c_fold(uint64_t reg, uint64_t constant) {
+  __m128i product = _mm_clmulepi64_si128(
+    _mm_cvtsi64_si128((long long) reg),
+    _mm_cvtsi64_si128((long long) constant),
+    0x00
+  );
+  return (uint32_t) _mm_crc32_u64(0, (uint64_t) _mm_cvtsi128_si64(product));
 }
 
-static napi_value set_fsctl_lock_volume(napi_env env, napi_callback_info info) {
-#if defined(_WIN32)
-  return task_args(env, info, task_execute_set_fsctl_lock_volume);
-#else
-  THROW(env, "only supported on windows");
-#endif
+TARGET("sse4.2,pclmul")
+static uint32_t crc32c_update_lanes(
+  uint32_t reg,
+  const uint8_t* data,
+  size_t lane,
+  const uint64_t constants[2]
+) {
+  assert(lane % 8 == 0);
+  uint64_t a = reg;
+  uint64_t b = 0;
+  uint64_t c = 0;
+  const uint8_t* data_b = data + lane;
+  const uint8_t* data_c = data + lane * 2;
+  for (size_t index = 0; index < lane; index += 8) {
+    uint64_t word_a;
+    uint64_t word_b;
+    uint64_t word_c;
+    memcpy(&word_a, data + index, 8);
+    memcpy(&word_b, data_b + index, 8);
+    memcpy(&word_c, data_c + index, 8);
+    a = _mm_crc32_u64(a, word_a);
+    b = _mm_crc32_u64(b, word_b);
+    c = _mm_crc32_u64(c, word_c);
+  }
+  return (
+    crc32c_fold(a, constants[1]) ^
+    crc32c_fold(b, constants[0]) ^
+    (uint32_t) c
+  );
 }
 
-static napi_value Init(napi_env env, napi_value exports) {
-  // We require assert() for safety (our asserts are not side-effect free):
-#ifdef NDEBUG
-  fprintf(stderr, "NDEBUG compile flag not supported\n");
-  abort();
+TARGET("sse4.2,pclmul")
+static uint32_t crc32c_update_pclmul(
+  uint32_t reg,
+  const uint8_t* data,
+  size_t length
+) {
+  while (length > 0 && ((uintptr_t) data & 7)) {
+    reg = _mm_crc32_u8(reg, *data++);
+    length--;
+  }
+  while (length >= CRC32C_LANE_LONG * 3) {
+    reg = crc32c_update_lanes(reg, data, CRC32C_LANE_LONG, crc32c_lane_long);
+    data += CRC32C_LANE_LONG * 3;
+    length -= CRC32C_LANE_LONG * 3;
+  }
+  while (length >= CRC32C_LANE_SHORT * 3) {
+    reg = crc32c_update_lanes(reg, data, CRC32C_LANE_SHORT, crc32c_lane_short);
+    data += CRC32C_LANE_SHORT * 3;
+    length -= CRC32C_LANE_SHORT * 3;
+  }
+  return crc32c_update_sse42(reg, data, length);
+}
 #endif
-  // We use an int to represent the size of an aligned buffer.
-  // INT_MAX must therefore be sufficient for Node's own buffer.kMaxLength:
-  assert(INT_MAX >= 2147483647);
-  // On Linux, some versions of libuv did not define UV_FS_O_DIRECT correctly:
-  // As a result, UV_FS_O_DIRECT was set to 0 so we must get O_DIRECT ourselves.
-  // See: https://github.com/libuv/libuv/issues/2420
-#if defined(__linux__) && defined(__arm__)
-  int o_direct = 0x10000;
-#elif defined(__linux__) && defined(__m68k__)
-  int o_direct = 0x10000;
-#elif defined(__linux__) && defined(__mips__)
-  int o_direct = 0x08000;
-#elif defined(__linux__) && defined(__powerpc__)
-  int o_direct = 0x20000;
-#elif defined(__linux__) && defined(__s390x__)
-  int o_direct = 0x04000;
-#elif defined(__linux__) && defined(__x86_64__)
-  int o_direct = 0x04000;
-#else
-  int o_direct = UV_FS_O_DIRECT;
+
+// Selects a kernel by name, returning 0 if the CPU does not support it, so
+// that each kernel can be tested:
+static int crc32c_select(
+  const char* name,
+  uint32_t (**update)(uint32_t, const uint8_t*, size_t)
+) {
+  if (strcmp(name, "table") == 0) {
+    *update = crc32c_update_table;
+    return 1;
+  }
+#if defined(CPU_X64)
+  if (strcmp(name, "sse42") == 0 && cpu.sse42) {
+    *update = crc32c_update_sse42;
+    return 1;
+  }
+  if (strcmp(name, "pclmul") == 0 && cpu.sse42 && cpu.pclmul) {
+    *update = crc32c_update_pclmul;
+    return 1;
+  }
 #endif
-  // On Windows, libuv maps these flags as follows:
-  // UV_FS_O_DIRECT > FILE_FLAG_NO_BUFFERING
-  // UV_FS_O_DSYNC  > FILE_FLAG_WRITE_THROUGH
-  // UV_FS_O_EXLOCK > SHARING MODE=0
-  // UV_FS_O_SYNC   > FILE_FLAG_WRITE_THROUGH
-  set_int(env, exports, "O_DIRECT", o_direct);
-  set_int(env, exports, "O_DSYNC", UV_FS_O_DSYNC);
-  set_int(env, exports, "O_EXCL", UV_FS_O_EXCL);
-  set_int(env, exports, "O_EXLOCK", UV_FS_O_EXLOCK);
-  set_int(env, exports, "O_SYNC", UV_FS_O_SYNC);
+  return 0;
+}
+
+// Returns the CRC32C of data, continuing from a previous crc (initially 0):
+static uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t length) {
+  uint32_t reg = ~crc;
+#if defined(CPU_X64)
+  if (cpu.sse42 && cpu.pclmul) {
+    return ~crc32c_update_pclmul(reg, data, length);
+  } else if (cpu.sse42) {
+    return ~crc32c_update_sse42(reg, data, length);
+  }
+#endif
+  return ~crc32c_update_table(reg, data, length);
+}
+
+// Buffer kernels are selected once at load time according to CPU features.
+// Each kernel handles any alignment and length, and leaves the tail, if any,
+// to the scalar kernel.
+struct simd_kernels {
+  const char* name;
+  int (*is_zero)(const uint8_t*, size_t);
+  int (*equals)(const uint8_t*, const uint8_t*, size_t);
+  void (*xor_into)(uint8_t*, const uint8_t*, size_t);
+  void (*fill)(uint8_t*, uint8_t, size_t);
+  uint64_t (*popcount)(const uint8_t*, size_t);
+};
+
+static struct simd_kernels simd;
+
+// Fills larger than this use non-temporal stores to avoid evicting the cache:
+#define SIMD_STREAM_MIN 1048576
+
+// Each thread should have at least this much work to amortize its creation:
+#define SIMD_THREAD_MIN 1048576
+#define SIMD_THREADS_MAX 64
+
+static int simd_is_zero_scalar(const uint8_t* data, size_t length) {
+  while (length >= 64) {
+    uint64_t words[8];
+    memcpy(words, data, 64);
+    if (
+      (words[0] | words[1] | words[2] | words[3] |
+       words[4] | words[5] | words[6] | words[7]) != 0
+    ) {
+      return 0;
+    }
+    data += 64;
+    length -= 64;
+  }
+  while (length--) if (*data++) return 0;
+  return 1;
+}
+
+static int simd_equals_scalar(
+  const uint8_t* a,
+  const uint8_t* b,
+  size_t length
+) {
+  return memcmp(a, b, length) == 0;
+}
+
+static void simd_xor_into_scalar(
+  uint8_t* target,
+  const uint8_t* source,
+  size_t length
+) {
+  while (length >= 8) {
+    uint64_t a;
+    uint64_t b;
+    memcpy(&a, target, 8);
+    memcpy(&b, source, 8);
+    a ^= b;
+    memcpy(target, &a, 8);
+    target += 8;
+    source += 8;
+    length -= 8;
+  }
+  while (length--) *target++ ^= *source++;
+}
+
+static void simd_fill_scalar(uint8_t* data, uint8_t value, size_t length) {
+  memset(data, value, length);
+}
+
+static uint64_t simd_popcount_word(uint64_t word) {
+  word = word - ((word >> 1) & 0x5555555555555555ULL);
+  word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+  word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (word * 0x0101010101010101ULL) >> 56;
+}
+
+static uint64_t simd_popcount_scalar(const uint8_t* data, size_t length) {
+  uint64_t count = 0;
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    count += simd_popcount_word(word);
+    data += 8;
+    length -= 8;
+  }
+  while (length--) count += simd_popcount_word(*data++);
+  return count;
+}
+
+#if defined(CPU_X64)
+static int simd_is_zero_sse2(const uint8_t* data, size_t length) {
+  const __m128i zero = _mm_setzero_si128();
+  while (length >= 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*) data);
+    __m128i b = _mm_loadu_si128((const __m128i*) (data + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*) (data + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*) (data + 48));
+    __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xffff) return 0;
+    data += 64;
+    length -= 64;
+  }
+  return simd_is_zero_scalar(data, length);
+}
+
+static int simd_equals_sse2(const uint8_t* a, const uint8_t* b, size_t length) {
+  while (length >= 64) {
+    __m128i e0 = _mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i*) a),
+      _mm_loadu_si128((const __m128i*) b)
+    );
+    __m128i e1 = _mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i*) (a + 16)),
+      _mm_loadu_si128((const __m128i*) (b + 16))
+    );
+    __m128i e2 = _mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i*) (a + 32)),
+      _mm_loadu_si128((const __m128i*) (b + 32))
+    );
+    __m128i e3 = _mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i*) (a + 48)),
+      _mm_loadu_si128((const __m128i*) (b + 48))
+    );
+    __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+    if (_mm_movemask_epi8(all) != 0xffff) return 0;
+    a += 64;
+    b += 64;
+    length -= 64;
+  }
+  return simd_equals_scalar(a, b, length);
+}
+
+static void simd_xor_into_sse2(
+  uint8_t* target,
+  const uint8_t* source,
+  size_t length
+) {
+  while (length >= 32) {
+    __m128i a = _mm_loadu_si128((const __m128i*) target);
+    __m128i b = _mm_loadu_si128((const __m128i*) (target + 16));
+    a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*) source));
+    b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i*) (source + 16)));
+    _mm_storeu_si128((__m128i*) target, a);
+    _mm_storeu_si128((__m128i*) (target + 16), b);
+    target += 32;
+    source += 32;
+    length -= 32;
+  }
+  simd_xor_into_scalar(target, source, length);
+}
+
+static void simd_fill_sse2(uint8_t* data, uint8_t value, size_t length) {
+  if (length < SIMD_STREAM_MIN) return simd_fill_scalar(data, value, length);
+  size_t head = (16 - ((uintptr_t) data & 15)) & 15;
+  simd_fill_scalar(data, value, head);
+  data += head;
+  length -= head;
+  const __m128i pattern = _mm_set1_epi8((char) value);
+  while (length >= 64) {
+    _mm_stream_si128((__m128i*) data, pattern);
+    _mm_stream_si128((__m128i*) (data + 16), pattern);
+    _mm_stream_si128((__m128i*) (data + 32), pattern);
+    _mm_stream_si128((__m128i*) (data + 48), pattern);
+    data += 64;
+    length -= 64;
+  }
+  _mm_sfence();
+  simd_fill_scalar(data, value, length);
+}
+
+static uint64_t simd_popcount_sse2(const uint8_t* data, size_t length) {
+  const __m128i m1 = _mm_set1_epi8(0x55);
+  const __m128i m2 = _mm_set1_epi8(0x33);
+  const __m128i m4 = _mm_set1_epi8(0x0f);
+  __m128i total = _mm_setzero_si128();
+  while (length >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) data);
+    v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi64(v, 1), m1));
+    v = _mm_add_epi8(
+      _mm_and_si128(v, m2),
+      _mm_and_si128(_mm_srli_epi64(v, 2), m2)
+    );
+    v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi64(v, 4)), m4);
+    total = _mm_add_epi64(total, _mm_sad_epu8(v, _mm_setzero_si128()));
+    data += 16;
+    length -= 16;
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i*) lanes, total);
+  return lanes[0] + lanes[1] + simd_popcount_scalar(data, length);
+}
+
+TARGET("avx2")
+static int simd_is_zero_avx2(const uint8_t* data, size_t length) {
+  while (length >= 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) data);
+    __m256i b = _mm256_loadu_si256((const __m256i*) (data + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*) (data + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i*) (data + 96));
+    __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+    if (!_mm256_testz_si256(any, any)) return 0;
+    data += 128;
+    length -= 128;
+  }
+  return simd_is_zero_scalar(data, length);
+}
+
+TARGET("avx2")
+static int simd_equals_avx2(const uint8_t* a, const uint8_t* b, size_t length) {
+  while (length >= 128) {
+    __m256i x0 = _mm256_xor_si256(
+      _mm256_loadu_si256((const __m256i*) a),
+      _mm256_loadu_si256((const __m256i*) b)
+    );
+    __m256i x1 = _mm256_xor_si256(
+      _mm256_loadu_si256((const __m256i*) (a + 32)),
+      _mm256_loadu_si256((const __m256i*) (b + 32))
+    );
+    __m256i x2 = _mm256_xor_si256(
+      _mm256_loadu_si256((const __m256i*) (a + 64)),
+      _mm256_loadu_si256((const __m256i*) (b + 64))
+    );
+    __m256i x3 = _mm256_xor_si256(
+      _mm256_loadu_si256((const __m256i*) (a + 96)),
+      _mm256_loadu_si256((const __m256i*) (b + 96))
+    );
+    __m256i any = _mm256_or_si256(
+      _mm256_or_si256(x0, x1),
+      _mm256_or_si256(x2, x3)
+    );
+    if (!_mm256_testz_si256(any, any)) return 0;
+    a += 128;
+    b += 128;
+    length -= 128;
+  }
+  return simd_equals_scalar(a, b, length);
+}
+
+TARGET("avx2")
+static void simd_xor_into_avx2(
+  uint8_t* target,
+  const uint8_t* source,
+  size_t length
+) {
+  while (length >= 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) target);
+    __m256i b = _mm256_loadu_si256((const __m256i*) (target + 32));
+    a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*) source));
+    b = _mm256_xor_si256(
+      b,
+      _mm256_loadu_si256((const __m256i*) (source + 32))
+    );
+    _mm256_storeu_si256((__m256i*) target, a);
+    _mm256_storeu_si256((__m256i*) (target + 32), b);
+    target += 64;
+    source += 64;
+    length -= 64;
+  }
+  simd_xor_into_scalar(target, source, length);
+}
+
+TARGET("avx2")
+static void simd_fill_avx2(uint8_t* data, uint8_t value, size_t length) {
+  if (length < SIMD_STREAM_MIN) return simd_fill_scalar(data, value, length);
+  size_t head = (32 - ((uintptr_t) data & 31)) & 31;
+  simd_fill_scalar(data, value, head);
+  data += head;
+  length -= head;
+  const __m256i pattern = _mm256_set1_epi8((char) value);
+  while (length >= 128) {
+    _mm256_stream_si256((__m256i*) data, pattern);
+    _mm256_stream_si256((__m256i*) (data + 32), pattern);
+    _mm256_stream_si256((__m256i*) (data + 64), pattern);
+    _mm256_stream_si256((__m256i*) (data + 96), pattern);
+    data += 128;
+    length -= 128;
+  }
+  _mm_sfence();
+  simd_fill_scalar(data, value, length);
+}
+
+// Popcount by nibble lookup with PSHUFB (Mula, Kurz and Lemire):
+TARGET("avx2")
+static uint64_t simd_popcount_avx2(const uint8_t* data, size_t length) {
+  const __m256i lookup = _mm256_setr_epi8(
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+  );
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  __m256i total = _mm256_setzero_si256();
+  while (length >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) data);
+    __m256i count = _mm256_add_epi8(
+      _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+      _mm256_shuffle_epi8(
+        lookup,
+        _mm256_and_si256(_mm256_srli_epi16(v, 4), low)
+      )
+    );
+    total = _mm256_add_epi64(
+      total,
+      _mm256_sad_epu8(count, _mm256_setzero_si256())
+    );
+    data += 32;
+    length -= 32;
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i*) lanes, total);
+  return (
+    lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+    simd_popcount_scalar(data, length)
+  );
+}
+
+TARGET("avx512f,avx512bw")
+static int simd_is_zero_avx512(const uint8_t* data, size_t length) {
+  while (length >= 256) {
+    __m512i a = _mm512_loadu_si512((const void*) data);
+    __m512i b = _mm512_loadu_si512((const void*) (data + 64));
+    __m512i c = _mm512_loadu_si512((const void*) (data + 128));
+    __m512i d = _mm512_loadu_si512((const void*) (data + 192));
+    __m512i any = _mm512_or_si512(_mm512_or_si512(a, b), _mm512_or_si512(c, d));
+    if (_mm512_test_epi64_mask(any, any)) return 0;
+    data += 256;
+    length -= 256;
+  }
+  return simd_is_zero_scalar(data, length);
+}
+
+TARGET("avx512f,avx512bw")
+static int simd_equals_avx512(
+  const uint8_t* a,
+  const uint8_t* b,
+  size_t length
+) {
+  while (length >= 256) {
+    __m512i x0 = _mm512_xor_si512(
+      _mm512_loadu_si512((const void*) a),
+      _mm512_loadu_si512((const void*) b)
+    );
+    __m512i x1 = _mm512_xor_si512(
+      _mm512_loadu_si512((const void*) (a + 64)),
+      _mm512_loadu_si512((const void*) (b + 64))
+    );
+    __m512i x2 = _mm512_xor_si512(
+      _mm512_loadu_si512((const void*) (a + 128)),
+      _mm512_loadu_si512((const void*) (b + 128))
+    );
+    __m512i x3 = _mm512_xor_si512(
+      _mm512_loadu_si512((const void*) (a + 192)),
+      _mm512_loadu_si512((const void*) (b + 192))
+    );
+    __m512i any = _mm512_or_si512(
+      _mm512_or_si512(x0, x1),
+      _mm512_or_si512(x2, x3)
+    );
+    if (_mm512_test_epi64_mask(any, any)) return 0;
+    a += 256;
+    b += 256;
+    length -= 256;
+  }
+  return simd_equals_scalar(a, b, length);
+}
+
+TARGET("avx512f,avx512bw")
+static void simd_xor_into_avx512(
+  uint8_t* target,
+  const uint8_t* source,
+  size_t length
+) {
+  while (length >= 128) {
+    __m512i a = _mm512_loadu_si512((const void*) target);
+    __m512i b = _mm512_loadu_si512((const void*) (target + 64));
+    a = _mm512_xor_si512(a, _mm512_loadu_si512((const void*) source));
+    b = _mm512_xor_si512(b, _mm512_loadu_si512((const void*) (source + 64)));
+    _mm512_storeu_si512((void*) target, a);
+    _mm512_storeu_si512((void*) (target + 64), b);
+    target += 128;
+    source += 128;
+    length -= 128;
+  }
+  simd_xor_into_scalar(target, source, length);
+}
+
+TARGET("avx512f,avx512bw")
+static void simd_fill_avx512(uint8_t* data, uint8_t value, size_t length) {
+  if (length < SIMD_STREAM_MIN) return simd_fill_scalar(data, value, length);
+  size_t head = (64 - ((uintptr_t) data & 63)) & 63;
+  simd_fill_scalar(data, value, head);
+  data += head;
+  length -= head;
+  const __m512i pattern = _mm512_set1_epi8((char) value);
+  while (length >= 256) {
+    _mm512_stream_si512((void*) data, pattern);
+    _mm512_stream_si512((void*) (data + 64), pattern);
+    _mm512_stream_si512((void*) (data + 128), pattern);
+    _mm512_stream_si512((void*) (data + 192), pattern);
+    data += 256;
+    length -= 256;
+  }
+  _mm_sfence();
+  simd_fill_scalar(data, value, length);
+}
+
+TARGET("avx512f,avx512bw")
+static uint64_t simd_popcount_avx512(const uint8_t* data, size_t length) {
+  const __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+  ));
+  const __m512i low = _mm512_set1_epi8(0x0f);
+  __m512i total = _mm512_setzero_si512();
+  while (length >= 64) {
+    __m512i v = _mm512_loadu_si512((const void*) data);
+    __m512i count = _mm512_add_epi8(
+      _mm512_shuffle_epi8(lookup, _mm512_and_si512(v, low)),
+      _mm512_shuffle_epi8(
+        lookup,
+        _mm512_and_si512(_mm512_srli_epi16(v, 4), low)
+      )
+    );
+    total = _mm512_add_epi64(
+      total,
+      _mm512_sad_epu8(count, _mm512_setzero_si512())
+    );
+    data += 64;
+    length -= 64;
+  }
+  return (
+    (uint64_t) _mm512_reduce_add_epi64(total) +
+    simd_popcount_scalar(data, length)
+  );
+}
+#endif
+
+static void simd_init(void) {
+  simd.name = "scalar";
+  simd.is_zero = simd_is_zero_scalar;
+  simd.equals = simd_equals_scalar;
+  simd.xor_into = simd_xor_into_scalar;
+  simd.fill = simd_fill_scalar;
+  simd.popcount = simd_popcount_scalar;
+#if defined(CPU_X64)
+  // SSE2 is part of the x86-64 baseline:
+  simd.name = "sse2";
+  simd.is_zero = simd_is_zero_sse2;
+  simd.equals = simd_equals_sse2;
+  simd.xor_into = simd_xor_into_sse2;
+  simd.fill = simd_fill_sse2;
+  simd.popcount = simd_popcount_sse2;
+  if (cpu.avx2) {
+    simd.name = "avx2";
+    simd.is_zero = simd_is_zero_avx2;
+    simd.equals = simd_equals_avx2;
+    simd.xor_into = simd_xor_into_avx2;
+    simd.fill = simd_fill_avx2;
+    simd.popcount = simd_popcount_avx2;
+  }
+  if (cpu.avx512) {
+    simd.name = "avx512";
+    simd.is_zero = simd_is_zero_avx512;
+    simd.equals = simd_equals_avx512;
+    simd.xor_into = simd_xor_into_avx512;
+    simd.fill = simd_fill_avx512;
+    simd.popcount = simd_popcount_avx512;
+  }
+#endif
+}
+
+#define SIMD_IS_ZERO 1
+#define SIMD_EQUALS 2
+#define SIMD_XOR_INTO 3
+#define SIMD_FILL 4
+#define SIMD_POPCOUNT 5
+
+struct simd_job {
+  int kernel;
+  uint8_t* a;
+  const uint8_t* b;
+  size_t length;
+  uint8_t value;
+  uint64_t result;
+};
+
+static void simd_job_run(void* data) {
+  struct simd_job* job = data;
+  switch (job->kernel) {
+    case SIMD_IS_ZERO:
+      job->result = (uint64_t) simd.is_zero(job->a, job->length);
+      break;
+    case SIMD_EQUALS:
+      job->result = (uint64_t) simd.equals(job->a, job->b, job->length);
+      break;
+    case SIMD_XOR_INTO:
+      simd.xor_into(job->a, job->b, job->length);
+      break;
+    case SIMD_FILL:
+      simd.fill(job->a, job->value, job->length);
+      break;
+    case SIMD_POPCOUNT:
+      job->result = simd.popcount(job->a, job->length);
+      break;
+    default:
+      abort();
+  }
+}
+
+// Runs a kernel, splitting large inputs across threads. The calling thread
+// takes the first slice, and boundaries fall on 64-byte multiples so that each
+// slice keeps the alignment of the buffer. Returns the conjunction of boolean
+// kernels, or the sum of popcounts.
+static uint64_t simd_run(
+  int kernel,
+  uint8_t* a,
+  const uint8_t* b,
+  size_t length,
+  uint8_t value,
+  int threads
+) {
+  assert(threads >= 1 && threads <= SIMD_THREADS_MAX);
+  if ((size_t) threads > length / SIMD_THREAD_MIN) {
+    threads = (int) (length / SIMD_THREAD_MIN);
+  }
+  if (threads < 1) threads = 1;
+  struct simd_job jobs[SIMD_THREADS_MAX];
+  uv_thread_t tids[SIMD_THREADS_MAX];
+  size_t slice = (length / (size_t) threads + 63) & ~((size_t) 63);
+  size_t offset = 0;
+  for (int index = 0; index < threads; index++) {
+    size_t size = length - offset < slice ? length - offset : slice;
+    jobs[index].kernel = kernel;
+    jobs[index].a = a + offset;
+    jobs[index].b = b ? b + offset : NULL;
+    jobs[index].length = size;
+    jobs[index].value = value;
+    jobs[index].result = 0;
+    offset += size;
+  }
+  assert(offset == length);
+  int created = 1;
+  while (created < threads) {
+    if (uv_thread_create(&tids[created], simd_job_run, &jobs[created]) != 0) {
+      break;
+    }
+    created++;
+  }
+  simd_job_run(&jobs[0]);
+  // Run any slices for which a thread could not be created:
+  for (int index = created; index < threads; index++) {
+    simd_job_run(&jobs[index]);
+  }
+  for (int index = 1; index < created; index++) {
+    int joined = uv_thread_join(&tids[index]);
+    assert(joined == 0);
+  }
+  uint64_t result = kernel == SIMD_POPCOUNT ? 0 : 1;
+  for (int index = 0; index < threads; index++) {
+    if (kernel == SIMD_POPCOUNT) {
+      result += jobs[index].result;
+    } else if (kernel == SIMD_IS_ZERO || kernel == SIMD_EQUALS) {
+      result = result && jobs[index].result;
+    }
+  }
+  return result;
+}
+
+// BLAKE3 splits its input into 1 KiB chunks, hashes each chunk to a chaining
+// value, and merges chaining values pairwise up a binary tree, so that any
+// complete subtree can be hashed independently of the rest of the input.
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_STACK_MAX 54
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+
+static const uint32_t BLAKE3_IV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// The message permutation applied before each of the 7 rounds:
+static const uint8_t BLAKE3_SCHEDULE[7][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+  { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+  { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+  { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+  { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+  { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+};
+
+struct blake3_output {
+  uint32_t cv[8];
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint64_t counter;
+  uint32_t block_len;
+  uint32_t flags;
+};
+
+struct blake3_chunk {
+  uint32_t cv[8];
+  uint64_t counter;
+  uint8_t buffer[BLAKE3_BLOCK_LEN];
+  size_t buffer_len;
+  size_t blocks;
+};
+
+struct blake3_hasher {
+  struct blake3_chunk chunk;
+  uint32_t stack[BLAKE3_STACK_MAX][8];
+  int stack_len;
+};
+
+static uint32_t blake3_rotr(uint32_t word, int bits) {
+  return (word >> bits) | (word << (32 - bits));
+}
+
+static void blake3_g(
+  uint32_t* state,
+  int a,
+  int b,
+  int c,
+  int d,
+  uint32_t x,
+  uint32_t y
+) {
+  state[a] = state[a] + state[b] + x;
+  state[d] = blake3_rotr(state[d] ^ state[a], 16);
+  state[c] = state[c] + state[d];
+  state[b] = blake3_rotr(state[b] ^ state[c], 12);
+  state[a] = state[a] + state[b] + y;
+  state[d] = blake3_rotr(state[d] ^ state[a], 8);
+  state[c] = state[c] + state[d];
+  state[b] = blake3_rotr(state[b] ^ state[c], 7);
+}
+
+static void blake3_compress(
+  const uint32_t cv[8],
+  const uint8_t block[BLAKE3_BLOCK_LEN],
+  uint32_t block_len,
+  uint64_t counter,
+  uint32_t flags,
+  uint32_t out[16]
+) {
+  uint32_t m[16];
+  for (int index = 0; index < 16; index++) {
+    m[index] = (
+      ((uint32_t) block[index * 4 + 0] << 0) |
+      ((uint32_t) block[index * 4 + 1] << 8) |
+      ((uint32_t) block[index * 4 + 2] << 16) |
+      ((uint32_t) block[index * 4 + 3] << 24)
+    );
+  }
+  uint32_t state[16] = {
+    cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+    BLAKE3_IV[0], BLAKE3_IV[1], BLAKE3_IV[2], BLAKE3_IV[3],
+    (uint32_t) counter, (uint32_t) (counter >> 32), block_len, flags
+  };
+  for (int round = 0; round < 7; round++) {
+    const uint8_t* s = BLAKE3_SCHEDULE[round];
+    blake3_g(state, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+    blake3_g(state, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+    blake3_g(state, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+    blake3_g(state, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+    blake3_g(state, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+    blake3_g(state, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+    blake3_g(state, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+    blake3_g(state, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+  }
+  for (int index = 0; index < 8; index++) {
+    out[index] = state[index] ^ state[index + 8];
+    out[index + 8] = state[index + 8] ^ cv[index];
+  }
+}
+
+static void blake3_output_cv(struct blake3_output* output, uint32_t cv[8]) {
+  uint32_t out[16];
+  blake3_compress(
+    output->cv,
+    output->block,
+    output->block_len,
+    output->counter,
+    output->flags,
+    out
+  );
+  memcpy(cv, out, 32);
+}
+
+static void blake3_output_root(
+  struct blake3_output* output,
+  uint8_t hash[BLAKE3_OUT_LEN]
+) {
+  uint32_t out[16];
+  blake3_compress(
+    output->cv,
+    output->block,
+    output->block_len,
+    0,
+    output->flags | BLAKE3_ROOT,
+    out
+  );
+  for (int index = 0; index < 8; index++) {
+    hash[index * 4 + 0] = (uint8_t) (out[index] >> 0);
+    hash[index * 4 + 1] = (uint8_t) (out[index] >> 8);
+    hash[index * 4 + 2] = (uint8_t) (out[index] >> 16);
+    hash[index * 4 + 3] = (uint8_t) (out[index] >> 24);
+  }
+}
+
+static void blake3_parent(
+  const uint32_t left[8],
+  const uint32_t right[8],
+  struct blake3_output* output
+) {
+  memcpy(output->cv, BLAKE3_IV, 32);
+  for (int index = 0; index < 8; index++) {
+    uint32_t l = left[index];
+    uint32_t r = right[index];
+    for (int byte = 0; byte < 4; byte++) {
+      output->block[index * 4 + byte] = (uint8_t) (l >> (byte * 8));
+      output->block[32 + index * 4 + byte] = (uint8_t) (r >> (byte * 8));
+    }
+  }
+  output->counter = 0;
+  output->block_len = BLAKE3_BLOCK_LEN;
+  output->flags = BLAKE3_PARENT;
+}
+
+static void blake3_parent_cv(
+  const uint32_t left[8],
+  const uint32_t right[8],
+  uint32_t cv[8]
+) {
+  struct blake3_output output;
+  blake3_parent(left, right, &output);
+  blake3_output_cv(&output, cv);
+}
+
+static void blake3_chunk_init(struct blake3_chunk* chunk, uint64_t counter) {
+  memcpy(chunk->cv, BLAKE3_IV, 32);
+  chunk->counter = counter;
+  chunk->buffer_len = 0;
+  chunk->blocks = 0;
+}
+
+static size_t blake3_chunk_len(struct blake3_chunk* chunk) {
+  return chunk->blocks * BLAKE3_BLOCK_LEN + chunk->buffer_len;
+}
+
+static uint32_t blake3_chunk_start(struct blake3_chunk* chunk) {
+  return chunk->blocks == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+static void blake3_chunk_update(
+  struct blake3_chunk* chunk,
+  const uint8_t* input,
+  size_t length
+) {
+  while (length > 0) {
+    // Keep the last block buffered, since it must be compressed as CHUNK_END:
+    if (chunk->buffer_len == BLAKE3_BLOCK_LEN) {
+      uint32_t out[16];
+      blake3_compress(
+        chunk->cv,
+        chunk->buffer,
+        BLAKE3_BLOCK_LEN,
+        chunk->counter,
+        blake3_chunk_start(chunk),
+        out
+      );
+      memcpy(chunk->cv, out, 32);
+      chunk->blocks++;
+      chunk->buffer_len = 0;
+    }
+    size_t take = BLAKE3_BLOCK_LEN - chunk->buffer_len;
+    if (take > length) take = length;
+    memcpy(chunk->buffer + chunk->buffer_len, input, take);
+    chunk->buffer_len += take;
+    input += take;
+    length -= take;
+  }
+}
+
+static void blake3_chunk_output(
+  struct blake3_chunk* chunk,
+  struct blake3_output* output
+) {
+  memcpy(output->cv, chunk->cv, 32);
+  memset(output->block, 0, BLAKE3_BLOCK_LEN);
+  memcpy(output->block, chunk->buffer, chunk->buffer_len);
+  output->counter = chunk->counter;
+  output->block_len = (uint32_t) chunk->buffer_len;
+  output->flags = blake3_chunk_start(chunk) | BLAKE3_CHUNK_END;
+}
+
+// Starts a hasher at a chunk counter, which is 0 unless the hasher is to hash
+// a subtree whose first chunk is at that counter:
+static void blake3_init(struct blake3_hasher* hasher, uint64_t counter) {
+  blake3_chunk_init(&hasher->chunk, counter);
+  hasher->stack_len = 0;
+}
+
+// Merges the chaining value of a completed chunk into the stack, where the
+// number of trailing zero bits in the total number of chunks is the number of
+// subtrees which are now complete:
+static void blake3_push(
+  struct blake3_hasher* hasher,
+  uint32_t cv[8],
+  uint64_t chunks
+) {
+  while ((chunks & 1) == 0) {
+    assert(hasher->stack_len > 0);
+    hasher->stack_len--;
+    blake3_parent_cv(hasher->stack[hasher->stack_len], cv, cv);
+    chunks >>= 1;
+  }
+  assert(hasher->stack_len < BLAKE3_STACK_MAX);
+  memcpy(hasher->stack[hasher->stack_len++], cv, 32);
+}
+
+static void blake3_update(
+  struct blake3_hasher* hasher,
+  const uint8_t* input,
+  size_t length
+) {
+  while (length > 0) {
+    // A completed chunk is only merged once more input arrives, since the
+    // last chunk must be finalized differently:
+    if (blake3_chunk_len(&hasher->chunk) == BLAKE3_CHUNK_LEN) {
+      struct blake3_output output;
+      uint32_t cv[8];
+      blake3_chunk_output(&hasher->chunk, &output);
+      blake3_output_cv(&output, cv);
+      uint64_t chunks = hasher->chunk.counter + 1;
+      blake3_push(hasher, cv, chunks);
+      blake3_chunk_init(&hasher->chunk, chunks);
+    }
+    size_t take = BLAKE3_CHUNK_LEN - blake3_chunk_len(&hasher->chunk);
+    if (take > length) take = length;
+    blake3_chunk_update(&hasher->chunk, input, take);
+    input += take;
+    length -= take;
+  }
+}
+
+// Merges the output of the rightmost subtree with every subtree on the stack,
+// from right to left, leaving the output of the root node:
+static void blake3_merge(
+  struct blake3_hasher* hasher,
+  struct blake3_output* output
+) {
+  int remaining = hasher->stack_len;
+  while (remaining > 0) {
+    uint32_t cv[8];
+    blake3_output_cv(output, cv);
+    remaining--;
+    blake3_parent(hasher->stack[remaining], cv, output);
+  }
+}
+
+static void blake3_hasher_output(
+  struct blake3_hasher* hasher,
+  struct blake3_output* output
+) {
+  blake3_chunk_output(&hasher->chunk, output);
+  blake3_merge(hasher, output);
+}
+
+static void blake3_finalize(
+  struct blake3_hasher* hasher,
+  uint8_t hash[BLAKE3_OUT_LEN]
+) {
+  struct blake3_output output;
+  blake3_hasher_output(hasher, &output);
+  blake3_output_root(&output, hash);
+}
+
+static void blake3(
+  const uint8_t* input,
+  size_t length,
+  uint8_t hash[BLAKE3_OUT_LEN]
+) {
+  struct blake3_hasher hasher;
+  blake3_init(&hasher, 0);
+  blake3_update(&hasher, input, length);
+  blake3_finalize(&hasher, hash);
+}
+
+// Content-defined chunking (FastCDC) finds chunk boundaries with a Gear hash,
+// where each byte shifts the hash left by 1 and adds a random 64-bit value for
+// the byte, so that the hash at a position depends only on the last 64 bytes.
+// A boundary follows the first position whose hash has zeroes in the bits of
+// a mask, using a harder mask before the average chunk size and an easier mask
+// after it, to narrow the distribution of chunk sizes. The mask takes the top
+// bits of the hash, since these depend on the most bytes.
+#define CDC_WINDOW 64
+#define CDC_AVG_MIN 256
+#define CDC_AVG_MAX 16777216
+#define CDC_SIZE_MAX 268435456
+// Each lane of the vectorized kernels hashes a stripe of this many positions:
+#define CDC_STRIPE 512
+
+static uint64_t CDC_GEAR[256];
+
+// Returns the first position from "from" up to "to" whose hash has zeroes in
+// the bits of the mask, or "to" if there is none. The caller guarantees that
+// the 63 bytes before "from" are readable, since they are part of the window.
+static size_t (*cdc_find)(const uint8_t*, size_t, size_t, uint64_t);
+
+// The best kernel supported by the CPU, which a chunker uses by default:
+static const char* cdc_name = "scalar";
+
+static size_t cdc_find_scalar(
+  const uint8_t* bytes,
+  size_t from,
+  size_t to,
+  uint64_t mask
+) {
+  assert(from >= CDC_WINDOW - 1);
+  uint64_t hash = 0;
+  for (size_t index = from - (CDC_WINDOW - 1); index < from; index++) {
+    hash = (hash << 1) + CDC_GEAR[bytes[index]];
+  }
+  for (size_t index = from; index < to; index++) {
+    hash = (hash << 1) + CDC_GEAR[bytes[index]];
+    if ((hash & mask) == 0) return index;
+  }
+  return to;
+}
+
+#if defined(CPU_X64)
+// The Gear hash is a serial dependency within a stripe, but since the hash at
+// a position depends only on its window, we can hash several stripes at once,
+// one per lane, after warming up each lane on the window before its stripe.
+// The first match of the first lane with a match is the first match overall.
+TARGET("avx2")
+static size_t cdc_find_avx2(
+  const uint8_t* bytes,
+  size_t from,
+  size_t to,
+  uint64_t mask
+) {
+  assert(from >= CDC_WINDOW - 1);
+  const __m256i masks = _mm256_set1_epi64x((long long) mask);
+  const __m256i zero = _mm256_setzero_si256();
+  while (to - from >= CDC_STRIPE * 4) {
+    const uint8_t* lane = bytes + from - (CDC_WINDOW - 1);
+    __m256i hash = zero;
+    size_t found[4] = { SIZE_MAX, SIZE_MAX, SIZE_MAX, SIZE_MAX };
+    int pending = 15;
+    for (size_t step = 0; step < CDC_STRIPE + CDC_WINDOW - 1; step++) {
+      __m256i index = _mm256_set_epi64x(
+        lane[step + CDC_STRIPE * 3],
+        lane[step + CDC_STRIPE * 2],
+        lane[step + CDC_STRIPE],
+        lane[step]
+      );
+      hash = _mm256_add_epi64(
+        _mm256_slli_epi64(hash, 1),
+        _mm256_i64gather_epi64((const long long*) CDC_GEAR, index, 8)
+      );
+      if (step < CDC_WINDOW - 1) continue;
+      int matches = _mm256_movemask_pd(_mm256_castsi256_pd(
+        _mm256_cmpeq_epi64(_mm256_and_si256(hash, masks), zero)
+      )) & pending;
+      if (matches == 0) continue;
+      size_t position = from + step - (CDC_WINDOW - 1);
+      if (matches & 1) return position;
+      for (int l = 1; l < 4; l++) {
+        if (matches & (1 << l)) found[l] = position + (size_t) l * CDC_STRIPE;
+      }
+      pending &= ~matches;
+    }
+    for (int l = 1; l < 4; l++) {
+      if (found[l] != SIZE_MAX) return found[l];
+    }
+    from += CDC_STRIPE * 4;
+  }
+  return cdc_find_scalar(bytes, from, to, mask);
+}
+
+TARGET("avx512f")
+static size_t cdc_find_avx512(
+  const uint8_t* bytes,
+  size_t from,
+  size_t to,
+  uint64_t mask
+) {
+  assert(from >= CDC_WINDOW - 1);
+  const __m512i masks = _mm512_set1_epi64((long long) mask);
+  const __m512i stripes = _mm512_set_epi64(
+    CDC_STRIPE * 7, CDC_STRIPE * 6, CDC_STRIPE * 5, CDC_STRIPE * 4,
+    CDC_STRIPE * 3, CDC_STRIPE * 2, CDC_STRIPE, 0
+  );
+  // The gather of bytes reads 8 bytes for each, so stop 8 bytes short:
+  while (to - from >= CDC_STRIPE * 8 + 8) {
+    const uint8_t* lane = bytes + from - (CDC_WINDOW - 1);
+    __m512i hash = _mm512_setzero_si512();
+    size_t found[8];
+    for (int l = 0; l < 8; l++) found[l] = SIZE_MAX;
+    __mmask8 pending = 0xff;
+    for (size_t step = 0; step < CDC_STRIPE + CDC_WINDOW - 1; step++) {
+      // Gather the 8 bytes of the step as 64-bit indices into the table:
+      __m512i offsets = _mm512_add_epi64(
+        stripes,
+        _mm512_set1_epi64((long long) step)
+      );
+      __m512i index = _mm512_and_si512(
+        _mm512_i64gather_epi64(offsets, (const void*) lane, 1),
+        _mm512_set1_epi64(0xff)
+      );
+      hash = _mm512_add_epi64(
+        _mm512_slli_epi64(hash, 1),
+        _mm512_i64gather_epi64(index, (const void*) CDC_GEAR, 8)
+      );
+      if (step < CDC_WINDOW - 1) continue;
+      __mmask8 matches = _mm512_testn_epi64_mask(hash, masks) & pending;
+      if (matches == 0) continue;
+      size_t position = from + step - (CDC_WINDOW - 1);
+      if (matches & 1) return position;
+      for (int l = 1; l < 8; l++) {
+        if (matches & (1 << l)) found[l] = position + (size_t) l * CDC_STRIPE;
+      }
+      pending &= (__mmask8) ~matches;
+    }
+    for (int l = 1; l < 8; l++) {
+      if (found[l] != SIZE_MAX) return found[l];
+    }
+    from += CDC_STRIPE * 8;
+  }
+  return cdc_find_avx2(bytes, from, to, mask);
+}
+#endif
+
+static void cdc_init(void) {
+  // The table must never change, since chunk boundaries, and therefore dedup
+  // across backups, depend on it. We derive it from SplitMix64:
+  uint64_t state = 0x4765617248617368ULL;
+  for (int index = 0; index < 256; index++) {
+    state += 0x9e3779b97f4a7c15ULL;
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    CDC_GEAR[index] = z ^ (z >> 31);
+  }
+  cdc_find = cdc_find_scalar;
+#if defined(CPU_X64)
+  if (cpu.avx2) cdc_find = cdc_find_avx2;
+  if (cpu.avx512) cdc_find = cdc_find_avx512;
+  if (cpu.avx2) cdc_name = "avx2";
+  if (cpu.avx512) cdc_name = "avx512";
+#endif
+}
+
+// Selects a kernel by name, returning 0 if the CPU does not support it, so
+// that each kernel can be tested:
+static int cdc_select(
+  const char* name,
+  size_t (**find)(const uint8_t*, size_t, size_t, uint64_t)
+) {
+  if (strcmp(name, "scalar") == 0) {
+    *find = cdc_find_scalar;
+    return 1;
+  }
+#if defined(CPU_X64)
+  if (strcmp(name, "avx2") == 0 && cpu.avx2) {
+    *find = cdc_find_avx2;
+    return 1;
+  }
+  if (strcmp(name, "avx512") == 0 && cpu.avx512) {
+    *find = cdc_find_avx512;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+struct cdc_chunk {
+  int64_t offset;
+  int64_t length;
+  uint8_t hash[BLAKE3_OUT_LEN];
+};
+
+// A chunker carries its state across buffers, namely the current chunk, its
+// hash so far, and the window of the last 63 bytes:
+struct chunker {
+  int64_t min;
+  int64_t avg;
+  int64_t max;
+  uint64_t mask_hard;
+  uint64_t mask_easy;
+  int64_t position;
+  int64_t start;
+  uint8_t tail[CDC_WINDOW - 1];
+  struct blake3_hasher hasher;
+  size_t (*find)(const uint8_t*, size_t, size_t, uint64_t);
+  int busy;
+};
+
+static const napi_type_tag CHUNKER_TYPE_TAG = {
+  0x6368756e6b657201ULL, 0x5a0f2c83d1b64e97ULL
+};
+
+static uint64_t cdc_mask(int bits) {
+  return bits <= 0 ? 0 : ~0ULL << (64 - bits);
+}
+
+static void chunker_reset(struct chunker* chunker) {
+  chunker->position = 0;
+  chunker->start = 0;
+  memset(chunker->tail, 0, sizeof(chunker->tail));
+  blake3_init(&chunker->hasher, 0);
+}
+
+// Searches positions of a buffer, where a window may reach back into the tail:
+static size_t chunker_find(
+  const struct chunker* chunker,
+  const uint8_t* head,
+  const uint8_t* data,
+  size_t from,
+  size_t to,
+  uint64_t mask
+) {
+  const size_t tail = CDC_WINDOW - 1;
+  if (from < tail) {
+    size_t end = to < tail ? to : tail;
+    size_t found = chunker->find(head, from + tail, end + tail, mask);
+    if (found < end + tail) return found - tail;
+    from = end;
+  }
+  if (from < to) return chunker->find(data, from, to, mask);
+  return to;
+}
+
+// Chunks a buffer, appending each chunk which ends within the buffer:
+static int chunker_update(
+  struct chunker* chunker,
+  const uint8_t* data,
+  size_t length,
+  struct cdc_chunk** chunks,
+  size_t* chunks_length
+) {
+  const size_t tail = CDC_WINDOW - 1;
+  uint8_t head[(CDC_WINDOW - 1) * 2];
+  memcpy(head, chunker->tail, tail);
+  memcpy(head + tail, data, length < tail ? length : tail);
+  size_t capacity = 0;
+  size_t index = 0;
+  while (index < length) {
+    // The boundary regions of the current chunk, relative to the buffer:
+    int64_t base = chunker->start - chunker->position;
+    int64_t hard = base + chunker->min - 1;
+    int64_t easy = base + chunker->avg - 1;
+    int64_t forced = base + chunker->max - 1;
+    int64_t bound = (int64_t) length;
+    int64_t found = -1;
+    int64_t from = hard > (int64_t) index ? hard : (int64_t) index;
+    int64_t to = easy < bound ? easy : bound;
+    if (from < to) {
+      size_t result = chunker_find(
+        chunker,
+        head,
+        data,
+        (size_t) from,
+        (size_t) to,
+        chunker->mask_hard
+      );
+      if (result < (size_t) to) found = (int64_t) result;
+    }
+    if (found < 0) {
+      from = easy > (int64_t) index ? easy : (int64_t) index;
+      to = forced < bound ? forced : bound;
+      if (from < to) {
+        size_t result = chunker_find(
+          chunker,
+          head,
+          data,
+          (size_t) from,
+          (size_t) to,
+          chunker->mask_easy
+        );
+        if (result < (size_t) to) found = (int64_t) result;
+      }
+    }
+    if (found < 0 && forced >= (int64_t) index && forced < bound) {
+      found = forced;
+    }
+    if (found < 0) {
+      blake3_update(&chunker->hasher, data + index, length - index);
+      break;
+    }
+    size_t end = (size_t) found + 1;
+    blake3_update(&chunker->hasher, data + index, end - index);
+    if (*chunks_length == capacity) {
+      capacity = capacity == 0 ? 16 : capacity * 2;
+      struct cdc_chunk* grown = realloc(
+        *chunks,
+        capacity * sizeof(struct cdc_chunk)
+      );
+      if (grown == NULL) return 0;
+      *chunks = grown;
+    }
+    struct cdc_chunk* chunk = &(*chunks)[(*chunks_length)++];
+    chunk->offset = chunker->start;
+    chunk->length = chunker->position + (int64_t) end - chunker->start;
+    blake3_finalize(&chunker->hasher, chunk->hash);
+    blake3_init(&chunker->hasher, 0);
+    chunker->start = chunker->position + (int64_t) end;
+    index = end;
+  }
+  // Keep the last 63 bytes of the stream for the windows of the next buffer:
+  if (length >= tail) {
+    memcpy(chunker->tail, data + length - tail, tail);
+  } else {
+    memmove(chunker->tail, chunker->tail + length, tail - length);
+    memcpy(chunker->tail + tail - length, data, length);
+  }
+  chunker->position += (int64_t) length;
+  return 1;
+}
+
+// AES-256-XTS (IEEE 1619) encrypts each sector of a device with the sector
+// number as the tweak, so that identical sectors at different addresses have
+// different ciphertexts, without storing an IV. Within a sector, each 16-byte
+// block is encrypted with the tweak multiplied by a power of the primitive
+// element of GF(2^128), so that blocks are independent and can be pipelined.
+// We use AES-NI for 8 blocks at a time, or VAES for 16, with a portable
+// fallback. A key is 64 bytes: the data key followed by the tweak key.
+//
+// The portable fallback looks up the S-box in a table, indexed by bytes of the
+// key and data, so that its timing may leak them through the cache. It is used
+// only where the CPU has no AES instructions.
+#define AES_ROUNDS 14
+#define CRYPT_KEY 64
+#define CRYPT_SECTOR_MIN 512
+#define CRYPT_SECTOR_MAX 65536
+
+static uint8_t AES_SBOX[256];
+static uint8_t AES_SBOX_INVERSE[256];
+
+struct crypt {
+  int references;
+  size_t sector;
+  uint8_t keys[AES_ROUNDS + 1][16];
+  uint8_t keys_decrypt[AES_ROUNDS + 1][16];
+  uint8_t keys_tweak[AES_ROUNDS + 1][16];
+  // The kernels are selected per key, so that each can be tested:
+  void (*encrypt)(
+    const struct crypt* crypt,
+    const uint8_t* source,
+    uint8_t* target,
+    size_t length,
+    uint64_t sector
+  );
+  void (*decrypt)(
+    const struct crypt* crypt,
+    const uint8_t* source,
+    uint8_t* target,
+    size_t length,
+    uint64_t sector
+  );
+};
+
+// The best kernel supported by the CPU:
+static const char* xts_name = "scalar";
+
+static uint8_t aes_xtime(uint8_t x) {
+  return (uint8_t) ((x << 1) ^ ((x >> 7) * 0x1b));
+}
+
+static uint8_t aes_multiply(uint8_t a, uint8_t b) {
+  uint8_t result = 0;
+  while (b) {
+    if (b & 1) result ^= a;
+    a = aes_xtime(a);
+    b >>= 1;
+  }
+  return result;
+}
+
+static uint8_t aes_rotate(uint8_t x, int bits) {
+  return (uint8_t) ((x << bits) | (x >> (8 - bits)));
+}
+
+static void aes_expand(const uint8_t* key, uint8_t keys[AES_ROUNDS + 1][16]) {
+  uint8_t* words = &keys[0][0];
+  memcpy(words, key, 32);
+  uint8_t rcon = 1;
+  for (int index = 8; index < 4 * (AES_ROUNDS + 1); index++) {
+    uint8_t word[4];
+    memcpy(word, words + 4 * (index - 1), 4);
+    if (index % 8 == 0) {
+      uint8_t first = word[0];
+      word[0] = (uint8_t) (AES_SBOX[word[1]] ^ rcon);
+      word[1] = AES_SBOX[word[2]];
+      word[2] = AES_SBOX[word[3]];
+      word[3] = AES_SBOX[first];
+      rcon = aes_xtime(rcon);
+    } else if (index % 8 == 4) {
+      for (int byte = 0; byte < 4; byte++) word[byte] = AES_SBOX[word[byte]];
+    }
+    for (int byte = 0; byte < 4; byte++) {
+      words[4 * index + byte] = words[4 * (index - 8) + byte] ^ word[byte];
+    }
+  }
+}
+
+static void aes_encrypt_block(
+  const uint8_t keys[AES_ROUNDS + 1][16],
+  uint8_t state[16]
+) {
+  for (int byte = 0; byte < 16; byte++) state[byte] ^= keys[0][byte];
+  for (int round = 1; round <= AES_ROUNDS; round++) {
+    // SubBytes and ShiftRows, where the state is column-major:
+    uint8_t shifted[16];
+    for (int column = 0; column < 4; column++) {
+      for (int row = 0; row < 4; row++) {
+        shifted[row + 4 * column] =
+          AES_SBOX[state[row + 4 * ((column + row) & 3)]];
+      }
+    }
+    for (int column = 0; column < 4; column++) {
+      uint8_t* c = shifted + 4 * column;
+      if (round < AES_ROUNDS) {
+        uint8_t a0 = c[0], a1 = c[1], a2 = c[2], a3 = c[3];
+        uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+        c[0] = a0 ^ all ^ aes_xtime(a0 ^ a1);
+        c[1] = a1 ^ all ^ aes_xtime(a1 ^ a2);
+        c[2] = a2 ^ all ^ aes_xtime(a2 ^ a3);
+        c[3] = a3 ^ all ^ aes_xtime(a3 ^ a0);
+      }
+      for (int row = 0; row < 4; row++) {
+        state[row + 4 * column] = c[row] ^ keys[round][row + 4 * column];
+      }
+    }
+  }
+}
+
+static void aes_decrypt_block(
+  const uint8_t keys[AES_ROUNDS + 1][16],
+  uint8_t state[16]
+) {
+  for (int byte = 0; byte < 16; byte++) state[byte] ^= keys[AES_ROUNDS][byte];
+  for (int round = AES_ROUNDS - 1; round >= 0; round--) {
+    // InvShiftRows and InvSubBytes, then AddRoundKey and InvMixColumns:
+    uint8_t shifted[16];
+    for (int column = 0; column < 4; column++) {
+      for (int row = 0; row < 4; row++) {
+        shifted[row + 4 * column] =
+          AES_SBOX_INVERSE[state[row + 4 * ((column - row + 4) & 3)]];
+      }
+    }
+    for (int byte = 0; byte < 16; byte++) shifted[byte] ^= keys[round][byte];
+    for (int column = 0; column < 4; column++) {
+      uint8_t* c = shifted + 4 * column;
+      if (round > 0) {
+        uint8_t a0 = c[0], a1 = c[1], a2 = c[2], a3 = c[3];
+        c[0] = aes_multiply(a0, 14) ^ aes_multiply(a1, 11) ^
+          aes_multiply(a2, 13) ^ aes_multiply(a3, 9);
+        c[1] = aes_multiply(a0, 9) ^ aes_multiply(a1, 14) ^
+          aes_multiply(a2, 11) ^ aes_multiply(a3, 13);
+        c[2] = aes_multiply(a0, 13) ^ aes_multiply(a1, 9) ^
+          aes_multiply(a2, 14) ^ aes_multiply(a3, 11);
+        c[3] = aes_multiply(a0, 11) ^ aes_multiply(a1, 13) ^
+          aes_multiply(a2, 9) ^ aes_multiply(a3, 14);
+      }
+      memcpy(state + 4 * column, c, 4);
+    }
+  }
+}
+
+// Multiplies a tweak by the primitive element x, in the little-endian
+// representation of IEEE 1619:
+static void xts_multiply(uint8_t tweak[16]) {
+  uint8_t carry = tweak[15] >> 7;
+  for (int byte = 15; byte > 0; byte--) {
+    tweak[byte] = (uint8_t) ((tweak[byte] << 1) | (tweak[byte - 1] >> 7));
+  }
+  tweak[0] = (uint8_t) ((tweak[0] << 1) ^ (carry * 0x87));
+}
+
+static void xts_scalar(
+  const struct crypt* crypt,
+  const uint8_t* source,
+  uint8_t* target,
+  size_t length,
+  uint64_t sector,
+  int decrypt
+) {
+  assert(length % crypt->sector == 0);
+  for (size_t offset = 0; offset < length; offset += crypt->sector) {
+    uint8_t tweak[16] = { 0 };
+    for (int byte = 0; byte < 8; byte++) {
+      tweak[byte] = (uint8_t) (sector >> (8 * byte));
+    }
+    sector++;
+    aes_encrypt_block(crypt->keys_tweak, tweak);
+    for (size_t block = 0; block < crypt->sector; block += 16) {
+      uint8_t state[16];
+      for (int byte = 0; byte < 16; byte++) {
+        state[byte] = source[offset + block + byte] ^ tweak[byte];
+      }
+      if (decrypt) {
+        aes_decrypt_block(crypt->keys, state);
+      } else {
+        aes_encrypt_block(crypt->keys, state);
+      }
+      for (int byte = 0; byte < 16; byte++) {
+        target[offset + block + byte] = state[byte] ^ tweak[byte];
+      }
+      xts_multiply(tweak);
+    }
+  }
+}
+
+static void xts_encrypt_scalar(
+  const struct crypt* crypt,
+  const uint8_t* source,
+  uint8_t* target,
+  size_t length,
+  uint64_t sector
+) {
+  xts_scalar(crypt, source, target, length, sector, 0);
+}
+
+static void xts_decrypt_scalar(
+  const struct crypt* crypt,
+  const uint8_t* source,
+  uint8_t* target,
+  size_t length,
+  uint64_t sector
+) {
+  xts_scalar(crypt, source, target, length, sector, 1);
+}
+
+#if defined(CPU_X64)
+TARGET("aes,sse2")
+static __m128i xts_multiply_aesni(__m128i tweak) {
+  // Shift each 64-bit half left, carrying bit 63 into bit 64 and reducing
+  // bit 127 into the low byte:
+  __m128i carry = _mm_shuffle_epi32(_mm_srai_epi32(tweak, 31), 0x13);
+  carry = _mm_and_si128(carry, _mm_set_epi32(0, 1, 0, 0x87));
+  return _mm_xor_si128(_mm_add_epi64(tweak, tweak), carry);
+}
+
+TARGET("aes,sse2")
+static __m128i xts_tweak_aesni(const struct crypt* crypt, uint64_t sector) {
+  __m128i tweak = _mm_set_epi64x(0, (long long) sector);
+  tweak = _mm_xor_si128(
+    tweak,
+    _mm_loadu_si128((const __m128i*) crypt->keys_tweak[0])
+  );
+  for (int round = 1; round < AES_ROUNDS; round++) {
+    tweak = _mm_aesenc_si128(
+      tweak,
+      _mm_loadu_si128((const __m128i*) crypt->keys_tweak[round])
+    );
+  }
+  return _mm_aesenclast_si128(
+    tweak,
+    _mm_loadu_si128((const __m128i*) crypt->keys_tweak[AES_ROUNDS])
+  );
+}
+
+// Encrypts or decrypts 8 blocks at a time, so that the latency of each aesenc
+// is hidden behind the other 7:
+TARGET("aes,sse2")
+static void xts_aesni(
+  const struct crypt* crypt,
+  const uint8_t* source,
+  uint8_t* target,
+  size_t length,
+  uint64_t sector,
+  int decrypt
+) {
+  assert(length % crypt->sector == 0);
+  assert(crypt->sector % 128 == 0);
+  __m128i keys[AES_ROUNDS + 1];
+  for (int round = 0; round <= AES_ROUNDS; round++) {
+    keys[round] = _mm_loadu_si128(
+      (const __m128i*) (decrypt ? crypt->keys_decrypt : crypt->keys)[round]
+    );
+  }
+  for (size_t offset = 0; offset < length; offset += crypt->sector) {
+    __m128i tweak = xts_tweak_aesni(crypt, sector++);
+    for (size_t block = 0; block < crypt->sector; block += 128) {
+      const __m128i* input = (const __m128i*) (source + offset + block);
+      __m128i* output = (__m128i*) (target + offset + block);
+      __m128i tweaks[8];
+      __m128i state[8];
+      for (int lane = 0; lane < 8; lane++) {
+        tweaks[lane] = tweak;
+        tweak = xts_multiply_aesni(tweak);
+        state[lane] = _mm_xor_si128(
+          _mm_xor_si128(_mm_loadu_si128(input + lane), tweaks[lane]),
+          keys[0]
+        );
+      }
+      if (decrypt) {
+        for (int round = 1; round < AES_ROUNDS; round++) {
+          for (int lane = 0; lane < 8; lane++) {
+            state[lane] = _mm_aesdec_si128(state[lane], keys[round]);
+          }
+        }
+        for (int lane = 0; lane < 8; lane++) {
+          state[lane] = _mm_aesdeclast_si128(state[lane], keys[AES_ROUNDS]);
+        }
+      } else {
+        for (int round = 1; round < AES_ROUNDS; round++) {
+          for (int lane = 0; lane < 8; lane++) {
+            state[lane] = _mm_aesenc_si128(state[lane], keys[round]);
+          }
+        }
+        for (int lane = 0; lane < 8; lane++) {
+          state[lane] = _mm_aesenclast_si128(state[lane], keys[AES_ROUNDS]);
+        }
+      }
+      for (int lane = 0; lane < 8; lane++) {
+        _mm_storeu_si128(
+          output + lane,
+          _mm_xor_si128(state[lane], tweaks[lane])
+        );
+      }
+    }
+  }
+}
+
+TARGET("aes,sse2")
+static void xts_encrypt_aesni(
+  const struct crypt* crypt,
+  const uint8_t* source,
+  uint8_t* target,
+  size_t length,
+  uint64_t sector
+) {
+  xts_aesni(crypt, source, target, length, sector, 0);
+}
+
+TARGET("aes,sse2")
+static void xts_decrypt_aesni(
+  const struct crypt* crypt,
+  const uint8_t* source,
+  uint8_t* target,
+  size_t length,
+  uint64_t sector
+) {
+  xts_aesni(crypt, source, target, length, sector, 1);
+}
+
+// The decryption keys for aesdec are the encryption keys in reverse, passed
+// through InvMixColumns (the "equivalent inverse cipher"):
+TARGET("aes,sse2")
+static void aes_expand_decrypt_aesni(struct crypt* crypt) {
+  memcpy(crypt->keys_decrypt[0], crypt->keys[AES_ROUNDS], 16);
+  for (int round = 1; round < AES_ROUNDS; round++) {
+    __m128i key = _mm_loadu_si128(
+      (const __m128i*) crypt->keys[AES_ROUNDS - round]
+    );
+    _mm_storeu_si128(
+      (__m128i*) crypt->keys_decrypt[round],
+      _mm_aesimc_si128(key)
+    );
+  }
+  memcpy(crypt->keys_decrypt[AES_ROUNDS], crypt->keys[0], 16);
+}
+
+// Multiplies the tweak in each 128-bit lane by x^4:
+TARGET("vaes,avx512f,aes")
+static __m512i xts_multiply4_vaes(__m512i tweaks) {
+  __m512i carry = _mm512_shuffle_epi32(
+    _mm512_srli_epi64(tweaks, 60),
+    _MM_PERM_BADC
+  );
+  // The 4 bits carried out of bit 127 reduce by x^7 + x^2 + x + 1:
+  __m512i reduced = _mm512_xor_si512(
+    _mm512_xor_si512(carry, _mm512_slli_epi64(carry, 1)),
+    _mm512_xor_si512(_mm512_slli_epi64(carry, 2), _mm512_slli_epi64(carry, 7))
+  );
+  return _mm512_xor_si512(
+    _mm512_slli_epi64(tweaks, 4),
+    _mm512_mask_blend_epi64(0x55, carry, reduced)
+  );
+}
+
+// Encrypts or decrypts 16 blocks at a time, 4 in each of 4 ZMM registers:
+TARGET("vaes,avx512f,aes")
+static void xts_vaes(
+  const struct crypt* crypt,
+  const uint8_t* source,
+  uint8_t* target,
+  size_t length,
+  uint64_t sector,
+  int decrypt
+) {
+  assert(length % crypt->sector == 0);
+  assert(crypt->sector % 256 == 0);
+  __m512i keys[AES_ROUNDS + 1];
+  for (int round = 0; round <= AES_ROUNDS; round++) {
+    keys[round] = _mm512_broadcast_i32x4(
+      _mm_loadu_si128(
+        (const __m128i*) (decrypt ? crypt->keys_decrypt : crypt->keys)[round]
+      )
+    );
+  }
+  for (size_t offset = 0; offset < length; offset += crypt->sector) {
+    __m128i tweak = xts_tweak_aesni(crypt, sector++);
+    __m512i tweaks = _mm512_castsi128_si512(tweak);
+    // The lane of _mm512_inserti32x4() must be an immediate:
+    tweak = xts_multiply_aesni(tweak);
+    tweaks = _mm512_inserti32x4(tweaks, tweak, 1);
+    tweak = xts_multiply_aesni(tweak);
+    tweaks = _mm512_inserti32x4(tweaks, tweak, 2);
+    tweak = xts_multiply_aesni(tweak);
+    tweaks = _mm512_inserti32x4(tweaks, tweak, 3);
+    for (size_t block = 0; block < crypt->sector; block += 256) {
+      const uint8_t* input = source + offset + block;
+      uint8_t* output = target + offset + block;
+      __m512i lanes[4];
+      __m512i state[4];
+      for (int lane = 0; lane < 4; lane++) {
+        lanes[lane] = tweaks;
+        tweaks = xts_multiply4_vaes(tweaks);
+        state[lane] = _mm512_xor_si512(
+          _mm512_xor_si512(_mm512_loadu_si512(input + 64 * lane), lanes[lane]),
+          keys[0]
+        );
+      }
+      if (decrypt) {
+        for (int round = 1; round < AES_ROUNDS; round++) {
+          for (int lane = 0; lane < 4; lane++) {
+            state[lane] = _mm512_aesdec_epi128(state[lane], keys[round]);
+          }
+        }
+        for (int lane = 0; lane < 4; lane++) {
+          state[lane] = _mm512_aesdeclast_epi128(state[lane], keys[AES_ROUNDS]);
+        }
+      } else {
+        for (int round = 1; round < AES_ROUNDS; round++) {
+          for (int lane = 0; lane < 4; lane++) {
+            state[lane] = _mm512_aesenc_epi128(state[lane], keys[round]);
+          }
+        }
+        for (int lane = 0; lane < 4; lane++) {
+          state[lane] = _mm512_aesenclast_epi128(state[lane], keys[AES_ROUNDS]);
+        }
+      }
+      for (int lane = 0; lane < 4; lane++) {
+        _mm512_storeu_si512(
+          output + 64 * lane,
+          _mm512_xor_si512(state[lane], lanes[lane])
+        );
+      }
+    }
+  }
+}
+
+TARGET("vaes,avx512f,aes")
+static void xts_encrypt_vaes(
+  const struct crypt* crypt,
+  const uint8_t* source,
+  uint8_t* target,
+  size_t length,
+  uint64_t sector
+) {
+  xts_vaes(crypt, source, target, length, sector, 0);
+}
+
+TARGET("vaes,avx512f,aes")
+static void xts_decrypt_vaes(
+  const struct crypt* crypt,
+  const uint8_t* source,
+  uint8_t* target,
+  size_t length,
+  uint64_t sector
+) {
+  xts_vaes(crypt, source, target, length, sector, 1);
+}
+#endif
+
+static void aes_init(void) {
+  // The S-box is the multiplicative inverse in GF(2^8) followed by an affine
+  // transform. We walk the field by powers of the generator 3, whose inverse
+  // is then the matching power of 3^-1:
+  uint8_t p = 1;
+  uint8_t q = 1;
+  do {
+    p = (uint8_t) (p ^ (p << 1) ^ ((p & 0x80) ? 0x1b : 0));
+    q ^= (uint8_t) (q << 1);
+    q ^= (uint8_t) (q << 2);
+    q ^= (uint8_t) (q << 4);
+    if (q & 0x80) q ^= 0x09;
+    AES_SBOX[p] = q ^ aes_rotate(q, 1) ^ aes_rotate(q, 2) ^ aes_rotate(q, 3) ^
+      aes_rotate(q, 4) ^ 0x63;
+  } while (p != 1);
+  AES_SBOX[0] = 0x63;
+  for (int index = 0; index < 256; index++) {
+    AES_SBOX_INVERSE[AES_SBOX[index]] = (uint8_t) index;
+  }
+#if defined(CPU_X64)
+  if (cpu.aes) xts_name = "aesni";
+  if (cpu.aes && cpu.vaes) xts_name = "vaes";
+#endif
+}
+
+// Selects the kernels of a key by name, returning 0 if the CPU does not
+// support them:
+static int xts_select(struct crypt* crypt, const char* name) {
+  if (strcmp(name, "scalar") == 0) {
+    crypt->encrypt = xts_encrypt_scalar;
+    crypt->decrypt = xts_decrypt_scalar;
+    return 1;
+  }
+#if defined(CPU_X64)
+  if (strcmp(name, "aesni") == 0 && cpu.aes) {
+    crypt->encrypt = xts_encrypt_aesni;
+    crypt->decrypt = xts_decrypt_aesni;
+    return 1;
+  }
+  if (strcmp(name, "vaes") == 0 && cpu.aes && cpu.vaes) {
+    crypt->encrypt = xts_encrypt_vaes;
+    crypt->decrypt = xts_decrypt_vaes;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+// Keys are set per fd, and each read or write holds a reference to the key
+// of its fd, so that the key may be changed or removed while I/O is pending:
+struct crypt_entry {
+  int fd;
+  struct crypt* crypt;
+};
+
+static uv_mutex_t crypt_mutex;
+static struct crypt_entry* crypt_table = NULL;
+static size_t crypt_table_length = 0;
+static size_t crypt_table_capacity = 0;
+
+static void crypt_wipe(void* pointer, size_t size) {
+  // Do not let the compiler elide the wipe of memory about to be freed:
+  volatile uint8_t* bytes = pointer;
+  while (size--) *bytes++ = 0;
+}
+
+static void crypt_release(struct crypt* crypt) {
+  uv_mutex_lock(&crypt_mutex);
+  int references = --crypt->references;
+  uv_mutex_unlock(&crypt_mutex);
+  if (references == 0) {
+    crypt_wipe(crypt, sizeof(struct crypt));
+    free(crypt);
+  }
+}
+
+static struct crypt* crypt_acquire(int fd) {
+  struct crypt* crypt = NULL;
+  uv_mutex_lock(&crypt_mutex);
+  for (size_t index = 0; index < crypt_table_length; index++) {
+    if (crypt_table[index].fd == fd) {
+      crypt = crypt_table[index].crypt;
+      crypt->references++;
+      break;
+    }
+  }
+  uv_mutex_unlock(&crypt_mutex);
+  return crypt;
+}
+
+// Sets (or with NULL removes) the key of an fd, returning 0 on OOM:
+static int crypt_set(int fd, struct crypt* crypt) {
+  struct crypt* previous = NULL;
+  uv_mutex_lock(&crypt_mutex);
+  size_t index = 0;
+  while (index < crypt_table_length && crypt_table[index].fd != fd) index++;
+  if (index < crypt_table_length) {
+    previous = crypt_table[index].crypt;
+    if (crypt) {
+      crypt_table[index].crypt = crypt;
+    } else {
+      crypt_table[index] = crypt_table[--crypt_table_length];
+    }
+  } else if (crypt) {
+    if (crypt_table_length == crypt_table_capacity) {
+      size_t capacity = crypt_table_capacity ? crypt_table_capacity * 2 : 16;
+      struct crypt_entry* table = realloc(
+        crypt_table,
+        capacity * sizeof(struct crypt_entry)
+      );
+      if (table == NULL) {
+        uv_mutex_unlock(&crypt_mutex);
+        return 0;
+      }
+      crypt_table = table;
+      crypt_table_capacity = capacity;
+    }
+    crypt_table[crypt_table_length].fd = fd;
+    crypt_table[crypt_table_length].crypt = crypt;
+    crypt_table_length++;
+  }
+  uv_mutex_unlock(&crypt_mutex);
+  if (previous) crypt_release(previous);
+  return 1;
+}
+
+static int get_o_direct(void) {
+  // On Linux, some versions of libuv did not define UV_FS_O_DIRECT correctly:
+  // As a result, UV_FS_O_DIRECT was set to 0 so we must get O_DIRECT ourselves.
+  // See: https://github.com/libuv/libuv/issues/2420
+#if defined(__linux__) && defined(__arm__)
+  return 0x10000;
+#elif defined(__linux__) && defined(__m68k__)
+  return 0x10000;
+#elif defined(__linux__) && defined(__mips__)
+  return 0x08000;
+#elif defined(__linux__) && defined(__powerpc__)
+  return 0x20000;
+#elif defined(__linux__) && defined(__s390x__)
+  return 0x04000;
+#elif defined(__linux__) && defined(__x86_64__)
+  return 0x04000;
+#else
+  return UV_FS_O_DIRECT;
+#endif
+}
+
+// Positional reads and writes return the number of bytes transferred, or a
+// negative libuv error code. Both loop until all bytes are transferred, since
+// a short transfer is not an error. Only a read may stop short, at EOF.
+static int64_t io_read(
+  int fd,
+  uint8_t* buffer,
+  size_t length,
+  int64_t position
+) {
+  size_t done = 0;
+  while (done < length) {
+#if defined(_WIN32)
+    uv_fs_t req;
+    uv_buf_t buf = uv_buf_init(
+      (char*) buffer + done,
+      (unsigned int) (length - done)
+    );
+    int64_t result = uv_fs_read(
+      NULL,
+      &req,
+      fd,
+      &buf,
+      1,
+      position + (int64_t) done,
+      NULL
+    );
+    uv_fs_req_cleanup(&req);
+#else
+    int64_t result = pread(
+      fd,
+      buffer + done,
+      length - done,
+      (off_t) (position + (int64_t) done)
+    );
+    if (result < 0 && errno == EINTR) continue;
+    if (result < 0) result = -errno;
+#endif
+    if (result < 0) return result;
+    if (result == 0) break;
+    done += (size_t) result;
+  }
+  return (int64_t) done;
+}
+
+static int64_t io_write(
+  int fd,
+  const uint8_t* buffer,
+  size_t length,
+  int64_t position
+) {
+  size_t done = 0;
+  while (done < length) {
+#if defined(_WIN32)
+    uv_fs_t req;
+    uv_buf_t buf = uv_buf_init(
+      (char*) buffer + done,
+      (unsigned int) (length - done)
+    );
+    int64_t result = uv_fs_write(
+      NULL,
+      &req,
+      fd,
+      &buf,
+      1,
+      position + (int64_t) done,
+      NULL
+    );
+    uv_fs_req_cleanup(&req);
+#else
+    int64_t result = pwrite(
+      fd,
+      buffer + done,
+      length - done,
+      (off_t) (position + (int64_t) done)
+    );
+    if (result < 0 && errno == EINTR) continue;
+    if (result < 0) result = -errno;
+#endif
+    if (result < 0) return result;
+    if (result == 0) return UV_EIO;
+    done += (size_t) result;
+  }
+  return (int64_t) done;
+}
+
+static const char* io_error(int64_t result, const char* unexpected) {
+  assert(result < 0);
+  switch (result) {
+    case UV_EBADF: return "EBADF, fd is an invalid file descriptor";
+    case UV_EFBIG: return "EFBIG, position exceeds the maximum file size";
+    case UV_EINVAL: return "EINVAL, buffer, length or position is not aligned";
+    case UV_EIO: return "EIO, an I/O error occurred";
+    case UV_EISDIR: return "EISDIR, fd refers to a directory";
+    case UV_ENOSPC: return "ENOSPC, no space left on device";
+    case UV_EPERM: return "EPERM, the operation is not permitted";
+    default: return unexpected;
+  }
+}
+
+// Deallocates a range of a regular file, leaving a hole which reads as zeroes,
+// without changing the size of the file:
+static int64_t io_punch(int fd, int64_t position, int64_t length) {
+#if defined(__linux__)
+  if (
+    fallocate(
+      fd,
+      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+      (off_t) position,
+      (off_t) length
+    ) != 0
+  ) {
+    return -errno;
+  }
+  return 0;
+#elif defined(__APPLE__) && defined(F_PUNCHHOLE)
+  fpunchhole_t punch;
+  memset(&punch, 0, sizeof(punch));
+  punch.fp_offset = (off_t) position;
+  punch.fp_length = (off_t) length;
+  if (fcntl(fd, F_PUNCHHOLE, &punch) != 0) return -errno;
+  return 0;
+#else
+  return UV_ENOTSUP;
+#endif
+}
+
+// Extends a regular file to at least size bytes, leaving a hole:
+static int64_t io_extend(int fd, int64_t size) {
+#if defined(_WIN32)
+  uv_fs_t req;
+  int result = uv_fs_fstat(NULL, &req, fd, NULL);
+  int64_t current = (int64_t) req.statbuf.st_size;
+  int regular = (req.statbuf.st_mode & S_IFMT) == S_IFREG;
+  uv_fs_req_cleanup(&req);
+  if (result != 0) return result;
+  if (!regular || current >= size) return 0;
+  result = uv_fs_ftruncate(NULL, &req, fd, size, NULL);
+  uv_fs_req_cleanup(&req);
+  return result;
+#else
+  struct stat st;
+  if (fstat(fd, &st) != 0) return -errno;
+  if ((st.st_mode & S_IFMT) != S_IFREG || st.st_size >= size) return 0;
+  if (ftruncate(fd, (off_t) size) != 0) return -errno;
+  return 0;
+#endif
+}
+
+// Extends a regular file to at least size bytes, allocating the space where
+// the filesystem supports it, so that later writes within the size neither
+// fail with ENOSPC nor grow the file:
+static int64_t io_allocate(int fd, int64_t size) {
+#if defined(__linux__)
+  struct stat st;
+  if (fstat(fd, &st) != 0) return -errno;
+  if ((st.st_mode & S_IFMT) != S_IFREG || st.st_size >= size) return 0;
+  if (fallocate(fd, 0, 0, (off_t) size) == 0) return 0;
+  if (errno != EOPNOTSUPP) return -errno;
+#elif defined(__APPLE__)
+  struct stat st;
+  if (fstat(fd, &st) != 0) return -errno;
+  if ((st.st_mode & S_IFMT) != S_IFREG || st.st_size >= size) return 0;
+  fstore_t store;
+  memset(&store, 0, sizeof(store));
+  store.fst_flags = F_ALLOCATEALL;
+  store.fst_posmode = F_PEOFPOSMODE;
+  store.fst_length = (off_t) (size - st.st_size);
+  // Allocation is only an optimization here, so a failure is not an error:
+  fcntl(fd, F_PREALLOCATE, &store);
+#endif
+  return io_extend(fd, size);
+}
+
+// Sets the size of a regular file:
+static int64_t io_truncate(int fd, int64_t size) {
+#if defined(_WIN32)
+  uv_fs_t req;
+  int result = uv_fs_ftruncate(NULL, &req, fd, size, NULL);
+  uv_fs_req_cleanup(&req);
+  return result;
+#else
+  if (ftruncate(fd, (off_t) size) != 0) return -errno;
+  return 0;
+#endif
+}
+
+// Returns the size of a regular file, or of a block or character device:
+static const char* io_size(int fd, int64_t* size) {
+#if defined(_WIN32)
+  uv_fs_t req;
+  int result = uv_fs_fstat(NULL, &req, fd, NULL);
+  int regular = result == 0 && (req.statbuf.st_mode & S_IFMT) == S_IFREG;
+  int64_t st_size = (int64_t) req.statbuf.st_size;
+  uv_fs_req_cleanup(&req);
+  if (result != 0) return "fstat failed";
+  if (regular) {
+    *size = st_size;
+    return NULL;
+  }
+#else
+  struct stat st;
+  if (fstat(fd, &st) == -1) return "fstat failed";
+  if ((st.st_mode & S_IFMT) == S_IFREG) {
+    *size = (int64_t) st.st_size;
+    return NULL;
+  }
+#endif
+  struct task_data* task = calloc(1, sizeof(struct task_data));
+  if (!task) return "insufficient memory";
+  task->fd = fd;
+  task->device = 1;
+  task_execute_get_block_device_size(task);
+  const char* error = task->error;
+  *size = task->device_size;
+  free(task);
+  return error;
+}
+
+// Verification and other work on the threadpool needs aligned scratch memory.
+// We keep a small pool of scratch buffers rather than allocating per request.
+#define SCRATCH_SIZE 1048576
+#define SCRATCH_ALIGNMENT 4096
+#define SCRATCH_POOL_MAX 16
+
+static uv_mutex_t scratch_mutex;
+static void* scratch_pool[SCRATCH_POOL_MAX];
+static int scratch_pool_length = 0;
+
+static void* scratch_acquire(void) {
+  void* ptr = NULL;
+  uv_mutex_lock(&scratch_mutex);
+  if (scratch_pool_length > 0) ptr = scratch_pool[--scratch_pool_length];
+  uv_mutex_unlock(&scratch_mutex);
+  if (ptr == NULL) ptr = aligned_malloc(SCRATCH_SIZE, SCRATCH_ALIGNMENT);
+  return ptr;
+}
+
+static void scratch_release(void* ptr) {
+  assert(ptr != NULL);
+  uv_mutex_lock(&scratch_mutex);
+  if (scratch_pool_length < SCRATCH_POOL_MAX) {
+    scratch_pool[scratch_pool_length++] = ptr;
+    ptr = NULL;
+  }
+  uv_mutex_unlock(&scratch_mutex);
+  if (ptr != NULL) aligned_free(ptr);
+}
+
+// A bounce buffer is a scratch buffer, or if larger, an allocation of its own:
+static uint8_t* bounce_alloc(size_t size) {
+  if (size <= SCRATCH_SIZE) return scratch_acquire();
+  return aligned_malloc(size, SCRATCH_ALIGNMENT);
+}
+
+static void bounce_free(uint8_t* buffer, size_t size) {
+  if (size <= SCRATCH_SIZE) {
+    scratch_release(buffer);
+  } else {
+    aligned_free(buffer);
+  }
+}
+
+static int64_t io_fdatasync(int fd) {
+#if defined(_WIN32)
+  uv_fs_t req;
+  int64_t result = uv_fs_fdatasync(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  return result;
+#elif defined(__APPLE__)
+  // macOS does not declare fdatasync():
+  if (fsync(fd) != 0) return -errno;
+  return 0;
+#else
+  if (fdatasync(fd) != 0) return -errno;
+  return 0;
+#endif
+}
+
+#if defined(__linux__)
+// Drops cached pages for a range so that a read must come from the device.
+// POSIX_FADV_DONTNEED skips dirty pages, so we first write them back, even if
+// the write was not asked to be followed by fdatasync():
+static const char* io_verify_drop(int fd, int64_t position, size_t length) {
+  int64_t result = io_fdatasync(fd);
+  if (result < 0) return io_error(result, "unexpected error, fdatasync");
+  posix_fadvise(fd, (off_t) position, (off_t) length, POSIX_FADV_DONTNEED);
+  return NULL;
+}
+#endif
+
+// Reads back a range just written and compares it with what was written. The
+// read must come from the device and not the page cache, so on Linux we reopen
+// the file with O_DIRECT if need be, or failing that (e.g. if the range is not
+// aligned for direct I/O) we write back and drop cached pages for the range,
+// and set synced. Elsewhere the read may come from the page cache.
+static const char* io_verify(
+  int fd,
+  const uint8_t* buffer,
+  size_t length,
+  int64_t position,
+  int* synced
+) {
+  int source = fd;
+  const char* error = NULL;
+#if defined(__linux__)
+  int flags = fcntl(fd, F_GETFL);
+  if (flags != -1 && (flags & get_o_direct()) == 0) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int direct = open(path, O_RDONLY | get_o_direct());
+    if (direct != -1) {
+      source = direct;
+    } else {
+      error = io_verify_drop(fd, position, length);
+      if (error) return error;
+      if (synced) *synced = 1;
+    }
+  }
+#endif
+  uint8_t* scratch = scratch_acquire();
+  if (scratch == NULL) error = "insufficient memory";
+  size_t done = 0;
+  while (error == NULL && done < length) {
+    size_t chunk = length - done;
+    if (chunk > SCRATCH_SIZE) chunk = SCRATCH_SIZE;
+    int64_t offset = position + (int64_t) done;
+    int64_t result = io_read(source, scratch, chunk, offset);
+#if defined(__linux__)
+    if (result == UV_EINVAL && source != fd) {
+      close(source);
+      source = fd;
+      error = io_verify_drop(fd, position, length);
+      if (synced) *synced = 1;
+      continue;
+    }
+#endif
+    if (result < 0) {
+      error = io_error(result, "unexpected error, read");
+    } else if (
+      (size_t) result != chunk ||
+      !simd.equals(scratch, buffer + done, chunk)
+    ) {
+      error = "write verification failed, data read back differs";
+    }
+    done += chunk;
+  }
+#if defined(__linux__)
+  if (source != fd) close(source);
+#endif
+  if (scratch != NULL) scratch_release(scratch);
+  return error;
+}
+
+// The sector format reserves a trailer at the end of each block for a sequence
+// number, the block address and a CRC32C over the rest of the block, much like
+// T10 Protection Information but in software. A torn write fails the CRC32C, a
+// misdirected write fails the address, and a stale block fails the sequence.
+#define FORMAT_TRAILER 16
+#define FORMAT_BLOCK_MIN 512
+#define FORMAT_BLOCK_MAX 4194304
+
+static void format_write_uint32(uint8_t* target, uint32_t value) {
+  target[0] = (uint8_t) value;
+  target[1] = (uint8_t) (value >> 8);
+  target[2] = (uint8_t) (value >> 16);
+  target[3] = (uint8_t) (value >> 24);
+}
+
+static uint32_t format_read_uint32(const uint8_t* source) {
+  return (
+    (uint32_t) source[0] |
+    (uint32_t) source[1] << 8 |
+    (uint32_t) source[2] << 16 |
+    (uint32_t) source[3] << 24
+  );
+}
+
+static void format_write_uint64(uint8_t* target, uint64_t value) {
+  format_write_uint32(target, (uint32_t) value);
+  format_write_uint32(target + 4, (uint32_t) (value >> 32));
+}
+
+static uint64_t format_read_uint64(const uint8_t* source) {
+  return (
+    (uint64_t) format_read_uint32(source) |
+    (uint64_t) format_read_uint32(source + 4) << 32
+  );
+}
+
+// Fills the trailer of each block in place, leaving the payloads untouched:
+static void format_fill(
+  uint8_t* buffer,
+  size_t length,
+  size_t block,
+  int64_t position,
+  uint64_t sequence
+) {
+  assert(length % block == 0);
+  assert(position % (int64_t) block == 0);
+  uint64_t address = (uint64_t) position / block;
+  for (size_t offset = 0; offset < length; offset += block) {
+    uint8_t* trailer = buffer + offset + block - FORMAT_TRAILER;
+    format_write_uint64(trailer, sequence);
+    format_write_uint32(trailer + 8, (uint32_t) address++);
+    format_write_uint32(
+      trailer + 12,
+      crc32c(0, buffer + offset, block - 4)
+    );
+  }
+}
+
+// Verifies the trailer of a single block at the given address:
+static const char* format_check(
+  const uint8_t* buffer,
+  size_t block,
+  uint64_t address,
+  int sequence_expect,
+  uint64_t sequence_expected,
+  uint64_t* sequence
+) {
+  const uint8_t* trailer = buffer + block - FORMAT_TRAILER;
+  if (format_read_uint32(trailer + 12) != crc32c(0, buffer, block - 4)) {
+    return "block checksum mismatch, torn or corrupt write";
+  }
+  if (format_read_uint32(trailer + 8) != (uint32_t) address) {
+    return "block address mismatch, misdirected write";
+  }
+  *sequence = format_read_uint64(trailer);
+  if (sequence_expect && *sequence != sequence_expected) {
+    return "block sequence mismatch, torn or stale write";
+  }
+  return NULL;
+}
+
+// Verifies the trailer of each block and then strips the trailers by moving
+// the payloads together at the start of the buffer:
+static const char* format_strip(
+  uint8_t* buffer,
+  size_t length,
+  size_t block,
+  int64_t position,
+  int sequence_expect,
+  uint64_t sequence_expected,
+  uint64_t* sequence_max
+) {
+  if (length % block != 0) return "short read, expected whole blocks";
+  assert(position % (int64_t) block == 0);
+  uint64_t address = (uint64_t) position / block;
+  size_t payload = block - FORMAT_TRAILER;
+  for (size_t offset = 0; offset < length; offset += block) {
+    uint64_t sequence = 0;
+    const char* error = format_check(
+      buffer + offset,
+      block,
+      address++,
+      sequence_expect,
+      sequence_expected,
+      &sequence
+    );
+    if (error) return error;
+    if (sequence > *sequence_max) *sequence_max = sequence;
+  }
+  for (size_t index = 1; index < length / block; index++) {
+    memmove(buffer + index * payload, buffer + index * block, payload);
+  }
+  return NULL;
+}
+
+// Decrypts in place what was read from a position, which must be whole
+// sectors:
+static const char* io_decrypt(
+  const struct crypt* crypt,
+  uint8_t* buffer,
+  size_t length,
+  int64_t position
+) {
+  if (crypt == NULL) return NULL;
+  if (length % crypt->sector != 0) {
+    return "encrypted read ended within a sector";
+  }
+  uint64_t sector = (uint64_t) position / crypt->sector;
+  crypt->decrypt(crypt, buffer, buffer, length, sector);
+  return NULL;
+}
+
+// Writes may be compressed with LZ4 on the threadpool into a frame, padded
+// with zeroes to the sector size so that the frame can be written and read
+// back with O_DIRECT. Data which does not compress is stored as is. A frame
+// is a 16-byte header followed by the payload:
+//
+//   0  magic "DIOZ"
+//   4  u32 method (0 stored, 1 LZ4 block)
+//   8  u32 payload length in bytes
+//  12  u32 decompressed length in bytes
+#define COMPRESS_MAGIC "DIOZ"
+#define COMPRESS_HEADER 16
+#define COMPRESS_STORED 0
+#define COMPRESS_LZ4 1
+#define COMPRESS_SECTOR_MIN 512
+#define COMPRESS_SECTOR_MAX 65536
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_DISTANCE_MAX 65535
+#define LZ4_HASH_BITS 12
+
+static uint32_t lz4_read_uint32(const uint8_t* source) {
+  uint32_t value;
+  memcpy(&value, source, 4);
+  return value;
+}
+
+static uint64_t lz4_read_uint64(const uint8_t* source) {
+  uint64_t value;
+  memcpy(&value, source, 8);
+  return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence) {
+  return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Writes a length of 15 or more as the continuation bytes after a token:
+static uint8_t* lz4_write_length(uint8_t* target, size_t length) {
+  length -= 15;
+  while (length >= 255) {
+    *target++ = 255;
+    length -= 255;
+  }
+  *target++ = (uint8_t) length;
+  return target;
+}
+
+// Writes a sequence of literals followed by a match (or by nothing if this is
+// the last sequence), returning NULL if the sequence would not fit:
+static uint8_t* lz4_write_sequence(
+  uint8_t* target,
+  const uint8_t* target_end,
+  const uint8_t* literals,
+  size_t literals_length,
+  size_t offset,
+  size_t match_length
+) {
+  size_t worst = 1 + literals_length / 255 + 1 + literals_length + 2 +
+    match_length / 255 + 1;
+  if (worst > (size_t) (target_end - target)) return NULL;
+  uint8_t* token = target++;
+  *token = (uint8_t) ((literals_length < 15 ? literals_length : 15) << 4);
+  if (literals_length >= 15) target = lz4_write_length(target, literals_length);
+  memcpy(target, literals, literals_length);
+  target += literals_length;
+  if (match_length == 0) return target;
+  *target++ = (uint8_t) (offset & 255);
+  *target++ = (uint8_t) (offset >> 8);
+  match_length -= LZ4_MIN_MATCH;
+  *token |= (uint8_t) (match_length < 15 ? match_length : 15);
+  if (match_length >= 15) target = lz4_write_length(target, match_length);
+  return target;
+}
+
+// Compresses a block in the LZ4 block format with a greedy single-probe hash
+// table, as in LZ4's fast mode, returning the compressed length or 0 if the
+// block does not fit within the target:
+static size_t lz4_compress(
+  const uint8_t* source,
+  size_t length,
+  uint8_t* target,
+  size_t target_length
+) {
+  uint32_t table[1 << LZ4_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  const uint8_t* target_end = target + target_length;
+  uint8_t* output = target;
+  size_t anchor = 0;
+  if (length > LZ4_MATCH_LIMIT) {
+    // The last match must start at least 12 bytes, and end at least 5 bytes,
+    // before the end of the block:
+    size_t limit = length - LZ4_MATCH_LIMIT;
+    size_t match_limit = length - LZ4_LAST_LITERALS;
+    size_t position = 1;
+    while (position < limit) {
+      uint32_t sequence = lz4_read_uint32(source + position);
+      uint32_t hash = lz4_hash(sequence);
+      size_t candidate = table[hash];
+      table[hash] = (uint32_t) position;
+      if (
+        candidate >= position ||
+        position - candidate > LZ4_DISTANCE_MAX ||
+        lz4_read_uint32(source + candidate) != sequence
+      ) {
+        // Skip faster through data which does not compress:
+        position += 1 + ((position - anchor) >> 6);
+        continue;
+      }
+      while (
+        position > anchor &&
+        candidate > 0 &&
+        source[position - 1] == source[candidate - 1]
+      ) {
+        position--;
+        candidate--;
+      }
+      size_t match = position + LZ4_MIN_MATCH;
+      size_t reference = candidate + LZ4_MIN_MATCH;
+      while (match + 8 <= match_limit) {
+        uint64_t a = lz4_read_uint64(source + match);
+        uint64_t b = lz4_read_uint64(source + reference);
+        if (a != b) break;
+        match += 8;
+        reference += 8;
+      }
+      while (match < match_limit && source[match] == source[reference]) {
+        match++;
+        reference++;
+      }
+      output = lz4_write_sequence(
+        output,
+        target_end,
+        source + anchor,
+        position - anchor,
+        position - candidate,
+        match - position
+      );
+      if (output == NULL) return 0;
+      anchor = match;
+      position = match;
+      // Index a position within the match to find the next match sooner:
+      if (position - 2 < limit) {
+        table[lz4_hash(lz4_read_uint32(source + position - 2))] =
+          (uint32_t) (position - 2);
+      }
+    }
+  }
+  output = lz4_write_sequence(
+    output,
+    target_end,
+    source + anchor,
+    length - anchor,
+    0,
+    0
+  );
+  if (output == NULL) return 0;
+  return (size_t) (output - target);
+}
+
+// Reads a length of 15 or more from the continuation bytes after a token:
+static int lz4_read_length(
+  const uint8_t* source,
+  size_t source_length,
+  size_t* position,
+  size_t* length
+) {
+  uint8_t byte;
+  do {
+    if (*position >= source_length) return 0;
+    byte = source[(*position)++];
+    *length += byte;
+  } while (byte == 255);
+  return 1;
+}
+
+// Decompresses a block in the LZ4 block format, checking every length and
+// offset against the source and target, so that a corrupt block can never
+// read or write out of bounds. Returns 1 if the block decompresses to exactly
+// the expected length:
+static int lz4_decompress(
+  const uint8_t* source,
+  size_t source_length,
+  uint8_t* target,
+  size_t target_length
+) {
+  size_t input = 0;
+  size_t output = 0;
+  while (1) {
+    if (input >= source_length) return 0;
+    uint8_t token = source[input++];
+    size_t literals = token >> 4;
+    if (
+      literals == 15 &&
+      !lz4_read_length(source, source_length, &input, &literals)
+    ) {
+      return 0;
+    }
+    if (
+      literals > source_length - input ||
+      literals > target_length - output
+    ) {
+      return 0;
+    }
+    memcpy(target + output, source + input, literals);
+    input += literals;
+    output += literals;
+    if (input == source_length) break;
+    if (source_length - input < 2) return 0;
+    size_t offset = source[input] | ((size_t) source[input + 1] << 8);
+    input += 2;
+    if (offset == 0 || offset > output) return 0;
+    size_t match = token & 15;
+    if (
+      match == 15 &&
+      !lz4_read_length(source, source_length, &input, &match)
+    ) {
+      return 0;
+    }
+    match += LZ4_MIN_MATCH;
+    if (match > target_length - output) return 0;
+    uint8_t* copy = target + output;
+    if (offset >= match) {
+      memcpy(copy, copy - offset, match);
+    } else {
+      // The match overlaps itself, repeating the last offset bytes:
+      for (size_t index = 0; index < match; index++) {
+        copy[index] = copy[index - offset];
+      }
+    }
+    output += match;
+  }
+  return output == target_length;
+}
+
+static size_t compress_padded(size_t length, size_t sector) {
+  return (length + sector - 1) / sector * sector;
+}
+
+// Compresses a buffer into a padded frame, which the caller must free with
+// bounce_free() and the frame's padded length:
+static const char* compress_frame(
+  const uint8_t* buffer,
+  size_t length,
+  size_t sector,
+  uint8_t** frame,
+  size_t* frame_length,
+  size_t* compressed
+) {
+  size_t size = compress_padded(COMPRESS_HEADER + length, sector);
+  uint8_t* target = bounce_alloc(size);
+  if (target == NULL) return "insufficient memory";
+  uint32_t method = COMPRESS_LZ4;
+  size_t payload = lz4_compress(
+    buffer,
+    length,
+    target + COMPRESS_HEADER,
+    length > 0 ? length - 1 : 0
+  );
+  if (payload == 0) {
+    method = COMPRESS_STORED;
+    payload = length;
+    memcpy(target + COMPRESS_HEADER, buffer, length);
+  }
+  memcpy(target, COMPRESS_MAGIC, 4);
+  format_write_uint32(target + 4, method);
+  format_write_uint32(target + 8, (uint32_t) payload);
+  format_write_uint32(target + 12, (uint32_t) length);
+  *compressed = COMPRESS_HEADER + payload;
+  *frame_length = compress_padded(*compressed, sector);
+  memset(target + *compressed, 0, *frame_length - *compressed);
+  *frame = target;
+  return NULL;
+}
+
+// Reads the frame at a position, first its first sector for the header and
+// then any remaining sectors, and decompresses it into the buffer:
+static const char* compress_read(
+  int fd,
+  const struct crypt* crypt,
+  int64_t position,
+  size_t sector,
+  uint8_t* buffer,
+  size_t length,
+  size_t* bytes,
+  size_t* compressed
+) {
+  uint8_t* scratch = scratch_acquire();
+  if (scratch == NULL) return "insufficient memory";
+  const char* error = NULL;
+  uint8_t* frame = scratch;
+  size_t frame_length = SCRATCH_SIZE;
+  int64_t result = io_read(fd, scratch, sector, position);
+  size_t got = result < 0 ? 0 : (size_t) result;
+  uint32_t method = 0;
+  size_t payload = 0;
+  size_t original = 0;
+  if (result < 0) {
+    error = io_error(result, "unexpected error, read");
+  } else if ((error = io_decrypt(crypt, scratch, got, position)) != NULL) {
+    // The frame ended within an encrypted sector.
+  } else if (
+    got < COMPRESS_HEADER ||
+    memcmp(scratch, COMPRESS_MAGIC, 4) != 0
+  ) {
+    error = "compressed frame is corrupt";
+  } else {
+    method = format_read_uint32(scratch + 4);
+    payload = format_read_uint32(scratch + 8);
+    original = format_read_uint32(scratch + 12);
+    if (
+      (method != COMPRESS_STORED && method != COMPRESS_LZ4) ||
+      (method == COMPRESS_STORED && payload != original) ||
+      (method == COMPRESS_LZ4 && payload >= original)
+    ) {
+      error = "compressed frame is corrupt";
+    } else if (original > length) {
+      error = "buffer is too small for the decompressed data";
+    }
+  }
+  size_t end = COMPRESS_HEADER + payload;
+  if (error == NULL && end > got) {
+    // A short first read can only be the end of a regular file:
+    if (got < sector) {
+      error = "compressed frame is corrupt";
+    } else {
+      frame_length = compress_padded(end, sector);
+      if (frame_length > SCRATCH_SIZE) {
+        frame = aligned_malloc(frame_length, SCRATCH_ALIGNMENT);
+        if (frame == NULL) {
+          error = "insufficient memory";
+        } else {
+          memcpy(frame, scratch, got);
+        }
+      }
+    }
+    if (error == NULL) {
+      result = io_read(
+        fd,
+        frame + got,
+        frame_length - got,
+        position + (int64_t) got
+      );
+      if (result < 0) {
+        error = io_error(result, "unexpected error, read");
+      } else if (got + (size_t) result < end) {
+        error = "compressed frame is corrupt";
+      } else {
+        error = io_decrypt(
+          crypt,
+          frame + got,
+          (size_t) result,
+          position + (int64_t) got
+        );
+      }
+    }
+  }
+  if (error == NULL) {
+    if (method == COMPRESS_STORED) {
+      memcpy(buffer, frame + COMPRESS_HEADER, payload);
+    } else if (
+      !lz4_decompress(frame + COMPRESS_HEADER, payload, buffer, original)
+    ) {
+      error = "compressed frame is corrupt";
+    }
+    *bytes = original;
+    *compressed = end;
+  }
+  if (frame != scratch && frame != NULL) aligned_free(frame);
+  scratch_release(scratch);
+  return error;
+}
+
+// A Merkle tree over the leaves of a device or file is kept in a sidecar file,
+// mapped into memory, and updated as writes complete, by hashing only the
+// leaves touched by a write and the path from each up to the root. Leaves and
+// parents are hashed with distinct prefixes (as in RFC 6962) so that a leaf
+// can never be mistaken for a parent. A parent without a right child takes
+// the hash of its left child. The sidecar is a 4096-byte header followed by
+// every level of the tree, from the leaves to the root:
+//
+//   0  magic "DIOMERKL"
+//   8  u32 version
+//  12  u32 hash size in bytes
+//  16  u64 leaf size in bytes
+//  24  u64 size of the device or file in bytes
+//  32  u64 number of leaves
+//  40  u32 number of levels
+//  44  u32 CRC32C of the header up to here
+#define MERKLE_MAGIC "DIOMERKL"
+#define MERKLE_VERSION 1
+#define MERKLE_HEADER 4096
+#define MERKLE_HASH BLAKE3_OUT_LEN
+#define MERKLE_LEAF_DEFAULT 65536
+#define MERKLE_LEAF_MIN 4096
+#define MERKLE_LEAF_MAX SCRATCH_SIZE
+#define MERKLE_LEVELS_MAX 64
+
+static const napi_type_tag MERKLE_TYPE_TAG = {
+  0x6d65726b6c65d10aULL, 0x9c1b7f3a52e04e61ULL
+};
+
+struct merkle {
+  uv_mutex_t mutex;
+  uint8_t* map;
+  size_t map_length;
+#if defined(_WIN32)
+  HANDLE mapping;
+#endif
+  int64_t size;
+  int64_t leaf;
+  int64_t leaves;
+  int levels;
+  int64_t level_count[MERKLE_LEVELS_MAX];
+  size_t level_offset[MERKLE_LEVELS_MAX];
+};
+
+static uint8_t* merkle_node(struct merkle* tree, int level, int64_t index) {
+  assert(level >= 0 && level < tree->levels);
+  assert(index >= 0 && index < tree->level_count[level]);
+  return tree->map + tree->level_offset[level] + (size_t) index * MERKLE_HASH;
+}
+
+static void merkle_hash_leaf(
+  const uint8_t* data,
+  size_t length,
+  uint8_t hash[MERKLE_HASH]
+) {
+  static const uint8_t prefix = 0;
+  struct blake3_hasher hasher;
+  blake3_init(&hasher, 0);
+  blake3_update(&hasher, &prefix, 1);
+  blake3_update(&hasher, data, length);
+  blake3_finalize(&hasher, hash);
+}
+
+static void merkle_hash_parent(
+  const uint8_t* left,
+  const uint8_t* right,
+  uint8_t hash[MERKLE_HASH]
+) {
+  uint8_t input[1 + MERKLE_HASH * 2];
+  input[0] = 1;
+  memcpy(input + 1, left, MERKLE_HASH);
+  memcpy(input + 1 + MERKLE_HASH, right, MERKLE_HASH);
+  blake3(input, sizeof(input), hash);
+}
+
+// Lays out the levels of the tree, returning the length of the sidecar:
+static size_t merkle_layout(struct merkle* tree) {
+  size_t offset = MERKLE_HEADER;
+  int64_t count = tree->leaves;
+  tree->levels = 0;
+  while (1) {
+    assert(tree->levels < MERKLE_LEVELS_MAX);
+    tree->level_count[tree->levels] = count;
+    tree->level_offset[tree->levels] = offset;
+    tree->levels++;
+    offset += (size_t) count * MERKLE_HASH;
+    if (count == 1) break;
+    count = (count + 1) / 2;
+  }
+  return offset;
+}
+
+static int64_t merkle_leaf_length(struct merkle* tree, int64_t index) {
+  int64_t start = index * tree->leaf;
+  return tree->size - start < tree->leaf ? tree->size - start : tree->leaf;
+}
+
+static void merkle_hash_node(struct merkle* tree, int level, int64_t index) {
+  assert(level > 0);
+  uint8_t* left = merkle_node(tree, level - 1, index * 2);
+  uint8_t* node = merkle_node(tree, level, index);
+  if (index * 2 + 1 < tree->level_count[level - 1]) {
+    merkle_hash_parent(left, merkle_node(tree, level - 1, index * 2 + 1), node);
+  } else {
+    memcpy(node, left, MERKLE_HASH);
+  }
+}
+
+// Rehashes the parents of a range of leaves, up to the root:
+static void merkle_rehash(struct merkle* tree, int64_t first, int64_t last) {
+  for (int level = 1; level < tree->levels; level++) {
+    first /= 2;
+    last /= 2;
+    for (int64_t index = first; index <= last; index++) {
+      merkle_hash_node(tree, level, index);
+    }
+  }
+}
+
+// Initializes the tree of a device or file of zeroes. Every node of a level
+// but the last has the same full subtree beneath it, so each level costs a
+// single hash and a fill, rather than a hash per node:
+static const char* merkle_init_zeroes(struct merkle* tree) {
+  uint8_t* zeroes = calloc(1, (size_t) tree->leaf);
+  if (zeroes == NULL) return "insufficient memory";
+  uint8_t full[MERKLE_HASH];
+  merkle_hash_leaf(zeroes, (size_t) tree->leaf, full);
+  int64_t last = tree->leaves - 1;
+  for (int64_t index = 0; index < last; index++) {
+    memcpy(merkle_node(tree, 0, index), full, MERKLE_HASH);
+  }
+  merkle_hash_leaf(
+    zeroes,
+    (size_t) merkle_leaf_length(tree, last),
+    merkle_node(tree, 0, last)
+  );
+  free(zeroes);
+  for (int level = 1; level < tree->levels; level++) {
+    merkle_hash_parent(full, full, full);
+    last = tree->level_count[level] - 1;
+    for (int64_t index = 0; index < last; index++) {
+      memcpy(merkle_node(tree, level, index), full, MERKLE_HASH);
+    }
+    merkle_hash_node(tree, level, last);
+  }
+  return NULL;
+}
+
+static void merkle_unmap(struct merkle* tree) {
+  if (tree->map == NULL) return;
+#if defined(_WIN32)
+  UnmapViewOfFile(tree->map);
+  CloseHandle(tree->mapping);
+  tree->mapping = NULL;
+#else
+  munmap(tree->map, tree->map_length);
+#endif
+  tree->map = NULL;
+}
+
+static const char* merkle_map(struct merkle* tree, int fd, size_t length) {
+#if defined(_WIN32)
+  HANDLE handle = uv_get_osfhandle(fd);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return "EBADF, fd is an invalid file descriptor";
+  }
+  tree->mapping = CreateFileMapping(
+    handle,
+    NULL,
+    PAGE_READWRITE,
+    (DWORD) ((uint64_t) length >> 32),
+    (DWORD) length,
+    NULL
+  );
+  if (tree->mapping == NULL) return "CreateFileMapping failed";
+  tree->map = MapViewOfFile(tree->mapping, FILE_MAP_ALL_ACCESS, 0, 0, length);
+  if (tree->map == NULL) {
+    CloseHandle(tree->mapping);
+    tree->mapping = NULL;
+    return "MapViewOfFile failed";
+  }
+#else
+  void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) return "mmap failed";
+  tree->map = map;
+#endif
+  tree->map_length = length;
+  return NULL;
+}
+
+static int merkle_flush(struct merkle* tree) {
+#if defined(_WIN32)
+  return FlushViewOfFile(tree->map, tree->map_length) ? 0 : UV_EIO;
+#else
+  return msync(tree->map, tree->map_length, MS_SYNC) == 0 ? 0 : -errno;
+#endif
+}
+
+static void merkle_header(struct merkle* tree, uint8_t* header) {
+  memset(header, 0, 48);
+  memcpy(header, MERKLE_MAGIC, 8);
+  format_write_uint32(header + 8, MERKLE_VERSION);
+  format_write_uint32(header + 12, MERKLE_HASH);
+  format_write_uint64(header + 16, (uint64_t) tree->leaf);
+  format_write_uint64(header + 24, (uint64_t) tree->size);
+  format_write_uint64(header + 32, (uint64_t) tree->leaves);
+  format_write_uint32(header + 40, (uint32_t) tree->levels);
+  format_write_uint32(header + 44, crc32c(0, header, 44));
+}
+
+// Maps the sidecar of a tree, creating the tree of a device or file of zeroes
+// if the sidecar is empty:
+static const char* merkle_open(struct merkle* tree, int fd) {
+  size_t length = merkle_layout(tree);
+  int64_t current = 0;
+  const char* error = io_size(fd, &current);
+  if (error) return error;
+  int create = current == 0;
+  if (create) {
+    int64_t result = io_truncate(fd, (int64_t) length);
+    if (result < 0) return io_error(result, "unexpected error, ftruncate");
+  } else if (current != (int64_t) length) {
+    return "sidecar is invalid or does not match options";
+  }
+  error = merkle_map(tree, fd, length);
+  if (error) return error;
+  uint8_t header[48];
+  merkle_header(tree, header);
+  if (create) {
+    error = merkle_init_zeroes(tree);
+    if (!error) memcpy(tree->map, header, sizeof(header));
+  } else if (memcmp(tree->map, header, sizeof(header)) != 0) {
+    error = "sidecar is invalid or does not match options";
+  }
+  if (error) merkle_unmap(tree);
+  return error;
+}
+
+// Rehashes the leaves touched by a write, and then the path from each up to
+// the root. A leaf which the write covers only in part is read back and hashed
+// under the tree's mutex, so that of two writes within one leaf, the one to
+// commit last hashes the leaf with both writes in place:
+static const char* merkle_update(
+  struct merkle* tree,
+  int fd,
+  const uint8_t* buffer,
+  size_t length,
+  int64_t position
+) {
+  if (length == 0) return NULL;
+  int64_t end = position + (int64_t) length;
+  int64_t first = position / tree->leaf;
+  int64_t last = (end - 1) / tree->leaf;
+  uint8_t* hashes = malloc((size_t) (last - first + 1) * MERKLE_HASH);
+  if (hashes == NULL) return "insufficient memory";
+  int partial = 0;
+  for (int64_t index = first; index <= last; index++) {
+    int64_t start = index * tree->leaf;
+    int64_t leaf_length = merkle_leaf_length(tree, index);
+    uint8_t* hash = hashes + (index - first) * MERKLE_HASH;
+    if (start >= position && start + leaf_length <= end) {
+      merkle_hash_leaf(buffer + (start - position), (size_t) leaf_length, hash);
+    } else {
+      partial = 1;
+    }
+  }
+  uint8_t* scratch = NULL;
+  const char* error = NULL;
+  if (partial) {
+    scratch = scratch_acquire();
+    if (scratch == NULL) error = "insufficient memory";
+  }
+  uv_mutex_lock(&tree->mutex);
+  if (!error && tree->map == NULL) error = "tree was closed";
+  // At most the first and last leaves are partial:
+  for (int64_t index = first; !error && partial && index <= last; index++) {
+    int64_t start = index * tree->leaf;
+    int64_t leaf_length = merkle_leaf_length(tree, index);
+    if (start >= position && start + leaf_length <= end) continue;
+    // Read whole sectors, since a short last leaf may not be aligned for an fd
+    // opened with O_DIRECT, and the leaf size is a multiple of 4096:
+    size_t size = ((size_t) leaf_length + 4095) & ~(size_t) 4095;
+    int64_t result = io_read(fd, scratch, size, start);
+    if (result < 0) {
+      error = io_error(result, "unexpected error, read");
+    } else {
+      if (result > leaf_length) result = leaf_length;
+      // A leaf beyond the end of a file reads as zeroes:
+      memset(scratch + result, 0, (size_t) (leaf_length - result));
+      uint8_t* hash = hashes + (index - first) * MERKLE_HASH;
+      merkle_hash_leaf(scratch, (size_t) leaf_length, hash);
+    }
+  }
+  if (!error) {
+    memcpy(
+      merkle_node(tree, 0, first),
+      hashes,
+      (size_t) (last - first + 1) * MERKLE_HASH
+    );
+    merkle_rehash(tree, first, last);
+  }
+  uv_mutex_unlock(&tree->mutex);
+  if (scratch) scratch_release(scratch);
+  free(hashes);
+  return error;
+}
+
+static void merkle_finalize(napi_env env, void* data, void* hint) {
+  struct merkle* tree = data;
+  merkle_unmap(tree);
+  uv_mutex_destroy(&tree->mutex);
+  free(tree);
+}
+
+static int arg_merkle(napi_env env, napi_value value, struct merkle** tree) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  if (type != napi_external) return 0;
+  bool tagged = false;
+  OK(napi_check_object_type_tag(env, value, &MERKLE_TYPE_TAG, &tagged));
+  if (!tagged) return 0;
+  OK(napi_get_value_external(env, value, (void**) tree));
+  return 1;
+}
+
+struct io_data {
+  int fd;
+  int write;
+  uint8_t* buffer;
+  size_t length;
+  int64_t position;
+  int crc32c;
+  int crc32c_expect;
+  uint32_t crc32c_expected;
+  uint32_t crc32c_value;
+  int fdatasync;
+  int verify;
+  // Set if the verify had to write back the range to read it from the device:
+  int verify_synced;
+  int atomic;
+  size_t format;
+  int sequence_expect;
+  uint64_t sequence;
+  struct merkle* merkle;
+  int compress;
+  size_t sector;
+  size_t compressed;
+  struct crypt* crypt;
+  int64_t bytes;
+  napi_ref ref_buffer;
+  napi_ref ref_callback;
+  napi_ref ref_merkle;
+  napi_async_work async_work;
+  const char* error;
+};
+
+// Writes with RWF_ATOMIC in a single call, which the kernel either completes
+// in full or fails, after checking the length against the atomic write unit:
+static const char* io_write_atomic(
+  int fd,
+  const uint8_t* buffer,
+  size_t length,
+  int64_t position,
+  int64_t* bytes
+) {
+  int64_t min = 0;
+  int64_t max = 0;
+  io_atomic_units(fd, &min, &max);
+  if (max == 0) return "atomic writes are not supported by this file or device";
+  if ((int64_t) length < min || (int64_t) length > max) {
+    return "length must be within the atomic write unit of the file or device";
+  }
+#if defined(__linux__) && defined(RWF_DSYNC)
+  struct iovec iov = { (void*) buffer, length };
+  int64_t result;
+  do {
+    result = pwritev2(fd, &iov, 1, (off_t) position, RWF_ATOMIC);
+  } while (result < 0 && errno == EINTR);
+  if (result < 0) return io_error(-errno, "unexpected error, write");
+  if ((size_t) result != length) return "unexpected short write";
+  *bytes = result;
+  return NULL;
+#else
+  (void) buffer;
+  (void) position;
+  (void) bytes;
+  return "atomic writes are not supported by this file or device";
+#endif
+}
+
+static const char* io_execute_write(
+  struct io_data* io,
+  uint8_t* buffer,
+  size_t length
+) {
+  int64_t result = 0;
+  if (io->atomic) {
+    const char* error = io_write_atomic(
+      io->fd,
+      buffer,
+      length,
+      io->position,
+      &io->bytes
+    );
+    if (error) return error;
+  } else {
+    result = io_write(io->fd, buffer, length, io->position);
+    if (result < 0) return io_error(result, "unexpected error, write");
+    io->bytes = result;
+  }
+  if (io->fdatasync) {
+    result = io_fdatasync(io->fd);
+    if (result < 0) return io_error(result, "unexpected error, fdatasync");
+  }
+  if (io->verify) {
+    const char* error = io_verify(
+      io->fd,
+      buffer,
+      length,
+      io->position,
+      &io->verify_synced
+    );
+    if (error) return error;
+  }
+  if (io->merkle) {
+    return merkle_update(io->merkle, io->fd, buffer, length, io->position);
+  }
+  return NULL;
+}
+
+void io_execute(napi_env env, void* data) {
+  struct io_data* io = data;
+  assert(io->fd >= 0);
+  assert(io->bytes == 0);
+  assert(io->error == NULL);
+  if (io->write) {
+    if (io->format) {
+      format_fill(
+        io->buffer,
+        io->length,
+        io->format,
+        io->position,
+        io->sequence
+      );
+    }
+    // Checksum what we intend to write, so that an expected checksum can
+    // catch memory corruption before it reaches the disk:
+    if (io->crc32c) io->crc32c_value = crc32c(0, io->buffer, io->length);
+    if (io->crc32c_expect && io->crc32c_value != io->crc32c_expected) {
+      io->error = "crc32c mismatch";
+      return;
+    }
+    // Compress and encrypt on this thread, so that the data is still in cache:
+    uint8_t* buffer = io->buffer;
+    size_t length = io->length;
+    size_t bounce = 0;
+    if (io->compress) {
+      io->error = compress_frame(
+        io->buffer,
+        io->length,
+        io->sector,
+        &buffer,
+        &length,
+        &io->compressed
+      );
+      if (io->error) return;
+      bounce = compress_padded(COMPRESS_HEADER + io->length, io->sector);
+    }
+    if (io->crypt) {
+      uint64_t sector = (uint64_t) io->position / io->crypt->sector;
+      if (bounce) {
+        io->crypt->encrypt(io->crypt, buffer, buffer, length, sector);
+      } else {
+        // Encrypt into a bounce buffer, leaving the caller's buffer as is:
+        bounce = length > 0 ? length : 1;
+        buffer = bounce_alloc(bounce);
+        if (buffer == NULL) {
+          io->error = "insufficient memory";
+          return;
+        }
+        io->crypt->encrypt(io->crypt, io->buffer, buffer, length, sector);
+      }
+    }
+    io->error = io_execute_write(io, buffer, length);
+    if (bounce) bounce_free(buffer, bounce);
+  } else {
+    if (io->compress) {
+      // Decompress straight into the buffer:
+      size_t bytes = 0;
+      io->error = compress_read(
+        io->fd,
+        io->crypt,
+        io->position,
+        io->sector,
+        io->buffer,
+        io->length,
+        &bytes,
+        &io->compressed
+      );
+      if (io->error) return;
+      io->bytes = (int64_t) bytes;
+    } else {
+      int64_t result = io_read(io->fd, io->buffer, io->length, io->position);
+      if (result < 0) {
+        io->error = io_error(result, "unexpected error, read");
+        return;
+      }
+      io->bytes = result;
+      // Decrypt in place:
+      io->error = io_decrypt(
+        io->crypt,
+        io->buffer,
+        (size_t) io->bytes,
+        io->position
+      );
+      if (io->error) return;
+    }
+    if (io->crc32c) {
+      io->crc32c_value = crc32c(0, io->buffer, (size_t) io->bytes);
+    }
+    if (io->crc32c_expect && io->crc32c_value != io->crc32c_expected) {
+      io->error = "crc32c mismatch";
+      return;
+    }
+    if (io->format) {
+      uint64_t sequence_expected = io->sequence;
+      io->sequence = 0;
+      io->error = format_strip(
+        io->buffer,
+        (size_t) io->bytes,
+        io->format,
+        io->position,
+        io->sequence_expect,
+        sequence_expected,
+        &io->sequence
+      );
+    }
+  }
+}
+
+void io_complete(napi_env env, napi_status status, void* data) {
+  struct io_data* io = data;
+  if (status == napi_cancelled) {
+    io->error = "async work was cancelled";
+  } else {
+    assert(status == napi_ok);
+  }
+  int argc = 0;
+  napi_value argv[2];
+  if (io->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, io->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_object(env, &argv[1]));
+    set_int(env, argv[1], "bytes", io->bytes);
+    if (io->crc32c) set_int(env, argv[1], "crc32c", io->crc32c_value);
+    if (io->compress) {
+      set_int(env, argv[1], "compressedBytes", (int64_t) io->compressed);
+    }
+    if (io->verify) {
+      napi_value synced;
+      OK(napi_get_boolean(env, io->verify_synced, &synced));
+      OK(napi_set_named_property(env, argv[1], "verifySynced", synced));
+    }
+    if (io->format && !io->write) {
+      // The payloads of whole blocks now start at the beginning of the range:
+      set_int(
+        env,
+        argv[1],
+        "payloadBytes",
+        io->bytes / (int64_t) io->format *
+        (int64_t) (io->format - FORMAT_TRAILER)
+      );
+      set_int(env, argv[1], "sequence", (int64_t) io->sequence);
+    }
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, io->ref_callback, &callback));
+  // Do not assert the return status of napi_call_function():
+  // If the callback throws then the return status will not be napi_ok.
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, io->ref_buffer));
+  OK(napi_delete_reference(env, io->ref_callback));
+  if (io->ref_merkle) OK(napi_delete_reference(env, io->ref_merkle));
+  if (io->crypt) crypt_release(io->crypt);
+  OK(napi_delete_async_work(env, io->async_work));
+  free(io);
+  io = NULL;
+}
+
+static napi_value io_queue(napi_env env, napi_callback_info info, int write) {
+  size_t argc = 7;
+  napi_value argv[7];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  uint8_t* buffer = NULL;
+  size_t buffer_length = 0;
+  int offset = 0;
+  int length = 0;
+  int64_t position = 0;
+  if (
+    argc != 7 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_buffer(env, argv[1], &buffer, &buffer_length) ||
+    !arg_int(env, argv[2], &offset) ||
+    !arg_int(env, argv[3], &length) ||
+    !arg_int64(env, argv[4], &position) ||
+    !arg_object(env, argv[5]) ||
+    !arg_function(env, argv[6])
+  ) {
+    THROW(env,
+      "bad arguments, expected: "
+      "(fd, buffer, offset, length, position, options, callback)"
+    );
+  }
+  if ((size_t) offset > buffer_length) {
+    THROW(env, "offset must not be greater than buffer.length");
+  }
+  if ((size_t) length > buffer_length - (size_t) offset) {
+    THROW(env, "offset + length must not be greater than buffer.length");
+  }
+  napi_value options = argv[5];
+  int crc = 0;
+  int crc_expect = 0;
+  uint32_t crc_expected = 0;
+  if (!option_bool(env, options, "crc32c", &crc)) {
+    THROW(env, "options.crc32c must be a boolean");
+  }
+  if (
+    !option_uint32(env, options, "expectCRC32C", &crc_expect, &crc_expected)
+  ) {
+    THROW(env, "options.expectCRC32C must be a uint32");
+  }
+  int sync = 0;
+  int verify = 0;
+  if (!option_bool(env, options, "fdatasync", &sync)) {
+    THROW(env, "options.fdatasync must be a boolean");
+  }
+  if (!option_bool(env, options, "verify", &verify)) {
+    THROW(env, "options.verify must be a boolean");
+  }
+  if ((sync || verify) && !write) {
+    THROW(env, "options.fdatasync and options.verify are only for writes");
+  }
+  int atomic = 0;
+  if (!option_bool(env, options, "atomic", &atomic)) {
+    THROW(env, "options.atomic must be a boolean");
+  }
+  if (atomic) {
+    if (!write) THROW(env, "options.atomic is only for writes");
+    if (
+      length == 0 ||
+      (length & (length - 1)) ||
+      position % length != 0
+    ) {
+      THROW(env,
+        "length must be a power of 2 and position a multiple of length "
+        "for options.atomic"
+      );
+    }
+  }
+  int64_t format = 0;
+  int64_t sequence = 0;
+  int sequence_expect = 0;
+  if (!option_int64(env, options, "format", &format)) {
+    THROW(env, "options.format must be a block size");
+  }
+  if (format != 0) {
+    if (
+      format < FORMAT_BLOCK_MIN ||
+      format > FORMAT_BLOCK_MAX ||
+      (format & (format - 1))
+    ) {
+      THROW(env, "options.format must be a power of 2 from 512 to 4194304");
+    }
+    if (length % format != 0 || position % format != 0) {
+      THROW(env, "length and position must be multiples of options.format");
+    }
+  }
+  napi_value sequence_value;
+  if (option_value(env, options, "sequence", &sequence_value)) {
+    if (!arg_int64(env, sequence_value, &sequence)) {
+      THROW(env, "options.sequence must be a safe integer");
+    }
+    if (format == 0) THROW(env, "options.sequence requires options.format");
+    sequence_expect = !write;
+  }
+  int compress = 0;
+  int64_t sector = COMPRESS_SECTOR_MIN;
+  napi_value compress_value;
+  if (option_value(env, options, "compress", &compress_value)) {
+    char method[8];
+    size_t method_length = 0;
+    if (
+      napi_get_value_string_utf8(
+        env,
+        compress_value,
+        method,
+        sizeof(method),
+        &method_length
+      ) != napi_ok ||
+      strcmp(method, "lz4") != 0
+    ) {
+      THROW(env, "options.compress must be \"lz4\"");
+    }
+    if (format != 0) {
+      THROW(env, "options.compress cannot be combined with options.format");
+    }
+    if (atomic) {
+      THROW(env, "options.compress cannot be combined with options.atomic");
+    }
+    compress = 1;
+  }
+  if (
+    !option_int64(env, options, "sectorSize", &sector) ||
+    sector < COMPRESS_SECTOR_MIN ||
+    sector > COMPRESS_SECTOR_MAX ||
+    (sector & (sector - 1))
+  ) {
+    THROW(env, "options.sectorSize must be a power of 2 from 512 to 65536");
+  }
+  // A compressed write may be longer than length, up to the padded frame:
+  int64_t extent = length;
+  if (compress && write) {
+    extent = (int64_t) compress_padded(
+      COMPRESS_HEADER + (size_t) length,
+      (size_t) sector
+    );
+  }
+  struct merkle* merkle = NULL;
+  napi_value merkle_value;
+  if (option_value(env, options, "merkle", &merkle_value)) {
+    if (!arg_merkle(env, merkle_value, &merkle)) {
+      THROW(env, "options.merkle must be a Merkle tree");
+    }
+    if (!write) THROW(env, "options.merkle is only for writes");
+    if (position + extent > merkle->size) {
+      THROW(env, "options.merkle must cover position + length");
+    }
+  }
+  struct crypt* crypt = crypt_acquire(fd);
+  if (crypt) {
+    if (
+      position % (int64_t) crypt->sector != 0 ||
+      (!compress && length % (int64_t) crypt->sector != 0)
+    ) {
+      crypt_release(crypt);
+      THROW(env,
+        "length and position must be multiples of the encryption sector size"
+      );
+    }
+    if (compress && sector % (int64_t) crypt->sector != 0) {
+      crypt_release(crypt);
+      THROW(env,
+        "options.sectorSize must be a multiple of the encryption sector size"
+      );
+    }
+  }
+  struct io_data* io = calloc(1, sizeof(struct io_data));
+  if (!io) {
+    if (crypt) crypt_release(crypt);
+    THROW(env, "insufficient memory");
+  }
+  io->fd = fd;
+  io->write = write;
+  io->buffer = buffer + offset;
+  io->length = (size_t) length;
+  io->position = position;
+  io->crc32c = crc || crc_expect;
+  io->crc32c_expect = crc_expect;
+  io->crc32c_expected = crc_expected;
+  io->fdatasync = sync;
+  io->verify = verify;
+  io->atomic = atomic;
+  io->format = (size_t) format;
+  io->sequence_expect = sequence_expect;
+  io->sequence = (uint64_t) sequence;
+  io->merkle = merkle;
+  io->compress = compress;
+  io->sector = (size_t) sector;
+  io->crypt = crypt;
+  io->error = NULL;
+  OK(napi_create_reference(env, argv[1], 1, &io->ref_buffer));
+  if (merkle) {
+    OK(napi_create_reference(env, merkle_value, 1, &io->ref_merkle));
+  }
+  OK(napi_create_reference(env, argv[6], 1, &io->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    io_execute,
+    io_complete,
+    io,
+    &io->async_work
+  ));
+  OK(napi_queue_async_work(env, io->async_work));
+  return NULL;
+}
+
+// Returns the maximum size of a single I/O to a block device, so that larger
+// I/Os are not split by the kernel, or 0 if unknown or not a block device:
+static int64_t io_max_transfer(int fd) {
+#if defined(__APPLE__)
+  uint64_t bytes = 0;
+  if (ioctl(fd, DKIOCGETMAXBYTECOUNTWRITE, &bytes) == -1) return 0;
+  return bytes > INT64_MAX ? 0 : (int64_t) bytes;
+#elif defined(__linux__)
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (st.st_mode & S_IFMT) != S_IFBLK) return 0;
+  long long kilobytes = 0;
+  if (io_queue_value(st.st_rdev, "max_sectors_kb", &kilobytes) != 0) return 0;
+  return kilobytes < 0 ? 0 : (int64_t) kilobytes * 1024;
+#else
+  (void) fd;
+  return 0;
+#endif
+}
+
+// An engine streams a range of a file or block device through a block
+// function on a number of threads, each with its own aligned buffers, so that
+// the device sees a queue depth equal to the number of threads. The engine
+// provides rate limiting, throttled progress reports, and a checkpoint below
+// which every block is complete. An engine runs within a single task on the
+// threadpool, so that the event loop sees only progress and completion.
+#define ENGINE_BLOCK_DEFAULT 1048576
+#define ENGINE_BLOCK_MAX 67108864
+#define ENGINE_BUFFERS_MAX 2
+#define ENGINE_COUNTERS 2
+#define ENGINE_DEPTH_DEFAULT 4
+#define ENGINE_DEPTH_MAX 64
+#define ENGINE_INTERVAL_DEFAULT 1000
+
+struct engine;
+
+struct engine_worker {
+  struct engine* engine;
+  uv_thread_t thread;
+  uint8_t* buffers[ENGINE_BUFFERS_MAX];
+  int64_t inflight;
+};
+
+struct engine_report {
+  int64_t bytes;
+  int64_t checkpoint;
+  int64_t total;
+  uint64_t elapsed;
+  int64_t counters[ENGINE_COUNTERS];
+  const char* const* counter_names;
+};
+
+struct engine {
+  // Set by the caller before the engine runs:
+  int64_t start;
+  int64_t end;
+  size_t block;
+  int depth;
+  int buffers;
+  int64_t rate;
+  uint64_t interval;
+  const char* counter_names[ENGINE_COUNTERS];
+  const char* (*prepare)(struct engine*);
+  const char* (*run)(struct engine_worker*, int64_t, size_t);
+  const char* (*finish)(struct engine*);
+  void (*result)(struct engine*, napi_env, napi_value);
+  void (*cleanup)(struct engine*);
+  // Owned by the engine, and protected by the mutex while workers run:
+  uv_mutex_t mutex;
+  int64_t next;
+  int64_t bytes;
+  int64_t counters[ENGINE_COUNTERS];
+  uint64_t time_start;
+  uint64_t time_progress;
+  uint64_t time_end;
+  struct engine_worker workers[ENGINE_DEPTH_MAX];
+  napi_threadsafe_function progress;
+  napi_ref ref_progress;
+  napi_ref ref_callback;
+  // Set by the caller to keep an object alive while the engine runs:
+  napi_ref ref_keep;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static void set_number(
+  napi_env env,
+  napi_value object,
+  const char* name,
+  double number
+) {
+  napi_value value;
+  OK(napi_create_double(env, number, &value));
+  OK(napi_set_named_property(env, object, name, value));
+}
+
+static void engine_report_object(
+  napi_env env,
+  napi_value object,
+  struct engine_report* report
+) {
+  set_int(env, object, "bytes", report->bytes);
+  set_int(env, object, "checkpoint", report->checkpoint);
+  set_int(env, object, "total", report->total);
+  double seconds = (double) report->elapsed / 1e9;
+  set_number(env, object, "elapsed", seconds * 1000);
+  set_number(
+    env,
+    object,
+    "throughput",
+    seconds > 0 ? (double) report->bytes / seconds : 0
+  );
+  for (int index = 0; index < ENGINE_COUNTERS; index++) {
+    if (report->counter_names[index] == NULL) continue;
+    set_int(env, object, report->counter_names[index], report->counters[index]);
+  }
+}
+
+// Every block below the lowest block in flight has been completed, since
+// blocks are handed out in order:
+static int64_t engine_checkpoint(struct engine* engine) {
+  int64_t checkpoint = engine->next < engine->end ? engine->next : engine->end;
+  for (int index = 0; index < engine->depth; index++) {
+    int64_t inflight = engine->workers[index].inflight;
+    if (inflight >= 0 && inflight < checkpoint) checkpoint = inflight;
+  }
+  return checkpoint;
+}
+
+static void engine_snapshot(
+  struct engine* engine,
+  struct engine_report* report,
+  uint64_t now
+) {
+  report->bytes = engine->bytes;
+  report->checkpoint = engine_checkpoint(engine);
+  report->total = engine->end - engine->start;
+  report->elapsed = now - engine->time_start;
+  for (int index = 0; index < ENGINE_COUNTERS; index++) {
+    report->counters[index] = engine->counters[index];
+  }
+  report->counter_names = engine->counter_names;
+}
+
+static void engine_progress_call(
+  napi_env env,
+  napi_value callback,
+  void* context,
+  void* data
+) {
+  struct engine_report* report = data;
+  // The environment is NULL if the progress function is being torn down:
+  if (env != NULL && callback != NULL) {
+    napi_value object;
+    OK(napi_create_object(env, &object));
+    engine_report_object(env, object, report);
+    napi_value scope;
+    OK(napi_get_global(env, &scope));
+    napi_call_function(env, scope, callback, 1, &object, NULL);
+  }
+  free(report);
+}
+
+// Called with the mutex held:
+static void engine_report_progress(struct engine* engine, uint64_t now) {
+  if (engine->progress == NULL) return;
+  if (now - engine->time_progress < engine->interval) return;
+  engine->time_progress = now;
+  struct engine_report* report = malloc(sizeof(struct engine_report));
+  if (!report) return;
+  engine_snapshot(engine, report, now);
+  if (
+    napi_call_threadsafe_function(
+      engine->progress,
+      report,
+      napi_tsfn_nonblocking
+    ) != napi_ok
+  ) {
+    free(report);
+  }
+}
+
+// Called by a block function when it reaches the end of a regular file:
+static void engine_eof(struct engine* engine, int64_t position) {
+  uv_mutex_lock(&engine->mutex);
+  if (position < engine->end) engine->end = position;
+  uv_mutex_unlock(&engine->mutex);
+}
+
+static void engine_count(struct engine* engine, int counter, int64_t amount) {
+  assert(counter >= 0 && counter < ENGINE_COUNTERS);
+  uv_mutex_lock(&engine->mutex);
+  engine->counters[counter] += amount;
+  uv_mutex_unlock(&engine->mutex);
+}
+
+static void engine_worker_run(void* data) {
+  struct engine_worker* worker = data;
+  struct engine* engine = worker->engine;
+  for (;;) {
+    uv_mutex_lock(&engine->mutex);
+    if (engine->error || engine->next >= engine->end) {
+      uv_mutex_unlock(&engine->mutex);
+      break;
+    }
+    int64_t position = engine->next;
+    size_t length = engine->block;
+    if ((int64_t) length > engine->end - position) {
+      length = (size_t) (engine->end - position);
+    }
+    engine->next += (int64_t) length;
+    worker->inflight = position;
+    uint64_t due = 0;
+    if (engine->rate > 0) {
+      due = engine->time_start + (uint64_t) (
+        (double) (position - engine->start) * 1e9 / (double) engine->rate
+      );
+    }
+    uv_mutex_unlock(&engine->mutex);
+    if (due > 0) {
+      uint64_t now = uv_hrtime();
+      if (due > now) uv_sleep((unsigned int) ((due - now) / 1000000));
+    }
+    const char* error = engine->run(worker, position, length);
+    uv_mutex_lock(&engine->mutex);
+    worker->inflight = -1;
+    if (error && !engine->error) engine->error = error;
+    int64_t end = position + (int64_t) length;
+    if (end > engine->end) end = engine->end;
+    if (end > position) engine->bytes += end - position;
+    engine_report_progress(engine, uv_hrtime());
+    uv_mutex_unlock(&engine->mutex);
+  }
+}
+
+static void engine_execute(napi_env env, void* data) {
+  struct engine* engine = data;
+  assert(engine->depth >= 1 && engine->depth <= ENGINE_DEPTH_MAX);
+  assert(engine->buffers >= 0 && engine->buffers <= ENGINE_BUFFERS_MAX);
+  assert(engine->block > 0);
+  engine->time_start = uv_hrtime();
+  engine->time_progress = engine->time_start;
+  if (engine->prepare) engine->error = engine->prepare(engine);
+  if (engine->error) return;
+  assert(engine->start >= 0 && engine->start <= engine->end);
+  engine->next = engine->start;
+  for (int index = 0; index < engine->depth; index++) {
+    struct engine_worker* worker = &engine->workers[index];
+    worker->engine = engine;
+    worker->inflight = -1;
+    for (int buffer = 0; buffer < engine->buffers; buffer++) {
+      uint8_t* ptr = aligned_malloc(engine->block, SCRATCH_ALIGNMENT);
+      if (ptr == NULL) engine->error = "insufficient memory";
+      worker->buffers[buffer] = ptr;
+    }
+  }
+  int created = 0;
+  while (!engine->error && created < engine->depth) {
+    struct engine_worker* worker = &engine->workers[created];
+    if (uv_thread_create(&worker->thread, engine_worker_run, worker) != 0) {
+      uv_mutex_lock(&engine->mutex);
+      engine->error = "unable to create thread";
+      uv_mutex_unlock(&engine->mutex);
+      break;
+    }
+    created++;
+  }
+  for (int index = 0; index < created; index++) {
+    int joined = uv_thread_join(&engine->workers[index].thread);
+    assert(joined == 0);
+  }
+  for (int index = 0; index < engine->depth; index++) {
+    for (int buffer = 0; buffer < engine->buffers; buffer++) {
+      uint8_t* ptr = engine->workers[index].buffers[buffer];
+      if (ptr != NULL) aligned_free(ptr);
+      engine->workers[index].buffers[buffer] = NULL;
+    }
+  }
+  if (!engine->error && engine->finish) engine->error = engine->finish(engine);
+  engine->time_end = uv_hrtime();
+}
+
+static void engine_complete(napi_env env, napi_status status, void* data) {
+  struct engine* engine = data;
+  if (status == napi_cancelled) {
+    engine->error = "async work was cancelled";
+  } else {
+    assert(status == napi_ok);
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  // Drop any progress reports not yet delivered, which would be stale, and
+  // report final progress instead:
+  if (engine->progress != NULL) {
+    OK(napi_release_threadsafe_function(engine->progress, napi_tsfn_abort));
+    engine->progress = NULL;
+    if (!engine->error) {
+      napi_value object;
+      OK(napi_create_object(env, &object));
+      struct engine_report report;
+      engine_snapshot(engine, &report, engine->time_end);
+      engine_report_object(env, object, &report);
+      napi_value on_progress;
+      OK(napi_get_reference_value(env, engine->ref_progress, &on_progress));
+      napi_call_function(env, scope, on_progress, 1, &object, NULL);
+    }
+    OK(napi_delete_reference(env, engine->ref_progress));
+  }
+  int argc = 0;
+  napi_value argv[2];
+  if (engine->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, engine->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_object(env, &argv[1]));
+    struct engine_report report;
+    engine_snapshot(engine, &report, engine->time_end);
+    engine_report_object(env, argv[1], &report);
+    if (engine->result) engine->result(engine, env, argv[1]);
+  }
+  napi_value callback;
+  OK(napi_get_reference_value(env, engine->ref_callback, &callback));
+  // Do not assert the return status of napi_call_function():
+  // If the callback throws then the return status will not be napi_ok.
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, engine->ref_callback));
+  if (engine->ref_keep) OK(napi_delete_reference(env, engine->ref_keep));
+  OK(napi_delete_async_work(env, engine->async_work));
+  uv_mutex_destroy(&engine->mutex);
+  if (engine->cleanup) engine->cleanup(engine);
+  free(engine);
+  engine = NULL;
+}
+
+// Parses the options common to all engines, returning an error message if an
+// option is invalid:
+static const char* engine_options(
+  napi_env env,
+  napi_value options,
+  struct engine* engine
+) {
+  int64_t block = ENGINE_BLOCK_DEFAULT;
+  int64_t depth = ENGINE_DEPTH_DEFAULT;
+  int64_t rate = 0;
+  int64_t interval = ENGINE_INTERVAL_DEFAULT;
+  if (
+    !option_int64(env, options, "blockSize", &block) ||
+    block < 512 ||
+    block > ENGINE_BLOCK_MAX ||
+    block % 512 != 0
+  ) {
+    return "options.blockSize must be a multiple of 512 up to 67108864";
+  }
+  if (
+    !option_int64(env, options, "depth", &depth) ||
+    depth < 1 ||
+    depth > ENGINE_DEPTH_MAX
+  ) {
+    return "options.depth must be from 1 to 64";
+  }
+  if (!option_int64(env, options, "rateLimit", &rate)) {
+    return "options.rateLimit must be a number of bytes per second";
+  }
+  if (!option_int64(env, options, "progressInterval", &interval)) {
+    return "options.progressInterval must be a number of milliseconds";
+  }
+  engine->block = (size_t) block;
+  engine->depth = (int) depth;
+  engine->rate = rate;
+  engine->interval = (uint64_t) interval * 1000000;
+  return NULL;
+}
+
+// Queues an engine, taking ownership of it, and throwing if onProgress is
+// neither a function nor null:
+static napi_value engine_queue(
+  napi_env env,
+  struct engine* engine,
+  napi_value on_progress,
+  napi_value callback
+) {
+  napi_valuetype type;
+  OK(napi_typeof(env, on_progress, &type));
+  assert(arg_function(env, callback));
+  assert(type == napi_function || type == napi_null);
+  engine->error = NULL;
+  int mutex = uv_mutex_init(&engine->mutex);
+  assert(mutex == 0);
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  if (type == napi_function) {
+    OK(napi_create_threadsafe_function(
+      env,
+      on_progress,
+      NULL,
+      name,
+      0,
+      1,
+      NULL,
+      NULL,
+      NULL,
+      engine_progress_call,
+      &engine->progress
+    ));
+    OK(napi_create_reference(env, on_progress, 1, &engine->ref_progress));
+  }
+  OK(napi_create_reference(env, callback, 1, &engine->ref_callback));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    engine_execute,
+    engine_complete,
+    engine,
+    &engine->async_work
+  ));
+  OK(napi_queue_async_work(env, engine->async_work));
+  return NULL;
+}
+
+static int arg_progress(napi_env env, napi_value value) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  return type == napi_function || type == napi_null;
+}
+
+struct scrub_range {
+  int64_t offset;
+  int64_t length;
+  const char* error;
+};
+
+struct scrub_data {
+  struct engine engine;
+  int fd;
+  size_t sector;
+  size_t format;
+  struct scrub_range* ranges;
+  size_t ranges_length;
+  size_t ranges_capacity;
+};
+
+#define SCRUB_BAD_BYTES 0
+#define SCRUB_RETRIES 1
+
+static void scrub_bad(
+  struct scrub_data* scrub,
+  int64_t offset,
+  int64_t length,
+  const char* error
+) {
+  uv_mutex_lock(&scrub->engine.mutex);
+  scrub->engine.counters[SCRUB_BAD_BYTES] += length;
+  if (scrub->ranges_length == scrub->ranges_capacity) {
+    size_t capacity = scrub->ranges_capacity ? scrub->ranges_capacity * 2 : 64;
+    struct scrub_range* ranges = realloc(
+      scrub->ranges,
+      capacity * sizeof(struct scrub_range)
+    );
+    if (ranges == NULL) {
+      if (!scrub->engine.error) scrub->engine.error = "insufficient memory";
+      uv_mutex_unlock(&scrub->engine.mutex);
+      return;
+    }
+    scrub->ranges = ranges;
+    scrub->ranges_capacity = capacity;
+  }
+  struct scrub_range* range = &scrub->ranges[scrub->ranges_length++];
+  range->offset = offset;
+  range->length = length;
+  range->error = error;
+  uv_mutex_unlock(&scrub->engine.mutex);
+}
+
+// Verifies the sector format, if any, of blocks read successfully:
+static void scrub_check(
+  struct scrub_data* scrub,
+  const uint8_t* buffer,
+  int64_t position,
+  size_t length
+) {
+  if (scrub->format == 0) return;
+  for (size_t offset = 0; offset + scrub->format <= length; ) {
+    uint64_t sequence = 0;
+    const char* error = format_check(
+      buffer + offset,
+      scrub->format,
+      ((uint64_t) position + offset) / scrub->format,
+      0,
+      0,
+      &sequence
+    );
+    if (error) scrub_bad(scrub, position + offset, scrub->format, error);
+    offset += scrub->format;
+  }
+}
+
+// Retries a failed block a unit at a time to pinpoint bad sectors, where the
+// unit is the sector format block if any, else the sector size:
+static const char* scrub_retry(
+  struct scrub_data* scrub,
+  uint8_t* buffer,
+  int64_t position,
+  size_t length
+) {
+  engine_count(&scrub->engine, SCRUB_RETRIES, 1);
+  size_t unit = scrub->format ? scrub->format : scrub->sector;
+  for (size_t offset = 0; offset < length; offset += unit) {
+    size_t size = length - offset < unit ? length - offset : unit;
+    int bad = 0;
+    for (size_t sector = 0; sector < size; sector += scrub->sector) {
+      int64_t at = position + (int64_t) (offset + sector);
+      size_t count = scrub->sector;
+      if (size - sector < count) count = size - sector;
+      int64_t result = io_read(scrub->fd, buffer + offset + sector, count, at);
+      if (result == UV_EIO) {
+        scrub_bad(scrub, at, (int64_t) count, io_error(result, NULL));
+        bad = 1;
+      } else if (result < 0) {
+        return io_error(result, "unexpected error, read");
+      } else if ((size_t) result < count) {
+        engine_eof(&scrub->engine, at + result);
+        return NULL;
+      }
+    }
+    if (!bad) scrub_check(scrub, buffer + offset, position + offset, size);
+  }
+  return NULL;
+}
+
+static const char* scrub_run(
+  struct engine_worker* worker,
+  int64_t position,
+  size_t length
+) {
+  struct scrub_data* scrub = (struct scrub_data*) worker->engine;
+  uint8_t* buffer = worker->buffers[0];
+  int64_t result = io_read(scrub->fd, buffer, length, position);
+  if (result == UV_EIO) return scrub_retry(scrub, buffer, position, length);
+  if (result < 0) return io_error(result, "unexpected error, read");
+  if ((size_t) result < length) engine_eof(&scrub->engine, position + result);
+  scrub_check(scrub, buffer, position, (size_t) result);
+  return NULL;
+}
+
+static const char* scrub_prepare(struct engine* engine) {
+  struct scrub_data* scrub = (struct scrub_data*) engine;
+  if (engine->end >= 0) return NULL;
+  int64_t size = 0;
+  const char* error = io_size(scrub->fd, &size);
+  if (error) return error;
+  engine->end = size;
+  if (engine->start > engine->end) engine->start = engine->end;
+  return NULL;
+}
+
+static int scrub_range_compare(const void* a, const void* b) {
+  const struct scrub_range* x = a;
+  const struct scrub_range* y = b;
+  if (x->offset < y->offset) return -1;
+  if (x->offset > y->offset) return 1;
+  return 0;
+}
+
+static void scrub_result(
+  struct engine* engine,
+  napi_env env,
+  napi_value result
+) {
+  struct scrub_data* scrub = (struct scrub_data*) engine;
+  qsort(
+    scrub->ranges,
+    scrub->ranges_length,
+    sizeof(struct scrub_range),
+    scrub_range_compare
+  );
+  // Merge adjacent bad ranges with the same error:
+  size_t length = 0;
+  for (size_t index = 0; index < scrub->ranges_length; index++) {
+    struct scrub_range* range = &scrub->ranges[index];
+    if (length > 0) {
+      struct scrub_range* last = &scrub->ranges[length - 1];
+      if (
+        last->offset + last->length == range->offset &&
+        strcmp(last->error, range->error) == 0
+      ) {
+        last->length += range->length;
+        continue;
+      }
+    }
+    scrub->ranges[length++] = *range;
+  }
+  napi_value array;
+  OK(napi_create_array_with_length(env, length, &array));
+  for (size_t index = 0; index < length; index++) {
+    napi_value object;
+    OK(napi_create_object(env, &object));
+    set_int(env, object, "offset", scrub->ranges[index].offset);
+    set_int(env, object, "length", scrub->ranges[index].length);
+    napi_value error;
+    OK(napi_create_string_utf8(
+      env,
+      scrub->ranges[index].error,
+      NAPI_AUTO_LENGTH,
+      &error
+    ));
+    OK(napi_set_named_property(env, object, "error", error));
+    OK(napi_set_element(env, array, (uint32_t) index, object));
+  }
+  OK(napi_set_named_property(env, result, "badRanges", array));
+}
+
+static void scrub_cleanup(struct engine* engine) {
+  struct scrub_data* scrub = (struct scrub_data*) engine;
+  if (scrub->ranges) free(scrub->ranges);
+  scrub->ranges = NULL;
+}
+
+struct image_data {
+  struct engine engine;
+  int fd_source;
+  int fd_target;
+  int punch;
+  // The size of the target before imaging, beyond which zero blocks can be
+  // skipped since they will read as zeroes once the target is extended:
+  int64_t target_size;
+};
+
+#define IMAGE_DATA_BYTES 0
+#define IMAGE_ZERO_BYTES 1
+
+// Copies a block unless it is all zeroes, in which case we seek over it,
+// leaving a hole in the image, or punch a hole if asked to. Zero blocks within
+// the existing size of the target (e.g. a block device or an older image) are
+// written if not punched, since they would otherwise leave stale data:
+static const char* image_run(
+  struct engine_worker* worker,
+  int64_t position,
+  size_t length
+) {
+  struct image_data* image = (struct image_data*) worker->engine;
+  uint8_t* buffer = worker->buffers[0];
+  int64_t result = io_read(image->fd_source, buffer, length, position);
+  if (result < 0) return io_error(result, "unexpected error, read");
+  if ((size_t) result < length) {
+    engine_eof(&image->engine, position + result);
+    length = (size_t) result;
+  }
+  if (length == 0) return NULL;
+  if (simd.is_zero(buffer, length)) {
+    engine_count(&image->engine, IMAGE_ZERO_BYTES, (int64_t) length);
+    if (image->punch) {
+      result = io_punch(image->fd_target, position, (int64_t) length);
+      if (result == 0) return NULL;
+      // Fall back to writing zeroes where holes are not supported, e.g. when
+      // the target is a block device:
+      if (result != UV_ENOTSUP && result != UV_EINVAL) {
+        return io_error(result, "unexpected error, punch");
+      }
+    } else if (position >= image->target_size) {
+      return NULL;
+    }
+  } else {
+    engine_count(&image->engine, IMAGE_DATA_BYTES, (int64_t) length);
+  }
+  result = io_write(image->fd_target, buffer, length, position);
+  if (result < 0) return io_error(result, "unexpected error, write");
+  return NULL;
+}
+
+static const char* image_prepare(struct engine* engine) {
+  struct image_data* image = (struct image_data*) engine;
+  // If the size of the target is unknown then every zero block is written:
+  if (io_size(image->fd_target, &image->target_size) != NULL) {
+    image->target_size = INT64_MAX;
+  }
+  if (engine->end >= 0) return NULL;
+  int64_t size = 0;
+  const char* error = io_size(image->fd_source, &size);
+  if (error) return error;
+  engine->end = size;
+  if (engine->start > engine->end) engine->start = engine->end;
+  return NULL;
+}
+
+// A trailing run of zero blocks was never written, so we extend the image to
+// its full size, which also makes the trailing run a hole:
+static const char* image_finish(struct engine* engine) {
+  struct image_data* image = (struct image_data*) engine;
+  int64_t result = io_extend(image->fd_target, engine->end);
+  if (result < 0) return io_error(result, "unexpected error, ftruncate");
+  return NULL;
+}
+
+struct copy_data {
+  struct engine engine;
+  int fd_source;
+  int fd_target;
+  int64_t offset;
+  int64_t target_offset;
+  int verify;
+  int depth_reads;
+  int depth_writes;
+  uv_sem_t reads;
+  uv_sem_t writes;
+  // Optional ranges to copy, which the engine sees as a single range of the
+  // sum of their lengths, starting at 0:
+  int64_t* ranges;
+  int64_t* ranges_start;
+  size_t ranges_length;
+};
+
+#define COPY_VERIFIED_BYTES 0
+
+// Copies a piece of a block, bounding the reads and writes in flight on either
+// device with the semaphores. Returns the number of bytes read, which is less
+// than length only at the end of the source:
+static const char* copy_piece(
+  struct copy_data* copy,
+  uint8_t* buffer,
+  size_t length,
+  int64_t position,
+  int64_t target,
+  size_t* copied
+) {
+  uv_sem_wait(&copy->reads);
+  int64_t result = io_read(copy->fd_source, buffer, length, position);
+  uv_sem_post(&copy->reads);
+  if (result < 0) return io_error(result, "unexpected error, read");
+  *copied = (size_t) result;
+  if (result == 0) return NULL;
+  const char* error = NULL;
+  uv_sem_wait(&copy->writes);
+  result = io_write(copy->fd_target, buffer, *copied, target);
+  if (result < 0) {
+    error = io_error(result, "unexpected error, write");
+  } else if (copy->verify) {
+    error = io_verify(copy->fd_target, buffer, *copied, target, NULL);
+  }
+  uv_sem_post(&copy->writes);
+  if (!error && copy->verify) {
+    engine_count(&copy->engine, COPY_VERIFIED_BYTES, (int64_t) *copied);
+  }
+  return error;
+}
+
+// Copies the pieces of the ranges which fall within a block:
+static const char* copy_ranges(
+  struct copy_data* copy,
+  uint8_t* buffer,
+  int64_t position,
+  size_t length
+) {
+  // Find the last range starting at or before the position:
+  size_t low = 0;
+  size_t high = copy->ranges_length;
+  while (high - low > 1) {
+    size_t middle = low + (high - low) / 2;
+    if (copy->ranges_start[middle] <= position) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  size_t range = low;
+  while (length > 0) {
+    assert(range < copy->ranges_length);
+    int64_t skip = position - copy->ranges_start[range];
+    int64_t remaining = copy->ranges[range * 2 + 1] - skip;
+    if (remaining <= 0) {
+      range++;
+      continue;
+    }
+    size_t piece = length;
+    if ((int64_t) piece > remaining) piece = (size_t) remaining;
+    int64_t source = copy->ranges[range * 2] + skip;
+    size_t copied = 0;
+    const char* error = copy_piece(
+      copy,
+      buffer,
+      piece,
+      source,
+      source,
+      &copied
+    );
+    if (error) return error;
+    if (copied < piece) return "short read, a range exceeds the source";
+    buffer += piece;
+    position += (int64_t) piece;
+    length -= piece;
+  }
+  return NULL;
+}
+
+// Each worker owns one buffer of the ring, and carries a block from a read to
+// a write, while the semaphores bound the reads and writes in flight on either
+// device, so that reads of later blocks overlap with writes of earlier blocks:
+static const char* copy_run(
+  struct engine_worker* worker,
+  int64_t position,
+  size_t length
+) {
+  struct copy_data* copy = (struct copy_data*) worker->engine;
+  uint8_t* buffer = worker->buffers[0];
+  if (copy->ranges) return copy_ranges(copy, buffer, position, length);
+  int64_t target = position - copy->offset + copy->target_offset;
+  size_t copied = 0;
+  const char* error = copy_piece(
+    copy,
+    buffer,
+    length,
+    position,
+    target,
+    &copied
+  );
+  if (!error && copied < length) {
+    engine_eof(&copy->engine, position + (int64_t) copied);
+  }
+  return error;
+}
+
+static const char* copy_prepare(struct engine* engine) {
+  struct copy_data* copy = (struct copy_data*) engine;
+  if (engine->end >= 0) return NULL;
+  int64_t size = 0;
+  const char* error = io_size(copy->fd_source, &size);
+  if (error) return error;
+  engine->end = size > copy->offset ? size : copy->offset;
+  if (engine->start > engine->end) engine->start = engine->end;
+  return NULL;
+}
+
+static void copy_cleanup(struct engine* engine) {
+  struct copy_data* copy = (struct copy_data*) engine;
+  uv_sem_destroy(&copy->reads);
+  uv_sem_destroy(&copy->writes);
+  if (copy->ranges) free(copy->ranges);
+  copy->ranges = NULL;
+  if (copy->ranges_start) free(copy->ranges_start);
+  copy->ranges_start = NULL;
+}
+
+// Parses the options shared by copyDevice() and applyDelta():
+static const char* copy_options(
+  napi_env env,
+  napi_value options,
+  struct copy_data* copy
+) {
+  struct engine* engine = &copy->engine;
+  const char* error = engine_options(env, options, engine);
+  if (error) return error;
+  int64_t depth_reads = engine->depth;
+  int64_t depth_writes = engine->depth;
+  if (
+    !option_int64(env, options, "srcDepth", &depth_reads) ||
+    depth_reads < 1 ||
+    depth_reads > ENGINE_DEPTH_MAX
+  ) {
+    return "options.srcDepth must be from 1 to 64";
+  }
+  if (
+    !option_int64(env, options, "dstDepth", &depth_writes) ||
+    depth_writes < 1 ||
+    depth_writes > ENGINE_DEPTH_MAX
+  ) {
+    return "options.dstDepth must be from 1 to 64";
+  }
+  if (!option_bool(env, options, "verify", &copy->verify)) {
+    return "options.verify must be a boolean";
+  }
+  copy->depth_reads = (int) depth_reads;
+  copy->depth_writes = (int) depth_writes;
+  return NULL;
+}
+
+static napi_value copy_queue(
+  napi_env env,
+  struct copy_data* copy,
+  napi_value on_progress,
+  napi_value callback
+) {
+  struct engine* engine = &copy->engine;
+  int sem_reads = uv_sem_init(&copy->reads, (unsigned int) copy->depth_reads);
+  assert(sem_reads == 0);
+  int sem_writes = uv_sem_init(
+    &copy->writes,
+    (unsigned int) copy->depth_writes
+  );
+  assert(sem_writes == 0);
+  // Enough buffers in the ring for every read and write to be in flight:
+  engine->depth = copy->depth_reads + copy->depth_writes;
+  if (engine->depth > ENGINE_DEPTH_MAX) engine->depth = ENGINE_DEPTH_MAX;
+  engine->buffers = 1;
+  if (copy->verify) {
+    engine->counter_names[COPY_VERIFIED_BYTES] = "verifiedBytes";
+  }
+  engine->prepare = copy_prepare;
+  engine->run = copy_run;
+  engine->cleanup = copy_cleanup;
+  return engine_queue(env, engine, on_progress, callback);
+}
+
+// A block index holds the BLAKE3 hash of every block of a device or image, so
+// that a later scan can find the blocks which have changed since. The index is
+// a 4096-byte header followed by a packed array of hashes:
+//
+//   0  magic "DIOINDEX"
+//   8  u32 version
+//  12  u32 hash size in bytes
+//  16  u64 block size in bytes
+//  24  u64 size of the device or image in bytes
+//  32  u64 number of blocks
+//  40  u32 CRC32C of the hashes
+//  44  u32 CRC32C of the header up to here
+#define INDEX_MAGIC "DIOINDEX"
+#define INDEX_VERSION 1
+#define INDEX_HEADER 4096
+#define INDEX_HASH BLAKE3_OUT_LEN
+
+struct index_data {
+  struct engine engine;
+  int fd;
+  int fd_index;
+  int delta;
+  int update;
+  int64_t size;
+  int64_t blocks;
+  uint8_t* hashes;
+  int64_t previous_blocks;
+  uint8_t* previous;
+};
+
+static int64_t index_blocks(int64_t size, int64_t block) {
+  return size / block + (size % block != 0 ? 1 : 0);
+}
+
+static const char* index_load(struct index_data* index) {
+  uint8_t* header = aligned_malloc(INDEX_HEADER, SCRATCH_ALIGNMENT);
+  if (header == NULL) return "insufficient memory";
+  int64_t result = io_read(index->fd_index, header, INDEX_HEADER, 0);
+  const char* error = NULL;
+  if (result < 0) {
+    error = io_error(result, "unexpected error, read");
+  } else if (
+    result != INDEX_HEADER ||
+    memcmp(header, INDEX_MAGIC, 8) != 0 ||
+    format_read_uint32(header + 8) != INDEX_VERSION ||
+    format_read_uint32(header + 12) != INDEX_HASH ||
+    format_read_uint32(header + 44) != crc32c(0, header, 44)
+  ) {
+    error = "index is invalid or corrupt";
+  }
+  uint64_t block = error ? 0 : format_read_uint64(header + 16);
+  uint64_t size = error ? 0 : format_read_uint64(header + 24);
+  uint64_t blocks = error ? 0 : format_read_uint64(header + 32);
+  uint32_t checksum = error ? 0 : format_read_uint32(header + 40);
+  aligned_free(header);
+  if (error) return error;
+  if (
+    block == 0 ||
+    block % 512 != 0 ||
+    block > ENGINE_BLOCK_MAX ||
+    size > 9007199254740991 ||
+    blocks != (uint64_t) index_blocks((int64_t) size, (int64_t) block) ||
+    blocks > SIZE_MAX / INDEX_HASH
+  ) {
+    return "index is invalid or corrupt";
+  }
+  index->engine.block = (size_t) block;
+  index->previous_blocks = (int64_t) blocks;
+  size_t length = (size_t) blocks * INDEX_HASH;
+  index->previous = malloc(length > 0 ? length : 1);
+  if (index->previous == NULL) return "insufficient memory";
+  result = io_read(index->fd_index, index->previous, length, INDEX_HEADER);
+  if (result < 0) return io_error(result, "unexpected error, read");
+  if (
+    (size_t) result != length ||
+    crc32c(0, index->previous, length) != checksum
+  ) {
+    return "index is invalid or corrupt";
+  }
+  return NULL;
+}
+
+static const char* index_prepare(struct engine* engine) {
+  struct index_data* index = (struct index_data*) engine;
+  if (index->delta) {
+    const char* error = index_load(index);
+    if (error) return error;
+  }
+  const char* error = io_size(index->fd, &index->size);
+  if (error) return error;
+  index->blocks = index_blocks(index->size, (int64_t) engine->block);
+  if ((uint64_t) index->blocks > SIZE_MAX / INDEX_HASH) {
+    return "insufficient memory";
+  }
+  size_t length = (size_t) index->blocks * INDEX_HASH;
+  index->hashes = calloc(length > 0 ? length : 1, 1);
+  if (index->hashes == NULL) return "insufficient memory";
+  engine->start = 0;
+  engine->end = index->size;
+  return NULL;
+}
+
+// Workers hash whole blocks into their own slots of the array of hashes:
+static const char* index_run(
+  struct engine_worker* worker,
+  int64_t position,
+  size_t length
+) {
+  struct index_data* index = (struct index_data*) worker->engine;
+  uint8_t* buffer = worker->buffers[0];
+  int64_t result = io_read(index->fd, buffer, length, position);
+  if (result < 0) return io_error(result, "unexpected error, read");
+  if ((size_t) result < length) {
+    return "short read, the size changed during the scan";
+  }
+  int64_t block = position / (int64_t) index->engine.block;
+  assert(block < index->blocks);
+  blake3(buffer, length, index->hashes + block * INDEX_HASH);
+  return NULL;
+}
+
+static const char* index_finish(struct engine* engine) {
+  struct index_data* index = (struct index_data*) engine;
+  if (!index->update) return NULL;
+  size_t length = (size_t) index->blocks * INDEX_HASH;
+  uint8_t* header = aligned_malloc(INDEX_HEADER, SCRATCH_ALIGNMENT);
+  if (header == NULL) return "insufficient memory";
+  memset(header, 0, INDEX_HEADER);
+  memcpy(header, INDEX_MAGIC, 8);
+  format_write_uint32(header + 8, INDEX_VERSION);
+  format_write_uint32(header + 12, INDEX_HASH);
+  format_write_uint64(header + 16, (uint64_t) engine->block);
+  format_write_uint64(header + 24, (uint64_t) index->size);
+  format_write_uint64(header + 32, (uint64_t) index->blocks);
+  format_write_uint32(header + 40, crc32c(0, index->hashes, length));
+  format_write_uint32(header + 44, crc32c(0, header, 44));
+  // Write the hashes before the header, so that an interrupted update leaves
+  // an index which fails its checksum rather than one which is stale:
+  int64_t result = io_write(
+    index->fd_index,
+    index->hashes,
+    length,
+    INDEX_HEADER
+  );
+  if (result >= 0) {
+    result = io_truncate(index->fd_index, INDEX_HEADER + (int64_t) length);
+  }
+  if (result >= 0) result = io_write(index->fd_index, header, INDEX_HEADER, 0);
+  aligned_free(header);
+  if (result < 0) return io_error(result, "unexpected error, write");
+  return NULL;
+}
+
+static void index_result(
+  struct engine* engine,
+  napi_env env,
+  napi_value result
+) {
+  struct index_data* index = (struct index_data*) engine;
+  int64_t block = (int64_t) engine->block;
+  set_int(env, result, "blockSize", block);
+  if (!index->delta) return;
+  // Merge adjacent changed blocks into ranges, where every block beyond the
+  // end of the previous index has changed:
+  napi_value array;
+  OK(napi_create_array(env, &array));
+  uint32_t ranges = 0;
+  int64_t changed = 0;
+  int64_t run = -1;
+  for (int64_t number = 0; number <= index->blocks; number++) {
+    int differs = number < index->blocks && (
+      number >= index->previous_blocks ||
+      memcmp(
+        index->hashes + number * INDEX_HASH,
+        index->previous + number * INDEX_HASH,
+        INDEX_HASH
+      ) != 0
+    );
+    if (differs && run < 0) run = number;
+    if (differs || run < 0) continue;
+    int64_t offset = run * block;
+    int64_t end = number * block;
+    if (end > index->size) end = index->size;
+    napi_value object;
+    OK(napi_create_object(env, &object));
+    set_int(env, object, "offset", offset);
+    set_int(env, object, "length", end - offset);
+    OK(napi_set_element(env, array, ranges++, object));
+    changed += end - offset;
+    run = -1;
+  }
+  set_int(env, result, "changedBytes", changed);
+  OK(napi_set_named_property(env, result, "changedRanges", array));
+}
+
+static void index_cleanup(struct engine* engine) {
+  struct index_data* index = (struct index_data*) engine;
+  if (index->hashes) free(index->hashes);
+  index->hashes = NULL;
+  if (index->previous) free(index->previous);
+  index->previous = NULL;
+}
+
+static napi_value index_queue(
+  napi_env env,
+  napi_callback_info info,
+  int delta
+) {
+  size_t argc = 5;
+  napi_value argv[5];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  int fd_index = 0;
+  if (
+    argc != 5 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_int(env, argv[1], &fd_index) ||
+    !arg_object(env, argv[2]) ||
+    !arg_progress(env, argv[3]) ||
+    !arg_function(env, argv[4])
+  ) {
+    THROW(env,
+      "bad arguments, expected: (fd, indexFd, options, onProgress, callback)"
+    );
+  }
+  struct index_data* index = calloc(1, sizeof(struct index_data));
+  if (!index) THROW(env, "insufficient memory");
+  struct engine* engine = &index->engine;
+  const char* error = engine_options(env, argv[2], engine);
+  index->update = !delta;
+  if (!error && delta && !option_bool(env, argv[2], "update", &index->update)) {
+    error = "options.update must be a boolean";
+  }
+  if (error) {
+    free(index);
+    THROW(env, error);
+  }
+  index->fd = fd;
+  index->fd_index = fd_index;
+  index->delta = delta;
+  engine->buffers = 1;
+  engine->prepare = index_prepare;
+  engine->run = index_run;
+  engine->finish = index_finish;
+  engine->result = index_result;
+  engine->cleanup = index_cleanup;
+  return engine_queue(env, engine, argv[3], argv[4]);
+}
+
+// Hashes a range as a single BLAKE3 message in parallel, since every block of
+// a power of 2 number of chunks is a complete subtree of the BLAKE3 tree, which
+// can be hashed to a chaining value independently of the rest of the range.
+// The chaining values of the blocks are then merged up the tree as if they
+// were the chaining values of chunks.
+struct hash_data {
+  struct engine engine;
+  int fd;
+  int leaves;
+  int64_t offset;
+  int64_t blocks;
+  uint8_t* cvs;
+  struct blake3_output last;
+  uint8_t root[BLAKE3_OUT_LEN];
+};
+
+static void hash_store_cv(uint8_t* target, const uint32_t cv[8]) {
+  for (int index = 0; index < 8; index++) {
+    format_write_uint32(target + index * 4, cv[index]);
+  }
+}
+
+static void hash_load_cv(const uint8_t* source, uint32_t cv[8]) {
+  for (int index = 0; index < 8; index++) {
+    cv[index] = format_read_uint32(source + index * 4);
+  }
+}
+
+static const char* hash_prepare(struct engine* engine) {
+  struct hash_data* hash = (struct hash_data*) engine;
+  if (engine->end < 0) {
+    int64_t size = 0;
+    const char* error = io_size(hash->fd, &size);
+    if (error) return error;
+    engine->end = size > hash->offset ? size : hash->offset;
+  }
+  int64_t length = engine->end - engine->start;
+  int64_t block = (int64_t) engine->block;
+  hash->blocks = length / block + (length % block != 0 ? 1 : 0);
+  if ((uint64_t) hash->blocks > SIZE_MAX / BLAKE3_OUT_LEN) {
+    return "insufficient memory";
+  }
+  size_t bytes = (size_t) hash->blocks * BLAKE3_OUT_LEN;
+  hash->cvs = malloc(bytes > 0 ? bytes : 1);
+  if (hash->cvs == NULL) return "insufficient memory";
+  return NULL;
+}
+
+static const char* hash_run(
+  struct engine_worker* worker,
+  int64_t position,
+  size_t length
+) {
+  struct hash_data* hash = (struct hash_data*) worker->engine;
+  uint8_t* buffer = worker->buffers[0];
+  int64_t result = io_read(hash->fd, buffer, length, position);
+  if (result < 0) return io_error(result, "unexpected error, read");
+  if ((size_t) result < length) {
+    return "short read, the size changed during the scan";
+  }
+  int64_t relative = position - hash->offset;
+  int64_t number = relative / (int64_t) hash->engine.block;
+  struct blake3_hasher hasher;
+  struct blake3_output output;
+  uint32_t cv[8];
+  blake3_init(&hasher, (uint64_t) relative / BLAKE3_CHUNK_LEN);
+  blake3_update(&hasher, buffer, length);
+  blake3_hasher_output(&hasher, &output);
+  blake3_output_cv(&output, cv);
+  hash_store_cv(hash->cvs + number * BLAKE3_OUT_LEN, cv);
+  // The last block is not merged as a chaining value, since its output may
+  // yet be the root, if it is the only block:
+  if (number == hash->blocks - 1) hash->last = output;
+  return NULL;
+}
+
+static const char* hash_finish(struct engine* engine) {
+  struct hash_data* hash = (struct hash_data*) engine;
+  if (hash->blocks == 0) {
+    blake3(NULL, 0, hash->root);
+    return NULL;
+  }
+  struct blake3_hasher hasher;
+  blake3_init(&hasher, 0);
+  for (int64_t number = 0; number < hash->blocks - 1; number++) {
+    uint32_t cv[8];
+    hash_load_cv(hash->cvs + number * BLAKE3_OUT_LEN, cv);
+    blake3_push(&hasher, cv, (uint64_t) number + 1);
+  }
+  struct blake3_output output = hash->last;
+  blake3_merge(&hasher, &output);
+  blake3_output_root(&output, hash->root);
+  return NULL;
+}
+
+static void hash_result(
+  struct engine* engine,
+  napi_env env,
+  napi_value result
+) {
+  struct hash_data* hash = (struct hash_data*) engine;
+  napi_value value;
+  void* data = NULL;
+  OK(napi_create_buffer(env, BLAKE3_OUT_LEN, &data, &value));
+  memcpy(data, hash->root, BLAKE3_OUT_LEN);
+  OK(napi_set_named_property(env, result, "hash", value));
+  set_int(env, result, "blockSize", (int64_t) engine->block);
+  if (!hash->leaves) return;
+  size_t bytes = (size_t) hash->blocks * BLAKE3_OUT_LEN;
+  OK(napi_create_buffer_copy(env, bytes, hash->cvs, NULL, &value));
+  OK(napi_set_named_property(env, result, "leaves", value));
+}
+
+static void hash_cleanup(struct engine* engine) {
+  struct hash_data* hash = (struct hash_data*) engine;
+  if (hash->cvs) free(hash->cvs);
+  hash->cvs = NULL;
+}
+
+struct rebuild_data {
+  struct engine engine;
+  int fd;
+  struct merkle* tree;
+};
+
+// Hashes the leaves of a block, and stores the hashes, unless the tree has
+// since been closed:
+static const char* rebuild_run(
+  struct engine_worker* worker,
+  int64_t position,
+  size_t length
+) {
+  struct rebuild_data* rebuild = (struct rebuild_data*) worker->engine;
+  struct merkle* tree = rebuild->tree;
+  uint8_t* buffer = worker->buffers[0];
+  int64_t result = io_read(rebuild->fd, buffer, length, position);
+  if (result < 0) return io_error(result, "unexpected error, read");
+  // Leaves beyond the end of a file read as zeroes:
+  memset(buffer + result, 0, length - (size_t) result);
+  int64_t first = position / tree->leaf;
+  int64_t count = ((int64_t) length + tree->leaf - 1) / tree->leaf;
+  uint8_t* hashes = malloc((size_t) count * MERKLE_HASH);
+  if (hashes == NULL) return "insufficient memory";
+  for (int64_t index = 0; index < count; index++) {
+    merkle_hash_leaf(
+      buffer + index * tree->leaf,
+      (size_t) merkle_leaf_length(tree, first + index),
+      hashes + index * MERKLE_HASH
+    );
+  }
+  const char* error = NULL;
+  uv_mutex_lock(&tree->mutex);
+  if (tree->map == NULL) {
+    error = "tree was closed";
+  } else {
+    memcpy(merkle_node(tree, 0, first), hashes, (size_t) count * MERKLE_HASH);
+  }
+  uv_mutex_unlock(&tree->mutex);
+  free(hashes);
+  return error;
+}
+
+static const char* rebuild_finish(struct engine* engine) {
+  struct merkle* tree = ((struct rebuild_data*) engine)->tree;
+  const char* error = NULL;
+  uv_mutex_lock(&tree->mutex);
+  if (tree->map == NULL) {
+    error = "tree was closed";
+  } else {
+    merkle_rehash(tree, 0, tree->leaves - 1);
+  }
+  uv_mutex_unlock(&tree->mutex);
+  return error;
+}
+
+struct fill_data {
+  struct engine engine;
+  int fd;
+  uint8_t* pattern;
+  size_t pattern_length;
+  uint8_t* buffer;
+};
+
+// Every worker writes from the same buffer, since the pattern repeats at the
+// start of every block:
+static const char* fill_run(
+  struct engine_worker* worker,
+  int64_t position,
+  size_t length
+) {
+  struct fill_data* fill = (struct fill_data*) worker->engine;
+  int64_t result = io_write(fill->fd, fill->buffer, length, position);
+  if (result < 0) return io_error(result, "unexpected error, write");
+  return NULL;
+}
+
+static size_t fill_gcd(size_t a, size_t b) {
+  while (b != 0) {
+    size_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+static const char* fill_prepare(struct engine* engine) {
+  struct fill_data* fill = (struct fill_data*) engine;
+  size_t length = fill->pattern_length;
+  // Shrink the block to the device's maximum I/O size, keeping it a multiple
+  // of 512 and of the pattern:
+  int64_t max = io_max_transfer(fill->fd);
+  size_t multiple = 512 / fill_gcd(512, length) * length;
+  if (max > 0 && (int64_t) engine->block > max && (int64_t) multiple <= max) {
+    engine->block = (size_t) max - (size_t) max % multiple;
+  }
+  assert(engine->block % length == 0);
+  fill->buffer = aligned_malloc(engine->block, SCRATCH_ALIGNMENT);
+  if (fill->buffer == NULL) return "insufficient memory";
+  if (length == 1) {
+    simd.fill(fill->buffer, fill->pattern[0], engine->block);
+  } else {
+    memcpy(fill->buffer, fill->pattern, length);
+    size_t filled = length;
+    while (filled < engine->block) {
+      size_t copy = filled;
+      if (copy > engine->block - filled) copy = engine->block - filled;
+      memcpy(fill->buffer + filled, fill->buffer, copy);
+      filled += copy;
+    }
+  }
+  return NULL;
+}
+
+static void fill_result(
+  struct engine* engine,
+  napi_env env,
+  napi_value result
+) {
+  set_int(env, result, "blockSize", (int64_t) engine->block);
+}
+
+static void fill_cleanup(struct engine* engine) {
+  struct fill_data* fill = (struct fill_data*) engine;
+  if (fill->buffer) aligned_free(fill->buffer);
+  fill->buffer = NULL;
+  free(fill->pattern);
+  fill->pattern = NULL;
+}
+
+static void chunker_finalize(napi_env env, void* data, void* hint) {
+  free(data);
+}
+
+static int arg_chunker(
+  napi_env env,
+  napi_value value,
+  struct chunker** chunker
+) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  if (type != napi_external) return 0;
+  bool tagged = false;
+  OK(napi_check_object_type_tag(env, value, &CHUNKER_TYPE_TAG, &tagged));
+  if (!tagged) return 0;
+  OK(napi_get_value_external(env, value, (void**) chunker));
+  return 1;
+}
+
+static napi_value chunk_object(napi_env env, struct cdc_chunk* chunk) {
+  napi_value object;
+  OK(napi_create_object(env, &object));
+  set_int(env, object, "offset", chunk->offset);
+  set_int(env, object, "length", chunk->length);
+  napi_value hash;
+  OK(napi_create_buffer_copy(env, BLAKE3_OUT_LEN, chunk->hash, NULL, &hash));
+  OK(napi_set_named_property(env, object, "hash", hash));
+  return object;
+}
+
+// Reed-Solomon erasure coding over GF(2^8) with the polynomial x^8 + x^4 + x^3
+// + x^2 + 1 (0x11d). Multiplying a region by a constant c is linear in the
+// bits of each byte, so c * x = c * (x & 15) ^ c * (x & 240), and each half is
+// a lookup in a 16-byte table, which PSHUFB does for 16, 32 or 64 bytes at a
+// time. Every kernel therefore computes the same bytes.
+#define GF_MATRIX_MAX 64
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+static void (*gf_mul_xor)(
+  uint8_t* target,
+  const uint8_t* source,
+  size_t length,
+  uint8_t coefficient
+);
+
+// The best kernel supported by the CPU, which a volume uses by default:
+static const char* gf_name = "scalar";
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) return 0;
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+  assert(a != 0);
+  return gf_exp[255 - gf_log[a]];
+}
+
+static void gf_tables(uint8_t coefficient, uint8_t low[16], uint8_t high[16]) {
+  for (int x = 0; x < 16; x++) {
+    low[x] = gf_mul(coefficient, (uint8_t) x);
+    high[x] = gf_mul(coefficient, (uint8_t) (x << 4));
+  }
+}
+
+// target ^= coefficient * source:
+static void gf_mul_xor_scalar(
+  uint8_t* target,
+  const uint8_t* source,
+  size_t length,
+  uint8_t coefficient
+) {
+  uint8_t low[16];
+  uint8_t high[16];
+  gf_tables(coefficient, low, high);
+  for (size_t index = 0; index < length; index++) {
+    uint8_t x = source[index];
+    target[index] ^= low[x & 15] ^ high[x >> 4];
+  }
+}
+
+#if defined(CPU_X64)
+TARGET("ssse3")
+static void gf_mul_xor_ssse3(
+  uint8_t* target,
+  const uint8_t* source,
+  size_t length,
+  uint8_t coefficient
+) {
+  uint8_t low[16];
+  uint8_t high[16];
+  gf_tables(coefficient, low, high);
+  const __m128i table_low = _mm_loadu_si128((const __m128i*) low);
+  const __m128i table_high = _mm_loadu_si128((const __m128i*) high);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t index = 0;
+  for (; index + 16 <= length; index += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*) (source + index));
+    __m128i product = _mm_xor_si128(
+      _mm_shuffle_epi8(table_low, _mm_and_si128(x, mask)),
+      _mm_shuffle_epi8(table_high, _mm_and_si128(_mm_srli_epi64(x, 4), mask))
+    );
+    __m128i y = _mm_loadu_si128((const __m128i*) (target + index));
+    _mm_storeu_si128((__m128i*) (target + index), _mm_xor_si128(y, product));
+  }
+  gf_mul_xor_scalar(
+    target + index,
+    source + index,
+    length - index,
+    coefficient
+  );
+}
+
+TARGET("avx2")
+static void gf_mul_xor_avx2(
+  uint8_t* target,
+  const uint8_t* source,
+  size_t length,
+  uint8_t coefficient
+) {
+  uint8_t low[16];
+  uint8_t high[16];
+  gf_tables(coefficient, low, high);
+  // VPSHUFB looks up each 128-bit lane separately:
+  const __m256i table_low = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*) low)
+  );
+  const __m256i table_high = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*) high)
+  );
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t index = 0;
+  for (; index + 64 <= length; index += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (source + index));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (source + index + 32));
+    __m256i pa = _mm256_xor_si256(
+      _mm256_shuffle_epi8(table_low, _mm256_and_si256(a, mask)),
+      _mm256_shuffle_epi8(
+        table_high,
+        _mm256_and_si256(_mm256_srli_epi64(a, 4), mask)
+      )
+    );
+    __m256i pb = _mm256_xor_si256(
+      _mm256_shuffle_epi8(table_low, _mm256_and_si256(b, mask)),
+      _mm256_shuffle_epi8(
+        table_high,
+        _mm256_and_si256(_mm256_srli_epi64(b, 4), mask)
+      )
+    );
+    __m256i* ta = (__m256i*) (target + index);
+    __m256i* tb = (__m256i*) (target + index + 32);
+    _mm256_storeu_si256(ta, _mm256_xor_si256(_mm256_loadu_si256(ta), pa));
+    _mm256_storeu_si256(tb, _mm256_xor_si256(_mm256_loadu_si256(tb), pb));
+  }
+  gf_mul_xor_ssse3(
+    target + index,
+    source + index,
+    length - index,
+    coefficient
+  );
+}
+
+TARGET("avx512f,avx512bw")
+static void gf_mul_xor_avx512(
+  uint8_t* target,
+  const uint8_t* source,
+  size_t length,
+  uint8_t coefficient
+) {
+  uint8_t low[16];
+  uint8_t high[16];
+  gf_tables(coefficient, low, high);
+  const __m512i table_low = _mm512_broadcast_i32x4(
+    _mm_loadu_si128((const __m128i*) low)
+  );
+  const __m512i table_high = _mm512_broadcast_i32x4(
+    _mm_loadu_si128((const __m128i*) high)
+  );
+  const __m512i mask = _mm512_set1_epi8(0x0f);
+  size_t index = 0;
+  for (; index + 64 <= length; index += 64) {
+    __m512i x = _mm512_loadu_si512((const void*) (source + index));
+    __m512i l = _mm512_shuffle_epi8(table_low, _mm512_and_si512(x, mask));
+    __m512i h = _mm512_shuffle_epi8(
+      table_high,
+      _mm512_and_si512(_mm512_srli_epi64(x, 4), mask)
+    );
+    __m512i y = _mm512_loadu_si512((const void*) (target + index));
+    // y ^ l ^ h in one instruction:
+    _mm512_storeu_si512(
+      (void*) (target + index),
+      _mm512_ternarylogic_epi32(y, l, h, 0x96)
+    );
+  }
+  gf_mul_xor_ssse3(
+    target + index,
+    source + index,
+    length - index,
+    coefficient
+  );
+}
+#endif
+
+static void gf_init(void) {
+  int x = 1;
+  for (int index = 0; index < 255; index++) {
+    gf_exp[index] = (uint8_t) x;
+    gf_exp[index + 255] = (uint8_t) x;
+    gf_log[x] = (uint8_t) index;
+    x <<= 1;
+    if (x & 0x100) x ^= 0x11d;
+  }
+  gf_mul_xor = gf_mul_xor_scalar;
+#if defined(CPU_X64)
+  if (cpu.ssse3) gf_mul_xor = gf_mul_xor_ssse3;
+  if (cpu.avx2) gf_mul_xor = gf_mul_xor_avx2;
+  if (cpu.avx512) gf_mul_xor = gf_mul_xor_avx512;
+  if (cpu.ssse3) gf_name = "ssse3";
+  if (cpu.avx2) gf_name = "avx2";
+  if (cpu.avx512) gf_name = "avx512";
+#endif
+}
+
+// Selects a kernel by name, returning 0 if the CPU does not support it, so
+// that each kernel can be tested:
+static int gf_select(
+  const char* name,
+  void (**mul_xor)(uint8_t*, const uint8_t*, size_t, uint8_t)
+) {
+  if (strcmp(name, "scalar") == 0) {
+    *mul_xor = gf_mul_xor_scalar;
+    return 1;
+  }
+#if defined(CPU_X64)
+  if (strcmp(name, "ssse3") == 0 && cpu.ssse3) {
+    *mul_xor = gf_mul_xor_ssse3;
+    return 1;
+  }
+  if (strcmp(name, "avx2") == 0 && cpu.avx2) {
+    *mul_xor = gf_mul_xor_avx2;
+    return 1;
+  }
+  if (strcmp(name, "avx512") == 0 && cpu.avx512) {
+    *mul_xor = gf_mul_xor_avx512;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+// Inverts a square matrix of up to GF_MATRIX_MAX rows in place by Gauss-Jordan
+// elimination, returning 0 if the matrix is singular:
+static int gf_invert(uint8_t* matrix, int size) {
+  uint8_t inverse[GF_MATRIX_MAX * GF_MATRIX_MAX];
+  memset(inverse, 0, (size_t) (size * size));
+  for (int row = 0; row < size; row++) inverse[row * size + row] = 1;
+  for (int column = 0; column < size; column++) {
+    int pivot = column;
+    while (pivot < size && matrix[pivot * size + column] == 0) pivot++;
+    if (pivot == size) return 0;
+    if (pivot != column) {
+      for (int index = 0; index < size; index++) {
+        uint8_t temp = matrix[pivot * size + index];
+        matrix[pivot * size + index] = matrix[column * size + index];
+        matrix[column * size + index] = temp;
+        temp = inverse[pivot * size + index];
+        inverse[pivot * size + index] = inverse[column * size + index];
+        inverse[column * size + index] = temp;
+      }
+    }
+    uint8_t scale = gf_inv(matrix[column * size + column]);
+    for (int index = 0; index < size; index++) {
+      matrix[column * size + index] = gf_mul(
+        matrix[column * size + index],
+        scale
+      );
+      inverse[column * size + index] = gf_mul(
+        inverse[column * size + index],
+        scale
+      );
+    }
+    for (int row = 0; row < size; row++) {
+      uint8_t factor = matrix[row * size + column];
+      if (row == column || factor == 0) continue;
+      for (int index = 0; index < size; index++) {
+        matrix[row * size + index] ^= gf_mul(
+          factor,
+          matrix[column * size + index]
+        );
+        inverse[row * size + index] ^= gf_mul(
+          factor,
+          inverse[column * size + index]
+        );
+      }
+    }
+  }
+  memcpy(matrix, inverse, (size_t) (size * size));
+  return 1;
+}
+
+// A volume spreads one logical address space across a number of devices (or
+// regular files), in one of two layouts:
+//
+// A stripe volume (RAID-0) puts stripe k of the volume on row k / N of device
+// k % N. A read or write is split into one part per device, each of which
+// transfers that device's stripes of the range on the threadpool, so that the
+// devices work in parallel, and the request completes once when the last part
+// completes.
+//
+// A mirror volume (RAID-1) writes every replica in parallel, completing when a
+// quorum of replicas has been written, and reads from the replica with the
+// lowest recent latency. If that read has not completed by the replica's p95
+// latency, a hedged read is sent to the next best replica, and the first read
+// to complete wins. A read which fails is retried on another replica, and a
+// replica which fails a write is taken out of the mirror, since it is stale.
+//
+// An erasure volume puts k data chunks and m parity chunks in each row, data
+// chunk j on device j and parity chunk p on device k + p, where the parity is
+// a Cauchy Reed-Solomon code, so that any k chunks of a row can reconstruct
+// the others. Rows are read and written on the threadpool in parallel. A read
+// of a chunk which cannot be read is reconstructed, and a write of part of a
+// row updates the parity by the difference between the old and new data. A
+// device which fails a write is taken out of the volume, which stays readable
+// and writable while no more than m devices have failed.
+#define VOLUME_DEVICES_MAX 64
+#define VOLUME_STRIPE_DEFAULT 65536
+#define VOLUME_STRIPE_MIN 512
+#define VOLUME_STRIPE_MAX 16777216
+#define VOLUME_STRIPE 0
+#define VOLUME_MIRROR 1
+#define VOLUME_ERASURE 2
+// Concurrent writes of a row, and degraded reads, are serialized by a lock,
+// one of a small number chosen by the row index:
+#define VOLUME_ROW_LOCKS 64
+#define VOLUME_SAMPLES 64
+#define VOLUME_SAMPLES_MIN 16
+// The latency added to a replica whose read fails, so that it is avoided:
+#define VOLUME_PENALTY 100000000
+
+static const napi_type_tag VOLUME_TYPE_TAG = {
+  0x766f6c756d650d01ULL, 0x3e8a5c17b29f4d60ULL
+};
+
+struct volume_replica {
+  int failed;
+  int64_t reads;
+  int64_t writes;
+  int64_t errors;
+  // An exponentially weighted moving average of read latency, to choose the
+  // replica, and a ring of recent read latencies, for the hedge deadline:
+  uint64_t latency;
+  uint64_t samples[VOLUME_SAMPLES];
+  int samples_length;
+  int samples_index;
+};
+
+// A mirrored write which some replicas have yet to complete. Once the write
+// is acknowledged, a replica which has yet to complete it is stale for the
+// range, and must not serve a read which overlaps the range:
+struct volume_write {
+  int64_t position;
+  int64_t length;
+  uint64_t pending;
+  int acknowledged;
+  struct volume_write* next;
+};
+
+struct volume {
+  int layout;
+  int count;
+  int fds[VOLUME_DEVICES_MAX];
+  int64_t stripe;
+  int64_t size;
+  int64_t sector_logical;
+  int64_t sector_physical;
+  int quorum;
+  int hedge;
+  int64_t hedge_delay;
+  int64_t hedges;
+  int64_t failovers;
+  struct volume_replica replicas[VOLUME_DEVICES_MAX];
+  struct volume_write* writes;
+  int parity;
+  // The m x k Cauchy matrix which encodes the parity of an erasure volume:
+  uint8_t cauchy[GF_MATRIX_MAX * GF_MATRIX_MAX];
+  void (*gf_mul_xor)(uint8_t*, const uint8_t*, size_t, uint8_t);
+  int64_t reconstructions;
+  // The counters of an erasure volume are updated on the threadpool:
+  uv_mutex_t mutex;
+  uv_mutex_t rows[VOLUME_ROW_LOCKS];
+};
+
+struct volume_io;
+
+struct volume_part {
+  struct volume_io* io;
+  int device;
+  uint8_t* bounce;
+  uint64_t latency;
+  napi_async_work async_work;
+  const char* error;
+};
+
+struct volume_io {
+  napi_env env;
+  struct volume* volume;
+  int write;
+  uint8_t* buffer;
+  uint8_t* source;
+  size_t length;
+  int64_t position;
+  // Parts and the hedge timer still to complete or close:
+  int outstanding;
+  int inflight;
+  uint64_t tried;
+  int succeeded;
+  int failed;
+  int done;
+  int hedged;
+  int winner;
+  uv_mutex_t mutex;
+  uv_timer_t timer;
+  int timer_active;
+  struct volume_write* entry;
+  const char* error;
+  int parts_length;
+  struct volume_part parts[VOLUME_DEVICES_MAX];
+  napi_ref ref_volume;
+  napi_ref ref_buffer;
+  napi_ref ref_callback;
+};
+
+// Returns the size and sector sizes of a device, or the size of a regular
+// file, whose sectors are taken to be 512 bytes:
+static const char* volume_probe(
+  int fd,
+  int64_t* size,
+  int64_t* logical,
+  int64_t* physical
+) {
+  *logical = 512;
+  *physical = 512;
+#if defined(_WIN32)
+  uv_fs_t req;
+  int result = uv_fs_fstat(NULL, &req, fd, NULL);
+  int regular = result == 0 && (req.statbuf.st_mode & S_IFMT) == S_IFREG;
+  int64_t st_size = (int64_t) req.statbuf.st_size;
+  uv_fs_req_cleanup(&req);
+  if (result != 0) return "fstat failed";
+  if (regular) {
+    *size = st_size;
+    return NULL;
+  }
+#else
+  struct stat st;
+  if (fstat(fd, &st) == -1) return "fstat failed";
+  if ((st.st_mode & S_IFMT) == S_IFREG) {
+    *size = (int64_t) st.st_size;
+    return NULL;
+  }
+#endif
+  struct task_data* task = calloc(1, sizeof(struct task_data));
+  if (!task) return "insufficient memory";
+  task->fd = fd;
+  task->device = 1;
+  task_execute_get_block_device_size(task);
+  const char* error = task->error;
+  *size = task->device_size;
+  *logical = task->device_sector_logical;
+  *physical = task->device_sector_physical;
+  free(task);
+  return error;
+}
+
+// Transfers the stripes of a range which fall on one device, in order:
+static const char* volume_transfer(
+  struct volume* volume,
+  int device,
+  int write,
+  uint8_t* buffer,
+  size_t length,
+  int64_t position
+) {
+  int64_t stripe = volume->stripe;
+  int64_t count = volume->count;
+  int64_t end = position + (int64_t) length;
+  int64_t first = position / stripe;
+  // The first stripe of the range on this device:
+  int64_t index = first + ((device - first % count) % count + count) % count;
+  for (; index * stripe < end; index += count) {
+    int64_t start = index * stripe;
+    if (start < position) start = position;
+    int64_t stop = (index + 1) * stripe;
+    if (stop > end) stop = end;
+    int64_t offset = (index / count) * stripe + start % stripe;
+    uint8_t* data = buffer + (start - position);
+    size_t bytes = (size_t) (stop - start);
+    int fd = volume->fds[device];
+    int64_t result = write ?
+      io_write(fd, data, bytes, offset) :
+      io_read(fd, data, bytes, offset);
+    if (result < 0) {
+      return io_error(
+        result,
+        write ? "unexpected error, write" : "unexpected error, read"
+      );
+    }
+    if ((size_t) result != bytes) return "unexpected end of device";
+  }
+  return NULL;
+}
+
+static void volume_account(
+  struct volume* volume,
+  int device,
+  int write,
+  const char* error
+) {
+  struct volume_replica* replica = &volume->replicas[device];
+  uv_mutex_lock(&volume->mutex);
+  if (error) {
+    replica->errors++;
+    if (write) replica->failed = 1;
+  } else if (write) {
+    replica->writes++;
+  } else {
+    replica->reads++;
+  }
+  uv_mutex_unlock(&volume->mutex);
+}
+
+static uint64_t volume_failures(struct volume* volume) {
+  uint64_t failed = 0;
+  uv_mutex_lock(&volume->mutex);
+  for (int device = 0; device < volume->count; device++) {
+    if (volume->replicas[device].failed) failed |= (uint64_t) 1 << device;
+  }
+  uv_mutex_unlock(&volume->mutex);
+  return failed;
+}
+
+static int volume_popcount(uint64_t mask) {
+  int count = 0;
+  for (; mask; mask &= mask - 1) count++;
+  return count;
+}
+
+// Reads or writes part of the chunk of a row on a device of an erasure volume:
+static const char* volume_chunk(
+  struct volume* volume,
+  int device,
+  int write,
+  uint8_t* buffer,
+  size_t length,
+  int64_t row,
+  int64_t offset
+) {
+  int fd = volume->fds[device];
+  int64_t position = row * volume->stripe + offset;
+  int64_t result = write ?
+    io_write(fd, buffer, length, position) :
+    io_read(fd, buffer, length, position);
+  const char* error = NULL;
+  if (result < 0) {
+    error = io_error(
+      result,
+      write ? "unexpected error, write" : "unexpected error, read"
+    );
+  } else if ((size_t) result != length) {
+    error = "unexpected end of device";
+  }
+  volume_account(volume, device, write, error);
+  return error;
+}
+
+// Returns the range [*start, *end) of data chunk j of a row which a request
+// covers, relative to the chunk, or 0 if the request does not cover the chunk:
+static int volume_chunk_range(
+  struct volume_io* io,
+  int64_t row,
+  int j,
+  int64_t* start,
+  int64_t* end
+) {
+  struct volume* volume = io->volume;
+  int64_t k = volume->count - volume->parity;
+  int64_t chunk = (row * k + j) * volume->stripe;
+  int64_t from = io->position > chunk ? io->position : chunk;
+  int64_t to = io->position + (int64_t) io->length;
+  if (to > chunk + volume->stripe) to = chunk + volume->stripe;
+  if (from >= to) return 0;
+  *start = from - chunk;
+  *end = to - chunk;
+  return 1;
+}
+
+// Loads the range [offset, offset + length) of every chunk of a row in want
+// into chunks[device], reading what can be read, and reconstructing the rest
+// from any k chunks of the row which can be read:
+static const char* volume_erasure_load(
+  struct volume* volume,
+  int64_t row,
+  int64_t offset,
+  size_t length,
+  uint8_t** chunks,
+  uint64_t want
+) {
+  int count = volume->count;
+  int k = count - volume->parity;
+  uint64_t tried = volume_failures(volume);
+  uint64_t have = 0;
+  for (int device = 0; device < count; device++) {
+    uint64_t bit = (uint64_t) 1 << device;
+    if (!(want & bit) || (tried & bit)) continue;
+    tried |= bit;
+    if (
+      !volume_chunk(volume, device, 0, chunks[device], length, row, offset)
+    ) {
+      have |= bit;
+    }
+  }
+  uint64_t missing = want & ~have;
+  if (missing == 0) return NULL;
+  // Choose k chunks, those already read first, then data before parity:
+  int chosen[GF_MATRIX_MAX];
+  int chosen_length = 0;
+  for (int device = 0; device < count && chosen_length < k; device++) {
+    if (have & ((uint64_t) 1 << device)) chosen[chosen_length++] = device;
+  }
+  for (int device = 0; device < count && chosen_length < k; device++) {
+    uint64_t bit = (uint64_t) 1 << device;
+    if (tried & bit) continue;
+    tried |= bit;
+    if (
+      !volume_chunk(volume, device, 0, chunks[device], length, row, offset)
+    ) {
+      chosen[chosen_length++] = device;
+    }
+  }
+  if (chosen_length < k) return "too many devices have failed";
+  // The rows of the generator matrix [I; C] for the chosen chunks map the data
+  // to the chosen chunks, so the inverse maps the chosen chunks to the data:
+  uint8_t matrix[GF_MATRIX_MAX * GF_MATRIX_MAX];
+  for (int t = 0; t < k; t++) {
+    for (int j = 0; j < k; j++) {
+      int device = chosen[t];
+      matrix[t * k + j] = device < k ?
+        (uint8_t) (device == j) :
+        volume->cauchy[(device - k) * k + j];
+    }
+  }
+  if (!gf_invert(matrix, k)) return "unexpected singular matrix";
+  for (int device = 0; device < count; device++) {
+    if (!(missing & ((uint64_t) 1 << device))) continue;
+    memset(chunks[device], 0, length);
+    for (int t = 0; t < k; t++) {
+      // The coefficient of chosen chunk t in this chunk:
+      uint8_t coefficient = 0;
+      for (int j = 0; j < k; j++) {
+        uint8_t generator = device < k ?
+          (uint8_t) (device == j) :
+          volume->cauchy[(device - k) * k + j];
+        coefficient ^= gf_mul(generator, matrix[j * k + t]);
+      }
+      if (coefficient == 0) continue;
+      if (coefficient == 1) {
+        simd.xor_into(chunks[device], chunks[chosen[t]], length);
+      } else {
+        volume->gf_mul_xor(
+          chunks[device],
+          chunks[chosen[t]],
+          length,
+          coefficient
+        );
+      }
+    }
+  }
+  uv_mutex_lock(&volume->mutex);
+  volume->reconstructions++;
+  uv_mutex_unlock(&volume->mutex);
+  return NULL;
+}
+
+static const char* volume_erasure_read(struct volume_io* io, int64_t row) {
+  struct volume* volume = io->volume;
+  int k = volume->count - volume->parity;
+  uint64_t failed = volume_failures(volume);
+  uint64_t missing = 0;
+  int64_t low = volume->stripe;
+  int64_t high = 0;
+  uint8_t* targets[GF_MATRIX_MAX];
+  int64_t starts[GF_MATRIX_MAX];
+  int64_t ends[GF_MATRIX_MAX];
+  for (int j = 0; j < k; j++) {
+    if (!volume_chunk_range(io, row, j, &starts[j], &ends[j])) continue;
+    targets[j] = io->buffer +
+      ((row * k + j) * volume->stripe + starts[j] - io->position);
+    size_t length = (size_t) (ends[j] - starts[j]);
+    if (
+      !(failed & ((uint64_t) 1 << j)) &&
+      !volume_chunk(volume, j, 0, targets[j], length, row, starts[j])
+    ) {
+      continue;
+    }
+    missing |= (uint64_t) 1 << j;
+    if (starts[j] < low) low = starts[j];
+    if (ends[j] > high) high = ends[j];
+  }
+  if (missing == 0) return NULL;
+  uv_mutex_t* lock = &volume->rows[row % VOLUME_ROW_LOCKS];
+  size_t span = (size_t) (high - low);
+  size_t size = span * (size_t) volume->count;
+  uint8_t* buffer = bounce_alloc(size);
+  if (buffer == NULL) return "insufficient memory";
+  uint8_t* chunks[GF_MATRIX_MAX];
+  for (int device = 0; device < volume->count; device++) {
+    chunks[device] = buffer + span * (size_t) device;
+  }
+  uv_mutex_lock(lock);
+  const char* error = volume_erasure_load(
+    volume,
+    row,
+    low,
+    span,
+    chunks,
+    missing
+  );
+  uv_mutex_unlock(lock);
+  for (int j = 0; !error && j < k; j++) {
+    if (!(missing & ((uint64_t) 1 << j))) continue;
+    memcpy(
+      targets[j],
+      chunks[j] + (starts[j] - low),
+      (size_t) (ends[j] - starts[j])
+    );
+  }
+  bounce_free(buffer, size);
+  return error;
+}
+
+static const char* volume_erasure_write(struct volume_io* io, int64_t row) {
+  struct volume* volume = io->volume;
+  int count = volume->count;
+  int k = count - volume->parity;
+  uint64_t touched = 0;
+  int full = 1;
+  int64_t low = volume->stripe;
+  int64_t high = 0;
+  uint8_t* sources[GF_MATRIX_MAX];
+  int64_t starts[GF_MATRIX_MAX];
+  int64_t ends[GF_MATRIX_MAX];
+  for (int j = 0; j < k; j++) {
+    if (!volume_chunk_range(io, row, j, &starts[j], &ends[j])) {
+      full = 0;
+      continue;
+    }
+    touched |= (uint64_t) 1 << j;
+    sources[j] = io->source +
+      ((row * k + j) * volume->stripe + starts[j] - io->position);
+    if (starts[j] != 0 || ends[j] != volume->stripe) full = 0;
+    if (starts[j] < low) low = starts[j];
+    if (ends[j] > high) high = ends[j];
+  }
+  if (touched == 0) return NULL;
+  size_t span = (size_t) (high - low);
+  // A whole row needs a buffer for the parity, and part of a row a buffer for
+  // every chunk of the range:
+  size_t size = span * (size_t) (full ? volume->parity : count);
+  uint8_t* buffer = bounce_alloc(size);
+  if (buffer == NULL) return "insufficient memory";
+  uint8_t* chunks[GF_MATRIX_MAX];
+  for (int device = 0; device < count; device++) {
+    if (full && device < k) {
+      chunks[device] = sources[device];
+    } else {
+      chunks[device] = buffer + span * (size_t) (full ? device - k : device);
+    }
+  }
+  uv_mutex_t* lock = &volume->rows[row % VOLUME_ROW_LOCKS];
+  uv_mutex_lock(lock);
+  const char* error = NULL;
+  if (full) {
+    for (int p = 0; p < volume->parity; p++) {
+      memset(chunks[k + p], 0, span);
+      for (int j = 0; j < k; j++) {
+        volume->gf_mul_xor(
+          chunks[k + p],
+          chunks[j],
+          span,
+          volume->cauchy[p * k + j]
+        );
+      }
+    }
+  } else {
+    // Read the old data and parity, and add the difference between the old and
+    // new data, times the coefficient of each data chunk, to the parity:
+    uint64_t parity = (((uint64_t) 1 << volume->parity) - 1) << k;
+    error = volume_erasure_load(
+      volume,
+      row,
+      low,
+      span,
+      chunks,
+      touched | parity
+    );
+    for (int j = 0; !error && j < k; j++) {
+      if (!(touched & ((uint64_t) 1 << j))) continue;
+      uint8_t* delta = chunks[j] + (starts[j] - low);
+      size_t length = (size_t) (ends[j] - starts[j]);
+      simd.xor_into(delta, sources[j], length);
+      for (int p = 0; p < volume->parity; p++) {
+        volume->gf_mul_xor(
+          chunks[k + p] + (starts[j] - low),
+          delta,
+          length,
+          volume->cauchy[p * k + j]
+        );
+      }
+    }
+  }
+  if (!error) {
+    uint64_t failed = volume_failures(volume);
+    for (int device = 0; device < count; device++) {
+      uint64_t bit = (uint64_t) 1 << device;
+      if (failed & bit) continue;
+      if (device < k) {
+        if (!(touched & bit)) continue;
+        volume_chunk(
+          volume,
+          device,
+          1,
+          sources[device],
+          (size_t) (ends[device] - starts[device]),
+          row,
+          starts[device]
+        );
+      } else {
+        volume_chunk(volume, device, 1, chunks[device], span, row, low);
+      }
+    }
+    if (volume_popcount(volume_failures(volume)) > volume->parity) {
+      error = "too many devices have failed";
+    }
+  }
+  uv_mutex_unlock(lock);
+  bounce_free(buffer, size);
+  return error;
+}
+
+// Reads or writes the rows of a request which fall to one of its parts, every
+// nth row from the part's index, for n parts:
+static const char* volume_erasure(struct volume_io* io, int index) {
+  struct volume* volume = io->volume;
+  int64_t width = volume->stripe * (volume->count - volume->parity);
+  int64_t first = io->position / width;
+  int64_t last = first;
+  if (io->length > 0) {
+    last = (io->position + (int64_t) io->length - 1) / width;
+  }
+  for (int64_t row = first + index; row <= last; row += io->parts_length) {
+    const char* error = io->write ?
+      volume_erasure_write(io, row) :
+      volume_erasure_read(io, row);
+    if (error) return error;
+  }
+  return NULL;
+}
+
+// Transfers the whole range to or from one replica of a mirror. A hedged read
+// reads into a bounce buffer of its own, and only the first read to complete
+// copies into the caller's buffer:
+static const char* volume_transfer_replica(struct volume_part* part) {
+  struct volume_io* io = part->io;
+  int fd = io->volume->fds[part->device];
+  uint64_t start = uv_hrtime();
+  int64_t result;
+  if (io->write) {
+    result = io_write(fd, io->source, io->length, io->position);
+  } else {
+    uint8_t* target = io->buffer;
+    if (io->hedged) {
+      part->bounce = bounce_alloc(io->length > 0 ? io->length : 1);
+      if (part->bounce == NULL) return "insufficient memory";
+      target = part->bounce;
+    }
+    result = io_read(fd, target, io->length, io->position);
+  }
+  part->latency = uv_hrtime() - start;
+  if (result < 0) {
+    return io_error(
+      result,
+      io->write ? "unexpected error, write" : "unexpected error, read"
+    );
+  }
+  if ((size_t) result != io->length) return "unexpected end of device";
+  if (!io->write && part->bounce) {
+    uv_mutex_lock(&io->mutex);
+    if (io->winner == -1) {
+      io->winner = part->device;
+      memcpy(io->buffer, part->bounce, io->length);
+    }
+    uv_mutex_unlock(&io->mutex);
+  }
+  return NULL;
+}
+
+static void volume_part_execute(napi_env env, void* data) {
+  struct volume_part* part = data;
+  struct volume_io* io = part->io;
+  if (io->volume->layout == VOLUME_MIRROR) {
+    part->error = volume_transfer_replica(part);
+  } else if (io->volume->layout == VOLUME_ERASURE) {
+    part->error = volume_erasure(io, part->device);
+  } else {
+    part->error = volume_transfer(
+      io->volume,
+      part->device,
+      io->write,
+      io->buffer,
+      io->length,
+      io->position
+    );
+  }
+}
+
+static void volume_part_complete(napi_env env, napi_status status, void* data);
+
+static void volume_issue(struct volume_io* io, int device) {
+  struct volume_part* part = &io->parts[device];
+  assert(part->io == NULL);
+  part->io = io;
+  part->device = device;
+  io->tried |= (uint64_t) 1 << device;
+  io->outstanding++;
+  io->inflight++;
+  napi_value name;
+  OK(napi_create_string_utf8(
+    io->env,
+    RESOURCE_NAME,
+    NAPI_AUTO_LENGTH,
+    &name
+  ));
+  OK(napi_create_async_work(
+    io->env,
+    NULL,
+    name,
+    volume_part_execute,
+    volume_part_complete,
+    part,
+    &part->async_work
+  ));
+  OK(napi_queue_async_work(io->env, part->async_work));
+}
+
+static void volume_release(struct volume_io* io) {
+  if (io->outstanding > 0) return;
+  napi_env env = io->env;
+  if (io->entry) {
+    struct volume_write** link = &io->volume->writes;
+    while (*link != io->entry) link = &(*link)->next;
+    *link = io->entry->next;
+    free(io->entry);
+  }
+  for (int device = 0; device < io->volume->count; device++) {
+    struct volume_part* part = &io->parts[device];
+    if (part->bounce) {
+      bounce_free(part->bounce, io->length > 0 ? io->length : 1);
+    }
+  }
+  if (io->source != io->buffer) {
+    bounce_free(io->source, io->length > 0 ? io->length : 1);
+  }
+  uv_mutex_destroy(&io->mutex);
+  OK(napi_delete_reference(env, io->ref_volume));
+  OK(napi_delete_reference(env, io->ref_buffer));
+  OK(napi_delete_reference(env, io->ref_callback));
+  free(io);
+}
+
+static void volume_callback(struct volume_io* io, const char* error) {
+  assert(!io->done);
+  io->done = 1;
+  napi_env env = io->env;
+  int argc = 0;
+  napi_value argv[2];
+  if (error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_object(env, &argv[1]));
+    set_int(env, argv[1], "bytes", (int64_t) io->length);
+    if (io->volume->layout == VOLUME_MIRROR && !io->write) {
+      set_int(env, argv[1], "device", io->winner);
+    }
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, io->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+}
+
+// Returns the replica with the lowest recent latency which the request has not
+// tried, and which is neither failed nor stale for the range, or -1:
+static int volume_select(struct volume_io* io) {
+  struct volume* volume = io->volume;
+  uint64_t stale = 0;
+  int64_t end = io->position + (int64_t) io->length;
+  struct volume_write* write = volume->writes;
+  for (; write; write = write->next) {
+    if (
+      write->acknowledged &&
+      write->position < end &&
+      io->position < write->position + write->length
+    ) {
+      stale |= write->pending;
+    }
+  }
+  int best = -1;
+  for (int device = 0; device < volume->count; device++) {
+    struct volume_replica* replica = &volume->replicas[device];
+    uint64_t bit = (uint64_t) 1 << device;
+    if (replica->failed || (io->tried & bit) || (stale & bit)) continue;
+    if (
+      best == -1 ||
+      replica->latency < volume->replicas[best].latency
+    ) {
+      best = device;
+    }
+  }
+  return best;
+}
+
+static int volume_compare_samples(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Returns the p95 read latency of a replica in ns, or 0 if too few reads:
+static uint64_t volume_p95(struct volume_replica* replica) {
+  if (replica->samples_length < VOLUME_SAMPLES_MIN) return 0;
+  uint64_t samples[VOLUME_SAMPLES];
+  memcpy(samples, replica->samples, sizeof(samples));
+  qsort(
+    samples,
+    (size_t) replica->samples_length,
+    sizeof(uint64_t),
+    volume_compare_samples
+  );
+  return samples[replica->samples_length * 95 / 100];
+}
+
+static void volume_sample(struct volume_replica* replica, uint64_t latency) {
+  replica->samples[replica->samples_index] = latency;
+  replica->samples_index = (replica->samples_index + 1) % VOLUME_SAMPLES;
+  if (replica->samples_length < VOLUME_SAMPLES) replica->samples_length++;
+  if (replica->latency == 0) {
+    replica->latency = latency;
+  } else {
+    replica->latency = (replica->latency * 7 + latency) / 8;
+  }
+}
+
+static void volume_timer_closed(uv_handle_t* handle) {
+  struct volume_io* io = handle->data;
+  io->outstanding--;
+  volume_release(io);
+}
+
+static void volume_timer_close(struct volume_io* io) {
+  if (!io->timer_active) return;
+  io->timer_active = 0;
+  uv_close((uv_handle_t*) &io->timer, volume_timer_closed);
+}
+
+static void volume_hedge(uv_timer_t* timer) {
+  struct volume_io* io = timer->data;
+  if (!io->done) {
+    napi_handle_scope scope;
+    OK(napi_open_handle_scope(io->env, &scope));
+    int device = volume_select(io);
+    if (device >= 0) {
+      io->volume->hedges++;
+      volume_issue(io, device);
+    }
+    OK(napi_close_handle_scope(io->env, scope));
+  }
+  volume_timer_close(io);
+}
+
+// Starts a mirrored read on the best replica, with a hedge timer at its p95
+// latency (or at the fixed hedge delay) if there is another replica. Until a
+// replica has enough reads for a p95, its reads are not hedged:
+static void volume_read_start(struct volume_io* io) {
+  struct volume* volume = io->volume;
+  int device = volume_select(io);
+  assert(device >= 0);
+  int64_t delay = volume->hedge_delay;
+  if (delay < 0) {
+    uint64_t p95 = volume_p95(&volume->replicas[device]);
+    // Timers have a resolution of 1ms:
+    delay = p95 == 0 ? -1 : (int64_t) ((p95 + 999999) / 1000000);
+  }
+  io->tried |= (uint64_t) 1 << device;
+  io->hedged = volume->hedge && delay >= 0 && volume_select(io) >= 0;
+  volume_issue(io, device);
+  if (!io->hedged) return;
+  uv_loop_t* loop = NULL;
+  OK(napi_get_uv_event_loop(io->env, &loop));
+  int result = uv_timer_init(loop, &io->timer);
+  assert(result == 0);
+  io->timer.data = io;
+  io->timer_active = 1;
+  io->outstanding++;
+  result = uv_timer_start(&io->timer, volume_hedge, (uint64_t) delay, 0);
+  assert(result == 0);
+}
+
+static void volume_read_complete(
+  struct volume_io* io,
+  struct volume_part* part
+) {
+  struct volume* volume = io->volume;
+  struct volume_replica* replica = &volume->replicas[part->device];
+  if (part->error) {
+    replica->errors++;
+    replica->latency += VOLUME_PENALTY;
+  } else {
+    replica->reads++;
+    volume_sample(replica, part->latency);
+  }
+  if (io->done) return;
+  if (!part->error) {
+    // Without hedging there is only one read at a time, which wins:
+    if (!io->hedged) io->winner = part->device;
+    if (io->winner == part->device) {
+      volume_timer_close(io);
+      volume_callback(io, NULL);
+    }
+    return;
+  }
+  if (!io->error) io->error = part->error;
+  // Fail over to another replica, unless a hedged read is still in flight:
+  if (io->inflight > 0) return;
+  int device = volume_select(io);
+  if (device >= 0) {
+    volume->failovers++;
+    volume_issue(io, device);
+  } else {
+    volume_timer_close(io);
+    volume_callback(io, io->error);
+  }
+}
+
+static void volume_write_complete(
+  struct volume_io* io,
+  struct volume_part* part
+) {
+  struct volume* volume = io->volume;
+  struct volume_replica* replica = &volume->replicas[part->device];
+  io->entry->pending &= ~((uint64_t) 1 << part->device);
+  if (part->error) {
+    replica->errors++;
+    replica->failed = 1;
+    io->failed++;
+    if (!io->error) io->error = part->error;
+  } else {
+    replica->writes++;
+    io->succeeded++;
+  }
+  if (io->done) return;
+  if (io->succeeded >= volume->quorum) {
+    io->entry->acknowledged = 1;
+    volume_callback(io, NULL);
+  } else if (io->succeeded + io->inflight < volume->quorum) {
+    volume_callback(io, io->error);
+  }
+}
+
+static void volume_part_complete(napi_env env, napi_status status, void* data) {
+  struct volume_part* part = data;
+  struct volume_io* io = part->io;
+  if (status == napi_cancelled) part->error = "async work was cancelled";
+  OK(napi_delete_async_work(env, part->async_work));
+  io->outstanding--;
+  io->inflight--;
+  if (io->volume->layout == VOLUME_MIRROR) {
+    if (io->write) {
+      volume_write_complete(io, part);
+    } else {
+      volume_read_complete(io, part);
+    }
+  } else {
+    if (part->error && !io->error) io->error = part->error;
+    // The last part reports the first error of any part:
+    if (io->inflight == 0) volume_callback(io, io->error);
+  }
+  volume_release(io);
+}
+
+static void volume_free(struct volume* volume) {
+  while (volume->writes) {
+    struct volume_write* next = volume->writes->next;
+    free(volume->writes);
+    volume->writes = next;
+  }
+  uv_mutex_destroy(&volume->mutex);
+  for (int index = 0; index < VOLUME_ROW_LOCKS; index++) {
+    uv_mutex_destroy(&volume->rows[index]);
+  }
+  free(volume);
+}
+
+static void volume_finalize(napi_env env, void* data, void* hint) {
+  volume_free(data);
+}
+
+static int arg_volume(napi_env env, napi_value value, struct volume** volume) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  if (type != napi_external) return 0;
+  bool tagged = false;
+  OK(napi_check_object_type_tag(env, value, &VOLUME_TYPE_TAG, &tagged));
+  if (!tagged) return 0;
+  OK(napi_get_value_external(env, value, (void**) volume));
+  return 1;
+}
+
+// A log is a write-ahead log in a ring of preallocated segments at the start
+// of a block device or regular file. A record is appended to an in-memory
+// staging area, where it is given its LSN (its position in the log), and is
+// made durable by the next group commit, which writes every record staged so
+// far as whole blocks with a single write and fdatasync() (or RWF_DSYNC). Only
+// one commit is in flight at a time, so that appends arriving during a commit
+// are batched into the next.
+//
+// Each block has a header with a CRC32C of the block, the LSN of the block, so
+// that a stale block left from a previous lap of the ring is never taken for a
+// new one, and the offset of the first record which begins in the block, so
+// that records can be read from any block. Records are packed end to end
+// across the payload of blocks, each with a length and a CRC32C of its
+// payload, and a commit pads its last block, so that a durable block is never
+// rewritten.
+//
+// A commit torn by a crash may leave any of its blocks behind, valid at their
+// LSNs, beyond the tail. A later, shorter commit from the same LSN must not
+// adopt them, so every block also records its index within its commit, the
+// number of blocks in the commit, and a commit ID (a CRC32C of the commit as
+// staged), and only whole commits are recovered. Recovery reads the first
+// block of every segment to find the segment written last, and then scans
+// forward from the start of the commit of that block, commit by commit, to the
+// first commit which is not whole, which is the tail.
+#define LOG_MAGIC 0x4c57
+#define LOG_HEADER 32
+#define LOG_RECORD_HEADER 8
+#define LOG_BLOCK_MIN 512
+#define LOG_BLOCK_MAX 65536
+#define LOG_BLOCK_DEFAULT 4096
+#define LOG_SEGMENT_MIN 65536
+#define LOG_SEGMENT_MAX 1073741824
+#define LOG_SEGMENT_DEFAULT 16777216
+#define LOG_SEGMENTS_MIN 2
+#define LOG_SEGMENTS_MAX 1024
+#define LOG_SEGMENTS_DEFAULT 4
+// The first block of a commit, after which a record is never continued:
+#define LOG_FLAG_COMMIT 1
+// Recovery and reads scan the log this many bytes at a time:
+#define LOG_SCAN 1048576
+
+static const napi_type_tag LOG_TYPE_TAG = {
+  0x6c6f672d77616c01ULL, 0x9d3b27c4e15a8f06ULL
+};
+
+struct log_callback {
+  int64_t end;
+  napi_ref ref_callback;
+};
+
+struct log {
+  int fd;
+  int dsync;
+  int64_t block;
+  int64_t segment;
+  int64_t segments;
+  // Every LSN below head may be overwritten, and every LSN below durable is
+  // durable. Both are only changed on the main thread:
+  int64_t head;
+  int64_t durable;
+  int64_t commits;
+  int64_t records;
+  const char* error;
+  // The staging area holds the blocks of the next commit from LSN start, and
+  // is swapped with the spare by the commit, under the mutex:
+  uv_mutex_t mutex;
+  uint8_t* staging;
+  size_t staging_capacity;
+  size_t staging_length;
+  int64_t staging_start;
+  uint8_t* spare;
+  size_t spare_capacity;
+  // The commit in flight, which holds a reference to the log:
+  int committing;
+  napi_env env;
+  napi_ref ref_log;
+  napi_async_work async_work;
+  uint8_t* commit;
+  size_t commit_capacity;
+  size_t commit_length;
+  int64_t commit_start;
+  const char* commit_error;
+  // Callbacks of records which are not yet durable, in LSN order:
+  struct log_callback* callbacks;
+  size_t callbacks_head;
+  size_t callbacks_length;
+  size_t callbacks_capacity;
+};
+
+static int64_t log_ring(struct log* log) {
+  return log->segment * log->segments;
+}
+
+// Moves a position to where a record header may begin, past a block header,
+// or past the end of a block too short for a record header:
+static int64_t log_align(struct log* log, int64_t position) {
+  int64_t offset = position % log->block;
+  if (offset == 0) return position + LOG_HEADER;
+  if (log->block - offset < LOG_RECORD_HEADER) {
+    return position - offset + log->block + LOG_HEADER;
+  }
+  return position;
+}
+
+// Returns the end of a record of length bytes at an aligned position:
+static int64_t log_record_end(
+  struct log* log,
+  int64_t position,
+  int64_t length
+) {
+  int64_t remaining = LOG_RECORD_HEADER + length;
+  for (;;) {
+    int64_t room = log->block - position % log->block;
+    if (remaining <= room) return position + remaining;
+    remaining -= room;
+    position += room + LOG_HEADER;
+  }
+}
+
+// Copies bytes into the staging area at a position, across block payloads,
+// returning the position after the bytes:
+static int64_t log_stage(
+  struct log* log,
+  int64_t position,
+  const uint8_t* source,
+  size_t length
+) {
+  while (length > 0) {
+    if (position % log->block == 0) position += LOG_HEADER;
+    size_t room = (size_t) (log->block - position % log->block);
+    size_t bytes = length < room ? length : room;
+    memcpy(log->staging + (position - log->staging_start), source, bytes);
+    position += (int64_t) bytes;
+    source += bytes;
+    length -= bytes;
+  }
+  return position;
+}
+
+static int log_block_valid(
+  struct log* log,
+  const uint8_t* block,
+  int64_t lsn
+) {
+  if ((format_read_uint32(block + 4) & 0xffff) != LOG_MAGIC) return 0;
+  if ((int64_t) format_read_uint64(block + 8) != lsn) return 0;
+  uint32_t crc = crc32c(0, block + 4, (size_t) log->block - 4);
+  return format_read_uint32(block) == crc;
+}
+
+// Fills in the headers of the blocks of a commit:
+static void log_seal(
+  struct log* log,
+  uint8_t* blocks,
+  size_t length,
+  int64_t start
+) {
+  // The headers are zero but for the offset of the first record:
+  uint32_t id = crc32c(0, blocks, length);
+  uint32_t count = (uint32_t) (length / (size_t) log->block);
+  for (size_t offset = 0; offset < length; offset += (size_t) log->block) {
+    uint8_t* block = blocks + offset;
+    uint32_t flags = offset == 0 ? LOG_FLAG_COMMIT : 0;
+    format_write_uint32(block + 4, LOG_MAGIC | (flags << 16));
+    format_write_uint64(block + 8, (uint64_t) (start + (int64_t) offset));
+    format_write_uint32(block + 20, (uint32_t) (offset / (size_t) log->block));
+    format_write_uint32(block + 24, count);
+    format_write_uint32(block + 28, id);
+    uint32_t crc = crc32c(0, block + 4, (size_t) log->block - 4);
+    format_write_uint32(block, crc);
+  }
+}
+
+// Reads or writes blocks of the log from an LSN, wrapping around the ring:
+static const char* log_transfer(
+  struct log* log,
+  int write,
+  uint8_t* buffer,
+  size_t length,
+  int64_t lsn
+) {
+  while (length > 0) {
+    int64_t position = lsn % log_ring(log);
+    size_t bytes = length;
+    if ((int64_t) bytes > log_ring(log) - position) {
+      bytes = (size_t) (log_ring(log) - position);
+    }
+    int64_t result;
+    if (!write) {
+      result = io_read(log->fd, buffer, bytes, position);
+#if defined(__linux__) && defined(RWF_DSYNC)
+    } else if (log->dsync) {
+      struct iovec iov = { buffer, bytes };
+      do {
+        result = pwritev2(log->fd, &iov, 1, (off_t) position, RWF_DSYNC);
+      } while (result < 0 && errno == EINTR);
+      if (result < 0) result = -errno;
+#endif
+    } else {
+      result = io_write(log->fd, buffer, bytes, position);
+    }
+    if (result < 0) {
+      return io_error(
+        result,
+        write ? "unexpected error, write" : "unexpected error, read"
+      );
+    }
+    if ((size_t) result != bytes) {
+      return write ? "unexpected short write" : "unexpected end of log";
+    }
+    buffer += bytes;
+    length -= bytes;
+    lsn += (int64_t) bytes;
+  }
+  return NULL;
+}
+
+// Finds the tail of the log, the LSN after the last whole commit, and the
+// newest LSN known to have been written, which is beyond the tail if a torn
+// commit crossed into the next segment, overwriting its previous lap:
+static const char* log_recover(
+  struct log* log,
+  int64_t* tail,
+  int64_t* newest
+) {
+  uint8_t* buffer = bounce_alloc(LOG_SCAN);
+  if (buffer == NULL) return "insufficient memory";
+  const char* error = NULL;
+  int64_t last = -1;
+  int64_t last_index = 0;
+  for (int64_t index = 0; index < log->segments; index++) {
+    error = log_transfer(
+      log,
+      0,
+      buffer,
+      (size_t) log->block,
+      index * log->segment
+    );
+    if (error) break;
+    int64_t lsn = (int64_t) format_read_uint64(buffer + 8);
+    int64_t commit_index = (int64_t) format_read_uint32(buffer + 20);
+    if (
+      lsn % log_ring(log) == index * log->segment &&
+      lsn > last &&
+      commit_index <= lsn / log->block &&
+      log_block_valid(log, buffer, lsn)
+    ) {
+      last = lsn;
+      last_index = commit_index;
+    }
+  }
+  *tail = 0;
+  if (last >= 0 && !error) {
+    // A commit may begin in an earlier segment:
+    int64_t start = last - last_index * log->block;
+    int64_t at = start;
+    uint32_t count = 0;
+    uint32_t id = 0;
+    *tail = start;
+    // The blocks in the buffer, read ahead from the LSN window:
+    int64_t window = 0;
+    int64_t window_length = 0;
+    while (!error) {
+      if (at < window || at >= window + window_length) {
+        window = at;
+        window_length = LOG_SCAN;
+        if (window_length > log_ring(log)) window_length = log_ring(log);
+        error = log_transfer(log, 0, buffer, (size_t) window_length, window);
+        if (error) break;
+      }
+      const uint8_t* block = buffer + (at - window);
+      if (!log_block_valid(log, block, at)) break;
+      uint32_t index = format_read_uint32(block + 20);
+      if (at == start) {
+        if (index != 0) break;
+        count = format_read_uint32(block + 24);
+        id = format_read_uint32(block + 28);
+        if (count == 0) break;
+      } else if (
+        index != (uint32_t) ((at - start) / log->block) ||
+        format_read_uint32(block + 24) != count ||
+        format_read_uint32(block + 28) != id
+      ) {
+        break;
+      }
+      at += log->block;
+      if ((at - start) / log->block == (int64_t) count) {
+        start = at;
+        *tail = at;
+      }
+    }
+  }
+  *newest = last > *tail ? last : *tail;
+  bounce_free(buffer, LOG_SCAN);
+  return error;
+}
+
+static void log_execute_commit(napi_env env, void* data) {
+  struct log* log = data;
+  // Take the staging area, leaving the spare (which is zeroed) in its place:
+  uv_mutex_lock(&log->mutex);
+  log->commit = log->staging;
+  log->commit_capacity = log->staging_capacity;
+  log->commit_start = log->staging_start;
+  log->commit_length = (size_t) (
+    (log->staging_length + log->block - 1) / log->block * log->block
+  );
+  log->staging = log->spare;
+  log->staging_capacity = log->spare_capacity;
+  log->staging_start += (int64_t) log->commit_length;
+  log->staging_length = 0;
+  log->spare = NULL;
+  log->spare_capacity = 0;
+  uv_mutex_unlock(&log->mutex);
+  log->commit_error = NULL;
+  if (log->commit_length > 0) {
+    log_seal(log, log->commit, log->commit_length, log->commit_start);
+    log->commit_error = log_transfer(
+      log,
+      1,
+      log->commit,
+      log->commit_length,
+      log->commit_start
+    );
+    if (!log->commit_error && !log->dsync) {
+      int64_t result = io_fdatasync(log->fd);
+      if (result < 0) {
+        log->commit_error = io_error(result, "unexpected error, fdatasync");
+      }
+    }
+  }
+  memset(log->commit, 0, log->commit_length);
+  uv_mutex_lock(&log->mutex);
+  if (log->spare == NULL) {
+    log->spare = log->commit;
+    log->spare_capacity = log->commit_capacity;
+  } else {
+    aligned_free(log->commit);
+  }
+  log->commit = NULL;
+  uv_mutex_unlock(&log->mutex);
+}
+
+static void log_queue_commit(struct log* log);
+
+// Calls back every record up to the durable LSN, or every record on error:
+static void log_callback(struct log* log, napi_env env) {
+  while (log->callbacks_head < log->callbacks_length) {
+    struct log_callback* entry = &log->callbacks[log->callbacks_head];
+    if (!log->error && entry->end > log->durable) break;
+    log->callbacks_head++;
+    int argc = 0;
+    napi_value argv[1];
+    if (log->error) {
+      argc = 1;
+      napi_value message;
+      OK(napi_create_string_utf8(env, log->error, NAPI_AUTO_LENGTH, &message));
+      OK(napi_create_error(env, NULL, message, &argv[0]));
+    }
+    napi_value scope;
+    OK(napi_get_global(env, &scope));
+    napi_value callback;
+    OK(napi_get_reference_value(env, entry->ref_callback, &callback));
+    OK(napi_delete_reference(env, entry->ref_callback));
+    napi_call_function(env, scope, callback, argc, argv, NULL);
+  }
+  if (log->callbacks_head == log->callbacks_length) {
+    log->callbacks_head = 0;
+    log->callbacks_length = 0;
+  }
+}
+
+static void log_complete_commit(
+  napi_env env,
+  napi_status status,
+  void* data
+) {
+  struct log* log = data;
+  OK(napi_delete_async_work(env, log->async_work));
+  if (status == napi_cancelled) log->commit_error = "async work was cancelled";
+  // After a failed fdatasync() the state of the page cache is unknown, so that
+  // every later append must fail too:
+  if (log->commit_error && !log->error) log->error = log->commit_error;
+  if (!log->error) {
+    log->durable = log->commit_start + (int64_t) log->commit_length;
+    if (log->commit_length > 0) log->commits++;
+  }
+  log->committing = 0;
+  log_callback(log, env);
+  uv_mutex_lock(&log->mutex);
+  int staged = log->staging_length > 0;
+  uv_mutex_unlock(&log->mutex);
+  // A callback may have appended, and so queued the next commit itself, with
+  // a reference of its own:
+  if (staged && !log->error && !log->committing) {
+    log_queue_commit(log);
+  } else {
+    uint32_t count = 0;
+    OK(napi_reference_unref(env, log->ref_log, &count));
+  }
+}
+
+// The caller holds a reference to the log for the commit:
+static void log_queue_commit(struct log* log) {
+  assert(!log->committing);
+  log->committing = 1;
+  napi_value name;
+  OK(napi_create_string_utf8(
+    log->env,
+    RESOURCE_NAME,
+    NAPI_AUTO_LENGTH,
+    &name
+  ));
+  OK(napi_create_async_work(
+    log->env,
+    NULL,
+    name,
+    log_execute_commit,
+    log_complete_commit,
+    log,
+    &log->async_work
+  ));
+  OK(napi_queue_async_work(log->env, log->async_work));
+}
+
+static void log_finalize(napi_env env, void* data, void* hint) {
+  struct log* log = data;
+  // A commit in flight holds a reference to the log, as does every callback:
+  assert(!log->committing);
+  assert(log->callbacks_head == log->callbacks_length);
+  if (log->ref_log) napi_delete_reference(env, log->ref_log);
+  if (log->staging) aligned_free(log->staging);
+  if (log->spare) aligned_free(log->spare);
+  free(log->callbacks);
+  uv_mutex_destroy(&log->mutex);
+  free(log);
+}
+
+static int arg_log(napi_env env, napi_value value, struct log** log) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  if (type != napi_external) return 0;
+  bool tagged = false;
+  OK(napi_check_object_type_tag(env, value, &LOG_TYPE_TAG, &tagged));
+  if (!tagged) return 0;
+  OK(napi_get_value_external(env, value, (void**) log));
+  return 1;
+}
+
+void free_aligned(napi_env env, void* ptr, void* hint) {
+  aligned_free(ptr);
+  ptr = NULL;
+}
+
+// Returns the number of threads, or 0 if the optional argument is invalid:
+static int simd_threads(
+  napi_env env,
+  napi_value* argv,
+  size_t argc,
+  size_t at
+) {
+  if (argc <= at) return 1;
+  int threads = 0;
+  if (!arg_int(env, argv[at], &threads)) return 0;
+  if (threads < 1 || threads > SIMD_THREADS_MAX) return 0;
+  return threads;
+}
+
+static napi_value equals(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  uint8_t* a = NULL;
+  uint8_t* b = NULL;
+  size_t a_length = 0;
+  size_t b_length = 0;
+  int threads = simd_threads(env, argv, argc, 2);
+  if (
+    argc < 2 ||
+    argc > 3 ||
+    !arg_buffer(env, argv[0], &a, &a_length) ||
+    !arg_buffer(env, argv[1], &b, &b_length) ||
+    threads == 0
+  ) {
+    THROW(env, "bad arguments, expected: (a, b, threads=1..64)");
+  }
+  int result = a_length == b_length && simd_run(
+    SIMD_EQUALS,
+    a,
+    b,
+    a_length,
+    0,
+    threads
+  );
+  napi_value value;
+  OK(napi_get_boolean(env, result, &value));
+  return value;
+}
+
+static napi_value fill(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  uint8_t* buffer = NULL;
+  size_t length = 0;
+  int value = 0;
+  int threads = simd_threads(env, argv, argc, 2);
+  if (
+    argc < 2 ||
+    argc > 3 ||
+    !arg_buffer(env, argv[0], &buffer, &length) ||
+    !arg_int(env, argv[1], &value) ||
+    value > 255 ||
+    threads == 0
+  ) {
+    THROW(env,
+      "bad arguments, expected: (buffer, value=0..255, threads=1..64)"
+    );
+  }
+  simd_run(SIMD_FILL, buffer, NULL, length, (uint8_t) value, threads);
+  return NULL;
+}
+
+static napi_value hash_range(napi_env env, napi_callback_info info) {
+  size_t argc = 6;
+  napi_value argv[6];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  int64_t offset = 0;
+  int64_t length = 0;
+  napi_valuetype type = napi_undefined;
+  if (argc == 6) OK(napi_typeof(env, argv[2], &type));
+  if (
+    argc != 6 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_int64(env, argv[1], &offset) ||
+    (type != napi_null && !arg_int64(env, argv[2], &length)) ||
+    !arg_object(env, argv[3]) ||
+    !arg_progress(env, argv[4]) ||
+    !arg_function(env, argv[5])
+  ) {
+    THROW(env,
+      "bad arguments, expected: "
+      "(fd, offset, length, options, onProgress, callback)"
+    );
+  }
+  if (type == napi_null) {
+    length = -1;
+  } else if (length > 9007199254740991 - offset) {
+    THROW(env, "offset + length must not exceed Number.MAX_SAFE_INTEGER");
+  }
+  napi_value options = argv[3];
+  napi_value algo;
+  if (option_value(env, options, "algo", &algo)) {
+    char name[8];
+    size_t name_length = 0;
+    if (
+      napi_get_value_string_utf8(
+        env,
+        algo,
+        name,
+        sizeof(name),
+        &name_length
+      ) != napi_ok ||
+      strcmp(name, "blake3") != 0
+    ) {
+      THROW(env, "options.algo must be \"blake3\"");
+    }
+  }
+  struct hash_data* hash = calloc(1, sizeof(struct hash_data));
+  if (!hash) THROW(env, "insufficient memory");
+  struct engine* engine = &hash->engine;
+  const char* error = engine_options(env, options, engine);
+  if (
+    !error && (
+      engine->block < BLAKE3_CHUNK_LEN ||
+      (engine->block & (engine->block - 1)) != 0
+    )
+  ) {
+    error = "options.blockSize must be a power of 2 from 1024";
+  }
+  if (!error && !option_bool(env, options, "leaves", &hash->leaves)) {
+    error = "options.leaves must be a boolean";
+  }
+  if (error) {
+    free(hash);
+    THROW(env, error);
+  }
+  hash->fd = fd;
+  hash->offset = offset;
+  engine->start = offset;
+  engine->end = length >= 0 ? offset + length : -1;
+  engine->buffers = 1;
+  engine->prepare = hash_prepare;
+  engine->run = hash_run;
+  engine->finish = hash_finish;
+  engine->result = hash_result;
+  engine->cleanup = hash_cleanup;
+  return engine_queue(env, engine, argv[4], argv[5]);
+}
+
+static napi_value image_device(napi_env env, napi_callback_info info) {
+  size_t argc = 5;
+  napi_value argv[5];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd_source = 0;
+  int fd_target = 0;
+  if (
+    argc != 5 ||
+    !arg_int(env, argv[0], &fd_source) ||
+    !arg_int(env, argv[1], &fd_target) ||
+    !arg_object(env, argv[2]) ||
+    !arg_progress(env, argv[3]) ||
+    !arg_function(env, argv[4])
+  ) {
+    THROW(env,
+      "bad arguments, expected: (srcFd, dstFd, options, onProgress, callback)"
+    );
+  }
+  napi_value options = argv[2];
+  struct image_data* image = calloc(1, sizeof(struct image_data));
+  if (!image) THROW(env, "insufficient memory");
+  struct engine* engine = &image->engine;
+  const char* error = engine_options(env, options, engine);
+  int64_t start = 0;
+  int64_t end = -1;
+  int punch = 0;
+  napi_value end_value;
+  if (!error && !option_int64(env, options, "start", &start)) {
+    error = "options.start must be a safe integer";
+  }
+  if (!error && option_value(env, options, "end", &end_value)) {
+    end = 0;
+    if (!arg_int64(env, end_value, &end) || end < start) {
+      error = "options.end must be a safe integer not less than options.start";
+    }
+  }
+  if (!error && !option_bool(env, options, "punch", &punch)) {
+    error = "options.punch must be a boolean";
+  }
+  if (error) {
+    free(image);
+    THROW(env, error);
+  }
+  image->fd_source = fd_source;
+  image->fd_target = fd_target;
+  image->punch = punch;
+  engine->start = start;
+  engine->end = end;
+  engine->buffers = 1;
+  engine->counter_names[IMAGE_DATA_BYTES] = "dataBytes";
+  engine->counter_names[IMAGE_ZERO_BYTES] = "zeroBytes";
+  engine->prepare = image_prepare;
+  engine->run = image_run;
+  engine->finish = image_finish;
+  return engine_queue(env, engine, argv[3], argv[4]);
+}
+
+static napi_value is_zero(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  uint8_t* buffer = NULL;
+  size_t length = 0;
+  int threads = simd_threads(env, argv, argc, 1);
+  if (
+    argc < 1 ||
+    argc > 2 ||
+    !arg_buffer(env, argv[0], &buffer, &length) ||
+    threads == 0
+  ) {
+    THROW(env, "bad arguments, expected: (buffer, threads=1..64)");
+  }
+  int result = (int) simd_run(SIMD_IS_ZERO, buffer, NULL, length, 0, threads);
+  napi_value value;
+  OK(napi_get_boolean(env, result, &value));
+  return value;
+}
+
+struct log_open_data {
+  struct log* log;
+  int64_t tail;
+  int64_t newest;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static void log_open_execute(napi_env env, void* data) {
+  struct log_open_data* work = data;
+  struct log* log = work->log;
+  int64_t size = 0;
+  work->error = io_size(log->fd, &size);
+  if (work->error) return;
+  if (size < log_ring(log)) {
+    int64_t result = io_allocate(log->fd, log_ring(log));
+    if (result < 0) {
+      work->error = io_error(result, "unexpected error, fallocate");
+      return;
+    }
+    work->error = io_size(log->fd, &size);
+    if (work->error) return;
+    if (size < log_ring(log)) {
+      work->error = "segments * segmentSize must not exceed the device size";
+      return;
+    }
+  }
+  work->error = log_recover(log, &work->tail, &work->newest);
+}
+
+static void log_open_complete(napi_env env, napi_status status, void* data) {
+  struct log_open_data* work = data;
+  struct log* log = work->log;
+  if (status == napi_cancelled) work->error = "async work was cancelled";
+  int argc = 0;
+  napi_value argv[2];
+  if (work->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, work->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+    log_finalize(env, log, NULL);
+  } else {
+    argc = 2;
+    log->durable = work->tail;
+    log->staging_start = work->tail;
+    // The segments before the tail are kept until released, less any which a
+    // torn commit overwrote:
+    int64_t segment = work->newest / log->segment * log->segment;
+    log->head = segment - (log->segments - 1) * log->segment;
+    if (log->head < 0) log->head = 0;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_external(env, log, log_finalize, NULL, &argv[1]));
+    OK(napi_type_tag_object(env, argv[1], &LOG_TYPE_TAG));
+    log->env = env;
+    OK(napi_create_reference(env, argv[1], 0, &log->ref_log));
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, work->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, work->ref_callback));
+  OK(napi_delete_async_work(env, work->async_work));
+  free(work);
+}
+
+// Parses the geometry of a log, returning an error message if an option is
+// invalid:
+static const char* log_options(
+  napi_env env,
+  napi_value options,
+  int64_t* block,
+  int64_t* segment,
+  int64_t* segments
+) {
+  if (
+    !option_int64(env, options, "blockSize", block) ||
+    *block < LOG_BLOCK_MIN ||
+    *block > LOG_BLOCK_MAX ||
+    (*block & (*block - 1))
+  ) {
+    return "options.blockSize must be a power of 2 from 512 to 65536";
+  }
+  if (
+    !option_int64(env, options, "segmentSize", segment) ||
+    *segment < LOG_SEGMENT_MIN ||
+    *segment > LOG_SEGMENT_MAX ||
+    (*segment & (*segment - 1))
+  ) {
+    return "options.segmentSize must be a power of 2 from 65536 to 1073741824";
+  }
+  if (
+    !option_int64(env, options, "segments", segments) ||
+    *segments < LOG_SEGMENTS_MIN ||
+    *segments > LOG_SEGMENTS_MAX
+  ) {
+    return "options.segments must be from 2 to 1024";
+  }
+  return NULL;
+}
+
+static napi_value log_open(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  if (
+    argc != 3 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_object(env, argv[1]) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, options, callback)");
+  }
+  int64_t block = LOG_BLOCK_DEFAULT;
+  int64_t segment = LOG_SEGMENT_DEFAULT;
+  int64_t segments = LOG_SEGMENTS_DEFAULT;
+  const char* error = log_options(env, argv[1], &block, &segment, &segments);
+  if (error) THROW(env, error);
+  int dsync = 0;
+  napi_value sync_value;
+  if (option_value(env, argv[1], "sync", &sync_value)) {
+    char method[16];
+    size_t method_length = 0;
+    if (
+      napi_get_value_string_utf8(
+        env,
+        sync_value,
+        method,
+        sizeof(method),
+        &method_length
+      ) != napi_ok ||
+      (strcmp(method, "fdatasync") != 0 && strcmp(method, "dsync") != 0)
+    ) {
+      THROW(env, "options.sync must be \"fdatasync\" or \"dsync\"");
+    }
+    dsync = strcmp(method, "dsync") == 0;
+  }
+  struct log* log = calloc(1, sizeof(struct log));
+  if (!log) THROW(env, "insufficient memory");
+  int mutex = uv_mutex_init(&log->mutex);
+  assert(mutex == 0);
+  log->fd = fd;
+  log->block = block;
+  log->segment = segment;
+  log->segments = segments;
+  // Without RWF_DSYNC, each commit is followed by fdatasync():
+#if defined(__linux__) && defined(RWF_DSYNC)
+  log->dsync = dsync;
+#else
+  (void) dsync;
+#endif
+  struct log_open_data* work = calloc(1, sizeof(struct log_open_data));
+  if (!work) {
+    log_finalize(env, log, NULL);
+    THROW(env, "insufficient memory");
+  }
+  work->log = log;
+  OK(napi_create_reference(env, argv[2], 1, &work->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    log_open_execute,
+    log_open_complete,
+    work,
+    &work->async_work
+  ));
+  OK(napi_queue_async_work(env, work->async_work));
+  return NULL;
+}
+
+static napi_value log_append(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct log* log = NULL;
+  uint8_t* buffer = NULL;
+  size_t length = 0;
+  if (
+    argc != 3 ||
+    !arg_log(env, argv[0], &log) ||
+    !arg_buffer(env, argv[1], &buffer, &length) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (log, buffer, callback)");
+  }
+  if (length == 0) THROW(env, "buffer must not be empty");
+  if (length > UINT32_MAX) {
+    THROW(env, "buffer must be at most 4294967295 bytes");
+  }
+  if (log->error) THROW(env, log->error);
+  if (log->callbacks_length == log->callbacks_capacity) {
+    size_t capacity = log->callbacks_capacity * 2;
+    if (capacity == 0) capacity = 64;
+    struct log_callback* callbacks = realloc(
+      log->callbacks,
+      capacity * sizeof(struct log_callback)
+    );
+    if (!callbacks) THROW(env, "insufficient memory");
+    log->callbacks = callbacks;
+    log->callbacks_capacity = capacity;
+  }
+  uv_mutex_lock(&log->mutex);
+  int64_t lsn = log_align(log, log->staging_start + log->staging_length);
+  int64_t end = log_record_end(log, lsn, (int64_t) length);
+  int64_t blocks = (end - log->staging_start + log->block - 1) / log->block;
+  size_t size = (size_t) (blocks * log->block);
+  // A record may not be staged into a segment which has yet to be released:
+  int64_t limit = log->head / log->segment * log->segment + log_ring(log);
+  if (log->staging_start + (int64_t) size > limit) {
+    uv_mutex_unlock(&log->mutex);
+    THROW(env, "log is full, release records with logRelease()");
+  }
+  if (size > log->staging_capacity) {
+    size_t capacity = log->staging_capacity * 2;
+    if (capacity < size) capacity = size;
+    uint8_t* staging = aligned_malloc(capacity, SCRATCH_ALIGNMENT);
+    if (!staging) {
+      uv_mutex_unlock(&log->mutex);
+      THROW(env, "insufficient memory");
+    }
+    memset(staging, 0, capacity);
+    if (log->staging) {
+      memcpy(staging, log->staging, log->staging_length);
+      aligned_free(log->staging);
+    }
+    log->staging = staging;
+    log->staging_capacity = capacity;
+  }
+  uint8_t* first = log->staging +
+    (lsn / log->block * log->block - log->staging_start) + 16;
+  if (format_read_uint32(first) == 0) {
+    format_write_uint32(first, (uint32_t) (lsn % log->block));
+  }
+  uint8_t header[LOG_RECORD_HEADER];
+  format_write_uint32(header, (uint32_t) length);
+  format_write_uint32(header + 4, crc32c(0, buffer, length));
+  int64_t position = log_stage(log, lsn, header, LOG_RECORD_HEADER);
+  position = log_stage(log, position, buffer, length);
+  assert(position == end);
+  log->staging_length = (size_t) (end - log->staging_start);
+  uv_mutex_unlock(&log->mutex);
+  struct log_callback* entry = &log->callbacks[log->callbacks_length++];
+  entry->end = end;
+  OK(napi_create_reference(env, argv[2], 1, &entry->ref_callback));
+  log->records++;
+  if (!log->committing) {
+    uint32_t count = 0;
+    OK(napi_reference_ref(env, log->ref_log, &count));
+    log_queue_commit(log);
+  }
+  napi_value result;
+  OK(napi_create_int64(env, lsn, &result));
+  return result;
+}
+
+struct log_read_record {
+  int64_t lsn;
+  size_t offset;
+  size_t length;
+};
+
+struct log_read_data {
+  struct log* log;
+  int64_t lsn;
+  int64_t limit;
+  int64_t durable;
+  int64_t next;
+  struct log_read_record* records;
+  size_t records_length;
+  size_t records_capacity;
+  uint8_t* payload;
+  size_t payload_length;
+  size_t payload_capacity;
+  napi_ref ref_log;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static int log_read_reserve(struct log_read_data* read, size_t length) {
+  if (read->records_length == read->records_capacity) {
+    size_t capacity = read->records_capacity * 2;
+    if (capacity == 0) capacity = 64;
+    struct log_read_record* records = realloc(
+      read->records,
+      capacity * sizeof(struct log_read_record)
+    );
+    if (!records) return 0;
+    read->records = records;
+    read->records_capacity = capacity;
+  }
+  if (read->payload_length + length > read->payload_capacity) {
+    size_t capacity = read->payload_capacity * 2;
+    if (capacity < read->payload_length + length) {
+      capacity = read->payload_length + length;
+    }
+    uint8_t* payload = realloc(read->payload, capacity);
+    if (!payload) return 0;
+    read->payload = payload;
+    read->payload_capacity = capacity;
+  }
+  return 1;
+}
+
+// Parses records from an LSN up to the durable LSN, or until the limit. An LSN
+// which is a multiple of the block size reads from the first record to begin
+// in that block or later. A record which is continued by the first block of a
+// commit was torn by a crash during an earlier commit, and was never durable,
+// so it is skipped:
+static void log_read_execute(napi_env env, void* data) {
+  struct log_read_data* read = data;
+  struct log* log = read->log;
+  uint8_t* buffer = bounce_alloc(LOG_SCAN);
+  if (buffer == NULL) {
+    read->error = "insufficient memory";
+    return;
+  }
+  int64_t cursor = log_align(log, read->lsn);
+  int64_t block = cursor / log->block * log->block;
+  int seek = read->lsn % log->block == 0;
+  // The record being read, if any, and the bytes of its payload remaining:
+  struct log_read_record* record = NULL;
+  size_t remaining = 0;
+  uint32_t crc = 0;
+  int done = 0;
+  while (!done && !read->error && block < read->durable) {
+    size_t length = (size_t) (read->durable - block);
+    if (length > LOG_SCAN) length = LOG_SCAN;
+    read->error = log_transfer(log, 0, buffer, length, block);
+    for (size_t offset = 0; !done && !read->error && offset < length;) {
+      const uint8_t* bytes = buffer + offset;
+      if (!log_block_valid(log, bytes, block)) {
+        read->error = "log is corrupt";
+        break;
+      }
+      uint32_t flags = format_read_uint32(bytes + 4) >> 16;
+      if (record && (flags & LOG_FLAG_COMMIT)) {
+        read->payload_length = record->offset;
+        read->records_length--;
+        record = NULL;
+      }
+      if (cursor < block + LOG_HEADER) cursor = block + LOG_HEADER;
+      int64_t block_end = block + log->block;
+      if (seek) {
+        uint32_t first = format_read_uint32(bytes + 16);
+        if (first == 0) {
+          cursor = block_end;
+        } else {
+          cursor = block + first;
+          seek = 0;
+        }
+      }
+      while (cursor < block_end) {
+        if (record) {
+          size_t bytes_length = (size_t) (block_end - cursor);
+          if (bytes_length > remaining) bytes_length = remaining;
+          memcpy(
+            read->payload + read->payload_length,
+            bytes + (cursor - block),
+            bytes_length
+          );
+          read->payload_length += bytes_length;
+          remaining -= bytes_length;
+          cursor += (int64_t) bytes_length;
+          if (remaining > 0) continue;
+          if (
+            crc32c(0, read->payload + record->offset, record->length) != crc
+          ) {
+            read->error = "record checksum mismatch";
+            break;
+          }
+          record = NULL;
+          cursor = log_align(log, cursor);
+          continue;
+        }
+        if (block_end - cursor < LOG_RECORD_HEADER) break;
+        uint32_t record_length = format_read_uint32(bytes + (cursor - block));
+        // The rest of the block is padding:
+        if (record_length == 0) break;
+        if (
+          read->records_length > 0 &&
+          (int64_t) (read->payload_length + record_length) > read->limit
+        ) {
+          done = 1;
+          break;
+        }
+        // A record torn at the tail by a crash was never durable:
+        if (log_record_end(log, cursor, record_length) > read->durable) {
+          done = 1;
+          break;
+        }
+        if (!log_read_reserve(read, record_length)) {
+          read->error = "insufficient memory";
+          break;
+        }
+        record = &read->records[read->records_length++];
+        record->lsn = cursor;
+        record->offset = read->payload_length;
+        record->length = record_length;
+        crc = format_read_uint32(bytes + (cursor - block) + 4);
+        remaining = record_length;
+        cursor += LOG_RECORD_HEADER;
+      }
+      if (done || read->error) break;
+      block = block_end;
+      if (cursor < block) cursor = block;
+      offset += (size_t) log->block;
+    }
+  }
+  read->next = done ? cursor : read->durable;
+  if (read->next < read->lsn) read->next = read->lsn;
+  bounce_free(buffer, LOG_SCAN);
+}
+
+static void log_read_complete(napi_env env, napi_status status, void* data) {
+  struct log_read_data* read = data;
+  if (status == napi_cancelled) read->error = "async work was cancelled";
+  int argc = 0;
+  napi_value argv[2];
+  if (read->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, read->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_object(env, &argv[1]));
+    napi_value records;
+    OK(napi_create_array_with_length(env, read->records_length, &records));
+    for (size_t index = 0; index < read->records_length; index++) {
+      struct log_read_record* record = &read->records[index];
+      napi_value object;
+      OK(napi_create_object(env, &object));
+      set_int(env, object, "lsn", record->lsn);
+      napi_value buffer;
+      OK(napi_create_buffer_copy(
+        env,
+        record->length,
+        read->payload + record->offset,
+        NULL,
+        &buffer
+      ));
+      OK(napi_set_named_property(env, object, "data", buffer));
+      OK(napi_set_element(env, records, (uint32_t) index, object));
+    }
+    OK(napi_set_named_property(env, argv[1], "records", records));
+    set_int(env, argv[1], "next", read->next);
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, read->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, read->ref_log));
+  OK(napi_delete_reference(env, read->ref_callback));
+  OK(napi_delete_async_work(env, read->async_work));
+  free(read->records);
+  free(read->payload);
+  free(read);
+}
+
+static napi_value log_read(napi_env env, napi_callback_info info) {
+  size_t argc = 4;
+  napi_value argv[4];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct log* log = NULL;
+  int64_t lsn = 0;
+  int64_t limit = 0;
+  if (
+    argc != 4 ||
+    !arg_log(env, argv[0], &log) ||
+    !arg_int64(env, argv[1], &lsn) ||
+    !arg_int64(env, argv[2], &limit) ||
+    !arg_function(env, argv[3])
+  ) {
+    THROW(env, "bad arguments, expected: (log, lsn, length, callback)");
+  }
+  if (lsn < log->head / log->segment * log->segment) {
+    THROW(env, "lsn has been released");
+  }
+  if (lsn > log->durable) {
+    THROW(env, "lsn must not be greater than the durable lsn");
+  }
+  struct log_read_data* read = calloc(1, sizeof(struct log_read_data));
+  if (!read) THROW(env, "insufficient memory");
+  read->log = log;
+  read->lsn = lsn;
+  read->limit = limit;
+  read->durable = log->durable;
+  OK(napi_create_reference(env, argv[0], 1, &read->ref_log));
+  OK(napi_create_reference(env, argv[3], 1, &read->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    log_read_execute,
+    log_read_complete,
+    read,
+    &read->async_work
+  ));
+  OK(napi_queue_async_work(env, read->async_work));
+  return NULL;
+}
+
+static napi_value log_release(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct log* log = NULL;
+  int64_t lsn = 0;
+  if (
+    argc != 2 ||
+    !arg_log(env, argv[0], &log) ||
+    !arg_int64(env, argv[1], &lsn)
+  ) {
+    THROW(env, "bad arguments, expected: (log, lsn)");
+  }
+  if (lsn > log->durable) {
+    THROW(env, "lsn must not be greater than the durable lsn");
+  }
+  if (lsn > log->head) log->head = lsn;
+  return NULL;
+}
+
+static napi_value log_status(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct log* log = NULL;
+  if (argc != 1 || !arg_log(env, argv[0], &log)) {
+    THROW(env, "bad arguments, expected: (log)");
+  }
+  napi_value result;
+  OK(napi_create_object(env, &result));
+  set_int(env, result, "blockSize", log->block);
+  set_int(env, result, "segmentSize", log->segment);
+  set_int(env, result, "segments", log->segments);
+  set_int(env, result, "head", log->head);
+  uv_mutex_lock(&log->mutex);
+  int64_t tail = log->staging_start + (int64_t) log->staging_length;
+  uv_mutex_unlock(&log->mutex);
+  set_int(env, result, "tail", tail);
+  set_int(env, result, "durable", log->durable);
+  set_int(env, result, "records", log->records);
+  set_int(env, result, "commits", log->commits);
+  return result;
+}
+
+// A log scan recovers every record of a log which is not open, for a fast
+// start. The ring is streamed through an engine, so that it is read at a
+// queue depth of depth, and blocks and records are checked on depth threads.
+// Each worker checks the blocks of its chunk, and checksums every record which
+// begins in the chunk, reading ahead for a record which continues past the
+// chunk. Each chunk leaves a summary of its runs of consecutive blocks, from
+// which the head is found as the start of the segments kept by logOpen(),
+// without a second pass over the log. The tail is found by log_recover().
+#define LOG_SCAN_IO_DEFAULT 1048576
+
+struct log_scan_chunk {
+  // The LSN less the position of the first and last blocks of the chunk (or -1
+  // if the block is not valid), and the lengths of the runs of consecutive
+  // blocks from the start of the chunk and back from the end of the chunk:
+  int64_t base_first;
+  int64_t prefix;
+  int64_t base_last;
+  int64_t suffix;
+};
+
+struct log_scan_record {
+  int64_t lsn;
+  uint32_t length;
+  int checksum;
+};
+
+struct log_scan_worker {
+  // The LSN of each block of the chunk being scanned, or -1 if not valid:
+  int64_t* lsns;
+  struct log_scan_record* records;
+  size_t records_length;
+  size_t records_capacity;
+};
+
+struct log_scan_data {
+  struct engine engine;
+  // The geometry of the log, for log_transfer() and friends:
+  struct log log;
+  int64_t size;
+  struct log_scan_chunk* chunks;
+  struct log_scan_worker workers[ENGINE_DEPTH_MAX];
+  int64_t head;
+  int64_t tail;
+  struct log_scan_record* records;
+  size_t records_length;
+};
+
+// Checksums the payload of a record which begins in the chunk at position,
+// following it into later blocks of the chunk, or reading ahead if it
+// continues past the chunk. Sets valid only if every block of the record is
+// intact, and no block after the first begins a commit:
+static const char* log_scan_follow(
+  struct log_scan_data* scan,
+  struct engine_worker* worker,
+  int64_t position,
+  size_t length,
+  int64_t cursor,
+  uint32_t record_length,
+  int* valid,
+  uint32_t* crc
+) {
+  struct log* log = &scan->log;
+  int64_t* lsns = scan->workers[worker - scan->engine.workers].lsns;
+  uint8_t* ahead = worker->buffers[1];
+  int64_t ahead_start = 0;
+  int64_t ahead_length = 0;
+  int64_t block = cursor / log->block * log->block;
+  int64_t at = cursor + LOG_RECORD_HEADER;
+  const uint8_t* bytes = worker->buffers[0];
+  bytes += block % log_ring(log) - position;
+  size_t remaining = record_length;
+  uint32_t sum = 0;
+  *valid = 0;
+  for (;;) {
+    size_t room = (size_t) (block + log->block - at);
+    size_t bytes_length = remaining < room ? remaining : room;
+    sum = crc32c(sum, bytes + (at - block), bytes_length);
+    remaining -= bytes_length;
+    if (remaining == 0) break;
+    block += log->block;
+    at = block + LOG_HEADER;
+    int64_t physical = block % log_ring(log);
+    if (physical >= position && physical < position + (int64_t) length) {
+      if (lsns[(physical - position) / log->block] != block) return NULL;
+      bytes = worker->buffers[0] + (physical - position);
+    } else {
+      if (block < ahead_start || block >= ahead_start + ahead_length) {
+        if (physical >= scan->size) return NULL;
+        // Read only as many blocks as the rest of the record needs:
+        int64_t payload = log->block - LOG_HEADER;
+        ahead_length = ((int64_t) remaining + payload - 1) / payload;
+        ahead_length *= log->block;
+        if (ahead_length > (int64_t) scan->engine.block) {
+          ahead_length = (int64_t) scan->engine.block;
+        }
+        if (ahead_length > scan->size - physical) {
+          ahead_length = scan->size - physical;
+        }
+        ahead_start = block;
+        const char* error = log_transfer(
+          log,
+          0,
+          ahead,
+          (size_t) ahead_length,
+          block
+        );
+        if (error) return error;
+      }
+      bytes = ahead + (block - ahead_start);
+      if (!log_block_valid(log, bytes, block)) return NULL;
+    }
+    if ((format_read_uint32(bytes + 4) >> 16) & LOG_FLAG_COMMIT) return NULL;
+  }
+  *valid = 1;
+  *crc = sum;
+  return NULL;
+}
+
+static int log_scan_append(
+  struct log_scan_worker* sink,
+  int64_t lsn,
+  uint32_t length,
+  int checksum
+) {
+  if (sink->records_length == sink->records_capacity) {
+    size_t capacity = sink->records_capacity * 2;
+    if (capacity == 0) capacity = 1024;
+    struct log_scan_record* records = realloc(
+      sink->records,
+      capacity * sizeof(struct log_scan_record)
+    );
+    if (!records) return 0;
+    sink->records = records;
+    sink->records_capacity = capacity;
+  }
+  struct log_scan_record* record = &sink->records[sink->records_length++];
+  record->lsn = lsn;
+  record->length = length;
+  record->checksum = checksum;
+  return 1;
+}
+
+static const char* log_scan_run(
+  struct engine_worker* worker,
+  int64_t position,
+  size_t length
+) {
+  struct log_scan_data* scan = (struct log_scan_data*) worker->engine;
+  struct log* log = &scan->log;
+  struct log_scan_worker* sink = &scan->workers[worker - scan->engine.workers];
+  uint8_t* buffer = worker->buffers[0];
+  const char* error = log_transfer(log, 0, buffer, length, position);
+  if (error) return error;
+  size_t blocks = length / (size_t) log->block;
+  for (size_t index = 0; index < blocks; index++) {
+    const uint8_t* bytes = buffer + index * (size_t) log->block;
+    int64_t at = position + (int64_t) index * log->block;
+    int64_t lsn = (int64_t) format_read_uint64(bytes + 8);
+    sink->lsns[index] = -1;
+    if (
+      lsn >= 0 &&
+      lsn % log_ring(log) == at &&
+      log_block_valid(log, bytes, lsn)
+    ) {
+      sink->lsns[index] = lsn;
+    }
+  }
+  struct log_scan_chunk* chunk = &scan->chunks[position / scan->engine.block];
+  int64_t base_first = sink->lsns[0] < 0 ? -1 : sink->lsns[0] - position;
+  int64_t prefix = 0;
+  for (size_t index = 0; base_first >= 0 && index < blocks; index++) {
+    int64_t at = position + (int64_t) index * log->block;
+    if (sink->lsns[index] != base_first + at) break;
+    prefix += log->block;
+  }
+  int64_t end = position + (int64_t) length;
+  int64_t base_last = -1;
+  int64_t suffix = 0;
+  if (sink->lsns[blocks - 1] >= 0) {
+    base_last = sink->lsns[blocks - 1] - (end - log->block);
+    for (size_t index = blocks; index > 0; index--) {
+      int64_t at = position + (int64_t) (index - 1) * log->block;
+      if (sink->lsns[index - 1] != base_last + at) break;
+      suffix += log->block;
+    }
+  }
+  chunk->base_first = base_first;
+  chunk->prefix = prefix;
+  chunk->base_last = base_last;
+  chunk->suffix = suffix;
+  // Checksum every record which begins in a valid block of the chunk:
+  for (size_t index = 0; index < blocks; index++) {
+    int64_t lsn = sink->lsns[index];
+    if (lsn < 0) continue;
+    const uint8_t* bytes = buffer + index * (size_t) log->block;
+    uint32_t first = format_read_uint32(bytes + 16);
+    if (first < LOG_HEADER || first >= log->block) continue;
+    int64_t cursor = lsn + first;
+    int64_t block_end = lsn + log->block;
+    while (block_end - cursor >= LOG_RECORD_HEADER) {
+      const uint8_t* header = bytes + (cursor - lsn);
+      uint32_t record_length = format_read_uint32(header);
+      // The rest of the block is padding:
+      if (record_length == 0) break;
+      int valid = 0;
+      uint32_t crc = 0;
+      error = log_scan_follow(
+        scan,
+        worker,
+        position,
+        length,
+        cursor,
+        record_length,
+        &valid,
+        &crc
+      );
+      if (error) return error;
+      if (
+        valid &&
+        !log_scan_append(
+          sink,
+          cursor,
+          record_length,
+          crc == format_read_uint32(header + 4)
+        )
+      ) {
+        return "insufficient memory";
+      }
+      cursor = log_align(log, log_record_end(log, cursor, record_length));
+    }
+  }
+  return NULL;
+}
+
+static const char* log_scan_prepare(struct engine* engine) {
+  struct log_scan_data* scan = (struct log_scan_data*) engine;
+  struct log* log = &scan->log;
+  const char* error = io_size(log->fd, &scan->size);
+  if (error) return error;
+  if (scan->size > log_ring(log)) scan->size = log_ring(log);
+  scan->size = scan->size / log->block * log->block;
+  engine->start = 0;
+  engine->end = scan->size;
+  int64_t io = (int64_t) engine->block;
+  size_t chunks = (size_t) ((scan->size + io - 1) / io);
+  scan->chunks = calloc(chunks + 1, sizeof(struct log_scan_chunk));
+  if (!scan->chunks) return "insufficient memory";
+  for (size_t index = 0; index < chunks; index++) {
+    scan->chunks[index].base_first = -1;
+    scan->chunks[index].base_last = -1;
+  }
+  for (int index = 0; index < engine->depth; index++) {
+    scan->workers[index].lsns = malloc(
+      (size_t) (io / log->block) * sizeof(int64_t)
+    );
+    if (!scan->workers[index].lsns) return "insufficient memory";
+  }
+  return NULL;
+}
+
+static int log_scan_record_compare(const void* a, const void* b) {
+  const struct log_scan_record* x = a;
+  const struct log_scan_record* y = b;
+  if (x->lsn < y->lsn) return -1;
+  if (x->lsn > y->lsn) return 1;
+  return 0;
+}
+
+static const char* log_scan_finish(struct engine* engine) {
+  struct log_scan_data* scan = (struct log_scan_data*) engine;
+  struct log* log = &scan->log;
+  int64_t io = (int64_t) engine->block;
+  int64_t ring = log_ring(log);
+  // Find the segment written last, from the first block of each segment:
+  int64_t last = -1;
+  for (int64_t index = 0; index < log->segments; index++) {
+    int64_t at = index * log->segment;
+    if (at >= scan->size) break;
+    struct log_scan_chunk* chunk = &scan->chunks[at / io];
+    if (chunk->base_first >= 0 && chunk->base_first + at > last) {
+      last = chunk->base_first + at;
+    }
+  }
+  if (last < 0) return NULL;
+  // The tail is found by log_recover() itself, since only whole commits are
+  // recovered, which rereads at most the segment written last and any commit
+  // which crosses into it:
+  int64_t tail = 0;
+  int64_t newest = 0;
+  const char* error = log_recover(log, &tail, &newest);
+  if (error) return error;
+  // The head is the start of the segments kept by logOpen(), unless a block
+  // between the head and the tail is not valid:
+  int64_t head = newest / log->segment * log->segment;
+  head -= (log->segments - 1) * log->segment;
+  if (head < 0) head = 0;
+  int64_t lowest = tail;
+  while (lowest > head) {
+    int64_t at = (lowest - 1) % ring;
+    int64_t start = at / io * io;
+    int64_t chunk_length = scan->size - start < io ? scan->size - start : io;
+    int64_t offset = at + 1 - start;
+    int64_t base = lowest - offset - start;
+    struct log_scan_chunk* chunk = &scan->chunks[at / io];
+    int64_t run = 0;
+    if (offset == chunk_length) {
+      if (chunk->base_last == base) run = chunk->suffix;
+    } else if (chunk->base_first == base && chunk->prefix >= offset) {
+      run = offset;
+    }
+    if (run > offset) run = offset;
+    lowest -= run;
+    if (run < offset) break;
+  }
+  if (head < lowest) head = lowest;
+  scan->head = head;
+  scan->tail = tail;
+  // Gather the records which begin and end between the head and the tail:
+  size_t length = 0;
+  for (int index = 0; index < engine->depth; index++) {
+    length += scan->workers[index].records_length;
+  }
+  scan->records = malloc((length + 1) * sizeof(struct log_scan_record));
+  if (!scan->records) return "insufficient memory";
+  for (int index = 0; index < engine->depth; index++) {
+    struct log_scan_worker* sink = &scan->workers[index];
+    for (size_t record = 0; record < sink->records_length; record++) {
+      struct log_scan_record* item = &sink->records[record];
+      if (item->lsn < head) continue;
+      if (log_record_end(log, item->lsn, item->length) > tail) continue;
+      if (!item->checksum) return "record checksum mismatch";
+      scan->records[scan->records_length++] = *item;
+    }
+  }
+  qsort(
+    scan->records,
+    scan->records_length,
+    sizeof(struct log_scan_record),
+    log_scan_record_compare
+  );
+  return NULL;
+}
+
+static void log_scan_result(
+  struct engine* engine,
+  napi_env env,
+  napi_value result
+) {
+  struct log_scan_data* scan = (struct log_scan_data*) engine;
+  size_t length = scan->records_length;
+  set_int(env, result, "head", scan->head);
+  set_int(env, result, "tail", scan->tail);
+  set_int(env, result, "records", (int64_t) length);
+  void* data = NULL;
+  napi_value buffer;
+  napi_value array;
+  OK(napi_create_arraybuffer(env, length * sizeof(double), &data, &buffer));
+  for (size_t index = 0; index < length; index++) {
+    ((double*) data)[index] = (double) scan->records[index].lsn;
+  }
+  OK(napi_create_typedarray(
+    env,
+    napi_float64_array,
+    length,
+    buffer,
+    0,
+    &array
+  ));
+  OK(napi_set_named_property(env, result, "lsns", array));
+  OK(napi_create_arraybuffer(env, length * sizeof(uint32_t), &data, &buffer));
+  for (size_t index = 0; index < length; index++) {
+    ((uint32_t*) data)[index] = scan->records[index].length;
+  }
+  OK(napi_create_typedarray(
+    env,
+    napi_uint32_array,
+    length,
+    buffer,
+    0,
+    &array
+  ));
+  OK(napi_set_named_property(env, result, "lengths", array));
+}
+
+static void log_scan_cleanup(struct engine* engine) {
+  struct log_scan_data* scan = (struct log_scan_data*) engine;
+  for (int index = 0; index < ENGINE_DEPTH_MAX; index++) {
+    free(scan->workers[index].lsns);
+    free(scan->workers[index].records);
+  }
+  free(scan->chunks);
+  free(scan->records);
+}
+
+static napi_value log_scan(napi_env env, napi_callback_info info) {
+  size_t argc = 4;
+  napi_value argv[4];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  if (
+    argc != 4 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_object(env, argv[1]) ||
+    !arg_progress(env, argv[2]) ||
+    !arg_function(env, argv[3])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, options, onProgress, callback)");
+  }
+  napi_value options = argv[1];
+  int64_t block = LOG_BLOCK_DEFAULT;
+  int64_t segment = LOG_SEGMENT_DEFAULT;
+  int64_t segments = LOG_SEGMENTS_DEFAULT;
+  int64_t io = LOG_SCAN_IO_DEFAULT;
+  const char* error = log_options(env, options, &block, &segment, &segments);
+  if (error) THROW(env, error);
+  if (
+    !option_int64(env, options, "ioSize", &io) ||
+    io < block ||
+    io > ENGINE_BLOCK_MAX ||
+    (io & (io - 1))
+  ) {
+    THROW(env,
+      "options.ioSize must be a power of 2 from options.blockSize to 67108864"
+    );
+  }
+  struct log_scan_data* scan = calloc(1, sizeof(struct log_scan_data));
+  if (!scan) THROW(env, "insufficient memory");
+  struct engine* engine = &scan->engine;
+  error = engine_options(env, options, engine);
+  if (error) {
+    free(scan);
+    THROW(env, error);
+  }
+  scan->log.fd = fd;
+  scan->log.block = block;
+  scan->log.segment = segment;
+  scan->log.segments = segments;
+  // A chunk never spans segments:
+  engine->block = (size_t) (io < segment ? io : segment);
+  engine->start = 0;
+  engine->end = 0;
+  engine->buffers = 2;
+  engine->prepare = log_scan_prepare;
+  engine->run = log_scan_run;
+  engine->finish = log_scan_finish;
+  engine->result = log_scan_result;
+  engine->cleanup = log_scan_cleanup;
+  return engine_queue(env, engine, argv[2], argv[3]);
+}
+
+// A doublewrite protects pages updated in place from being torn by a power
+// loss, where a page is larger than the atomic write unit of the device. A
+// batch of pages is first written, after a header of their positions and
+// checksums, to a preallocated doublewrite area with a single write and a
+// single sync, and only then written in place. After a crash, every page of
+// the last batch in the area is rewritten in place if it differs, which
+// repairs any page torn by the crash. A batch whose copy in the area is not
+// intact was torn before any page was written in place, and is ignored.
+//
+// The header is [0,4) a CRC32C of the header from byte 4 to the end of the
+// entries, [4,8) a magic, [8,12) the page size, [12,16) the number of pages,
+// and then an entry of [0,8) the position and [8,12) a CRC32C of each page,
+// padded to a multiple of the page size, after which come the pages.
+#define DOUBLEWRITE_MAGIC 0x44574231
+#define DOUBLEWRITE_HEADER 16
+#define DOUBLEWRITE_ENTRY 16
+#define DOUBLEWRITE_PAGE_MIN 512
+#define DOUBLEWRITE_PAGE_MAX 1048576
+#define DOUBLEWRITE_PAGE_DEFAULT 16384
+#define DOUBLEWRITE_AREA_DEFAULT 2097152
+
+struct doublewrite_page {
+  int64_t position;
+  const uint8_t* buffer;
+};
+
+struct doublewrite_data {
+  int fd;
+  int area_fd;
+  int64_t area_offset;
+  int64_t area_size;
+  int64_t page;
+  int recover;
+  // The header and the copies of the pages, as written to the area:
+  uint8_t* area;
+  size_t area_length;
+  int64_t pages;
+  int64_t repaired;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static size_t doublewrite_header(int64_t page, int64_t pages) {
+  int64_t length = DOUBLEWRITE_HEADER + pages * DOUBLEWRITE_ENTRY;
+  return (size_t) ((length + page - 1) / page * page);
+}
+
+static const char* doublewrite_options(
+  napi_env env,
+  napi_value options,
+  struct doublewrite_data* work
+) {
+  work->area_fd = work->fd;
+  work->area_offset = 0;
+  work->area_size = DOUBLEWRITE_AREA_DEFAULT;
+  work->page = DOUBLEWRITE_PAGE_DEFAULT;
+  if (
+    !option_int64(env, options, "pageSize", &work->page) ||
+    work->page < DOUBLEWRITE_PAGE_MIN ||
+    work->page > DOUBLEWRITE_PAGE_MAX ||
+    (work->page & (work->page - 1))
+  ) {
+    return "options.pageSize must be a power of 2 from 512 to 1048576";
+  }
+  napi_value value;
+  if (option_value(env, options, "areaFd", &value)) {
+    int fd = 0;
+    if (!arg_int(env, value, &fd)) {
+      return "options.areaFd must be a file descriptor";
+    }
+    work->area_fd = fd;
+  }
+  if (
+    !option_int64(env, options, "areaOffset", &work->area_offset) ||
+    work->area_offset % work->page != 0
+  ) {
+    return "options.areaOffset must be a multiple of options.pageSize";
+  }
+  if (
+    !option_int64(env, options, "areaSize", &work->area_size) ||
+    work->area_size < work->page * 2 ||
+    work->area_size % work->page != 0
+  ) {
+    return "options.areaSize must be at least 2 pages of options.pageSize";
+  }
+  return NULL;
+}
+
+static const char* doublewrite_transfer(
+  int write,
+  int fd,
+  uint8_t* buffer,
+  size_t length,
+  int64_t position
+) {
+  int64_t result = write ?
+    io_write(fd, buffer, length, position) :
+    io_read(fd, buffer, length, position);
+  if (result < 0) {
+    return io_error(
+      result,
+      write ? "unexpected error, write" : "unexpected error, read"
+    );
+  }
+  if ((size_t) result != length) {
+    return write ? "unexpected short write" : "unexpected end of file";
+  }
+  return NULL;
+}
+
+static const char* doublewrite_sync(int fd) {
+  int64_t result = io_fdatasync(fd);
+  if (result < 0) return io_error(result, "unexpected error, fdatasync");
+  return NULL;
+}
+
+// Writes the pages in place from their copies in the area, in order of
+// position. When repairing, only pages which differ are written:
+static const char* doublewrite_apply(
+  struct doublewrite_data* work,
+  uint8_t* scratch
+) {
+  size_t header = doublewrite_header(work->page, work->pages);
+  for (int64_t index = 0; index < work->pages; index++) {
+    uint8_t* entry = work->area + DOUBLEWRITE_HEADER +
+      index * DOUBLEWRITE_ENTRY;
+    int64_t position = (int64_t) format_read_uint64(entry);
+    uint8_t* page = work->area + header + index * work->page;
+    if (scratch) {
+      int64_t result = io_read(
+        work->fd,
+        scratch,
+        (size_t) work->page,
+        position
+      );
+      if (result < 0) return io_error(result, "unexpected error, read");
+      if (
+        result == work->page &&
+        memcmp(scratch, page, (size_t) work->page) == 0
+      ) {
+        continue;
+      }
+      work->repaired++;
+    }
+    const char* error = doublewrite_transfer(
+      1,
+      work->fd,
+      page,
+      (size_t) work->page,
+      position
+    );
+    if (error) return error;
+  }
+  if (scratch && work->repaired == 0) return NULL;
+  return doublewrite_sync(work->fd);
+}
+
+// Loads the last batch from the area, leaving pages at 0 if there is no batch
+// or if its copy in the area is not intact:
+static const char* doublewrite_load(struct doublewrite_data* work) {
+  size_t page = (size_t) work->page;
+  uint8_t* first = aligned_malloc(page, SCRATCH_ALIGNMENT);
+  if (!first) return "insufficient memory";
+  int64_t result = io_read(work->area_fd, first, page, work->area_offset);
+  int64_t pages = 0;
+  if (result < 0) {
+    aligned_free(first);
+    return io_error(result, "unexpected error, read");
+  }
+  if (
+    result == work->page &&
+    format_read_uint32(first + 4) == DOUBLEWRITE_MAGIC &&
+    format_read_uint32(first + 8) == (uint32_t) page
+  ) {
+    pages = (int64_t) format_read_uint32(first + 12);
+  }
+  aligned_free(first);
+  if (pages == 0) return NULL;
+  size_t header = doublewrite_header(work->page, pages);
+  int64_t length = (int64_t) header + pages * work->page;
+  if (length > work->area_size) return NULL;
+  work->area = aligned_malloc((size_t) length, SCRATCH_ALIGNMENT);
+  if (!work->area) return "insufficient memory";
+  work->area_length = (size_t) length;
+  result = io_read(
+    work->area_fd,
+    work->area,
+    work->area_length,
+    work->area_offset
+  );
+  if (result < 0) return io_error(result, "unexpected error, read");
+  if (result != length) return NULL;
+  uint8_t* entries = work->area + DOUBLEWRITE_HEADER;
+  size_t crc_length = DOUBLEWRITE_HEADER - 4 +
+    (size_t) pages * DOUBLEWRITE_ENTRY;
+  if (crc32c(0, work->area + 4, crc_length) != format_read_uint32(work->area)) {
+    return NULL;
+  }
+  for (int64_t index = 0; index < pages; index++) {
+    uint8_t* entry = entries + index * DOUBLEWRITE_ENTRY;
+    uint32_t crc = crc32c(0, work->area + header + index * work->page, page);
+    if (crc != format_read_uint32(entry + 8)) return NULL;
+  }
+  work->pages = pages;
+  return NULL;
+}
+
+// Writes a batch to the area, and then in place:
+static const char* doublewrite_commit(struct doublewrite_data* work) {
+  int64_t result = io_allocate(
+    work->area_fd,
+    work->area_offset + work->area_size
+  );
+  if (result < 0) return io_error(result, "unexpected error, fallocate");
+  // The copies must be durable before any page is written in place:
+  const char* error = doublewrite_transfer(
+    1,
+    work->area_fd,
+    work->area,
+    work->area_length,
+    work->area_offset
+  );
+  if (!error) error = doublewrite_sync(work->area_fd);
+  if (!error) error = doublewrite_apply(work, NULL);
+  return error;
+}
+
+static void doublewrite_execute(napi_env env, void* data) {
+  struct doublewrite_data* work = data;
+  if (work->recover) {
+    work->error = doublewrite_load(work);
+    if (work->error || work->pages == 0) return;
+    uint8_t* scratch = aligned_malloc((size_t) work->page, SCRATCH_ALIGNMENT);
+    if (!scratch) {
+      work->error = "insufficient memory";
+      return;
+    }
+    work->error = doublewrite_apply(work, scratch);
+    aligned_free(scratch);
+    return;
+  }
+  work->error = doublewrite_commit(work);
+}
+
+static void doublewrite_complete(napi_env env, napi_status status, void* data) {
+  struct doublewrite_data* work = data;
+  if (status == napi_cancelled) work->error = "async work was cancelled";
+  int argc = 0;
+  napi_value argv[2];
+  if (work->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, work->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_object(env, &argv[1]));
+    set_int(env, argv[1], "pages", work->pages);
+    if (work->recover) set_int(env, argv[1], "repaired", work->repaired);
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, work->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, work->ref_callback));
+  OK(napi_delete_async_work(env, work->async_work));
+  if (work->area) aligned_free(work->area);
+  free(work);
+}
+
+static void doublewrite_queue(
+  napi_env env,
+  struct doublewrite_data* work,
+  napi_value callback
+) {
+  OK(napi_create_reference(env, callback, 1, &work->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    doublewrite_execute,
+    doublewrite_complete,
+    work,
+    &work->async_work
+  ));
+  OK(napi_queue_async_work(env, work->async_work));
+}
+
+static int doublewrite_page_compare(const void* a, const void* b) {
+  const struct doublewrite_page* x = a;
+  const struct doublewrite_page* y = b;
+  if (x->position < y->position) return -1;
+  if (x->position > y->position) return 1;
+  return 0;
+}
+
+// Copies pages, in order of position, after their header into the area to be
+// written:
+static const char* doublewrite_build(
+  struct doublewrite_data* work,
+  struct doublewrite_page* pages,
+  uint32_t length
+) {
+  qsort(
+    pages,
+    length,
+    sizeof(struct doublewrite_page),
+    doublewrite_page_compare
+  );
+  for (uint32_t index = 1; index < length; index++) {
+    if (pages[index].position == pages[index - 1].position) {
+      return "page positions must be unique";
+    }
+  }
+  size_t header = doublewrite_header(work->page, length);
+  work->area_length = header + (size_t) length * (size_t) work->page;
+  work->area = aligned_malloc(work->area_length, SCRATCH_ALIGNMENT);
+  if (!work->area) return "insufficient memory";
+  memset(work->area, 0, header);
+  format_write_uint32(work->area + 4, DOUBLEWRITE_MAGIC);
+  format_write_uint32(work->area + 8, (uint32_t) work->page);
+  format_write_uint32(work->area + 12, length);
+  for (uint32_t index = 0; index < length; index++) {
+    uint8_t* entry = work->area + DOUBLEWRITE_HEADER +
+      index * DOUBLEWRITE_ENTRY;
+    uint8_t* copy = work->area + header + index * (size_t) work->page;
+    memcpy(copy, pages[index].buffer, (size_t) work->page);
+    format_write_uint64(entry, (uint64_t) pages[index].position);
+    format_write_uint32(entry + 8, crc32c(0, copy, (size_t) work->page));
+  }
+  size_t crc_length = DOUBLEWRITE_HEADER - 4 +
+    (size_t) length * DOUBLEWRITE_ENTRY;
+  format_write_uint32(work->area, crc32c(0, work->area + 4, crc_length));
+  work->pages = length;
+  return NULL;
+}
+
+// Parses and copies an array of pages into the area to be written:
+static const char* doublewrite_pages(
+  napi_env env,
+  napi_value array,
+  struct doublewrite_data* work
+) {
+  uint32_t length = 0;
+  OK(napi_get_array_length(env, array, &length));
+  if (length == 0) return "pages must not be empty";
+  size_t header = doublewrite_header(work->page, length);
+  if ((int64_t) header + length * work->page > work->area_size) {
+    return "pages must fit in options.areaSize with their header";
+  }
+  struct doublewrite_page* pages = calloc(
+    length,
+    sizeof(struct doublewrite_page)
+  );
+  if (!pages) return "insufficient memory";
+  const char* error = NULL;
+  for (uint32_t index = 0; !error && index < length; index++) {
+    napi_value page;
+    napi_value position;
+    napi_value buffer;
+    uint8_t* data = NULL;
+    size_t data_length = 0;
+    OK(napi_get_element(env, array, index, &page));
+    if (
+      !arg_object(env, page) ||
+      !option_value(env, page, "position", &position) ||
+      !option_value(env, page, "buffer", &buffer) ||
+      !arg_int64(env, position, &pages[index].position) ||
+      !arg_buffer(env, buffer, &data, &data_length)
+    ) {
+      error = "pages must be an array of { position, buffer } objects";
+    } else if ((int64_t) data_length != work->page) {
+      error = "page buffers must be options.pageSize bytes";
+    } else if (pages[index].position % work->page != 0) {
+      error = "page positions must be a multiple of options.pageSize";
+    } else if (
+      work->area_fd == work->fd &&
+      pages[index].position < work->area_offset + work->area_size &&
+      pages[index].position + work->page > work->area_offset
+    ) {
+      error = "pages must not overlap the doublewrite area";
+    }
+    pages[index].buffer = data;
+  }
+  if (!error) error = doublewrite_build(work, pages, length);
+  free(pages);
+  return error;
+}
+
+static napi_value doublewrite(napi_env env, napi_callback_info info) {
+  size_t argc = 4;
+  napi_value argv[4];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  bool is_array = false;
+  if (
+    argc != 4 ||
+    !arg_int(env, argv[0], &fd) ||
+    napi_is_array(env, argv[1], &is_array) != napi_ok ||
+    !is_array ||
+    !arg_object(env, argv[2]) ||
+    !arg_function(env, argv[3])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, pages, options, callback)");
+  }
+  struct doublewrite_data* work = calloc(1, sizeof(struct doublewrite_data));
+  if (!work) THROW(env, "insufficient memory");
+  work->fd = fd;
+  const char* error = doublewrite_options(env, argv[2], work);
+  if (!error) error = doublewrite_pages(env, argv[1], work);
+  if (error) {
+    if (work->area) aligned_free(work->area);
+    free(work);
+    THROW(env, error);
+  }
+  doublewrite_queue(env, work, argv[3]);
+  return NULL;
+}
+
+static napi_value doublewrite_recover(
+  napi_env env,
+  napi_callback_info info
+) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  if (
+    argc != 3 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_object(env, argv[1]) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, options, callback)");
+  }
+  struct doublewrite_data* work = calloc(1, sizeof(struct doublewrite_data));
+  if (!work) THROW(env, "insufficient memory");
+  work->fd = fd;
+  work->recover = 1;
+  const char* error = doublewrite_options(env, argv[1], work);
+  if (error) {
+    free(work);
+    THROW(env, error);
+  }
+  doublewrite_queue(env, work, argv[2]);
+  return NULL;
+}
+
+// An allocator manages the free space of a block device or regular file in
+// units of unitSize bytes, with a bitmap of one bit per unit, set if the unit
+// is allocated. A second level, of one bit per word of the bitmap set if the
+// word is wholly allocated, lets a search skip allocated space 64 units (or
+// 4096 units) at a time. Allocation is first fit, of a run of units aligned
+// to a power of 2, so that extents can be aligned to the physical sector size
+// and to the optimal I/O size of the device (see getBlockDevice()). A unit may
+// not be smaller than the physical sector, or an extent could share a sector
+// with another, and a write of either would read-modify-write the other.
+//
+// The bitmap is persisted in 4096-byte blocks after a superblock and a
+// journal, at the start of the device, and is synced through the journal as a
+// doublewrite, so that a block of the bitmap is never torn. The space freed
+// since the last sync is not allocated again until the sync has made the free
+// durable, so that a crash can never leave space allocated twice.
+#define ALLOCATOR_MAGIC 0x414c4331
+#define ALLOCATOR_BLOCK 4096
+#define ALLOCATOR_BLOCK_WORDS (ALLOCATOR_BLOCK / 8)
+#define ALLOCATOR_UNIT_MIN 512
+#define ALLOCATOR_UNIT_MAX 16777216
+#define ALLOCATOR_UNIT_DEFAULT 4096
+#define ALLOCATOR_JOURNAL_MIN 16384
+#define ALLOCATOR_JOURNAL_DEFAULT 1048576
+
+static const napi_type_tag ALLOCATOR_TYPE_TAG = {
+  0x616c6c6f63617401ULL, 0x5c1e0b8a9d4f2736ULL
+};
+
+struct allocator_range {
+  int64_t unit;
+  int64_t count;
+};
+
+struct allocator {
+  int fd;
+  int64_t size;
+  int64_t unit;
+  int64_t units;
+  int64_t journal;
+  int64_t blocks;
+  // The units before reserved hold the superblock, journal and bitmap:
+  int64_t reserved;
+  // The bitmap searched for allocations, in which freed units stay set until
+  // the free is durable, the bitmap as it is to be persisted, and the second
+  // level of the bitmap searched for allocations:
+  uint64_t* bits;
+  uint64_t* disk;
+  uint64_t* full;
+  int64_t words;
+  int64_t free;
+  uint8_t* dirty;
+  struct allocator_range* pending;
+  size_t pending_length;
+  size_t pending_capacity;
+  // A sync in flight holds a reference to the allocator. Syncs requested in
+  // the meantime wait for the next:
+  int syncing;
+  napi_ref* waiting;
+  size_t waiting_length;
+  size_t waiting_capacity;
+};
+
+static int allocator_ctz(uint64_t word) {
+  assert(word != 0);
+#if defined(_MSC_VER)
+  unsigned long index = 0;
+  _BitScanForward64(&index, word);
+  return (int) index;
+#else
+  return __builtin_ctzll(word);
+#endif
+}
+
+static int64_t allocator_bitmap(struct allocator* allocator) {
+  return ALLOCATOR_BLOCK + allocator->journal;
+}
+
+// Returns the first unit from a unit up to a limit whose bit in a map has a
+// value, or the limit:
+static int64_t allocator_scan(
+  struct allocator* allocator,
+  const uint64_t* map,
+  int64_t unit,
+  int value,
+  int64_t limit
+) {
+  while (unit < limit) {
+    int64_t word = unit / 64;
+    if (!value && map == allocator->bits) {
+      uint64_t full = allocator->full[word / 64];
+      if ((unit & 4095) == 0 && full == ~0ULL) {
+        unit += 4096;
+        continue;
+      }
+      if ((unit & 63) == 0 && ((full >> (word & 63)) & 1)) {
+        unit += 64;
+        continue;
+      }
+    }
+    uint64_t bits = value ? map[word] : ~map[word];
+    bits &= ~0ULL << (unit & 63);
+    if (bits) {
+      int64_t found = word * 64 + allocator_ctz(bits);
+      return found < limit ? found : limit;
+    }
+    unit = (word + 1) * 64;
+  }
+  return limit;
+}
+
+// Sets or clears a run of units in a map, keeping the second level, the count
+// of free units, and the dirty blocks up to date:
+static void allocator_update(
+  struct allocator* allocator,
+  uint64_t* map,
+  int64_t unit,
+  int64_t count,
+  int set
+) {
+  int64_t end = unit + count;
+  while (unit < end) {
+    int64_t word = unit / 64;
+    int shift = (int) (unit & 63);
+    int64_t bits = end - unit < 64 - shift ? end - unit : 64 - shift;
+    uint64_t mask = (bits == 64 ? ~0ULL : (1ULL << bits) - 1) << shift;
+    if (map == allocator->bits) {
+      uint64_t before = map[word];
+      map[word] = set ? before | mask : before & ~mask;
+      uint64_t flipped = before ^ map[word];
+      int64_t changed = (int64_t) simd.popcount((const uint8_t*) &flipped, 8);
+      allocator->free += set ? -changed : changed;
+      uint64_t bit = 1ULL << (word & 63);
+      if (map[word] == ~0ULL) {
+        allocator->full[word / 64] |= bit;
+      } else {
+        allocator->full[word / 64] &= ~bit;
+      }
+    } else {
+      map[word] = set ? map[word] | mask : map[word] & ~mask;
+      allocator->dirty[word / ALLOCATOR_BLOCK_WORDS] = 1;
+    }
+    unit += bits;
+  }
+}
+
+// Returns the first unit of a free run of count units aligned to align units,
+// or -1 if there is none:
+static int64_t allocator_find(
+  struct allocator* allocator,
+  int64_t count,
+  int64_t align
+) {
+  int64_t unit = 0;
+  for (;;) {
+    unit = allocator_scan(
+      allocator,
+      allocator->bits,
+      unit,
+      0,
+      allocator->units
+    );
+    unit = (unit + align - 1) / align * align;
+    if (unit + count > allocator->units) return -1;
+    int64_t end = allocator_scan(
+      allocator,
+      allocator->bits,
+      unit,
+      1,
+      unit + count
+    );
+    if (end == unit + count) return unit;
+    unit = end;
+  }
+}
+
+static const char* allocator_alloc(struct allocator* allocator) {
+  allocator->blocks = (allocator->units + ALLOCATOR_BLOCK * 8 - 1) /
+    (ALLOCATOR_BLOCK * 8);
+  allocator->words = allocator->blocks * ALLOCATOR_BLOCK_WORDS;
+  size_t bytes = (size_t) (allocator->blocks * ALLOCATOR_BLOCK);
+  int64_t metadata = allocator_bitmap(allocator) + (int64_t) bytes;
+  allocator->reserved = (metadata + allocator->unit - 1) / allocator->unit;
+  allocator->bits = aligned_malloc(bytes, SCRATCH_ALIGNMENT);
+  allocator->disk = aligned_malloc(bytes, SCRATCH_ALIGNMENT);
+  allocator->full = calloc((size_t) (allocator->words + 63) / 64, 8);
+  allocator->dirty = calloc((size_t) allocator->blocks, 1);
+  if (
+    !allocator->bits ||
+    !allocator->disk ||
+    !allocator->full ||
+    !allocator->dirty
+  ) {
+    return "insufficient memory";
+  }
+  return NULL;
+}
+
+// Builds the bitmap searched for allocations from the bitmap as persisted:
+static void allocator_load(struct allocator* allocator) {
+  size_t bytes = (size_t) (allocator->words * 8);
+  memcpy(allocator->bits, allocator->disk, bytes);
+  allocator->free = allocator->words * 64 -
+    (int64_t) simd.popcount((const uint8_t*) allocator->bits, bytes);
+  for (int64_t word = 0; word < allocator->words; word++) {
+    if (allocator->bits[word] == ~0ULL) {
+      allocator->full[word / 64] |= 1ULL << (word & 63);
+    }
+  }
+}
+
+static void allocator_free(struct allocator* allocator) {
+  assert(!allocator->syncing);
+  assert(allocator->waiting_length == 0);
+  if (allocator->bits) aligned_free(allocator->bits);
+  if (allocator->disk) aligned_free(allocator->disk);
+  free(allocator->full);
+  free(allocator->dirty);
+  free(allocator->pending);
+  free(allocator->waiting);
+  free(allocator);
+}
+
+static void allocator_finalize(napi_env env, void* data, void* hint) {
+  allocator_free(data);
+}
+
+static int arg_allocator(
+  napi_env env,
+  napi_value value,
+  struct allocator** allocator
+) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  if (type != napi_external) return 0;
+  bool tagged = false;
+  OK(napi_check_object_type_tag(env, value, &ALLOCATOR_TYPE_TAG, &tagged));
+  if (!tagged) return 0;
+  OK(napi_get_value_external(env, value, (void**) allocator));
+  return 1;
+}
+
+struct allocator_open_data {
+  struct allocator* allocator;
+  int format;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static const char* allocator_transfer(
+  struct allocator* allocator,
+  int write,
+  uint8_t* buffer,
+  size_t length,
+  int64_t position
+) {
+  return doublewrite_transfer(write, allocator->fd, buffer, length, position);
+}
+
+// Writes an empty journal, the bitmap with the metadata and the units past
+// the end allocated, and lastly the superblock:
+static const char* allocator_format(struct allocator* allocator) {
+  int64_t size = 0;
+  const char* error = io_size(allocator->fd, &size);
+  if (error) return error;
+  if (allocator->size == 0) allocator->size = size;
+  int64_t logical = 0;
+  int64_t physical = 0;
+  int64_t device = 0;
+  error = volume_probe(allocator->fd, &device, &logical, &physical);
+  if (error) return error;
+  if (allocator->unit < physical || allocator->unit < logical) {
+    return "options.unitSize must be at least the physical sector size";
+  }
+  allocator->units = allocator->size / allocator->unit;
+  if (allocator->units == 0) return "size must be at least one unit";
+  error = allocator_alloc(allocator);
+  if (error) return error;
+  if (allocator->reserved >= allocator->units) {
+    return "size is too small for the metadata of the allocator";
+  }
+  int64_t result = io_extend(allocator->fd, allocator->size);
+  if (result < 0) return io_error(result, "unexpected error, ftruncate");
+  io_size(allocator->fd, &size);
+  if (size < allocator->size) return "size must not exceed the device size";
+  memset(allocator->disk, 0, (size_t) (allocator->words * 8));
+  allocator_update(allocator, allocator->disk, 0, allocator->reserved, 1);
+  allocator_update(
+    allocator,
+    allocator->disk,
+    allocator->units,
+    allocator->words * 64 - allocator->units,
+    1
+  );
+  memset(allocator->dirty, 0, (size_t) allocator->blocks);
+  uint8_t* block = aligned_malloc(ALLOCATOR_BLOCK, SCRATCH_ALIGNMENT);
+  if (!block) return "insufficient memory";
+  memset(block, 0, ALLOCATOR_BLOCK);
+  // A batch left in the journal by a previous format must not be replayed:
+  error = allocator_transfer(allocator, 1, block, ALLOCATOR_BLOCK, 4096);
+  if (!error) {
+    error = allocator_transfer(
+      allocator,
+      1,
+      (uint8_t*) allocator->disk,
+      (size_t) (allocator->blocks * ALLOCATOR_BLOCK),
+      allocator_bitmap(allocator)
+    );
+  }
+  if (!error) error = doublewrite_sync(allocator->fd);
+  if (!error) {
+    format_write_uint32(block + 4, ALLOCATOR_MAGIC);
+    format_write_uint64(block + 8, (uint64_t) allocator->size);
+    format_write_uint64(block + 16, (uint64_t) allocator->unit);
+    format_write_uint64(block + 24, (uint64_t) allocator->journal);
+    format_write_uint32(block, crc32c(0, block + 4, ALLOCATOR_BLOCK - 4));
+    error = allocator_transfer(allocator, 1, block, ALLOCATOR_BLOCK, 0);
+  }
+  if (!error) error = doublewrite_sync(allocator->fd);
+  aligned_free(block);
+  return error;
+}
+
+// Reads the superblock, repairs the bitmap from the journal, and reads the
+// bitmap:
+static const char* allocator_read(struct allocator* allocator) {
+  uint8_t* block = aligned_malloc(ALLOCATOR_BLOCK, SCRATCH_ALIGNMENT);
+  if (!block) return "insufficient memory";
+  int64_t result = io_read(allocator->fd, block, ALLOCATOR_BLOCK, 0);
+  const char* error = NULL;
+  if (result < 0) {
+    error = io_error(result, "unexpected error, read");
+  } else if (
+    result != ALLOCATOR_BLOCK ||
+    format_read_uint32(block + 4) != ALLOCATOR_MAGIC ||
+    format_read_uint32(block) != crc32c(0, block + 4, ALLOCATOR_BLOCK - 4)
+  ) {
+    error = "fd does not have an allocator, use options.format";
+  } else {
+    allocator->size = (int64_t) format_read_uint64(block + 8);
+    allocator->unit = (int64_t) format_read_uint64(block + 16);
+    allocator->journal = (int64_t) format_read_uint64(block + 24);
+    allocator->units = allocator->size / allocator->unit;
+  }
+  aligned_free(block);
+  if (error) return error;
+  struct doublewrite_data journal;
+  memset(&journal, 0, sizeof(journal));
+  journal.fd = allocator->fd;
+  journal.area_fd = allocator->fd;
+  journal.area_offset = ALLOCATOR_BLOCK;
+  journal.area_size = allocator->journal;
+  journal.page = ALLOCATOR_BLOCK;
+  error = doublewrite_load(&journal);
+  if (!error && journal.pages > 0) {
+    uint8_t* scratch = aligned_malloc(ALLOCATOR_BLOCK, SCRATCH_ALIGNMENT);
+    if (scratch) {
+      error = doublewrite_apply(&journal, scratch);
+      aligned_free(scratch);
+    } else {
+      error = "insufficient memory";
+    }
+  }
+  if (journal.area) aligned_free(journal.area);
+  if (!error) error = allocator_alloc(allocator);
+  if (!error) {
+    error = allocator_transfer(
+      allocator,
+      0,
+      (uint8_t*) allocator->disk,
+      (size_t) (allocator->blocks * ALLOCATOR_BLOCK),
+      allocator_bitmap(allocator)
+    );
+  }
+  return error;
+}
+
+static void allocator_open_execute(napi_env env, void* data) {
+  struct allocator_open_data* work = data;
+  struct allocator* allocator = work->allocator;
+  if (work->format) {
+    work->error = allocator_format(allocator);
+  } else {
+    work->error = allocator_read(allocator);
+  }
+  if (!work->error) allocator_load(allocator);
+}
+
+static void allocator_open_complete(
+  napi_env env,
+  napi_status status,
+  void* data
+) {
+  struct allocator_open_data* work = data;
+  if (status == napi_cancelled) work->error = "async work was cancelled";
+  int argc = 0;
+  napi_value argv[2];
+  if (work->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, work->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+    allocator_free(work->allocator);
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_external(
+      env,
+      work->allocator,
+      allocator_finalize,
+      NULL,
+      &argv[1]
+    ));
+    OK(napi_type_tag_object(env, argv[1], &ALLOCATOR_TYPE_TAG));
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, work->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, work->ref_callback));
+  OK(napi_delete_async_work(env, work->async_work));
+  free(work);
+}
+
+static napi_value allocator_open(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  if (
+    argc != 3 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_object(env, argv[1]) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, options, callback)");
+  }
+  napi_value options = argv[1];
+  int format = 0;
+  int64_t size = 0;
+  int64_t unit = ALLOCATOR_UNIT_DEFAULT;
+  int64_t journal = ALLOCATOR_JOURNAL_DEFAULT;
+  napi_value value;
+  if (!option_bool(env, options, "format", &format)) {
+    THROW(env, "options.format must be a boolean");
+  }
+  if (
+    !format && (
+      option_value(env, options, "size", &value) ||
+      option_value(env, options, "unitSize", &value) ||
+      option_value(env, options, "journalSize", &value)
+    )
+  ) {
+    THROW(env,
+      "options.size, options.unitSize and options.journalSize require "
+      "options.format"
+    );
+  }
+  if (
+    !option_int64(env, options, "unitSize", &unit) ||
+    unit < ALLOCATOR_UNIT_MIN ||
+    unit > ALLOCATOR_UNIT_MAX ||
+    (unit & (unit - 1))
+  ) {
+    THROW(env, "options.unitSize must be a power of 2 from 512 to 16777216");
+  }
+  if (!option_int64(env, options, "size", &size) || size % unit != 0) {
+    THROW(env, "options.size must be a multiple of options.unitSize");
+  }
+  if (
+    !option_int64(env, options, "journalSize", &journal) ||
+    journal < ALLOCATOR_JOURNAL_MIN ||
+    journal % ALLOCATOR_BLOCK != 0
+  ) {
+    THROW(env,
+      "options.journalSize must be a multiple of 4096 of at least 16384"
+    );
+  }
+  struct allocator* allocator = calloc(1, sizeof(struct allocator));
+  if (!allocator) THROW(env, "insufficient memory");
+  allocator->fd = fd;
+  allocator->size = size;
+  allocator->unit = unit;
+  allocator->journal = journal;
+  struct allocator_open_data* work = calloc(
+    1,
+    sizeof(struct allocator_open_data)
+  );
+  if (!work) {
+    allocator_free(allocator);
+    THROW(env, "insufficient memory");
+  }
+  work->allocator = allocator;
+  work->format = format;
+  OK(napi_create_reference(env, argv[2], 1, &work->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    allocator_open_execute,
+    allocator_open_complete,
+    work,
+    &work->async_work
+  ));
+  OK(napi_queue_async_work(env, work->async_work));
+  return NULL;
+}
+
+static napi_value allocator_allocate(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct allocator* allocator = NULL;
+  int64_t length = 0;
+  if (
+    argc != 3 ||
+    !arg_allocator(env, argv[0], &allocator) ||
+    !arg_int64(env, argv[1], &length) ||
+    !arg_object(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (allocator, length, options)");
+  }
+  int64_t alignment = allocator->unit;
+  if (
+    !option_int64(env, argv[2], "alignment", &alignment) ||
+    alignment < allocator->unit ||
+    (alignment & (alignment - 1))
+  ) {
+    THROW(env,
+      "options.alignment must be a power of 2 and a multiple of the unit size"
+    );
+  }
+  if (length == 0) THROW(env, "length must not be 0");
+  int64_t count = (length + allocator->unit - 1) / allocator->unit;
+  int64_t unit = allocator_find(
+    allocator,
+    count,
+    alignment / allocator->unit
+  );
+  if (unit < 0) THROW(env, "insufficient contiguous free space");
+  allocator_update(allocator, allocator->bits, unit, count, 1);
+  allocator_update(allocator, allocator->disk, unit, count, 1);
+  napi_value result;
+  OK(napi_create_int64(env, unit * allocator->unit, &result));
+  return result;
+}
+
+static napi_value allocator_release(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct allocator* allocator = NULL;
+  int64_t offset = 0;
+  int64_t length = 0;
+  if (
+    argc != 3 ||
+    !arg_allocator(env, argv[0], &allocator) ||
+    !arg_int64(env, argv[1], &offset) ||
+    !arg_int64(env, argv[2], &length)
+  ) {
+    THROW(env, "bad arguments, expected: (allocator, offset, length)");
+  }
+  if (offset % allocator->unit != 0) {
+    THROW(env, "offset must be a multiple of the unit size");
+  }
+  if (length == 0) THROW(env, "length must not be 0");
+  int64_t unit = offset / allocator->unit;
+  int64_t count = (length + allocator->unit - 1) / allocator->unit;
+  if (unit + count > allocator->units) {
+    THROW(env, "offset + length must not exceed the size of the allocator");
+  }
+  if (unit < allocator->reserved) {
+    THROW(env, "range must not overlap the metadata of the allocator");
+  }
+  if (
+    allocator_scan(allocator, allocator->disk, unit, 0, unit + count) !=
+    unit + count
+  ) {
+    THROW(env, "range is not allocated");
+  }
+  if (allocator->pending_length == allocator->pending_capacity) {
+    size_t capacity = allocator->pending_capacity * 2;
+    if (capacity == 0) capacity = 64;
+    struct allocator_range* pending = realloc(
+      allocator->pending,
+      capacity * sizeof(struct allocator_range)
+    );
+    if (!pending) THROW(env, "insufficient memory");
+    allocator->pending = pending;
+    allocator->pending_capacity = capacity;
+  }
+  allocator->pending[allocator->pending_length].unit = unit;
+  allocator->pending[allocator->pending_length].count = count;
+  allocator->pending_length++;
+  allocator_update(allocator, allocator->disk, unit, count, 0);
+  return NULL;
+}
+
+struct allocator_sync_data {
+  struct allocator* allocator;
+  // The dirty blocks, in batches which each fit the journal:
+  struct doublewrite_data* batches;
+  size_t batches_length;
+  int64_t* blocks;
+  size_t blocks_length;
+  size_t pending;
+  napi_ref* callbacks;
+  size_t callbacks_length;
+  napi_ref ref_allocator;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static void allocator_sync_execute(napi_env env, void* data) {
+  struct allocator_sync_data* sync = data;
+  for (size_t index = 0; index < sync->batches_length; index++) {
+    sync->error = doublewrite_commit(&sync->batches[index]);
+    if (sync->error) break;
+  }
+}
+
+// Calls every waiting callback with an error:
+static void allocator_sync_fail(
+  napi_env env,
+  struct allocator* allocator,
+  const char* error
+) {
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value message;
+  OK(napi_create_string_utf8(env, error, NAPI_AUTO_LENGTH, &message));
+  napi_value argv[1];
+  OK(napi_create_error(env, NULL, message, &argv[0]));
+  napi_ref* waiting = allocator->waiting;
+  size_t waiting_length = allocator->waiting_length;
+  allocator->waiting = NULL;
+  allocator->waiting_length = 0;
+  allocator->waiting_capacity = 0;
+  for (size_t index = 0; index < waiting_length; index++) {
+    napi_value callback;
+    OK(napi_get_reference_value(env, waiting[index], &callback));
+    napi_call_function(env, scope, callback, 1, argv, NULL);
+    OK(napi_delete_reference(env, waiting[index]));
+  }
+  free(waiting);
+}
+
+static void allocator_sync_free(struct allocator_sync_data* sync) {
+  for (size_t index = 0; index < sync->batches_length; index++) {
+    if (sync->batches[index].area) aligned_free(sync->batches[index].area);
+  }
+  free(sync->batches);
+  free(sync->blocks);
+  free(sync->callbacks);
+  free(sync);
+}
+
+static const char* allocator_sync_start(napi_env env, napi_value value);
+
+static void allocator_sync_complete(
+  napi_env env,
+  napi_status status,
+  void* data
+) {
+  struct allocator_sync_data* sync = data;
+  struct allocator* allocator = sync->allocator;
+  if (status == napi_cancelled) sync->error = "async work was cancelled";
+  if (sync->error) {
+    // The blocks must be written again by the next sync:
+    for (size_t index = 0; index < sync->blocks_length; index++) {
+      allocator->dirty[sync->blocks[index]] = 1;
+    }
+  } else {
+    // Space freed before the sync may now be allocated again:
+    for (size_t index = 0; index < sync->pending; index++) {
+      struct allocator_range* range = &allocator->pending[index];
+      allocator_update(
+        allocator,
+        allocator->bits,
+        range->unit,
+        range->count,
+        0
+      );
+    }
+    allocator->pending_length -= sync->pending;
+    memmove(
+      allocator->pending,
+      allocator->pending + sync->pending,
+      allocator->pending_length * sizeof(struct allocator_range)
+    );
+  }
+  allocator->syncing = 0;
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value error;
+  if (sync->error) {
+    napi_value message;
+    OK(napi_create_string_utf8(env, sync->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &error));
+  } else {
+    OK(napi_get_undefined(env, &error));
+  }
+  napi_value value;
+  OK(napi_get_reference_value(env, sync->ref_allocator, &value));
+  for (size_t index = 0; index < sync->callbacks_length; index++) {
+    napi_value callback;
+    OK(napi_get_reference_value(env, sync->callbacks[index], &callback));
+    napi_call_function(env, scope, callback, 1, &error, NULL);
+    OK(napi_delete_reference(env, sync->callbacks[index]));
+  }
+  if (allocator->waiting_length > 0) {
+    const char* restart = allocator_sync_start(env, value);
+    if (restart) allocator_sync_fail(env, allocator, restart);
+  }
+  OK(napi_delete_reference(env, sync->ref_allocator));
+  OK(napi_delete_async_work(env, sync->async_work));
+  allocator_sync_free(sync);
+}
+
+// Snapshots the dirty blocks of the bitmap into batches for the journal, and
+// queues a sync for every waiting callback:
+static const char* allocator_sync_start(napi_env env, napi_value value) {
+  struct allocator* allocator = NULL;
+  int tagged = arg_allocator(env, value, &allocator);
+  assert(tagged);
+  assert(!allocator->syncing);
+  size_t dirty = 0;
+  for (int64_t block = 0; block < allocator->blocks; block++) {
+    if (allocator->dirty[block]) dirty++;
+  }
+  // The number of blocks which fit the journal with their header:
+  int64_t capacity = allocator->journal / ALLOCATOR_BLOCK;
+  while (
+    (int64_t) doublewrite_header(ALLOCATOR_BLOCK, capacity) +
+    capacity * ALLOCATOR_BLOCK > allocator->journal
+  ) {
+    capacity--;
+  }
+  assert(capacity > 0);
+  size_t batches = (dirty + (size_t) capacity - 1) / (size_t) capacity;
+  struct allocator_sync_data* sync = calloc(
+    1,
+    sizeof(struct allocator_sync_data)
+  );
+  if (!sync) return "insufficient memory";
+  struct doublewrite_page* pages = calloc(
+    dirty + 1,
+    sizeof(struct doublewrite_page)
+  );
+  sync->blocks = calloc(dirty + 1, sizeof(int64_t));
+  sync->batches = calloc(batches + 1, sizeof(struct doublewrite_data));
+  if (!pages || !sync->blocks || !sync->batches) {
+    free(pages);
+    allocator_sync_free(sync);
+    return "insufficient memory";
+  }
+  for (int64_t block = 0; block < allocator->blocks; block++) {
+    if (!allocator->dirty[block]) continue;
+    pages[sync->blocks_length].position = allocator_bitmap(allocator) +
+      block * ALLOCATOR_BLOCK;
+    pages[sync->blocks_length].buffer = (const uint8_t*) (
+      allocator->disk + block * ALLOCATOR_BLOCK_WORDS
+    );
+    sync->blocks[sync->blocks_length++] = block;
+  }
+  const char* error = NULL;
+  for (size_t index = 0; !error && index < batches; index++) {
+    struct doublewrite_data* batch = &sync->batches[index];
+    size_t start = index * (size_t) capacity;
+    size_t length = dirty - start < (size_t) capacity ?
+      dirty - start :
+      (size_t) capacity;
+    batch->fd = allocator->fd;
+    batch->area_fd = allocator->fd;
+    batch->area_offset = ALLOCATOR_BLOCK;
+    batch->area_size = allocator->journal;
+    batch->page = ALLOCATOR_BLOCK;
+    error = doublewrite_build(batch, pages + start, (uint32_t) length);
+    sync->batches_length++;
+  }
+  free(pages);
+  if (error) {
+    allocator_sync_free(sync);
+    return error;
+  }
+  // The blocks are clean once copied, so that any change from now on is
+  // written by the next sync:
+  for (size_t index = 0; index < sync->blocks_length; index++) {
+    allocator->dirty[sync->blocks[index]] = 0;
+  }
+  sync->allocator = allocator;
+  sync->pending = allocator->pending_length;
+  sync->callbacks = allocator->waiting;
+  sync->callbacks_length = allocator->waiting_length;
+  allocator->waiting = NULL;
+  allocator->waiting_length = 0;
+  allocator->waiting_capacity = 0;
+  allocator->syncing = 1;
+  OK(napi_create_reference(env, value, 1, &sync->ref_allocator));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    allocator_sync_execute,
+    allocator_sync_complete,
+    sync,
+    &sync->async_work
+  ));
+  OK(napi_queue_async_work(env, sync->async_work));
+  return NULL;
+}
+
+static napi_value allocator_sync(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct allocator* allocator = NULL;
+  if (
+    argc != 2 ||
+    !arg_allocator(env, argv[0], &allocator) ||
+    !arg_function(env, argv[1])
+  ) {
+    THROW(env, "bad arguments, expected: (allocator, callback)");
+  }
+  if (allocator->waiting_length == allocator->waiting_capacity) {
+    size_t capacity = allocator->waiting_capacity * 2;
+    if (capacity == 0) capacity = 8;
+    napi_ref* waiting = realloc(
+      allocator->waiting,
+      capacity * sizeof(napi_ref)
+    );
+    if (!waiting) THROW(env, "insufficient memory");
+    allocator->waiting = waiting;
+    allocator->waiting_capacity = capacity;
+  }
+  OK(napi_create_reference(
+    env,
+    argv[1],
+    1,
+    &allocator->waiting[allocator->waiting_length++]
+  ));
+  if (!allocator->syncing) {
+    const char* error = allocator_sync_start(env, argv[0]);
+    if (error) {
+      allocator->waiting_length--;
+      napi_ref ref = allocator->waiting[allocator->waiting_length];
+      OK(napi_delete_reference(env, ref));
+      THROW(env, error);
+    }
+  }
+  return NULL;
+}
+
+static napi_value allocator_stats(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct allocator* allocator = NULL;
+  if (argc != 1 || !arg_allocator(env, argv[0], &allocator)) {
+    THROW(env, "bad arguments, expected: (allocator)");
+  }
+  int64_t extents = 0;
+  int64_t largest = 0;
+  int64_t unit = 0;
+  for (;;) {
+    unit = allocator_scan(
+      allocator,
+      allocator->bits,
+      unit,
+      0,
+      allocator->units
+    );
+    if (unit == allocator->units) break;
+    int64_t end = allocator_scan(
+      allocator,
+      allocator->bits,
+      unit,
+      1,
+      allocator->units
+    );
+    extents++;
+    if (end - unit > largest) largest = end - unit;
+    unit = end;
+  }
+  int64_t pending = 0;
+  for (size_t index = 0; index < allocator->pending_length; index++) {
+    pending += allocator->pending[index].count;
+  }
+  int64_t dirty = 0;
+  for (int64_t block = 0; block < allocator->blocks; block++) {
+    dirty += allocator->dirty[block];
+  }
+  napi_value result;
+  OK(napi_create_object(env, &result));
+  set_int(env, result, "size", allocator->units * allocator->unit);
+  set_int(env, result, "unitSize", allocator->unit);
+  set_int(env, result, "metadataBytes", allocator->reserved * allocator->unit);
+  set_int(
+    env,
+    result,
+    "allocatedBytes",
+    (allocator->units - allocator->free - pending) * allocator->unit
+  );
+  set_int(env, result, "freeBytes", allocator->free * allocator->unit);
+  set_int(env, result, "pendingBytes", pending * allocator->unit);
+  set_int(env, result, "freeExtents", extents);
+  set_int(env, result, "largestFreeExtent", largest * allocator->unit);
+  set_number(
+    env,
+    result,
+    "fragmentation",
+    allocator->free > 0 ? 1 - (double) largest / (double) allocator->free : 0
+  );
+  set_int(env, result, "dirtyBlocks", dirty);
+  return result;
+}
+
+// A slot store splits a block device or regular file into fixed-size slots,
+// each holding one record of up to slotSize - 32 bytes after a header, so
+// that slot i is at position (i + 1) * slotSize, and a get or put of a record
+// is a single aligned I/O. The first slot holds a superblock. A slot header
+// has [0,4) a CRC32C of the rest of the header and the record, [4,8) a magic,
+// [8,16) the generation of the store, [16,20) the length of the record and
+// [20,32) zeroes. A slot is free unless its header is intact, so that a format
+// need only write a superblock of a new generation, and a free need only write
+// a sector of zeroes.
+//
+// Which slots are in use is not persisted, but found by a scan of the slots
+// when the store is opened, since the headers are authoritative. So that the
+// scan need not read every slot of a large device, the superblock has [0,4) a
+// CRC32C of [4,512), [4,8) a magic, [8,16) the generation, [16,24) the slot
+// size, [24,32) the number of slots and [32,40) a high-water mark, below which
+// every slot ever put since the format lies. A put above the mark first raises
+// it, by a quarter more than needed, so that the superblock is written only a
+// logarithmic number of times, and the scan reads no more than 5/4 of the
+// slots ever put.
+#define SLOT_MAGIC 0x534c5431
+#define SLOT_SUPER_MAGIC 0x534c5453
+#define SLOT_HEADER 32
+#define SLOT_SIZE_MIN 512
+#define SLOT_SIZE_MAX 16777216
+#define SLOT_SIZE_DEFAULT 4096
+#define SLOT_SCAN 1048576
+#define SLOT_GET 0
+#define SLOT_PUT 1
+#define SLOT_FREE 2
+
+static const napi_type_tag SLOT_TYPE_TAG = {
+  0x736c6f7473746f01ULL, 0x2b9e4d17c0a35f68ULL
+};
+
+struct slot_store {
+  int fd;
+  int64_t slot;
+  int64_t slots;
+  int64_t sector;
+  uint64_t generation;
+  int depth;
+  // The high-water mark of the superblock, raised under the mutex:
+  int64_t mark;
+  uv_mutex_t mutex;
+  // One bit per slot, set if the slot is allocated or being freed:
+  uint64_t* used;
+  int64_t used_count;
+  int64_t cursor;
+  // Slots found by the scan with an intact magic but a corrupt record:
+  int64_t corrupt;
+  int64_t gets;
+  int64_t puts;
+  int64_t frees;
+};
+
+struct slot_batch;
+
+struct slot_part {
+  struct slot_batch* batch;
+  size_t start;
+  size_t end;
+  napi_async_work async_work;
+  const char* error;
+};
+
+struct slot_batch {
+  napi_env env;
+  struct slot_store* store;
+  int op;
+  size_t length;
+  int64_t* slots;
+  // The offset and length of each record within the buffer, where the length
+  // of a record which was got is -1 if the slot is free, and -2 if corrupt:
+  size_t* offsets;
+  int64_t* lengths;
+  uint8_t* buffer;
+  size_t buffer_length;
+  int outstanding;
+  const char* error;
+  int parts_length;
+  struct slot_part parts[ENGINE_DEPTH_MAX];
+  napi_ref ref_store;
+  napi_ref ref_callback;
+};
+
+static int64_t slot_position(struct slot_store* store, int64_t slot) {
+  return (slot + 1) * store->slot;
+}
+
+static int slot_used(struct slot_store* store, int64_t slot) {
+  return (store->used[slot / 64] >> (slot & 63)) & 1;
+}
+
+static void slot_mark(struct slot_store* store, int64_t slot, int used) {
+  uint64_t bit = 1ULL << (slot & 63);
+  assert(slot_used(store, slot) != used);
+  if (used) {
+    store->used[slot / 64] |= bit;
+    store->used_count++;
+  } else {
+    store->used[slot / 64] &= ~bit;
+    store->used_count--;
+  }
+}
+
+// Returns the length of the record in a slot, -1 if the slot is free, or -2
+// if the header is intact but the record is corrupt:
+static int64_t slot_check(struct slot_store* store, const uint8_t* slot) {
+  if (
+    format_read_uint32(slot + 4) != SLOT_MAGIC ||
+    format_read_uint64(slot + 8) != store->generation
+  ) {
+    return -1;
+  }
+  int64_t length = (int64_t) format_read_uint32(slot + 16);
+  if (length > store->slot - SLOT_HEADER) return -2;
+  uint32_t crc = crc32c(0, slot + 4, SLOT_HEADER - 4 + (size_t) length);
+  if (crc != format_read_uint32(slot)) return -2;
+  return length;
+}
+
+static void slot_store_free(struct slot_store* store) {
+  uv_mutex_destroy(&store->mutex);
+  free(store->used);
+  free(store);
+}
+
+static void slot_store_finalize(napi_env env, void* data, void* hint) {
+  slot_store_free(data);
+}
+
+static int arg_slot_store(
+  napi_env env,
+  napi_value value,
+  struct slot_store** store
+) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  if (type != napi_external) return 0;
+  bool tagged = false;
+  OK(napi_check_object_type_tag(env, value, &SLOT_TYPE_TAG, &tagged));
+  if (!tagged) return 0;
+  OK(napi_get_value_external(env, value, (void**) store));
+  return 1;
+}
+
+struct slot_open_data {
+  struct slot_store* store;
+  int format;
+  int64_t slots;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+// Writes the superblock with a high-water mark, durably:
+static const char* slot_super_write(
+  struct slot_store* store,
+  uint8_t* super,
+  int64_t mark
+) {
+  memset(super, 0, (size_t) store->sector);
+  format_write_uint32(super + 4, SLOT_SUPER_MAGIC);
+  format_write_uint64(super + 8, store->generation);
+  format_write_uint64(super + 16, (uint64_t) store->slot);
+  format_write_uint64(super + 24, (uint64_t) store->slots);
+  format_write_uint64(super + 32, (uint64_t) mark);
+  format_write_uint32(super, crc32c(0, super + 4, SLOT_SIZE_MIN - 4));
+  int64_t result = io_write(store->fd, super, (size_t) store->sector, 0);
+  if (result < 0) return io_error(result, "unexpected error, write");
+  result = io_fdatasync(store->fd);
+  if (result < 0) return io_error(result, "unexpected error, fdatasync");
+  store->mark = mark;
+  return NULL;
+}
+
+// Raises the high-water mark above a slot before the slot is put:
+static const char* slot_raise(struct slot_store* store, int64_t slot) {
+  const char* error = NULL;
+  uv_mutex_lock(&store->mutex);
+  if (slot >= store->mark) {
+    int64_t mark = slot + 1 + store->mark / 4;
+    if (mark > store->slots) mark = store->slots;
+    uint8_t* super = aligned_malloc(
+      (size_t) store->sector,
+      SCRATCH_ALIGNMENT
+    );
+    if (super) {
+      error = slot_super_write(store, super, mark);
+      aligned_free(super);
+    } else {
+      error = "insufficient memory";
+    }
+  }
+  uv_mutex_unlock(&store->mutex);
+  return error;
+}
+
+// Writes a superblock of a new generation, which frees every slot:
+static const char* slot_format(
+  struct slot_store* store,
+  uint8_t* super,
+  int64_t size,
+  int64_t slots
+) {
+  uint64_t generation = (uint64_t) uv_hrtime();
+  if (
+    format_read_uint32(super + 4) == SLOT_SUPER_MAGIC &&
+    format_read_uint32(super) == crc32c(0, super + 4, SLOT_SIZE_MIN - 4)
+  ) {
+    generation = format_read_uint64(super + 8) + 1;
+  }
+  if (slots == 0) slots = size / store->slot - 1;
+  if (slots <= 0) return "fd must be at least 2 slots";
+  // A regular file is extended to hold the slots, but a device must fit them:
+  int64_t result = io_extend(store->fd, (slots + 1) * store->slot);
+  if (result < 0) return io_error(result, "unexpected error, ftruncate");
+  const char* error = io_size(store->fd, &size);
+  if (error) return error;
+  if (size < (slots + 1) * store->slot) {
+    return "options.slots must fit the device";
+  }
+  store->generation = generation;
+  store->slots = slots;
+  return slot_super_write(store, super, 0);
+}
+
+// Finds the slots in use from their headers, reading many slots at a time:
+static const char* slot_scan(struct slot_store* store) {
+  int64_t per = SLOT_SCAN / store->slot > 0 ? SLOT_SCAN / store->slot : 1;
+  size_t length = (size_t) (per * store->slot);
+  uint8_t* buffer = aligned_malloc(length, SCRATCH_ALIGNMENT);
+  if (!buffer) return "insufficient memory";
+  const char* error = NULL;
+  for (int64_t slot = 0; slot < store->mark; slot += per) {
+    int64_t count = store->mark - slot < per ? store->mark - slot : per;
+    size_t bytes = (size_t) (count * store->slot);
+    int64_t result = io_read(
+      store->fd,
+      buffer,
+      bytes,
+      slot_position(store, slot)
+    );
+    if (result < 0) {
+      error = io_error(result, "unexpected error, read");
+      break;
+    }
+    // The slots past the end of a regular file are free:
+    if ((size_t) result < bytes) {
+      memset(buffer + result, 0, bytes - (size_t) result);
+    }
+    for (int64_t index = 0; index < count; index++) {
+      int64_t check = slot_check(store, buffer + index * store->slot);
+      if (check == -1) continue;
+      if (check == -2) store->corrupt++;
+      slot_mark(store, slot + index, 1);
+    }
+  }
+  aligned_free(buffer);
+  return error;
+}
+
+static void slot_open_execute(napi_env env, void* data) {
+  struct slot_open_data* work = data;
+  struct slot_store* store = work->store;
+  int64_t size = 0;
+  int64_t logical = 0;
+  int64_t physical = 0;
+  work->error = volume_probe(store->fd, &size, &logical, &physical);
+  if (work->error) return;
+  store->sector = physical > logical ? physical : logical;
+  if (store->sector < SLOT_SIZE_MIN) store->sector = SLOT_SIZE_MIN;
+  uint8_t* super = aligned_malloc((size_t) store->sector, SCRATCH_ALIGNMENT);
+  if (!super) {
+    work->error = "insufficient memory";
+    return;
+  }
+  memset(super, 0, (size_t) store->sector);
+  int64_t result = io_read(store->fd, super, (size_t) store->sector, 0);
+  if (result < 0) {
+    work->error = io_error(result, "unexpected error, read");
+  } else if (work->format) {
+    if (store->slot % store->sector != 0) {
+      work->error = "options.slotSize must be a multiple of the sector size";
+    } else {
+      work->error = slot_format(store, super, size, work->slots);
+    }
+  } else if (
+    format_read_uint32(super + 4) != SLOT_SUPER_MAGIC ||
+    format_read_uint32(super) != crc32c(0, super + 4, SLOT_SIZE_MIN - 4)
+  ) {
+    work->error = "fd does not have a slot store, use options.format";
+  } else {
+    store->generation = format_read_uint64(super + 8);
+    store->slot = (int64_t) format_read_uint64(super + 16);
+    store->slots = (int64_t) format_read_uint64(super + 24);
+    store->mark = (int64_t) format_read_uint64(super + 32);
+    if (store->slot % store->sector != 0) {
+      work->error = "slot size must be a multiple of the sector size";
+    } else if (store->mark < 0 || store->mark > store->slots) {
+      work->error = "fd does not have a slot store, use options.format";
+    }
+  }
+  aligned_free(super);
+  if (work->error) return;
+  store->used = calloc((size_t) (store->slots + 63) / 64, 8);
+  if (!store->used) {
+    work->error = "insufficient memory";
+    return;
+  }
+  if (!work->format) work->error = slot_scan(store);
+}
+
+static void slot_open_complete(napi_env env, napi_status status, void* data) {
+  struct slot_open_data* work = data;
+  if (status == napi_cancelled) work->error = "async work was cancelled";
+  int argc = 0;
+  napi_value argv[2];
+  if (work->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, work->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+    slot_store_free(work->store);
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_external(
+      env,
+      work->store,
+      slot_store_finalize,
+      NULL,
+      &argv[1]
+    ));
+    OK(napi_type_tag_object(env, argv[1], &SLOT_TYPE_TAG));
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, work->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, work->ref_callback));
+  OK(napi_delete_async_work(env, work->async_work));
+  free(work);
+}
+
+static napi_value slot_open(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  if (
+    argc != 3 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_object(env, argv[1]) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, options, callback)");
+  }
+  napi_value options = argv[1];
+  int format = 0;
+  int64_t slot = SLOT_SIZE_DEFAULT;
+  int64_t slots = 0;
+  int64_t depth = ENGINE_DEPTH_DEFAULT;
+  napi_value value;
+  if (!option_bool(env, options, "format", &format)) {
+    THROW(env, "options.format must be a boolean");
+  }
+  if (
+    !format && (
+      option_value(env, options, "slotSize", &value) ||
+      option_value(env, options, "slots", &value)
+    )
+  ) {
+    THROW(env, "options.slotSize and options.slots require options.format");
+  }
+  if (
+    !option_int64(env, options, "slotSize", &slot) ||
+    slot < SLOT_SIZE_MIN ||
+    slot > SLOT_SIZE_MAX ||
+    (slot & (slot - 1))
+  ) {
+    THROW(env, "options.slotSize must be a power of 2 from 512 to 16777216");
+  }
+  if (!option_int64(env, options, "slots", &slots)) {
+    THROW(env, "options.slots must be a positive integer");
+  }
+  if (
+    !option_int64(env, options, "depth", &depth) ||
+    depth < 1 ||
+    depth > ENGINE_DEPTH_MAX
+  ) {
+    THROW(env, "options.depth must be from 1 to 64");
+  }
+  struct slot_store* store = calloc(1, sizeof(struct slot_store));
+  if (!store) THROW(env, "insufficient memory");
+  int mutex = uv_mutex_init(&store->mutex);
+  assert(mutex == 0);
+  store->fd = fd;
+  store->slot = slot;
+  store->depth = (int) depth;
+  struct slot_open_data* work = calloc(1, sizeof(struct slot_open_data));
+  if (!work) {
+    slot_store_free(store);
+    THROW(env, "insufficient memory");
+  }
+  work->store = store;
+  work->format = format;
+  work->slots = slots;
+  OK(napi_create_reference(env, argv[2], 1, &work->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    slot_open_execute,
+    slot_open_complete,
+    work,
+    &work->async_work
+  ));
+  OK(napi_queue_async_work(env, work->async_work));
+  return NULL;
+}
+
+static napi_value slot_allocate(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct slot_store* store = NULL;
+  if (argc != 1 || !arg_slot_store(env, argv[0], &store)) {
+    THROW(env, "bad arguments, expected: (store)");
+  }
+  if (store->used_count == store->slots) THROW(env, "no free slots");
+  // Next fit, skipping a word of used slots at a time:
+  int64_t slot = store->cursor;
+  for (;;) {
+    if (slot >= store->slots) slot = 0;
+    uint64_t free = ~store->used[slot / 64] & (~0ULL << (slot & 63));
+    if (free) {
+      slot = slot / 64 * 64 + allocator_ctz(free);
+      if (slot < store->slots) break;
+    }
+    slot = (slot / 64 + 1) * 64;
+  }
+  slot_mark(store, slot, 1);
+  store->cursor = slot + 1;
+  napi_value result;
+  OK(napi_create_int64(env, slot, &result));
+  return result;
+}
+
+static void slot_part_execute(napi_env env, void* data) {
+  struct slot_part* part = data;
+  struct slot_batch* batch = part->batch;
+  struct slot_store* store = batch->store;
+  for (size_t index = part->start; index < part->end; index++) {
+    int64_t position = slot_position(store, batch->slots[index]);
+    uint8_t* buffer = batch->buffer + batch->offsets[index];
+    int64_t result = 0;
+    if (batch->op == SLOT_GET) {
+      result = io_read(store->fd, buffer, (size_t) store->slot, position);
+      if (result < 0) {
+        part->error = io_error(result, "unexpected error, read");
+        return;
+      }
+      if (result < store->slot) {
+        memset(buffer + result, 0, (size_t) (store->slot - result));
+      }
+      batch->lengths[index] = slot_check(store, buffer);
+    } else {
+      if (batch->op == SLOT_PUT) {
+        part->error = slot_raise(store, batch->slots[index]);
+        if (part->error) return;
+      }
+      size_t length = batch->op == SLOT_PUT ?
+        (size_t) batch->lengths[index] :
+        (size_t) store->sector;
+      result = io_write(store->fd, buffer, length, position);
+      if (result < 0) {
+        part->error = io_error(result, "unexpected error, write");
+        return;
+      }
+    }
+  }
+}
+
+static void slot_batch_complete(
+  napi_env env,
+  napi_status status,
+  void* data
+) {
+  struct slot_part* part = data;
+  struct slot_batch* batch = part->batch;
+  struct slot_store* store = batch->store;
+  if (status == napi_cancelled) part->error = "async work was cancelled";
+  OK(napi_delete_async_work(env, part->async_work));
+  if (part->error && !batch->error) batch->error = part->error;
+  if (--batch->outstanding > 0) return;
+  int argc = 0;
+  napi_value argv[2];
+  if (batch->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, batch->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_object(env, &argv[1]));
+    set_int(env, argv[1], "slots", (int64_t) batch->length);
+  }
+  if (batch->op == SLOT_GET && !batch->error) {
+    napi_value buffers;
+    napi_value corrupt;
+    OK(napi_create_array_with_length(env, batch->length, &buffers));
+    OK(napi_create_array(env, &corrupt));
+    uint32_t corrupt_length = 0;
+    for (size_t index = 0; index < batch->length; index++) {
+      napi_value value;
+      if (batch->lengths[index] < 0) {
+        OK(napi_get_null(env, &value));
+      } else {
+        OK(napi_create_buffer_copy(
+          env,
+          (size_t) batch->lengths[index],
+          batch->buffer + batch->offsets[index] + SLOT_HEADER,
+          NULL,
+          &value
+        ));
+      }
+      OK(napi_set_element(env, buffers, (uint32_t) index, value));
+      if (batch->lengths[index] == -2) {
+        OK(napi_create_int64(env, batch->slots[index], &value));
+        OK(napi_set_element(env, corrupt, corrupt_length++, value));
+      }
+    }
+    OK(napi_set_named_property(env, argv[1], "buffers", buffers));
+    OK(napi_set_named_property(env, argv[1], "corrupt", corrupt));
+  }
+  if (batch->op == SLOT_FREE) {
+    // A slot is only allocated again once its free has been written, and
+    // stays allocated if the free failed:
+    for (size_t index = 0; index < batch->length; index++) {
+      if (!batch->error) slot_mark(store, batch->slots[index], 0);
+    }
+  }
+  if (!batch->error) {
+    int64_t* counter = batch->op == SLOT_GET ? &store->gets :
+      batch->op == SLOT_PUT ? &store->puts :
+      &store->frees;
+    *counter += (int64_t) batch->length;
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, batch->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, batch->ref_callback));
+  OK(napi_delete_reference(env, batch->ref_store));
+  aligned_free(batch->buffer);
+  free(batch->slots);
+  free(batch->offsets);
+  free(batch->lengths);
+  free(batch);
+}
+
+static int slot_compare(const void* a, const void* b) {
+  int64_t x = *(const int64_t*) a;
+  int64_t y = *(const int64_t*) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Parses an array of allocated slots, or of { slot, buffer } records to put,
+// into a batch with an aligned buffer for every I/O:
+static const char* slot_batch_parse(
+  napi_env env,
+  napi_value array,
+  struct slot_batch* batch
+) {
+  struct slot_store* store = batch->store;
+  uint32_t length = 0;
+  OK(napi_get_array_length(env, array, &length));
+  if (length == 0) return "slots must not be empty";
+  batch->length = length;
+  batch->slots = calloc(length, sizeof(int64_t));
+  batch->offsets = calloc(length, sizeof(size_t));
+  batch->lengths = calloc(length, sizeof(int64_t));
+  if (!batch->slots || !batch->offsets || !batch->lengths) {
+    return "insufficient memory";
+  }
+  uint8_t** records = NULL;
+  if (batch->op == SLOT_PUT) {
+    records = calloc(length, sizeof(uint8_t*));
+    if (!records) return "insufficient memory";
+  }
+  const char* error = NULL;
+  for (uint32_t index = 0; !error && index < length; index++) {
+    napi_value element;
+    napi_value value;
+    OK(napi_get_element(env, array, index, &element));
+    if (batch->op == SLOT_PUT) {
+      size_t record_length = 0;
+      if (
+        !arg_object(env, element) ||
+        !option_value(env, element, "slot", &value) ||
+        !arg_int64(env, value, &batch->slots[index]) ||
+        !option_value(env, element, "buffer", &value) ||
+        !arg_buffer(env, value, &records[index], &record_length)
+      ) {
+        error = "records must be an array of { slot, buffer } objects";
+        break;
+      }
+      if ((int64_t) record_length > store->slot - SLOT_HEADER) {
+        error = "buffers must be at most the slot size - 32 bytes";
+        break;
+      }
+      batch->lengths[index] = (int64_t) record_length;
+    } else if (!arg_int64(env, element, &batch->slots[index])) {
+      error = "slots must be an array of slot numbers";
+      break;
+    }
+    if (batch->slots[index] >= store->slots) {
+      error = "slots must be less than the number of slots";
+    } else if (!slot_used(store, batch->slots[index])) {
+      error = "slots must be allocated";
+    }
+  }
+  if (!error && batch->op != SLOT_GET) {
+    // A batch which writes a slot twice would race with itself:
+    int64_t* sorted = malloc(length * sizeof(int64_t));
+    if (!sorted) {
+      error = "insufficient memory";
+    } else {
+      memcpy(sorted, batch->slots, length * sizeof(int64_t));
+      qsort(sorted, length, sizeof(int64_t), slot_compare);
+      for (uint32_t index = 1; index < length; index++) {
+        if (sorted[index] == sorted[index - 1]) {
+          error = "slots must be unique";
+          break;
+        }
+      }
+      free(sorted);
+    }
+  }
+  if (error) {
+    free(records);
+    return error;
+  }
+  // A record is written with its header in whole sectors, a slot is read
+  // whole, and a free writes a sector of zeroes:
+  for (uint32_t index = 0; index < length; index++) {
+    batch->offsets[index] = batch->buffer_length;
+    if (batch->op == SLOT_PUT) {
+      int64_t bytes = SLOT_HEADER + batch->lengths[index];
+      bytes = (bytes + store->sector - 1) / store->sector * store->sector;
+      batch->buffer_length += (size_t) bytes;
+    } else if (batch->op == SLOT_GET) {
+      batch->buffer_length += (size_t) store->slot;
+    } else {
+      batch->offsets[index] = 0;
+      batch->buffer_length = (size_t) store->sector;
+    }
+  }
+  batch->buffer = aligned_malloc(batch->buffer_length, SCRATCH_ALIGNMENT);
+  if (!batch->buffer) {
+    free(records);
+    return "insufficient memory";
+  }
+  if (batch->op != SLOT_GET) memset(batch->buffer, 0, batch->buffer_length);
+  for (uint32_t index = 0; records && index < length; index++) {
+    uint8_t* slot = batch->buffer + batch->offsets[index];
+    size_t record_length = (size_t) batch->lengths[index];
+    memcpy(slot + SLOT_HEADER, records[index], record_length);
+    format_write_uint32(slot + 4, SLOT_MAGIC);
+    format_write_uint64(slot + 8, store->generation);
+    format_write_uint32(slot + 16, (uint32_t) record_length);
+    uint32_t crc = crc32c(0, slot + 4, SLOT_HEADER - 4 + record_length);
+    format_write_uint32(slot, crc);
+    // From here on, the length of a record to put is the length to write:
+    size_t end = index + 1 < length ?
+      batch->offsets[index + 1] :
+      batch->buffer_length;
+    batch->lengths[index] = (int64_t) (end - batch->offsets[index]);
+  }
+  free(records);
+  return NULL;
+}
+
+static napi_value slot_queue(napi_env env, napi_callback_info info, int op) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct slot_store* store = NULL;
+  bool array = false;
+  if (argc == 3) OK(napi_is_array(env, argv[1], &array));
+  if (
+    argc != 3 ||
+    !arg_slot_store(env, argv[0], &store) ||
+    !array ||
+    !arg_function(env, argv[2])
+  ) {
+    if (op == SLOT_PUT) {
+      THROW(env, "bad arguments, expected: (store, records, callback)");
+    }
+    THROW(env, "bad arguments, expected: (store, slots, callback)");
+  }
+  struct slot_batch* batch = calloc(1, sizeof(struct slot_batch));
+  if (!batch) THROW(env, "insufficient memory");
+  batch->env = env;
+  batch->store = store;
+  batch->op = op;
+  const char* error = slot_batch_parse(env, argv[1], batch);
+  if (error) {
+    if (batch->buffer) aligned_free(batch->buffer);
+    free(batch->slots);
+    free(batch->offsets);
+    free(batch->lengths);
+    free(batch);
+    THROW(env, error);
+  }
+  OK(napi_create_reference(env, argv[0], 1, &batch->ref_store));
+  OK(napi_create_reference(env, argv[2], 1, &batch->ref_callback));
+  // The batch is split into one part per thread, up to options.depth, each of
+  // which issues its I/Os in turn:
+  size_t parts = batch->length < (size_t) store->depth ?
+    batch->length :
+    (size_t) store->depth;
+  batch->parts_length = (int) parts;
+  batch->outstanding = (int) parts;
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  for (size_t index = 0; index < parts; index++) {
+    struct slot_part* part = &batch->parts[index];
+    part->batch = batch;
+    part->start = batch->length * index / parts;
+    part->end = batch->length * (index + 1) / parts;
+    OK(napi_create_async_work(
+      env,
+      NULL,
+      name,
+      slot_part_execute,
+      slot_batch_complete,
+      part,
+      &part->async_work
+    ));
+  }
+  for (size_t index = 0; index < parts; index++) {
+    OK(napi_queue_async_work(env, batch->parts[index].async_work));
+  }
+  return NULL;
+}
+
+static napi_value slot_get(napi_env env, napi_callback_info info) {
+  return slot_queue(env, info, SLOT_GET);
+}
+
+static napi_value slot_put(napi_env env, napi_callback_info info) {
+  return slot_queue(env, info, SLOT_PUT);
+}
+
+static napi_value slot_free(napi_env env, napi_callback_info info) {
+  return slot_queue(env, info, SLOT_FREE);
+}
+
+static napi_value slot_stats(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct slot_store* store = NULL;
+  if (argc != 1 || !arg_slot_store(env, argv[0], &store)) {
+    THROW(env, "bad arguments, expected: (store)");
+  }
+  napi_value result;
+  OK(napi_create_object(env, &result));
+  set_int(env, result, "slotSize", store->slot);
+  set_int(env, result, "recordSize", store->slot - SLOT_HEADER);
+  set_int(env, result, "sectorSize", store->sector);
+  set_int(env, result, "slots", store->slots);
+  set_int(env, result, "usedSlots", store->used_count);
+  set_int(env, result, "freeSlots", store->slots - store->used_count);
+  set_int(env, result, "corruptSlots", store->corrupt);
+  uv_mutex_lock(&store->mutex);
+  set_int(env, result, "scanSlots", store->mark);
+  uv_mutex_unlock(&store->mutex);
+  set_int(env, result, "gets", store->gets);
+  set_int(env, result, "puts", store->puts);
+  set_int(env, result, "frees", store->frees);
+  return result;
+}
+
+// A container is a regular file of chunks, each a compressed frame (see
+// compress_frame) padded to the sector size so that it can be read with
+// O_DIRECT in a single aligned read, followed by an index of the chunks
+// padded to the sector size, and ending with a 64-byte footer:
+//
+//   0  u32 CRC32C of [4,64)
+//   4  magic "DIOCHNK1"
+//  12  u32 sector size
+//  16  u64 position of the index
+//  24  u64 number of chunks
+//  32  u32 flags (1 checksums)
+//  36  u32 CRC32C of the index
+//
+// An index entry has [0,8) the position of the chunk, [8,12) the length of
+// its frame before padding, [12,16) its decompressed length and [16,20) a
+// CRC32C of the decompressed chunk, if checksummed. Since the footer ends the
+// file, the index and footer are read with one aligned read of the tail of
+// the file, if the index is small enough to fit in the tail.
+#define CONTAINER_MAGIC "DIOCHNK1"
+#define CONTAINER_FOOTER 64
+#define CONTAINER_ENTRY 24
+#define CONTAINER_TAIL 65536
+#define CONTAINER_CHECKSUM 1
+#define CONTAINER_CHUNK_MAX 0x7fff0000
+#define CONTAINER_READAHEAD_DEFAULT 1048576
+#define CONTAINER_READAHEAD_MAX 67108864
+
+static const napi_type_tag CONTAINER_WRITER_TYPE_TAG = {
+  0x636f6e7461696e01ULL, 0x8d2f6a13e5b74c90ULL
+};
+
+static const napi_type_tag CONTAINER_READER_TYPE_TAG = {
+  0x636f6e7461696e02ULL, 0x41e7c5d8926b0f3aULL
+};
+
+struct container_chunk {
+  int64_t position;
+  uint32_t frame;
+  uint32_t length;
+  uint32_t crc;
+};
+
+struct container_writer {
+  int fd;
+  int64_t sector;
+  int compress;
+  int checksum;
+  int64_t position;
+  struct container_chunk* chunks;
+  size_t chunks_length;
+  size_t chunks_capacity;
+  int busy;
+  int finished;
+};
+
+struct container_reader {
+  int fd;
+  int64_t sector;
+  int checksum;
+  int depth;
+  int64_t size;
+  struct container_chunk* chunks;
+  size_t chunks_length;
+};
+
+static size_t container_padded(
+  const struct container_chunk* chunk,
+  int64_t sector
+) {
+  return compress_padded(chunk->frame, (size_t) sector);
+}
+
+// Decodes the frame of a chunk into a buffer of its decompressed length:
+static const char* container_decode(
+  const struct container_reader* reader,
+  const struct container_chunk* chunk,
+  const uint8_t* frame,
+  uint8_t* buffer
+) {
+  uint32_t method = format_read_uint32(frame + 4);
+  size_t payload = format_read_uint32(frame + 8);
+  if (
+    memcmp(frame, COMPRESS_MAGIC, 4) != 0 ||
+    payload != chunk->frame - COMPRESS_HEADER ||
+    format_read_uint32(frame + 12) != chunk->length
+  ) {
+    return "chunk is corrupt";
+  }
+  if (method == COMPRESS_STORED && payload == chunk->length) {
+    memcpy(buffer, frame + COMPRESS_HEADER, payload);
+  } else if (
+    method != COMPRESS_LZ4 ||
+    !lz4_decompress(frame + COMPRESS_HEADER, payload, buffer, chunk->length)
+  ) {
+    return "chunk is corrupt";
+  }
+  if (reader->checksum && crc32c(0, buffer, chunk->length) != chunk->crc) {
+    return "chunk failed its checksum";
+  }
+  return NULL;
+}
+
+static void container_writer_finalize(napi_env env, void* data, void* hint) {
+  struct container_writer* writer = data;
+  free(writer->chunks);
+  free(writer);
+}
+
+static void container_reader_free(struct container_reader* reader) {
+  free(reader->chunks);
+  free(reader);
+}
+
+static void container_reader_finalize(napi_env env, void* data, void* hint) {
+  container_reader_free(data);
+}
+
+static int arg_container(
+  napi_env env,
+  napi_value value,
+  const napi_type_tag* tag,
+  void** container
+) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  if (type != napi_external) return 0;
+  bool tagged = false;
+  OK(napi_check_object_type_tag(env, value, tag, &tagged));
+  if (!tagged) return 0;
+  OK(napi_get_value_external(env, value, container));
+  return 1;
+}
+
+static napi_value container_create(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  if (argc != 2 || !arg_int(env, argv[0], &fd) || !arg_object(env, argv[1])) {
+    THROW(env, "bad arguments, expected: (fd, options)");
+  }
+  napi_value options = argv[1];
+  int64_t sector = 4096;
+  int checksum = 1;
+  int compress = 0;
+  if (
+    !option_int64(env, options, "sectorSize", &sector) ||
+    sector < COMPRESS_SECTOR_MIN ||
+    sector > COMPRESS_SECTOR_MAX ||
+    (sector & (sector - 1))
+  ) {
+    THROW(env, "options.sectorSize must be a power of 2 from 512 to 65536");
+  }
+  if (!option_bool(env, options, "checksum", &checksum)) {
+    THROW(env, "options.checksum must be a boolean");
+  }
+  napi_value compress_value;
+  if (option_value(env, options, "compress", &compress_value)) {
+    char method[8];
+    size_t method_length = 0;
+    if (
+      napi_get_value_string_utf8(
+        env,
+        compress_value,
+        method,
+        sizeof(method),
+        &method_length
+      ) != napi_ok ||
+      strcmp(method, "lz4") != 0
+    ) {
+      THROW(env, "options.compress must be \"lz4\"");
+    }
+    compress = 1;
+  }
+  struct container_writer* writer = calloc(
+    1,
+    sizeof(struct container_writer)
+  );
+  if (!writer) THROW(env, "insufficient memory");
+  writer->fd = fd;
+  writer->sector = sector;
+  writer->compress = compress;
+  writer->checksum = checksum;
+  napi_value result;
+  OK(napi_create_external(
+    env,
+    writer,
+    container_writer_finalize,
+    NULL,
+    &result
+  ));
+  OK(napi_type_tag_object(env, result, &CONTAINER_WRITER_TYPE_TAG));
+  return result;
+}
+
+struct container_append_data {
+  struct container_writer* writer;
+  int finish;
+  // The chunks to append, copied end to end, and their frames:
+  uint8_t* source;
+  size_t* lengths;
+  size_t length;
+  struct container_chunk* chunks;
+  uint8_t* target;
+  size_t target_length;
+  int64_t position;
+  napi_ref ref_writer;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+// Frames the chunks, or the index and footer, and writes them in one write:
+static void container_append_execute(napi_env env, void* data) {
+  struct container_append_data* work = data;
+  struct container_writer* writer = work->writer;
+  size_t sector = (size_t) writer->sector;
+  if (work->finish) {
+    size_t index = writer->chunks_length * CONTAINER_ENTRY;
+    work->target_length = compress_padded(index, sector) +
+      compress_padded(CONTAINER_FOOTER, sector);
+    work->target = aligned_malloc(work->target_length, SCRATCH_ALIGNMENT);
+    if (!work->target) {
+      work->error = "insufficient memory";
+      return;
+    }
+    memset(work->target, 0, work->target_length);
+    for (size_t chunk = 0; chunk < writer->chunks_length; chunk++) {
+      uint8_t* entry = work->target + chunk * CONTAINER_ENTRY;
+      format_write_uint64(entry, (uint64_t) writer->chunks[chunk].position);
+      format_write_uint32(entry + 8, writer->chunks[chunk].frame);
+      format_write_uint32(entry + 12, writer->chunks[chunk].length);
+      format_write_uint32(entry + 16, writer->chunks[chunk].crc);
+    }
+    uint8_t* footer = work->target + work->target_length - CONTAINER_FOOTER;
+    memcpy(footer + 4, CONTAINER_MAGIC, 8);
+    format_write_uint32(footer + 12, (uint32_t) sector);
+    format_write_uint64(footer + 16, (uint64_t) work->position);
+    format_write_uint64(footer + 24, (uint64_t) writer->chunks_length);
+    uint32_t flags = writer->checksum ? CONTAINER_CHECKSUM : 0;
+    format_write_uint32(footer + 32, flags);
+    format_write_uint32(footer + 36, crc32c(0, work->target, index));
+    format_write_uint32(footer, crc32c(0, footer + 4, CONTAINER_FOOTER - 4));
+  } else {
+    for (size_t chunk = 0; chunk < work->length; chunk++) {
+      work->target_length += compress_padded(
+        COMPRESS_HEADER + work->lengths[chunk],
+        sector
+      );
+    }
+    work->target = aligned_malloc(
+      work->target_length > 0 ? work->target_length : 1,
+      SCRATCH_ALIGNMENT
+    );
+    if (!work->target) {
+      work->error = "insufficient memory";
+      return;
+    }
+    const uint8_t* source = work->source;
+    size_t offset = 0;
+    for (size_t chunk = 0; chunk < work->length; chunk++) {
+      size_t length = work->lengths[chunk];
+      uint8_t* frame = work->target + offset;
+      uint32_t method = COMPRESS_STORED;
+      size_t payload = 0;
+      if (writer->compress) {
+        payload = lz4_compress(
+          source,
+          length,
+          frame + COMPRESS_HEADER,
+          length > 0 ? length - 1 : 0
+        );
+        if (payload > 0) method = COMPRESS_LZ4;
+      }
+      if (method == COMPRESS_STORED) {
+        payload = length;
+        memcpy(frame + COMPRESS_HEADER, source, length);
+      }
+      memcpy(frame, COMPRESS_MAGIC, 4);
+      format_write_uint32(frame + 4, method);
+      format_write_uint32(frame + 8, (uint32_t) payload);
+      format_write_uint32(frame + 12, (uint32_t) length);
+      size_t padded = compress_padded(COMPRESS_HEADER + payload, sector);
+      memset(
+        frame + COMPRESS_HEADER + payload,
+        0,
+        padded - COMPRESS_HEADER - payload
+      );
+      work->chunks[chunk].position = work->position + (int64_t) offset;
+      work->chunks[chunk].frame = (uint32_t) (COMPRESS_HEADER + payload);
+      work->chunks[chunk].length = (uint32_t) length;
+      if (writer->checksum) {
+        work->chunks[chunk].crc = crc32c(0, source, length);
+      }
+      source += length;
+      offset += padded;
+    }
+    // Compressed frames take less than the space reserved for them:
+    work->target_length = offset;
+  }
+  int64_t result = io_write(
+    writer->fd,
+    work->target,
+    work->target_length,
+    work->position
+  );
+  if (result < 0) {
+    work->error = io_error(result, "unexpected error, write");
+    return;
+  }
+  if (work->finish) {
+    int64_t end = work->position + (int64_t) work->target_length;
+    result = io_truncate(writer->fd, end);
+    if (result < 0) {
+      work->error = io_error(result, "unexpected error, ftruncate");
+      return;
+    }
+    result = io_fdatasync(writer->fd);
+    if (result < 0) {
+      work->error = io_error(result, "unexpected error, fdatasync");
+    }
+  }
+}
+
+static void container_append_complete(
+  napi_env env,
+  napi_status status,
+  void* data
+) {
+  struct container_append_data* work = data;
+  struct container_writer* writer = work->writer;
+  if (status == napi_cancelled) work->error = "async work was cancelled";
+  writer->busy = 0;
+  int argc = 0;
+  napi_value argv[2];
+  if (work->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, work->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_object(env, &argv[1]));
+    if (work->finish) {
+      writer->finished = 1;
+      set_int(env, argv[1], "chunks", (int64_t) writer->chunks_length);
+      set_int(
+        env,
+        argv[1],
+        "size",
+        work->position + (int64_t) work->target_length
+      );
+    } else {
+      // The chunks are only numbered once they have been written:
+      set_int(env, argv[1], "first", (int64_t) writer->chunks_length);
+      set_int(env, argv[1], "chunks", (int64_t) work->length);
+      set_int(env, argv[1], "bytes", (int64_t) work->target_length);
+      memcpy(
+        writer->chunks + writer->chunks_length,
+        work->chunks,
+        work->length * sizeof(struct container_chunk)
+      );
+      writer->chunks_length += work->length;
+      writer->position += (int64_t) work->target_length;
+    }
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, work->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, work->ref_callback));
+  OK(napi_delete_reference(env, work->ref_writer));
+  OK(napi_delete_async_work(env, work->async_work));
+  if (work->target) aligned_free(work->target);
+  free(work->source);
+  free(work->lengths);
+  free(work->chunks);
+  free(work);
+}
+
+static void container_append_free(struct container_append_data* work) {
+  free(work->source);
+  free(work->lengths);
+  free(work->chunks);
+  free(work);
+}
+
+static napi_value container_queue(
+  napi_env env,
+  napi_value writer_value,
+  napi_value callback,
+  struct container_append_data* work
+) {
+  struct container_writer* writer = work->writer;
+  writer->busy = 1;
+  work->position = writer->position;
+  OK(napi_create_reference(env, writer_value, 1, &work->ref_writer));
+  OK(napi_create_reference(env, callback, 1, &work->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    container_append_execute,
+    container_append_complete,
+    work,
+    &work->async_work
+  ));
+  OK(napi_queue_async_work(env, work->async_work));
+  return NULL;
+}
+
+static napi_value container_append(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct container_writer* writer = NULL;
+  bool array = false;
+  if (argc == 3) OK(napi_is_array(env, argv[1], &array));
+  if (
+    argc != 3 ||
+    !arg_container(
+      env,
+      argv[0],
+      &CONTAINER_WRITER_TYPE_TAG,
+      (void**) &writer
+    ) ||
+    !array ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (writer, buffers, callback)");
+  }
+  if (writer->finished) THROW(env, "writer is finished");
+  if (writer->busy) THROW(env, "writer is busy");
+  uint32_t length = 0;
+  OK(napi_get_array_length(env, argv[1], &length));
+  if (length == 0) THROW(env, "buffers must not be empty");
+  size_t total = 0;
+  for (uint32_t index = 0; index < length; index++) {
+    napi_value element;
+    uint8_t* buffer = NULL;
+    size_t buffer_length = 0;
+    OK(napi_get_element(env, argv[1], index, &element));
+    if (!arg_buffer(env, element, &buffer, &buffer_length)) {
+      THROW(env, "buffers must be an array of buffers");
+    }
+    if (buffer_length > CONTAINER_CHUNK_MAX) {
+      THROW(env, "buffers must be at most 2147418112 bytes");
+    }
+    total += buffer_length;
+  }
+  if (writer->chunks_length + length > writer->chunks_capacity) {
+    size_t capacity = writer->chunks_capacity * 2;
+    if (capacity < writer->chunks_length + length) {
+      capacity = writer->chunks_length + length;
+    }
+    struct container_chunk* chunks = realloc(
+      writer->chunks,
+      capacity * sizeof(struct container_chunk)
+    );
+    if (!chunks) THROW(env, "insufficient memory");
+    writer->chunks = chunks;
+    writer->chunks_capacity = capacity;
+  }
+  struct container_append_data* work = calloc(
+    1,
+    sizeof(struct container_append_data)
+  );
+  if (!work) THROW(env, "insufficient memory");
+  work->writer = writer;
+  work->length = length;
+  work->source = malloc(total > 0 ? total : 1);
+  work->lengths = calloc(length, sizeof(size_t));
+  work->chunks = calloc(length, sizeof(struct container_chunk));
+  if (!work->source || !work->lengths || !work->chunks) {
+    container_append_free(work);
+    THROW(env, "insufficient memory");
+  }
+  // The buffers are copied, so that they may be reused at once:
+  size_t offset = 0;
+  for (uint32_t index = 0; index < length; index++) {
+    napi_value element;
+    uint8_t* buffer = NULL;
+    size_t buffer_length = 0;
+    OK(napi_get_element(env, argv[1], index, &element));
+    int valid = arg_buffer(env, element, &buffer, &buffer_length);
+    assert(valid);
+    memcpy(work->source + offset, buffer, buffer_length);
+    work->lengths[index] = buffer_length;
+    offset += buffer_length;
+  }
+  return container_queue(env, argv[0], argv[2], work);
+}
+
+static napi_value container_finish(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct container_writer* writer = NULL;
+  if (
+    argc != 2 ||
+    !arg_container(
+      env,
+      argv[0],
+      &CONTAINER_WRITER_TYPE_TAG,
+      (void**) &writer
+    ) ||
+    !arg_function(env, argv[1])
+  ) {
+    THROW(env, "bad arguments, expected: (writer, callback)");
+  }
+  if (writer->finished) THROW(env, "writer is finished");
+  if (writer->busy) THROW(env, "writer is busy");
+  struct container_append_data* work = calloc(
+    1,
+    sizeof(struct container_append_data)
+  );
+  if (!work) THROW(env, "insufficient memory");
+  work->writer = writer;
+  work->finish = 1;
+  return container_queue(env, argv[0], argv[1], work);
+}
+
+struct container_open_data {
+  struct container_reader* reader;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+// Reads the tail of the file, and then the rest of the index if it did not
+// fit in the tail:
+static const char* container_load(struct container_reader* reader) {
+  const char* error = io_size(reader->fd, &reader->size);
+  if (error) return error;
+  if (reader->size < CONTAINER_FOOTER || reader->size % 512 != 0) {
+    return "fd is not a container";
+  }
+  int64_t start = reader->size > CONTAINER_TAIL ?
+    reader->size - CONTAINER_TAIL :
+    0;
+  start = start / CONTAINER_TAIL * CONTAINER_TAIL;
+  size_t tail = (size_t) (reader->size - start);
+  uint8_t* buffer = aligned_malloc(tail, SCRATCH_ALIGNMENT);
+  if (!buffer) return "insufficient memory";
+  int64_t result = io_read(reader->fd, buffer, tail, start);
+  uint8_t* footer = buffer + tail - CONTAINER_FOOTER;
+  int64_t index = 0;
+  if (result < 0) {
+    error = io_error(result, "unexpected error, read");
+  } else if (
+    result != (int64_t) tail ||
+    memcmp(footer + 4, CONTAINER_MAGIC, 8) != 0 ||
+    format_read_uint32(footer) != crc32c(0, footer + 4, CONTAINER_FOOTER - 4)
+  ) {
+    error = "fd is not a container";
+  } else {
+    reader->sector = format_read_uint32(footer + 12);
+    reader->checksum = (format_read_uint32(footer + 32) &
+      CONTAINER_CHECKSUM) != 0;
+    index = (int64_t) format_read_uint64(footer + 16);
+    reader->chunks_length = (size_t) format_read_uint64(footer + 24);
+    if (
+      reader->sector < COMPRESS_SECTOR_MIN ||
+      reader->sector > COMPRESS_SECTOR_MAX ||
+      (reader->sector & (reader->sector - 1)) ||
+      index % reader->sector != 0 ||
+      reader->chunks_length * CONTAINER_ENTRY >
+        (uint64_t) (reader->size - CONTAINER_FOOTER) ||
+      index > reader->size - CONTAINER_FOOTER -
+        (int64_t) (reader->chunks_length * CONTAINER_ENTRY)
+    ) {
+      error = "container index is corrupt";
+    }
+  }
+  size_t index_length = reader->chunks_length * CONTAINER_ENTRY;
+  uint8_t* entries = NULL;
+  uint8_t* extra = NULL;
+  if (!error && index >= start) entries = buffer + (index - start);
+  if (!error && index < start) {
+    // The index begins before the tail, and is read whole:
+    size_t length = (size_t) (start - index) + tail;
+    extra = aligned_malloc(length, SCRATCH_ALIGNMENT);
+    if (!extra) {
+      error = "insufficient memory";
+    } else {
+      memcpy(extra + (start - index), buffer, tail);
+      result = io_read(reader->fd, extra, (size_t) (start - index), index);
+      if (result < 0) {
+        error = io_error(result, "unexpected error, read");
+      } else if (result != start - index) {
+        error = "container index is corrupt";
+      }
+      entries = extra;
+    }
+  }
+  if (!error && crc32c(0, entries, index_length) !=
+    format_read_uint32(footer + 36)) {
+    error = "container index is corrupt";
+  }
+  if (!error) {
+    reader->chunks = calloc(
+      reader->chunks_length > 0 ? reader->chunks_length : 1,
+      sizeof(struct container_chunk)
+    );
+    if (!reader->chunks) error = "insufficient memory";
+  }
+  // The chunks must follow one another without overlapping, since a window
+  // of a scan reads from the position of its first chunk to its last:
+  int64_t after = 0;
+  for (size_t chunk = 0; !error && chunk < reader->chunks_length; chunk++) {
+    uint8_t* entry = entries + chunk * CONTAINER_ENTRY;
+    struct container_chunk* target = &reader->chunks[chunk];
+    target->position = (int64_t) format_read_uint64(entry);
+    target->frame = format_read_uint32(entry + 8);
+    target->length = format_read_uint32(entry + 12);
+    target->crc = format_read_uint32(entry + 16);
+    if (
+      target->frame < COMPRESS_HEADER ||
+      target->position < after ||
+      target->position % reader->sector != 0 ||
+      target->position + (int64_t) container_padded(target, reader->sector) >
+        index
+    ) {
+      error = "container index is corrupt";
+    }
+    after = target->position + (int64_t) container_padded(
+      target,
+      reader->sector
+    );
+  }
+  if (extra) aligned_free(extra);
+  aligned_free(buffer);
+  return error;
+}
+
+static void container_open_execute(napi_env env, void* data) {
+  struct container_open_data* work = data;
+  work->error = container_load(work->reader);
+}
+
+static void container_open_complete(
+  napi_env env,
+  napi_status status,
+  void* data
+) {
+  struct container_open_data* work = data;
+  if (status == napi_cancelled) work->error = "async work was cancelled";
+  int argc = 0;
+  napi_value argv[2];
+  if (work->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, work->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+    container_reader_free(work->reader);
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_external(
+      env,
+      work->reader,
+      container_reader_finalize,
+      NULL,
+      &argv[1]
+    ));
+    OK(napi_type_tag_object(env, argv[1], &CONTAINER_READER_TYPE_TAG));
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, work->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, work->ref_callback));
+  OK(napi_delete_async_work(env, work->async_work));
+  free(work);
+}
+
+static napi_value container_open(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  if (
+    argc != 3 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_object(env, argv[1]) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, options, callback)");
+  }
+  int64_t depth = ENGINE_DEPTH_DEFAULT;
+  if (
+    !option_int64(env, argv[1], "depth", &depth) ||
+    depth < 1 ||
+    depth > ENGINE_DEPTH_MAX
+  ) {
+    THROW(env, "options.depth must be from 1 to 64");
+  }
+  struct container_reader* reader = calloc(
+    1,
+    sizeof(struct container_reader)
+  );
+  if (!reader) THROW(env, "insufficient memory");
+  reader->fd = fd;
+  reader->depth = (int) depth;
+  struct container_open_data* work = calloc(
+    1,
+    sizeof(struct container_open_data)
+  );
+  if (!work) {
+    container_reader_free(reader);
+    THROW(env, "insufficient memory");
+  }
+  work->reader = reader;
+  OK(napi_create_reference(env, argv[2], 1, &work->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    container_open_execute,
+    container_open_complete,
+    work,
+    &work->async_work
+  ));
+  OK(napi_queue_async_work(env, work->async_work));
+  return NULL;
+}
+
+static napi_value container_info(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct container_reader* reader = NULL;
+  if (
+    argc != 1 ||
+    !arg_container(env, argv[0], &CONTAINER_READER_TYPE_TAG, (void**) &reader)
+  ) {
+    THROW(env, "bad arguments, expected: (reader)");
+  }
+  int64_t bytes = 0;
+  int64_t stored = 0;
+  for (size_t chunk = 0; chunk < reader->chunks_length; chunk++) {
+    bytes += reader->chunks[chunk].length;
+    stored += (int64_t) container_padded(
+      &reader->chunks[chunk],
+      reader->sector
+    );
+  }
+  napi_value result;
+  OK(napi_create_object(env, &result));
+  set_int(env, result, "chunks", (int64_t) reader->chunks_length);
+  set_int(env, result, "sectorSize", reader->sector);
+  set_int(env, result, "size", reader->size);
+  set_int(env, result, "bytes", bytes);
+  set_int(env, result, "storedBytes", stored);
+  napi_value checksum;
+  OK(napi_get_boolean(env, reader->checksum, &checksum));
+  OK(napi_set_named_property(env, result, "checksum", checksum));
+  return result;
+}
+
+struct container_read_data;
+
+struct container_read_part {
+  struct container_read_data* read;
+  size_t start;
+  size_t end;
+  napi_async_work async_work;
+  const char* error;
+};
+
+struct container_read_data {
+  struct container_reader* reader;
+  size_t length;
+  int64_t* chunks;
+  uint8_t** buffers;
+  int outstanding;
+  const char* error;
+  struct container_read_part parts[ENGINE_DEPTH_MAX];
+  napi_ref ref_reader;
+  napi_ref ref_callback;
+};
+
+// Reads each chunk of a part with one aligned read of its padded frame:
+static void container_read_execute(napi_env env, void* data) {
+  struct container_read_part* part = data;
+  struct container_read_data* read = part->read;
+  struct container_reader* reader = read->reader;
+  for (size_t index = part->start; index < part->end; index++) {
+    struct container_chunk* chunk = &reader->chunks[read->chunks[index]];
+    size_t padded = container_padded(chunk, reader->sector);
+    uint8_t* frame = aligned_malloc(padded, SCRATCH_ALIGNMENT);
+    read->buffers[index] = malloc(chunk->length > 0 ? chunk->length : 1);
+    if (!frame || !read->buffers[index]) {
+      if (frame) aligned_free(frame);
+      part->error = "insufficient memory";
+      return;
+    }
+    int64_t result = io_read(reader->fd, frame, padded, chunk->position);
+    if (result < 0) {
+      part->error = io_error(result, "unexpected error, read");
+    } else if (result < (int64_t) chunk->frame) {
+      part->error = "chunk is corrupt";
+    } else {
+      part->error = container_decode(
+        reader,
+        chunk,
+        frame,
+        read->buffers[index]
+      );
+    }
+    aligned_free(frame);
+    if (part->error) return;
+  }
+}
+
+static void container_read_complete(
+  napi_env env,
+  napi_status status,
+  void* data
+) {
+  struct container_read_part* part = data;
+  struct container_read_data* read = part->read;
+  struct container_reader* reader = read->reader;
+  if (status == napi_cancelled) part->error = "async work was cancelled";
+  OK(napi_delete_async_work(env, part->async_work));
+  if (part->error && !read->error) read->error = part->error;
+  if (--read->outstanding > 0) return;
+  int argc = 0;
+  napi_value argv[2];
+  if (read->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, read->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_array_with_length(env, read->length, &argv[1]));
+    for (size_t index = 0; index < read->length; index++) {
+      napi_value buffer;
+      OK(napi_create_buffer_copy(
+        env,
+        reader->chunks[read->chunks[index]].length,
+        read->buffers[index],
+        NULL,
+        &buffer
+      ));
+      OK(napi_set_element(env, argv[1], (uint32_t) index, buffer));
+    }
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, read->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, read->ref_callback));
+  OK(napi_delete_reference(env, read->ref_reader));
+  for (size_t index = 0; index < read->length; index++) {
+    free(read->buffers[index]);
+  }
+  free(read->buffers);
+  free(read->chunks);
+  free(read);
+}
+
+static napi_value container_read(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct container_reader* reader = NULL;
+  bool array = false;
+  if (argc == 3) OK(napi_is_array(env, argv[1], &array));
+  if (
+    argc != 3 ||
+    !arg_container(
+      env,
+      argv[0],
+      &CONTAINER_READER_TYPE_TAG,
+      (void**) &reader
+    ) ||
+    !array ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (reader, chunks, callback)");
+  }
+  uint32_t length = 0;
+  OK(napi_get_array_length(env, argv[1], &length));
+  if (length == 0) THROW(env, "chunks must not be empty");
+  struct container_read_data* read = calloc(
+    1,
+    sizeof(struct container_read_data)
+  );
+  if (read) {
+    read->chunks = calloc(length, sizeof(int64_t));
+    read->buffers = calloc(length, sizeof(uint8_t*));
+  }
+  if (!read || !read->chunks || !read->buffers) {
+    if (read) {
+      free(read->chunks);
+      free(read->buffers);
+    }
+    free(read);
+    THROW(env, "insufficient memory");
+  }
+  read->reader = reader;
+  read->length = length;
+  for (uint32_t index = 0; index < length; index++) {
+    napi_value element;
+    OK(napi_get_element(env, argv[1], index, &element));
+    if (
+      !arg_int64(env, element, &read->chunks[index]) ||
+      read->chunks[index] >= (int64_t) reader->chunks_length
+    ) {
+      free(read->chunks);
+      free(read->buffers);
+      free(read);
+      THROW(env, "chunks must be an array of chunk numbers");
+    }
+  }
+  OK(napi_create_reference(env, argv[0], 1, &read->ref_reader));
+  OK(napi_create_reference(env, argv[2], 1, &read->ref_callback));
+  size_t parts = length < (uint32_t) reader->depth ?
+    length :
+    (size_t) reader->depth;
+  read->outstanding = (int) parts;
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  for (size_t index = 0; index < parts; index++) {
+    struct container_read_part* part = &read->parts[index];
+    part->read = read;
+    part->start = length * index / parts;
+    part->end = length * (index + 1) / parts;
+    OK(napi_create_async_work(
+      env,
+      NULL,
+      name,
+      container_read_execute,
+      container_read_complete,
+      part,
+      &part->async_work
+    ));
+  }
+  for (size_t index = 0; index < parts; index++) {
+    OK(napi_queue_async_work(env, read->parts[index].async_work));
+  }
+  return NULL;
+}
+
+// A scan reads the chunks in order in windows of up to readahead bytes, each
+// with one read, since the chunks are contiguous. The next window is read
+// while the chunks of the current window are passed to onChunk:
+struct container_scan_data;
+
+struct container_window {
+  struct container_scan_data* scan;
+  size_t first;
+  size_t end;
+  uint8_t* buffer;
+  uint8_t** chunks;
+  napi_async_work async_work;
+  const char* error;
+};
+
+struct container_scan_data {
+  struct container_reader* reader;
+  size_t next;
+  size_t end;
+  size_t readahead;
+  int64_t bytes;
+  // Set once onChunk throws, after which the scan calls back no more:
+  int stopped;
+  napi_ref ref_reader;
+  napi_ref ref_on_chunk;
+  napi_ref ref_callback;
+};
+
+static void container_window_execute(napi_env env, void* data) {
+  struct container_window* window = data;
+  struct container_reader* reader = window->scan->reader;
+  if (window->first == window->end) return;
+  struct container_chunk* first = &reader->chunks[window->first];
+  struct container_chunk* last = &reader->chunks[window->end - 1];
+  size_t length = (size_t) (last->position - first->position) +
+    container_padded(last, reader->sector);
+  window->buffer = aligned_malloc(length, SCRATCH_ALIGNMENT);
+  window->chunks = calloc(window->end - window->first, sizeof(uint8_t*));
+  if (!window->buffer || !window->chunks) {
+    window->error = "insufficient memory";
+    return;
+  }
+  int64_t result = io_read(
+    reader->fd,
+    window->buffer,
+    length,
+    first->position
+  );
+  if (result < 0) {
+    window->error = io_error(result, "unexpected error, read");
+    return;
+  }
+  for (size_t index = window->first; index < window->end; index++) {
+    struct container_chunk* chunk = &reader->chunks[index];
+    size_t offset = (size_t) (chunk->position - first->position);
+    uint8_t** target = &window->chunks[index - window->first];
+    if ((int64_t) (offset + chunk->frame) > result) {
+      window->error = "chunk is corrupt";
+      return;
+    }
+    *target = malloc(chunk->length > 0 ? chunk->length : 1);
+    if (!*target) {
+      window->error = "insufficient memory";
+      return;
+    }
+    window->error = container_decode(
+      reader,
+      chunk,
+      window->buffer + offset,
+      *target
+    );
+    if (window->error) return;
+  }
+}
+
+static void container_window_complete(
+  napi_env env,
+  napi_status status,
+  void* data
+);
+
+// Queues a read of the chunks from scan->next which fit in the readahead, or
+// of at least one chunk, or of none if the scan has no chunks:
+static const char* container_window_queue(
+  napi_env env,
+  struct container_scan_data* scan
+) {
+  struct container_reader* reader = scan->reader;
+  struct container_window* window = calloc(
+    1,
+    sizeof(struct container_window)
+  );
+  if (!window) return "insufficient memory";
+  window->scan = scan;
+  window->first = scan->next;
+  window->end = scan->next < scan->end ? scan->next + 1 : scan->next;
+  int64_t start = window->first < scan->end ?
+    reader->chunks[window->first].position :
+    0;
+  while (window->end < scan->end) {
+    struct container_chunk* chunk = &reader->chunks[window->end];
+    int64_t end = chunk->position +
+      (int64_t) container_padded(chunk, reader->sector);
+    if (end - start > (int64_t) scan->readahead) break;
+    window->end++;
+  }
+  scan->next = window->end;
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    container_window_execute,
+    container_window_complete,
+    window,
+    &window->async_work
+  ));
+  OK(napi_queue_async_work(env, window->async_work));
+  return NULL;
+}
+
+static void container_scan_callback(
+  napi_env env,
+  napi_value scope,
+  struct container_scan_data* scan,
+  const char* error
+) {
+  int argc = 0;
+  napi_value argv[2];
+  if (error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_object(env, &argv[1]));
+    set_int(env, argv[1], "chunks", (int64_t) scan->end);
+    set_int(env, argv[1], "bytes", scan->bytes);
+  }
+  napi_value callback;
+  OK(napi_get_reference_value(env, scan->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+}
+
+static void container_window_complete(
+  napi_env env,
+  napi_status status,
+  void* data
+) {
+  struct container_window* window = data;
+  struct container_scan_data* scan = window->scan;
+  struct container_reader* reader = scan->reader;
+  if (status == napi_cancelled) window->error = "async work was cancelled";
+  OK(napi_delete_async_work(env, window->async_work));
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  const char* error = window->error;
+  int more = 0;
+  if (!error && !scan->stopped) {
+    // Read ahead while the chunks of this window are passed to onChunk:
+    if (scan->next < scan->end) {
+      error = container_window_queue(env, scan);
+      more = error == NULL;
+    }
+    napi_value on_chunk;
+    OK(napi_get_reference_value(env, scan->ref_on_chunk, &on_chunk));
+    for (size_t index = window->first; index < window->end; index++) {
+      napi_value argv[2];
+      size_t length = reader->chunks[index].length;
+      OK(napi_create_buffer_copy(
+        env,
+        length,
+        window->chunks[index - window->first],
+        NULL,
+        &argv[0]
+      ));
+      OK(napi_create_int64(env, (int64_t) index, &argv[1]));
+      napi_call_function(env, scope, on_chunk, 2, argv, NULL);
+      // Leave an exception thrown by onChunk to propagate, without calling
+      // into JavaScript again, and let any window read ahead clean up:
+      bool pending = false;
+      OK(napi_is_exception_pending(env, &pending));
+      if (pending) {
+        scan->stopped = 1;
+        break;
+      }
+      scan->bytes += (int64_t) length;
+    }
+  }
+  if (!more) {
+    if (!scan->stopped) container_scan_callback(env, scope, scan, error);
+    // Deleting a reference cannot throw, even with an exception pending:
+    OK(napi_delete_reference(env, scan->ref_callback));
+    OK(napi_delete_reference(env, scan->ref_on_chunk));
+    OK(napi_delete_reference(env, scan->ref_reader));
+    free(scan);
+  }
+  if (window->chunks) {
+    for (size_t index = 0; index < window->end - window->first; index++) {
+      free(window->chunks[index]);
+    }
+    free(window->chunks);
+  }
+  if (window->buffer) aligned_free(window->buffer);
+  free(window);
+}
+
+static napi_value container_scan(napi_env env, napi_callback_info info) {
+  size_t argc = 4;
+  napi_value argv[4];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct container_reader* reader = NULL;
+  if (
+    argc != 4 ||
+    !arg_container(
+      env,
+      argv[0],
+      &CONTAINER_READER_TYPE_TAG,
+      (void**) &reader
+    ) ||
+    !arg_object(env, argv[1]) ||
+    !arg_function(env, argv[2]) ||
+    !arg_function(env, argv[3])
+  ) {
+    THROW(env,
+      "bad arguments, expected: (reader, options, onChunk, callback)"
+    );
+  }
+  int64_t first = 0;
+  int64_t readahead = CONTAINER_READAHEAD_DEFAULT;
+  if (
+    !option_int64(env, argv[1], "first", &first) ||
+    first > (int64_t) reader->chunks_length
+  ) {
+    THROW(env, "options.first must be a chunk number");
+  }
+  if (
+    !option_int64(env, argv[1], "readahead", &readahead) ||
+    readahead < 1 ||
+    readahead > CONTAINER_READAHEAD_MAX
+  ) {
+    THROW(env, "options.readahead must be from 1 to 67108864");
+  }
+  struct container_scan_data* scan = calloc(
+    1,
+    sizeof(struct container_scan_data)
+  );
+  if (!scan) THROW(env, "insufficient memory");
+  scan->reader = reader;
+  scan->next = (size_t) first;
+  scan->end = reader->chunks_length;
+  scan->readahead = (size_t) readahead;
+  OK(napi_create_reference(env, argv[0], 1, &scan->ref_reader));
+  OK(napi_create_reference(env, argv[2], 1, &scan->ref_on_chunk));
+  OK(napi_create_reference(env, argv[3], 1, &scan->ref_callback));
+  const char* error = container_window_queue(env, scan);
+  if (error) {
+    OK(napi_delete_reference(env, scan->ref_callback));
+    OK(napi_delete_reference(env, scan->ref_on_chunk));
+    OK(napi_delete_reference(env, scan->ref_reader));
+    free(scan);
+    THROW(env, error);
+  }
+  return NULL;
+}
+
+// An arena is an anonymous file for spilling to disk, such as the runs of an
+// external sort. On Linux the file is opened with O_TMPFILE, so that it never
+// has a name, and elsewhere it is unlinked as soon as it is created (or is
+// deleted on close on Windows), so that its space is freed when the arena is
+// closed or the process exits or crashes. The file is opened for direct I/O
+// where the filesystem supports it.
+//
+// Extents of blockSize blocks are allocated first fit from a sorted list of
+// free extents, or else from the end of the file, and a released extent has
+// its space punched out of the file before it may be allocated again, so that
+// the punch can never erase a write of the next owner. An extent counts its
+// reads and writes in flight, and may not be released until they have called
+// back, so that neither can land after the extent is allocated again.
+#define ARENA_ALIGNMENT 4096
+#define ARENA_BLOCK_MIN 4096
+#define ARENA_BLOCK_MAX 16777216
+#define ARENA_BLOCK_DEFAULT 65536
+#define ARENA_READ 0
+#define ARENA_WRITE 1
+#define ARENA_RELEASE 2
+
+static const napi_type_tag ARENA_TYPE_TAG = {
+  0x6172656e61000001ULL, 0xb3d0971c4e265fa8ULL
+};
+
+struct arena_extent {
+  int64_t start;
+  int64_t count;
+  // The reads and writes in flight, of an allocated extent:
+  int64_t pending;
+};
+
+struct arena_extents {
+  struct arena_extent* items;
+  size_t length;
+  size_t capacity;
+};
+
+struct arena {
+  int fd;
+  int closed;
+  int direct;
+  int tmpfile;
+  int64_t block;
+  // The number of blocks below which every block is allocated or free:
+  int64_t end;
+  struct arena_extents used;
+  struct arena_extents free;
+  int pending;
+};
+
+// Returns the index of the last extent which starts at or before a block, or
+// -1 if there is none:
+static int64_t arena_find(struct arena_extents* list, int64_t block) {
+  int64_t low = 0;
+  int64_t high = (int64_t) list->length - 1;
+  int64_t found = -1;
+  while (low <= high) {
+    int64_t middle = low + (high - low) / 2;
+    if (list->items[middle].start <= block) {
+      found = middle;
+      low = middle + 1;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return found;
+}
+
+static int arena_insert(
+  struct arena_extents* list,
+  size_t index,
+  int64_t start,
+  int64_t count
+) {
+  if (list->length == list->capacity) {
+    size_t capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+    struct arena_extent* items = realloc(
+      list->items,
+      capacity * sizeof(struct arena_extent)
+    );
+    if (!items) return 0;
+    list->items = items;
+    list->capacity = capacity;
+  }
+  memmove(
+    list->items + index + 1,
+    list->items + index,
+    (list->length - index) * sizeof(struct arena_extent)
+  );
+  list->items[index].start = start;
+  list->items[index].count = count;
+  list->items[index].pending = 0;
+  list->length++;
+  return 1;
+}
+
+static void arena_remove(struct arena_extents* list, size_t index) {
+  memmove(
+    list->items + index,
+    list->items + index + 1,
+    (list->length - index - 1) * sizeof(struct arena_extent)
+  );
+  list->length--;
+}
+
+// Returns a released extent to the free list, merged with its neighbours, and
+// moves the end of the arena back over any free extent at the end:
+static int arena_release_blocks(
+  struct arena* arena,
+  int64_t start,
+  int64_t count
+) {
+  struct arena_extents* list = &arena->free;
+  size_t index = (size_t) (arena_find(list, start) + 1);
+  if (index > 0 && list->items[index - 1].start +
+    list->items[index - 1].count == start) {
+    index--;
+    list->items[index].count += count;
+  } else if (!arena_insert(list, index, start, count)) {
+    return 0;
+  }
+  if (
+    index + 1 < list->length &&
+    list->items[index].start + list->items[index].count ==
+      list->items[index + 1].start
+  ) {
+    list->items[index].count += list->items[index + 1].count;
+    arena_remove(list, index + 1);
+  }
+  struct arena_extent* last = &list->items[list->length - 1];
+  if (last->start + last->count == arena->end) {
+    arena->end = last->start;
+    list->length--;
+  }
+  return 1;
+}
+
+static void arena_close_fd(struct arena* arena) {
+  if (arena->closed) return;
+  arena->closed = 1;
+  uv_fs_t req;
+  uv_fs_close(NULL, &req, arena->fd, NULL);
+  uv_fs_req_cleanup(&req);
+}
+
+static void arena_free(struct arena* arena) {
+  arena_close_fd(arena);
+  free(arena->used.items);
+  free(arena->free.items);
+  free(arena);
+}
+
+static void arena_finalize(napi_env env, void* data, void* hint) {
+  arena_free(data);
+}
+
+static int arg_arena(napi_env env, napi_value value, struct arena** arena) {
+  napi_valuetype type;
+  OK(napi_typeof(env, value, &type));
+  if (type != napi_external) return 0;
+  bool tagged = false;
+  OK(napi_check_object_type_tag(env, value, &ARENA_TYPE_TAG, &tagged));
+  if (!tagged) return 0;
+  OK(napi_get_value_external(env, value, (void**) arena));
+  return 1;
+}
+
+struct arena_open_data {
+  struct arena* arena;
+  char* dir;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static void arena_open_execute(napi_env env, void* data) {
+  struct arena_open_data* work = data;
+  struct arena* arena = work->arena;
+  arena->fd = -1;
+#if defined(_WIN32)
+  // The file is deleted by Windows once its last handle is closed:
+  size_t length = strlen(work->dir) + 64;
+  char* path = malloc(length);
+  if (!path) {
+    work->error = "insufficient memory";
+    return;
+  }
+  snprintf(
+    path,
+    length,
+    "%s\\arena-%d-%llu.tmp",
+    work->dir,
+    (int) uv_os_getpid(),
+    (unsigned long long) uv_hrtime()
+  );
+  int flags = UV_FS_O_CREAT | UV_FS_O_EXCL | UV_FS_O_RDWR |
+    UV_FS_O_TEMPORARY;
+  for (int direct = 1; direct >= 0 && arena->fd < 0 && !work->error; direct--) {
+    uv_fs_t req;
+    int result = uv_fs_open(
+      NULL,
+      &req,
+      path,
+      flags | (direct ? UV_FS_O_DIRECT : 0),
+      0600,
+      NULL
+    );
+    uv_fs_req_cleanup(&req);
+    if (result >= 0) {
+      arena->fd = result;
+      arena->direct = direct;
+    } else if (result != UV_EINVAL || !direct) {
+      work->error = io_error(result, "unexpected error, open");
+    }
+  }
+  free(path);
+#else
+#if defined(__linux__) && defined(O_TMPFILE)
+  arena->fd = open(
+    work->dir,
+    O_TMPFILE | O_RDWR | O_CLOEXEC | get_o_direct(),
+    0600
+  );
+  if (arena->fd >= 0) arena->direct = 1;
+  // A filesystem without direct I/O (such as tmpfs) fails with EINVAL:
+  if (arena->fd < 0 && errno == EINVAL) {
+    arena->fd = open(work->dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  }
+  if (arena->fd >= 0) {
+    arena->tmpfile = 1;
+  } else if (errno != EOPNOTSUPP && errno != EISDIR) {
+    work->error = io_error(-errno, "unexpected error, open");
+    return;
+  }
+#endif
+  if (arena->fd < 0) {
+    size_t length = strlen(work->dir) + 16;
+    char* path = malloc(length);
+    if (!path) {
+      work->error = "insufficient memory";
+      return;
+    }
+    snprintf(path, length, "%s/.arena-XXXXXX", work->dir);
+    arena->fd = mkstemp(path);
+    if (arena->fd < 0) {
+      work->error = io_error(-errno, "unexpected error, mkstemp");
+      free(path);
+      return;
+    }
+    unlink(path);
+    free(path);
+    fcntl(arena->fd, F_SETFD, FD_CLOEXEC);
+#if defined(__APPLE__)
+    arena->direct = fcntl(arena->fd, F_NOCACHE, 1) == 0;
+#elif defined(__linux__)
+    int flags = fcntl(arena->fd, F_GETFL);
+    arena->direct = flags != -1 &&
+      fcntl(arena->fd, F_SETFL, flags | get_o_direct()) == 0;
+#endif
+  }
+#endif
+}
+
+static void arena_open_complete(napi_env env, napi_status status, void* data) {
+  struct arena_open_data* work = data;
+  if (status == napi_cancelled) work->error = "async work was cancelled";
+  int argc = 0;
+  napi_value argv[2];
+  if (work->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, work->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+    if (work->arena->fd < 0) work->arena->closed = 1;
+    arena_free(work->arena);
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_external(env, work->arena, arena_finalize, NULL, &argv[1]));
+    OK(napi_type_tag_object(env, argv[1], &ARENA_TYPE_TAG));
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, work->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, work->ref_callback));
+  OK(napi_delete_async_work(env, work->async_work));
+  free(work->dir);
+  free(work);
+}
+
+static napi_value arena_open(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  napi_valuetype type = napi_undefined;
+  if (argc == 3) OK(napi_typeof(env, argv[0], &type));
+  if (
+    argc != 3 ||
+    type != napi_string ||
+    !arg_object(env, argv[1]) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (dir, options, callback)");
+  }
+  int64_t block = ARENA_BLOCK_DEFAULT;
+  if (
+    !option_int64(env, argv[1], "blockSize", &block) ||
+    block < ARENA_BLOCK_MIN ||
+    block > ARENA_BLOCK_MAX ||
+    (block & (block - 1))
+  ) {
+    THROW(env, "options.blockSize must be a power of 2 from 4096 to 16777216");
+  }
+  size_t length = 0;
+  OK(napi_get_value_string_utf8(env, argv[0], NULL, 0, &length));
+  if (length == 0) THROW(env, "dir must not be empty");
+  struct arena_open_data* work = calloc(1, sizeof(struct arena_open_data));
+  if (work) {
+    work->arena = calloc(1, sizeof(struct arena));
+    work->dir = malloc(length + 1);
+  }
+  if (!work || !work->arena || !work->dir) {
+    if (work) {
+      free(work->arena);
+      free(work->dir);
+    }
+    free(work);
+    THROW(env, "insufficient memory");
+  }
+  OK(napi_get_value_string_utf8(env, argv[0], work->dir, length + 1, NULL));
+  work->arena->block = block;
+  OK(napi_create_reference(env, argv[2], 1, &work->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    arena_open_execute,
+    arena_open_complete,
+    work,
+    &work->async_work
+  ));
+  OK(napi_queue_async_work(env, work->async_work));
+  return NULL;
+}
+
+static napi_value arena_allocate(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct arena* arena = NULL;
+  int64_t length = 0;
+  if (
+    argc != 2 ||
+    !arg_arena(env, argv[0], &arena) ||
+    !arg_int64(env, argv[1], &length)
+  ) {
+    THROW(env, "bad arguments, expected: (arena, length)");
+  }
+  if (arena->closed) THROW(env, "arena is closed");
+  if (length == 0) THROW(env, "length must not be 0");
+  int64_t count = (length + arena->block - 1) / arena->block;
+  int64_t start = arena->end;
+  size_t index = 0;
+  for (; index < arena->free.length; index++) {
+    if (arena->free.items[index].count >= count) break;
+  }
+  if (index < arena->free.length) {
+    struct arena_extent* extent = &arena->free.items[index];
+    start = extent->start;
+    extent->start += count;
+    extent->count -= count;
+    if (extent->count == 0) arena_remove(&arena->free, index);
+  } else {
+    arena->end += count;
+  }
+  size_t position = (size_t) (arena_find(&arena->used, start) + 1);
+  if (!arena_insert(&arena->used, position, start, count)) {
+    arena_release_blocks(arena, start, count);
+    THROW(env, "insufficient memory");
+  }
+  napi_value result;
+  OK(napi_create_int64(env, start * arena->block, &result));
+  return result;
+}
+
+struct arena_io {
+  struct arena* arena;
+  int op;
+  int64_t position;
+  uint8_t* buffer;
+  size_t length;
+  // A bounce buffer, for a buffer or length not aligned for direct I/O:
+  uint8_t* bounce;
+  size_t bounce_length;
+  int64_t count;
+  napi_ref ref_arena;
+  napi_ref ref_buffer;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static void arena_io_execute(napi_env env, void* data) {
+  struct arena_io* io = data;
+  int fd = io->arena->fd;
+  if (io->op == ARENA_RELEASE) {
+    int64_t result = io_punch(
+      fd,
+      io->position,
+      io->count * io->arena->block
+    );
+    // Without hole punching, the space is reused but not returned:
+    if (result < 0 && result != UV_ENOTSUP && result != UV_EINVAL) {
+      io->error = io_error(result, "unexpected error, punch");
+    }
+    return;
+  }
+  uint8_t* target = io->bounce ? io->bounce : io->buffer;
+  size_t length = io->bounce ? io->bounce_length : io->length;
+  if (io->op == ARENA_WRITE) {
+    // Read the rest of a partial last 4096 bytes, so as not to clobber it:
+    if (io->length % ARENA_ALIGNMENT != 0) {
+      size_t tail = io->bounce_length - ARENA_ALIGNMENT;
+      int64_t result = io_read(
+        fd,
+        io->bounce + tail,
+        ARENA_ALIGNMENT,
+        io->position + (int64_t) tail
+      );
+      if (result < 0) {
+        io->error = io_error(result, "unexpected error, read");
+        return;
+      }
+      if (result < ARENA_ALIGNMENT) {
+        memset(
+          io->bounce + tail + result,
+          0,
+          ARENA_ALIGNMENT - (size_t) result
+        );
+      }
+    }
+    if (io->bounce) memcpy(io->bounce, io->buffer, io->length);
+    int64_t result = io_write(fd, target, length, io->position);
+    if (result < 0) io->error = io_error(result, "unexpected error, write");
+    return;
+  }
+  int64_t result = io_read(fd, target, length, io->position);
+  if (result < 0) {
+    io->error = io_error(result, "unexpected error, read");
+    return;
+  }
+  // An extent which has yet to be written past the end of the file reads as
+  // zeroes:
+  if ((size_t) result < length) {
+    memset(target + result, 0, length - (size_t) result);
+  }
+  if (io->bounce) memcpy(io->buffer, io->bounce, io->length);
+}
+
+static void arena_io_complete(napi_env env, napi_status status, void* data) {
+  struct arena_io* io = data;
+  struct arena* arena = io->arena;
+  if (status == napi_cancelled) io->error = "async work was cancelled";
+  arena->pending--;
+  int64_t start = io->position / arena->block;
+  if (io->op == ARENA_RELEASE) {
+    if (!arena_release_blocks(arena, start, io->count) && !io->error) {
+      io->error = "insufficient memory";
+    }
+  } else {
+    // The extent cannot have been released while this was in flight:
+    int64_t index = arena_find(&arena->used, start);
+    assert(index >= 0 && arena->used.items[index].pending > 0);
+    arena->used.items[index].pending--;
+  }
+  int argc = 0;
+  napi_value argv[2];
+  if (io->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, io->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_object(env, &argv[1]));
+    int64_t bytes = io->op == ARENA_RELEASE ?
+      io->count * arena->block :
+      (int64_t) io->length;
+    set_int(env, argv[1], "bytes", bytes);
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, io->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, io->ref_callback));
+  OK(napi_delete_reference(env, io->ref_arena));
+  if (io->ref_buffer) OK(napi_delete_reference(env, io->ref_buffer));
+  OK(napi_delete_async_work(env, io->async_work));
+  if (io->bounce) bounce_free(io->bounce, io->bounce_length);
+  free(io);
+}
+
+static napi_value arena_queue(
+  napi_env env,
+  napi_value* argv,
+  struct arena_io* io
+) {
+  io->arena->pending++;
+  OK(napi_create_reference(env, argv[0], 1, &io->ref_arena));
+  if (io->op != ARENA_RELEASE) {
+    OK(napi_create_reference(env, argv[2], 1, &io->ref_buffer));
+  }
+  napi_value callback = argv[io->op == ARENA_RELEASE ? 2 : 3];
+  OK(napi_create_reference(env, callback, 1, &io->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    arena_io_execute,
+    arena_io_complete,
+    io,
+    &io->async_work
+  ));
+  OK(napi_queue_async_work(env, io->async_work));
+  return NULL;
+}
+
+static napi_value arena_transfer(
+  napi_env env,
+  napi_callback_info info,
+  int op
+) {
+  size_t argc = 4;
+  napi_value argv[4];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct arena* arena = NULL;
+  int64_t position = 0;
+  uint8_t* buffer = NULL;
+  size_t length = 0;
+  if (
+    argc != 4 ||
+    !arg_arena(env, argv[0], &arena) ||
+    !arg_int64(env, argv[1], &position) ||
+    !arg_buffer(env, argv[2], &buffer, &length) ||
+    !arg_function(env, argv[3])
+  ) {
+    THROW(env, "bad arguments, expected: (arena, position, buffer, callback)");
+  }
+  if (arena->closed) THROW(env, "arena is closed");
+  if (position % ARENA_ALIGNMENT != 0) {
+    THROW(env, "position must be a multiple of 4096");
+  }
+  int64_t index = arena_find(&arena->used, position / arena->block);
+  int64_t end = 0;
+  if (index >= 0) {
+    struct arena_extent* extent = &arena->used.items[index];
+    end = (extent->start + extent->count) * arena->block;
+  }
+  if (position >= end || (int64_t) length > end - position) {
+    THROW(env, "position + buffer.length must be within an allocated extent");
+  }
+  if (length == 0) THROW(env, "buffer must not be empty");
+  struct arena_io* io = calloc(1, sizeof(struct arena_io));
+  if (!io) THROW(env, "insufficient memory");
+  io->arena = arena;
+  io->op = op;
+  io->position = position;
+  io->buffer = buffer;
+  io->length = length;
+  // The padding stays within the extent, whose end is aligned:
+  if (
+    ((uintptr_t) buffer % ARENA_ALIGNMENT) != 0 ||
+    length % ARENA_ALIGNMENT != 0
+  ) {
+    io->bounce_length = (length + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT *
+      ARENA_ALIGNMENT;
+    io->bounce = bounce_alloc(io->bounce_length);
+    if (!io->bounce) {
+      free(io);
+      THROW(env, "insufficient memory");
+    }
+  }
+  arena->used.items[index].pending++;
+  return arena_queue(env, argv, io);
+}
+
+static napi_value arena_read(napi_env env, napi_callback_info info) {
+  return arena_transfer(env, info, ARENA_READ);
+}
+
+static napi_value arena_write(napi_env env, napi_callback_info info) {
+  return arena_transfer(env, info, ARENA_WRITE);
+}
+
+static napi_value arena_release(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct arena* arena = NULL;
+  int64_t position = 0;
+  if (
+    argc != 3 ||
+    !arg_arena(env, argv[0], &arena) ||
+    !arg_int64(env, argv[1], &position) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (arena, position, callback)");
+  }
+  if (arena->closed) THROW(env, "arena is closed");
+  int64_t index = arena_find(&arena->used, position / arena->block);
+  if (
+    index < 0 ||
+    position != arena->used.items[index].start * arena->block
+  ) {
+    THROW(env, "position must be the start of an allocated extent");
+  }
+  if (arena->used.items[index].pending > 0) {
+    THROW(env, "extent has I/O in flight");
+  }
+  struct arena_io* io = calloc(1, sizeof(struct arena_io));
+  if (!io) THROW(env, "insufficient memory");
+  io->arena = arena;
+  io->op = ARENA_RELEASE;
+  io->position = position;
+  io->count = arena->used.items[index].count;
+  // The extent may not be read or written from now on, but is only free once
+  // its space has been punched:
+  arena_remove(&arena->used, (size_t) index);
+  return arena_queue(env, argv, io);
+}
+
+static napi_value arena_close(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct arena* arena = NULL;
+  if (argc != 1 || !arg_arena(env, argv[0], &arena)) {
+    THROW(env, "bad arguments, expected: (arena)");
+  }
+  if (arena->pending > 0) THROW(env, "arena has I/O in flight");
+  arena_close_fd(arena);
+  return NULL;
+}
+
+static napi_value arena_stats(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct arena* arena = NULL;
+  if (argc != 1 || !arg_arena(env, argv[0], &arena)) {
+    THROW(env, "bad arguments, expected: (arena)");
+  }
+  int64_t used = 0;
+  int64_t free_blocks = 0;
+  for (size_t index = 0; index < arena->used.length; index++) {
+    used += arena->used.items[index].count;
+  }
+  for (size_t index = 0; index < arena->free.length; index++) {
+    free_blocks += arena->free.items[index].count;
+  }
+  napi_value result;
+  OK(napi_create_object(env, &result));
+  set_int(env, result, "blockSize", arena->block);
+  set_int(env, result, "size", arena->end * arena->block);
+  set_int(env, result, "allocatedBytes", used * arena->block);
+  set_int(env, result, "freeBytes", free_blocks * arena->block);
+  set_int(env, result, "extents", (int64_t) arena->used.length);
+  set_int(env, result, "freeExtents", (int64_t) arena->free.length);
+  napi_value value;
+  OK(napi_get_boolean(env, arena->direct, &value));
+  OK(napi_set_named_property(env, result, "direct", value));
+  OK(napi_get_boolean(env, arena->tmpfile, &value));
+  OK(napi_set_named_property(env, result, "tmpfile", value));
+  OK(napi_get_boolean(env, arena->closed, &value));
+  OK(napi_set_named_property(env, result, "closed", value));
+  return result;
+}
+
+static napi_value merkle_close(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct merkle* tree = NULL;
+  if (argc != 1 || !arg_merkle(env, argv[0], &tree)) {
+    THROW(env, "bad arguments, expected: (tree)");
+  }
+  uv_mutex_lock(&tree->mutex);
+  merkle_unmap(tree);
+  uv_mutex_unlock(&tree->mutex);
+  return NULL;
+}
+
+static napi_value merkle_node_buffer(
+  napi_env env,
+  struct merkle* tree,
+  int level,
+  int64_t index
+) {
+  napi_value result;
+  void* data = NULL;
+  OK(napi_create_buffer(env, MERKLE_HASH, &data, &result));
+  uv_mutex_lock(&tree->mutex);
+  int open = tree->map != NULL;
+  if (open) memcpy(data, merkle_node(tree, level, index), MERKLE_HASH);
+  uv_mutex_unlock(&tree->mutex);
+  if (!open) THROW(env, "tree was closed");
+  return result;
+}
+
+static napi_value merkle_node_get(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct merkle* tree = NULL;
+  int level = 0;
+  int64_t index = 0;
+  if (
+    argc != 3 ||
+    !arg_merkle(env, argv[0], &tree) ||
+    !arg_int(env, argv[1], &level) ||
+    !arg_int64(env, argv[2], &index)
+  ) {
+    THROW(env, "bad arguments, expected: (tree, level, index)");
+  }
+  if (level >= tree->levels || index >= tree->level_count[level]) {
+    THROW(env, "level and index must address a node of the tree");
+  }
+  return merkle_node_buffer(env, tree, level, index);
+}
+
+static napi_value merkle_open_sidecar(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  if (
+    argc != 2 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_object(env, argv[1])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, options)");
+  }
+  napi_value options = argv[1];
+  napi_value size_value;
+  int64_t size = 0;
+  int64_t leaf = MERKLE_LEAF_DEFAULT;
+  if (
+    !option_value(env, options, "size", &size_value) ||
+    !arg_int64(env, size_value, &size) ||
+    size == 0
+  ) {
+    THROW(env, "options.size must be a positive safe integer");
+  }
+  if (
+    !option_int64(env, options, "leafSize", &leaf) ||
+    leaf < MERKLE_LEAF_MIN ||
+    leaf > MERKLE_LEAF_MAX ||
+    (leaf & (leaf - 1)) != 0
+  ) {
+    THROW(env, "options.leafSize must be a power of 2 from 4096 to 1048576");
+  }
+  struct merkle* tree = calloc(1, sizeof(struct merkle));
+  if (!tree) THROW(env, "insufficient memory");
+  tree->size = size;
+  tree->leaf = leaf;
+  tree->leaves = (size + leaf - 1) / leaf;
+  const char* error = merkle_open(tree, fd);
+  if (error) {
+    free(tree);
+    THROW(env, error);
+  }
+  int mutex = uv_mutex_init(&tree->mutex);
+  assert(mutex == 0);
+  napi_value result;
+  OK(napi_create_external(env, tree, merkle_finalize, NULL, &result));
+  OK(napi_type_tag_object(env, result, &MERKLE_TYPE_TAG));
+  return result;
+}
+
+static napi_value merkle_rebuild(napi_env env, napi_callback_info info) {
+  size_t argc = 5;
+  napi_value argv[5];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  struct merkle* tree = NULL;
+  if (
+    argc != 5 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_merkle(env, argv[1], &tree) ||
+    !arg_object(env, argv[2]) ||
+    !arg_progress(env, argv[3]) ||
+    !arg_function(env, argv[4])
+  ) {
+    THROW(env,
+      "bad arguments, expected: (fd, tree, options, onProgress, callback)"
+    );
+  }
+  struct rebuild_data* rebuild = calloc(1, sizeof(struct rebuild_data));
+  if (!rebuild) THROW(env, "insufficient memory");
+  struct engine* engine = &rebuild->engine;
+  const char* error = engine_options(env, argv[2], engine);
+  if (error) {
+    free(rebuild);
+    THROW(env, error);
+  }
+  rebuild->fd = fd;
+  rebuild->tree = tree;
+  // Every block must be whole leaves:
+  size_t leaf = (size_t) tree->leaf;
+  if (engine->block < leaf) engine->block = leaf;
+  engine->block -= engine->block % leaf;
+  engine->start = 0;
+  engine->end = tree->size;
+  engine->buffers = 1;
+  engine->run = rebuild_run;
+  engine->finish = rebuild_finish;
+  OK(napi_create_reference(env, argv[1], 1, &engine->ref_keep));
+  return engine_queue(env, engine, argv[3], argv[4]);
+}
+
+static napi_value merkle_root(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct merkle* tree = NULL;
+  if (argc != 1 || !arg_merkle(env, argv[0], &tree)) {
+    THROW(env, "bad arguments, expected: (tree)");
+  }
+  return merkle_node_buffer(env, tree, tree->levels - 1, 0);
+}
+
+struct merkle_sync_data {
+  struct merkle* tree;
+  napi_ref ref_tree;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static void merkle_sync_execute(napi_env env, void* data) {
+  struct merkle_sync_data* sync = data;
+  struct merkle* tree = sync->tree;
+  uv_mutex_lock(&tree->mutex);
+  if (tree->map == NULL) {
+    sync->error = "tree was closed";
+  } else {
+    int result = merkle_flush(tree);
+    if (result < 0) sync->error = io_error(result, "unexpected error, msync");
+  }
+  uv_mutex_unlock(&tree->mutex);
+}
+
+static void merkle_sync_complete(napi_env env, napi_status status, void* data) {
+  struct merkle_sync_data* sync = data;
+  if (status == napi_cancelled) sync->error = "async work was cancelled";
+  int argc = 0;
+  napi_value argv[1];
+  if (sync->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, sync->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, sync->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, sync->ref_tree));
+  OK(napi_delete_reference(env, sync->ref_callback));
+  OK(napi_delete_async_work(env, sync->async_work));
+  free(sync);
+}
+
+static napi_value merkle_sync(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct merkle* tree = NULL;
+  if (
+    argc != 2 ||
+    !arg_merkle(env, argv[0], &tree) ||
+    !arg_function(env, argv[1])
+  ) {
+    THROW(env, "bad arguments, expected: (tree, callback)");
+  }
+  struct merkle_sync_data* sync = calloc(1, sizeof(struct merkle_sync_data));
+  if (!sync) THROW(env, "insufficient memory");
+  sync->tree = tree;
+  OK(napi_create_reference(env, argv[0], 1, &sync->ref_tree));
+  OK(napi_create_reference(env, argv[1], 1, &sync->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    merkle_sync_execute,
+    merkle_sync_complete,
+    sync,
+    &sync->async_work
+  ));
+  OK(napi_queue_async_work(env, sync->async_work));
+  return NULL;
+}
+
+static napi_value popcount(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  uint8_t* buffer = NULL;
+  size_t length = 0;
+  int threads = simd_threads(env, argv, argc, 1);
+  if (
+    argc < 1 ||
+    argc > 2 ||
+    !arg_buffer(env, argv[0], &buffer, &length) ||
+    threads == 0
+  ) {
+    THROW(env, "bad arguments, expected: (buffer, threads=1..64)");
+  }
+  uint64_t result = simd_run(SIMD_POPCOUNT, buffer, NULL, length, 0, threads);
+  napi_value value;
+  OK(napi_create_int64(env, (int64_t) result, &value));
+  return value;
+}
+
+static napi_value xor_into(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  uint8_t* target = NULL;
+  uint8_t* source = NULL;
+  size_t target_length = 0;
+  size_t source_length = 0;
+  int threads = simd_threads(env, argv, argc, 2);
+  if (
+    argc < 2 ||
+    argc > 3 ||
+    !arg_buffer(env, argv[0], &target, &target_length) ||
+    !arg_buffer(env, argv[1], &source, &source_length) ||
+    threads == 0
+  ) {
+    THROW(env, "bad arguments, expected: (target, source, threads=1..64)");
+  }
+  if (target_length != source_length) {
+    THROW(env, "target.length must equal source.length");
+  }
+  simd_run(SIMD_XOR_INTO, target, source, target_length, 0, threads);
+  return NULL;
+}
+
+static napi_value apply_delta(napi_env env, napi_callback_info info) {
+  size_t argc = 6;
+  napi_value argv[6];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd_source = 0;
+  int fd_target = 0;
+  bool is_array = false;
+  if (
+    argc != 6 ||
+    !arg_int(env, argv[0], &fd_source) ||
+    !arg_int(env, argv[1], &fd_target) ||
+    napi_is_array(env, argv[2], &is_array) != napi_ok ||
+    !is_array ||
+    !arg_object(env, argv[3]) ||
+    !arg_progress(env, argv[4]) ||
+    !arg_function(env, argv[5])
+  ) {
+    THROW(env,
+      "bad arguments, expected: "
+      "(srcFd, dstFd, ranges, options, onProgress, callback)"
+    );
+  }
+  uint32_t length = 0;
+  OK(napi_get_array_length(env, argv[2], &length));
+  struct copy_data* copy = calloc(1, sizeof(struct copy_data));
+  if (!copy) THROW(env, "insufficient memory");
+  copy->ranges = malloc(sizeof(int64_t) * 2 * (length > 0 ? length : 1));
+  copy->ranges_start = malloc(sizeof(int64_t) * (length > 0 ? length : 1));
+  const char* error = NULL;
+  if (!copy->ranges || !copy->ranges_start) error = "insufficient memory";
+  int64_t total = 0;
+  for (uint32_t index = 0; !error && index < length; index++) {
+    napi_value range;
+    napi_value offset;
+    napi_value bytes;
+    int64_t* pair = copy->ranges + index * 2;
+    pair[0] = 0;
+    pair[1] = 0;
+    OK(napi_get_element(env, argv[2], index, &range));
+    if (
+      !arg_object(env, range) ||
+      !option_value(env, range, "offset", &offset) ||
+      !option_value(env, range, "length", &bytes) ||
+      !arg_int64(env, offset, &pair[0]) ||
+      !arg_int64(env, bytes, &pair[1]) ||
+      pair[1] > 9007199254740991 - pair[0] ||
+      pair[1] > 9007199254740991 - total
+    ) {
+      error = "ranges must be an array of { offset, length } objects";
+    } else {
+      copy->ranges_start[index] = total;
+      total += pair[1];
+    }
+  }
+  if (!error) error = copy_options(env, argv[3], copy);
+  if (error) {
+    if (copy->ranges) free(copy->ranges);
+    if (copy->ranges_start) free(copy->ranges_start);
+    free(copy);
+    THROW(env, error);
+  }
+  copy->fd_source = fd_source;
+  copy->fd_target = fd_target;
+  copy->ranges_length = length;
+  copy->engine.start = 0;
+  copy->engine.end = total;
+  return copy_queue(env, copy, argv[4], argv[5]);
+}
+
+static napi_value build_index(napi_env env, napi_callback_info info) {
+  return index_queue(env, info, 0);
+}
+
+static napi_value compute_delta(napi_env env, napi_callback_info info) {
+  return index_queue(env, info, 1);
+}
+
+static napi_value chunker_create(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  if (argc != 1 || !arg_object(env, argv[0])) {
+    THROW(env, "bad arguments, expected: (options)");
+  }
+  napi_value options = argv[0];
+  int64_t avg = 65536;
+  if (
+    !option_int64(env, options, "avgSize", &avg) ||
+    avg < CDC_AVG_MIN ||
+    avg > CDC_AVG_MAX ||
+    (avg & (avg - 1)) != 0
+  ) {
+    THROW(env, "options.avgSize must be a power of 2 from 256 to 16777216");
+  }
+  int64_t min = avg / 4;
+  int64_t max = avg * 4;
+  if (
+    !option_int64(env, options, "minSize", &min) ||
+    min < CDC_WINDOW ||
+    min > avg
+  ) {
+    THROW(env, "options.minSize must be from 64 to options.avgSize");
+  }
+  if (
+    !option_int64(env, options, "maxSize", &max) ||
+    max < avg ||
+    max > CDC_SIZE_MAX
+  ) {
+    THROW(env, "options.maxSize must be from options.avgSize to 268435456");
+  }
+  size_t (*find)(const uint8_t*, size_t, size_t, uint64_t) = cdc_find;
+  char kernel[8] = { 0 };
+  napi_value kernel_value;
+  if (option_value(env, options, "kernel", &kernel_value)) {
+    size_t kernel_length = 0;
+    if (
+      napi_get_value_string_utf8(
+        env,
+        kernel_value,
+        kernel,
+        sizeof(kernel),
+        &kernel_length
+      ) != napi_ok || (
+        strcmp(kernel, "scalar") != 0 &&
+        strcmp(kernel, "avx2") != 0 &&
+        strcmp(kernel, "avx512") != 0
+      )
+    ) {
+      THROW(env, "options.kernel must be \"scalar\", \"avx2\" or \"avx512\"");
+    }
+    if (!cdc_select(kernel, &find)) {
+      THROW(env, "options.kernel is not supported by this CPU");
+    }
+  }
+  struct chunker* chunker = calloc(1, sizeof(struct chunker));
+  if (!chunker) THROW(env, "insufficient memory");
+  chunker->find = find;
+  int bits = 0;
+  while (((int64_t) 1 << bits) < avg) bits++;
+  chunker->min = min;
+  chunker->avg = avg;
+  chunker->max = max;
+  // Normalized chunking, level 1:
+  chunker->mask_hard = cdc_mask(bits + 1);
+  chunker->mask_easy = cdc_mask(bits - 1);
+  chunker_reset(chunker);
+  napi_value result;
+  OK(napi_create_external(env, chunker, chunker_finalize, NULL, &result));
+  OK(napi_type_tag_object(env, result, &CHUNKER_TYPE_TAG));
+  return result;
+}
+
+static napi_value chunker_finish(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct chunker* chunker = NULL;
+  if (argc != 1 || !arg_chunker(env, argv[0], &chunker)) {
+    THROW(env, "bad arguments, expected: (chunker)");
+  }
+  if (chunker->busy) THROW(env, "chunker is busy");
+  napi_value result;
+  if (chunker->position == chunker->start) {
+    OK(napi_get_null(env, &result));
+  } else {
+    struct cdc_chunk chunk;
+    chunk.offset = chunker->start;
+    chunk.length = chunker->position - chunker->start;
+    blake3_finalize(&chunker->hasher, chunk.hash);
+    result = chunk_object(env, &chunk);
+  }
+  chunker_reset(chunker);
+  return result;
+}
+
+struct chunker_data {
+  struct chunker* chunker;
+  const uint8_t* buffer;
+  size_t length;
+  struct cdc_chunk* chunks;
+  size_t chunks_length;
+  napi_ref ref_chunker;
+  napi_ref ref_buffer;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+static void chunker_execute(napi_env env, void* data) {
+  struct chunker_data* work = data;
+  if (
+    !chunker_update(
+      work->chunker,
+      work->buffer,
+      work->length,
+      &work->chunks,
+      &work->chunks_length
+    )
+  ) {
+    work->error = "insufficient memory";
+  }
+}
+
+static void chunker_complete(napi_env env, napi_status status, void* data) {
+  struct chunker_data* work = data;
+  if (status == napi_cancelled) work->error = "async work was cancelled";
+  work->chunker->busy = 0;
+  int argc = 0;
+  napi_value argv[2];
+  if (work->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, work->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_array_with_length(env, work->chunks_length, &argv[1]));
+    for (size_t index = 0; index < work->chunks_length; index++) {
+      napi_value chunk = chunk_object(env, &work->chunks[index]);
+      OK(napi_set_element(env, argv[1], (uint32_t) index, chunk));
+    }
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, work->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, work->ref_chunker));
+  OK(napi_delete_reference(env, work->ref_buffer));
+  OK(napi_delete_reference(env, work->ref_callback));
+  OK(napi_delete_async_work(env, work->async_work));
+  if (work->chunks) free(work->chunks);
+  free(work);
+}
+
+static napi_value chunker_push(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct chunker* chunker = NULL;
+  uint8_t* buffer = NULL;
+  size_t length = 0;
+  if (
+    argc != 3 ||
+    !arg_chunker(env, argv[0], &chunker) ||
+    !arg_buffer(env, argv[1], &buffer, &length) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (chunker, buffer, callback)");
+  }
+  if (chunker->busy) THROW(env, "chunker is busy");
+  struct chunker_data* work = calloc(1, sizeof(struct chunker_data));
+  if (!work) THROW(env, "insufficient memory");
+  chunker->busy = 1;
+  work->chunker = chunker;
+  work->buffer = buffer;
+  work->length = length;
+  OK(napi_create_reference(env, argv[0], 1, &work->ref_chunker));
+  OK(napi_create_reference(env, argv[1], 1, &work->ref_buffer));
+  OK(napi_create_reference(env, argv[2], 1, &work->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    chunker_execute,
+    chunker_complete,
+    work,
+    &work->async_work
+  ));
+  OK(napi_queue_async_work(env, work->async_work));
+  return NULL;
+}
+
+static napi_value copy_device(napi_env env, napi_callback_info info) {
+  size_t argc = 5;
+  napi_value argv[5];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd_source = 0;
+  int fd_target = 0;
+  if (
+    argc != 5 ||
+    !arg_int(env, argv[0], &fd_source) ||
+    !arg_int(env, argv[1], &fd_target) ||
+    !arg_object(env, argv[2]) ||
+    !arg_progress(env, argv[3]) ||
+    !arg_function(env, argv[4])
+  ) {
+    THROW(env,
+      "bad arguments, expected: (srcFd, dstFd, options, onProgress, callback)"
+    );
+  }
+  napi_value options = argv[2];
+  struct copy_data* copy = calloc(1, sizeof(struct copy_data));
+  if (!copy) THROW(env, "insufficient memory");
+  const char* error = copy_options(env, options, copy);
+  int64_t offset = 0;
+  int64_t target_offset = -1;
+  int64_t end = -1;
+  int64_t resume = -1;
+  napi_value value;
+  if (!error && !option_int64(env, options, "offset", &offset)) {
+    error = "options.offset must be a safe integer";
+  }
+  if (!error && option_value(env, options, "dstOffset", &value)) {
+    target_offset = 0;
+    if (!arg_int64(env, value, &target_offset)) {
+      error = "options.dstOffset must be a safe integer";
+    }
+  }
+  if (!error && option_value(env, options, "length", &value)) {
+    int64_t length = 0;
+    if (!arg_int64(env, value, &length) || length > 9007199254740991 - offset) {
+      error = "options.length must be a safe integer";
+    } else {
+      end = offset + length;
+    }
+  }
+  if (!error && option_value(env, options, "resume", &value)) {
+    resume = 0;
+    if (
+      !arg_int64(env, value, &resume) ||
+      resume < offset ||
+      (end >= 0 && resume > end)
+    ) {
+      error = "options.resume must be a checkpoint within the range";
+    }
+  }
+  if (error) {
+    free(copy);
+    THROW(env, error);
+  }
+  copy->fd_source = fd_source;
+  copy->fd_target = fd_target;
+  copy->offset = offset;
+  copy->target_offset = target_offset >= 0 ? target_offset : offset;
+  copy->engine.start = resume >= 0 ? resume : offset;
+  copy->engine.end = end;
+  return copy_queue(env, copy, argv[3], argv[4]);
+}
+
+static napi_value fill_range(napi_env env, napi_callback_info info) {
+  size_t argc = 7;
+  napi_value argv[7];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  int64_t offset = 0;
+  int64_t length = 0;
+  int byte = 0;
+  uint8_t* pattern = NULL;
+  size_t pattern_length = 0;
+  int is_buffer = 0;
+  if (
+    argc != 7 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_int64(env, argv[1], &offset) ||
+    !arg_int64(env, argv[2], &length) ||
+    (
+      !(is_buffer = arg_buffer(env, argv[3], &pattern, &pattern_length)) &&
+      (!arg_int(env, argv[3], &byte) || byte > 255)
+    ) ||
+    !arg_object(env, argv[4]) ||
+    !arg_progress(env, argv[5]) ||
+    !arg_function(env, argv[6])
+  ) {
+    THROW(env,
+      "bad arguments, expected: "
+      "(fd, offset, length, pattern, options, onProgress, callback)"
+    );
+  }
+  if (offset > 9007199254740991 - length) {
+    THROW(env, "offset + length must not exceed Number.MAX_SAFE_INTEGER");
+  }
+  if (!is_buffer) {
+    pattern_length = 1;
+  } else if (pattern_length == 0) {
+    THROW(env, "pattern must not be empty");
+  }
+  struct fill_data* fill = calloc(1, sizeof(struct fill_data));
+  if (!fill) THROW(env, "insufficient memory");
+  struct engine* engine = &fill->engine;
+  const char* error = engine_options(env, argv[4], engine);
+  if (!error && engine->block % pattern_length != 0) {
+    error = "pattern length must divide options.blockSize";
+  }
+  if (!error) {
+    fill->pattern = malloc(pattern_length);
+    if (!fill->pattern) error = "insufficient memory";
+  }
+  if (error) {
+    free(fill);
+    THROW(env, error);
+  }
+  if (!is_buffer) {
+    fill->pattern[0] = (uint8_t) byte;
+  } else {
+    memcpy(fill->pattern, pattern, pattern_length);
+  }
+  fill->fd = fd;
+  fill->pattern_length = pattern_length;
+  engine->start = offset;
+  engine->end = offset + length;
+  engine->buffers = 0;
+  engine->prepare = fill_prepare;
+  engine->run = fill_run;
+  engine->result = fill_result;
+  engine->cleanup = fill_cleanup;
+  return engine_queue(env, engine, argv[5], argv[6]);
+}
+
+static napi_value get_aligned_buffer(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int int_size = 0;
+  int int_alignment = 0;
+  if (
+    argc != 2 ||
+    !arg_int(env, argv[0], &int_size) ||
+    !arg_int(env, argv[1], &int_alignment)
+  ) {
+    THROW(env, "bad arguments, expected: (size, alignment)");
+  }
+  assert(int_size >= 0);
+  assert(int_alignment >= 0);
+  size_t size = (size_t) int_size;
+  size_t alignment = (size_t) int_alignment;
+  if (size == 0) THROW(env, "size must not be 0");
+  if (size > 2147483647) THROW(env, "size must be at most 2147483647 bytes");
+  if (alignment == 0) THROW(env, "alignment must not be 0");
+  if (alignment & (alignment - 1)) THROW(env, "alignment must be a power of 2");
+  // Ensure portability for software tested only on 32-bit systems:
+  if (alignment < 8) THROW(env, "alignment must be at least 8 bytes");
+  // Detect excessive alignment values:
+  if (alignment > 4194304) {
+    THROW(env, "alignment must be at most 4194304 bytes");
+  }
+  if (alignment < sizeof(void *)) {
+    THROW(env, "alignment must be at least as large as a pointer");
+  }
+#if defined(_WIN32)
+  void *ptr = _aligned_malloc(size, alignment);
+  if (ptr == NULL) THROW(env, "insufficient memory");
+#else
+  void *ptr = NULL;
+  int result = posix_memalign(&ptr, alignment, size);
+  if (result == EINVAL) THROW(env, "bad alignment argument");
+  if (result == ENOMEM) THROW(env, "insufficient memory");
+  if (result != 0) THROW(env, "unexpected error, posix_memalign");
+#endif
+  assert(ptr != NULL);
+  // Check that pointer is aligned as we expect:
+  assert(((uintptr_t)(const void *)(ptr) & (alignment - 1)) == 0);
+  memset(ptr, 0, size);
+  napi_value buffer;
+  OK(napi_create_external_buffer(env, size, ptr, free_aligned, NULL, &buffer));
+  return buffer;
+}
+
+static napi_value blake3_buffer(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  uint8_t* data = NULL;
+  size_t length = 0;
+  if (argc != 1 || !arg_buffer(env, argv[0], &data, &length)) {
+    THROW(env, "bad arguments, expected: (buffer)");
+  }
+  napi_value result;
+  void* hash = NULL;
+  OK(napi_create_buffer(env, BLAKE3_OUT_LEN, &hash, &result));
+  blake3(data, length, hash);
+  return result;
+}
+
+static napi_value crc32c_buffer(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  uint8_t* buffer = NULL;
+  size_t length = 0;
+  if (
+    argc < 1 ||
+    argc > 2 ||
+    !arg_buffer(env, argv[0], &buffer, &length) ||
+    (argc == 2 && !arg_object(env, argv[1]))
+  ) {
+    THROW(env, "bad arguments, expected: (buffer, options={})");
+  }
+  uint32_t (*update)(uint32_t, const uint8_t*, size_t) = NULL;
+  char kernel[8] = { 0 };
+  napi_value kernel_value;
+  if (argc == 2 && option_value(env, argv[1], "kernel", &kernel_value)) {
+    size_t kernel_length = 0;
+    if (
+      napi_get_value_string_utf8(
+        env,
+        kernel_value,
+        kernel,
+        sizeof(kernel),
+        &kernel_length
+      ) != napi_ok || (
+        strcmp(kernel, "table") != 0 &&
+        strcmp(kernel, "sse42") != 0 &&
+        strcmp(kernel, "pclmul") != 0
+      )
+    ) {
+      THROW(env, "options.kernel must be \"table\", \"sse42\" or \"pclmul\"");
+    }
+    if (!crc32c_select(kernel, &update)) {
+      THROW(env, "options.kernel is not supported by this CPU");
+    }
+  }
+  uint32_t crc = update ?
+    ~update(~0U, buffer, length) :
+    crc32c(0, buffer, length);
+  napi_value result;
+  OK(napi_create_uint32(env, crc, &result));
+  return result;
+}
+
+static napi_value get_block_device(napi_env env, napi_callback_info info) {
+  size_t argc = 2;
+  napi_value argv[2];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  napi_value callback = argv[1];
+  napi_valuetype callback_type;
+  OK(napi_typeof(env, callback, &callback_type));
+  int fd = 0;
+  if (
+    argc != 2 ||
+    !arg_int(env, argv[0], &fd) ||
+    callback_type != napi_function
+  ) {
+    THROW(env, "bad arguments, expected: (fd, callback)");
+  }
+  return task_queue(env, task_execute_get_block_device, fd, 0, 1, callback);
+}
+
+static napi_value read_buffer(napi_env env, napi_callback_info info) {
+  return io_queue(env, info, 0);
+}
+
+static napi_value scrub(napi_env env, napi_callback_info info) {
+  size_t argc = 4;
+  napi_value argv[4];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  if (
+    argc != 4 ||
+    !arg_int(env, argv[0], &fd) ||
+    !arg_object(env, argv[1]) ||
+    !arg_progress(env, argv[2]) ||
+    !arg_function(env, argv[3])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, options, onProgress, callback)");
+  }
+  napi_value options = argv[1];
+  struct scrub_data* scrub = calloc(1, sizeof(struct scrub_data));
+  if (!scrub) THROW(env, "insufficient memory");
+  struct engine* engine = &scrub->engine;
+  const char* error = engine_options(env, options, engine);
+  int64_t start = 0;
+  int64_t end = -1;
+  int64_t sector = 512;
+  int64_t format = 0;
+  napi_value end_value;
+  if (!error && !option_int64(env, options, "start", &start)) {
+    error = "options.start must be a safe integer";
+  }
+  if (!error && option_value(env, options, "end", &end_value)) {
+    end = 0;
+    if (!arg_int64(env, end_value, &end) || end < start) {
+      error = "options.end must be a safe integer not less than options.start";
+    }
+  }
+  if (
+    !error && (
+      !option_int64(env, options, "sectorSize", &sector) ||
+      sector < 512 ||
+      (sector & (sector - 1)) ||
+      engine->block % (size_t) sector != 0
+    )
+  ) {
+    error =
+      "options.sectorSize must be a power of 2 dividing options.blockSize";
+  }
+  if (
+    !error && (
+      !option_int64(env, options, "format", &format) || (
+        format != 0 && (
+          format < sector ||
+          format > FORMAT_BLOCK_MAX ||
+          (format & (format - 1)) ||
+          engine->block % (size_t) format != 0
+        )
+      )
+    )
+  ) {
+    error = "options.format must be a power of 2 dividing options.blockSize";
+  }
+  if (!error && start % (format ? format : sector) != 0) {
+    error = "options.start must be a multiple of the sector or format size";
+  }
+  if (error) {
+    free(scrub);
+    THROW(env, error);
+  }
+  scrub->fd = fd;
+  scrub->sector = (size_t) sector;
+  scrub->format = (size_t) format;
+  engine->start = start;
+  engine->end = end;
+  engine->buffers = 1;
+  engine->counter_names[SCRUB_BAD_BYTES] = "badBytes";
+  engine->counter_names[SCRUB_RETRIES] = "retries";
+  engine->prepare = scrub_prepare;
+  engine->run = scrub_run;
+  engine->result = scrub_result;
+  engine->cleanup = scrub_cleanup;
+  return engine_queue(env, engine, argv[2], argv[3]);
+}
+
+static napi_value set_encryption(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  int fd = 0;
+  uint8_t* key = NULL;
+  size_t key_length = 0;
+  napi_valuetype type = napi_undefined;
+  if (argc == 3) OK(napi_typeof(env, argv[1], &type));
+  if (
+    argc != 3 ||
+    !arg_int(env, argv[0], &fd) ||
+    (type != napi_null && !arg_buffer(env, argv[1], &key, &key_length)) ||
+    !arg_object(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (fd, key, options)");
+  }
+  if (type == napi_null) {
+    // Remove the key:
+    if (!crypt_set(fd, NULL)) THROW(env, "insufficient memory");
+    return NULL;
+  }
+  if (key_length != CRYPT_KEY) THROW(env, "key must be 64 bytes");
+  // IEEE 1619 requires that the data key and tweak key be different:
+  if (memcmp(key, key + CRYPT_KEY / 2, CRYPT_KEY / 2) == 0) {
+    THROW(env, "key halves must be different");
+  }
+  int64_t sector = CRYPT_SECTOR_MIN;
+  if (
+    !option_int64(env, argv[2], "sectorSize", &sector) ||
+    sector < CRYPT_SECTOR_MIN ||
+    sector > CRYPT_SECTOR_MAX ||
+    (sector & (sector - 1))
+  ) {
+    THROW(env, "options.sectorSize must be a power of 2 from 512 to 65536");
+  }
+  char kernel[8] = { 0 };
+  memcpy(kernel, xts_name, strlen(xts_name));
+  napi_value kernel_value;
+  if (option_value(env, argv[2], "kernel", &kernel_value)) {
+    size_t kernel_length = 0;
+    if (
+      napi_get_value_string_utf8(
+        env,
+        kernel_value,
+        kernel,
+        sizeof(kernel),
+        &kernel_length
+      ) != napi_ok || (
+        strcmp(kernel, "scalar") != 0 &&
+        strcmp(kernel, "aesni") != 0 &&
+        strcmp(kernel, "vaes") != 0
+      )
+    ) {
+      THROW(env, "options.kernel must be \"scalar\", \"aesni\" or \"vaes\"");
+    }
+  }
+  struct crypt* crypt = calloc(1, sizeof(struct crypt));
+  if (!crypt) THROW(env, "insufficient memory");
+  if (!xts_select(crypt, kernel)) {
+    free(crypt);
+    THROW(env, "options.kernel is not supported by this CPU");
+  }
+  crypt->references = 1;
+  crypt->sector = (size_t) sector;
+  aes_expand(key, crypt->keys);
+  aes_expand(key + CRYPT_KEY / 2, crypt->keys_tweak);
+#if defined(CPU_X64)
+  if (cpu.aes) aes_expand_decrypt_aesni(crypt);
+#endif
+  if (!crypt_set(fd, crypt)) {
+    crypt_wipe(crypt, sizeof(struct crypt));
+    free(crypt);
+    THROW(env, "insufficient memory");
+  }
+  return NULL;
+}
+
+static napi_value set_f_nocache(napi_env env, napi_callback_info info) {
+#if defined(__APPLE__)
+  return task_args(env, info, task_execute_set_f_nocache);
+#else
+  THROW(env, "only supported on mac os");
+#endif
+}
+
+static napi_value set_flock(napi_env env, napi_callback_info info) {
+#if defined(_WIN32)
+  THROW(env, "not supported on windows");
+#else
+  return task_args(env, info, task_execute_set_flock);
+#endif
+}
+
+static napi_value set_fsctl_lock_volume(napi_env env, napi_callback_info info) {
+#if defined(_WIN32)
+  return task_args(env, info, task_execute_set_fsctl_lock_volume);
+#else
+  THROW(env, "only supported on windows");
+#endif
+}
+
+struct volume_open_data {
+  struct volume* volume;
+  napi_ref ref_callback;
+  napi_async_work async_work;
+  const char* error;
+};
+
+// Identifies the file or device behind an fd, by its device number if it is a
+// device, or else by its filesystem and inode, returning 0 if unknown:
+static int volume_identity(int fd, uint64_t identity[3]) {
+  uv_fs_t req;
+  int result = uv_fs_fstat(NULL, &req, fd, NULL);
+  uint64_t type = req.statbuf.st_mode & S_IFMT;
+  identity[0] = type == S_IFREG ? 0 : 1;
+  identity[1] = identity[0] ? req.statbuf.st_rdev : req.statbuf.st_dev;
+  identity[2] = identity[0] ? 0 : req.statbuf.st_ino;
+  uv_fs_req_cleanup(&req);
+  if (result != 0) return 0;
+#if defined(_WIN32)
+  // Windows reports no device number for a device:
+  if (identity[0]) return 0;
+#endif
+  return 1;
+}
+
+static void volume_open_execute(napi_env env, void* data) {
+  struct volume_open_data* work = data;
+  struct volume* volume = work->volume;
+  // Two fds of the same device would hold the same bytes twice, doubling the
+  // size of a stripe, and taking away the redundancy of a mirror or parity:
+  uint64_t identities[VOLUME_DEVICES_MAX][3];
+  int known[VOLUME_DEVICES_MAX];
+  for (int device = 0; device < volume->count; device++) {
+    known[device] = volume_identity(volume->fds[device], identities[device]);
+    for (int other = 0; known[device] && other < device; other++) {
+      if (
+        known[other] &&
+        memcmp(identities[device], identities[other], 24) == 0
+      ) {
+        work->error = "fds must be distinct devices";
+        return;
+      }
+    }
+  }
+  int64_t member = -1;
+  for (int device = 0; device < volume->count; device++) {
+    int64_t size = 0;
+    int64_t logical = 0;
+    int64_t physical = 0;
+    work->error = volume_probe(
+      volume->fds[device],
+      &size,
+      &logical,
+      &physical
+    );
+    if (work->error) return;
+    if (logical > volume->sector_logical) volume->sector_logical = logical;
+    if (physical > volume->sector_physical) volume->sector_physical = physical;
+    if (member == -1 || size < member) member = size;
+  }
+  if (volume->layout == VOLUME_MIRROR) {
+    // Every replica holds the whole sectors of the smallest replica:
+    volume->size = member / volume->sector_logical * volume->sector_logical;
+    return;
+  }
+  if (volume->stripe % volume->sector_logical != 0) {
+    work->error = "options.stripeSize must be a multiple of the sector size";
+    return;
+  }
+  // Every device contributes the whole stripes of the smallest device, of
+  // which parity devices contribute none to the size:
+  volume->size = member / volume->stripe * volume->stripe *
+    (volume->count - volume->parity);
+}
+
+static void volume_open_complete(napi_env env, napi_status status, void* data) {
+  struct volume_open_data* work = data;
+  if (status == napi_cancelled) work->error = "async work was cancelled";
+  int argc = 0;
+  napi_value argv[2];
+  if (work->error) {
+    argc = 1;
+    napi_value message;
+    OK(napi_create_string_utf8(env, work->error, NAPI_AUTO_LENGTH, &message));
+    OK(napi_create_error(env, NULL, message, &argv[0]));
+    volume_free(work->volume);
+  } else {
+    argc = 2;
+    OK(napi_get_undefined(env, &argv[0]));
+    OK(napi_create_external(
+      env,
+      work->volume,
+      volume_finalize,
+      NULL,
+      &argv[1]
+    ));
+    OK(napi_type_tag_object(env, argv[1], &VOLUME_TYPE_TAG));
+  }
+  napi_value scope;
+  OK(napi_get_global(env, &scope));
+  napi_value callback;
+  OK(napi_get_reference_value(env, work->ref_callback, &callback));
+  napi_call_function(env, scope, callback, argc, argv, NULL);
+  OK(napi_delete_reference(env, work->ref_callback));
+  OK(napi_delete_async_work(env, work->async_work));
+  free(work);
+}
+
+static napi_value volume_open(napi_env env, napi_callback_info info) {
+  size_t argc = 3;
+  napi_value argv[3];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  bool is_array = false;
+  if (
+    argc != 3 ||
+    napi_is_array(env, argv[0], &is_array) != napi_ok ||
+    !is_array ||
+    !arg_object(env, argv[1]) ||
+    !arg_function(env, argv[2])
+  ) {
+    THROW(env, "bad arguments, expected: (fds, options, callback)");
+  }
+  uint32_t count = 0;
+  OK(napi_get_array_length(env, argv[0], &count));
+  if (count < 1 || count > VOLUME_DEVICES_MAX) {
+    THROW(env, "fds must be an array of 1 to 64 fds");
+  }
+  int layout = VOLUME_STRIPE;
+  napi_value layout_value;
+  if (option_value(env, argv[1], "layout", &layout_value)) {
+    char name[16];
+    size_t name_length = 0;
+    if (
+      napi_get_value_string_utf8(
+        env,
+        layout_value,
+        name,
+        sizeof(name),
+        &name_length
+      ) != napi_ok ||
+      (
+        strcmp(name, "stripe") != 0 &&
+        strcmp(name, "mirror") != 0 &&
+        strcmp(name, "erasure") != 0
+      )
+    ) {
+      THROW(env,
+        "options.layout must be \"stripe\", \"mirror\" or \"erasure\""
+      );
+    }
+    if (strcmp(name, "mirror") == 0) layout = VOLUME_MIRROR;
+    if (strcmp(name, "erasure") == 0) layout = VOLUME_ERASURE;
+  }
+  napi_value unused;
+  int64_t stripe = VOLUME_STRIPE_DEFAULT;
+  if (
+    !option_int64(env, argv[1], "stripeSize", &stripe) ||
+    stripe < VOLUME_STRIPE_MIN ||
+    stripe > VOLUME_STRIPE_MAX ||
+    (stripe & (stripe - 1))
+  ) {
+    THROW(env, "options.stripeSize must be a power of 2 from 512 to 16777216");
+  }
+  if (
+    layout == VOLUME_MIRROR &&
+    option_value(env, argv[1], "stripeSize", &unused)
+  ) {
+    THROW(env, "options.stripeSize cannot be combined with a mirror layout");
+  }
+  int64_t quorum = count;
+  int hedge = 1;
+  int64_t hedge_delay = -1;
+  if (
+    !option_int64(env, argv[1], "writeQuorum", &quorum) ||
+    quorum < 1 ||
+    quorum > count
+  ) {
+    THROW(env, "options.writeQuorum must be from 1 to the number of fds");
+  }
+  if (!option_bool(env, argv[1], "hedge", &hedge)) {
+    THROW(env, "options.hedge must be a boolean");
+  }
+  if (
+    !option_int64(env, argv[1], "hedgeDelay", &hedge_delay) ||
+    (option_value(env, argv[1], "hedgeDelay", &unused) && hedge_delay < 0)
+  ) {
+    THROW(env, "options.hedgeDelay must be a non-negative integer");
+  }
+  if (
+    layout != VOLUME_MIRROR &&
+    (
+      option_value(env, argv[1], "writeQuorum", &unused) ||
+      option_value(env, argv[1], "hedge", &unused) ||
+      option_value(env, argv[1], "hedgeDelay", &unused)
+    )
+  ) {
+    THROW(env,
+      "options.writeQuorum, options.hedge and options.hedgeDelay "
+      "require a mirror layout"
+    );
+  }
+  int64_t parity = 2;
+  if (option_value(env, argv[1], "parityDevices", &unused)) {
+    if (layout != VOLUME_ERASURE) {
+      THROW(env, "options.parityDevices requires an erasure layout");
+    }
+    if (!option_int64(env, argv[1], "parityDevices", &parity)) parity = 0;
+  }
+  if (layout == VOLUME_ERASURE && (parity < 1 || parity >= count)) {
+    THROW(env,
+      "options.parityDevices must be from 1 to the number of fds - 1"
+    );
+  }
+  void (*mul_xor)(uint8_t*, const uint8_t*, size_t, uint8_t) = gf_mul_xor;
+  char kernel[8] = { 0 };
+  napi_value kernel_value;
+  if (option_value(env, argv[1], "kernel", &kernel_value)) {
+    if (layout != VOLUME_ERASURE) {
+      THROW(env, "options.kernel requires an erasure layout");
+    }
+    size_t kernel_length = 0;
+    if (
+      napi_get_value_string_utf8(
+        env,
+        kernel_value,
+        kernel,
+        sizeof(kernel),
+        &kernel_length
+      ) != napi_ok || (
+        strcmp(kernel, "scalar") != 0 &&
+        strcmp(kernel, "ssse3") != 0 &&
+        strcmp(kernel, "avx2") != 0 &&
+        strcmp(kernel, "avx512") != 0
+      )
+    ) {
+      THROW(env,
+        "options.kernel must be \"scalar\", \"ssse3\", \"avx2\" or \"avx512\""
+      );
+    }
+    if (!gf_select(kernel, &mul_xor)) {
+      THROW(env, "options.kernel is not supported by this CPU");
+    }
+  }
+  struct volume* volume = calloc(1, sizeof(struct volume));
+  if (!volume) THROW(env, "insufficient memory");
+  volume->layout = layout;
+  volume->count = (int) count;
+  volume->stripe = stripe;
+  volume->quorum = (int) quorum;
+  volume->hedge = hedge;
+  volume->hedge_delay = hedge_delay;
+  if (layout == VOLUME_ERASURE) {
+    volume->parity = (int) parity;
+    volume->gf_mul_xor = mul_xor;
+    // C[p][j] = 1 / (x[p] + y[j]) with x[p] = k + p and y[j] = j, which are
+    // distinct, so that every square submatrix of [I; C] is invertible:
+    int k = volume->count - volume->parity;
+    for (int p = 0; p < volume->parity; p++) {
+      for (int j = 0; j < k; j++) {
+        volume->cauchy[p * k + j] = gf_inv((uint8_t) ((k + p) ^ j));
+      }
+    }
+  }
+  int mutex = uv_mutex_init(&volume->mutex);
+  assert(mutex == 0);
+  for (int index = 0; index < VOLUME_ROW_LOCKS; index++) {
+    mutex = uv_mutex_init(&volume->rows[index]);
+    assert(mutex == 0);
+  }
+  for (uint32_t index = 0; index < count; index++) {
+    napi_value element;
+    OK(napi_get_element(env, argv[0], index, &element));
+    if (!arg_int(env, element, &volume->fds[index])) {
+      volume_free(volume);
+      THROW(env, "fds must be an array of 1 to 64 fds");
+    }
+  }
+  struct volume_open_data* work = calloc(1, sizeof(struct volume_open_data));
+  if (!work) {
+    volume_free(volume);
+    THROW(env, "insufficient memory");
+  }
+  work->volume = volume;
+  OK(napi_create_reference(env, argv[2], 1, &work->ref_callback));
+  napi_value name;
+  OK(napi_create_string_utf8(env, RESOURCE_NAME, NAPI_AUTO_LENGTH, &name));
+  OK(napi_create_async_work(
+    env,
+    NULL,
+    name,
+    volume_open_execute,
+    volume_open_complete,
+    work,
+    &work->async_work
+  ));
+  OK(napi_queue_async_work(env, work->async_work));
+  return NULL;
+}
+
+static napi_value volume_geometry(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct volume* volume = NULL;
+  if (argc != 1 || !arg_volume(env, argv[0], &volume)) {
+    THROW(env, "bad arguments, expected: (volume)");
+  }
+  napi_value result;
+  OK(napi_create_object(env, &result));
+  set_int(env, result, "devices", volume->count);
+  napi_value layout;
+  OK(napi_create_string_utf8(
+    env,
+    volume->layout == VOLUME_MIRROR ? "mirror" :
+      volume->layout == VOLUME_ERASURE ? "erasure" : "stripe",
+    NAPI_AUTO_LENGTH,
+    &layout
+  ));
+  OK(napi_set_named_property(env, result, "layout", layout));
+  set_int(env, result, "logicalSectorSize", volume->sector_logical);
+  set_int(env, result, "physicalSectorSize", volume->sector_physical);
+  set_int(env, result, "size", volume->size);
+  if (volume->layout == VOLUME_MIRROR) {
+    set_int(env, result, "writeQuorum", volume->quorum);
+  } else {
+    set_int(env, result, "stripeSize", volume->stripe);
+  }
+  if (volume->layout == VOLUME_ERASURE) {
+    set_int(env, result, "dataDevices", volume->count - volume->parity);
+    set_int(env, result, "parityDevices", volume->parity);
+  }
+  return result;
+}
+
+static napi_value volume_stats(napi_env env, napi_callback_info info) {
+  size_t argc = 1;
+  napi_value argv[1];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct volume* volume = NULL;
+  if (argc != 1 || !arg_volume(env, argv[0], &volume)) {
+    THROW(env, "bad arguments, expected: (volume)");
+  }
+  napi_value result;
+  OK(napi_create_object(env, &result));
+  napi_value devices;
+  OK(napi_create_array_with_length(env, (size_t) volume->count, &devices));
+  uv_mutex_lock(&volume->mutex);
+  for (int device = 0; device < volume->count; device++) {
+    struct volume_replica* replica = &volume->replicas[device];
+    napi_value object;
+    OK(napi_create_object(env, &object));
+    napi_value failed;
+    OK(napi_get_boolean(env, replica->failed != 0, &failed));
+    OK(napi_set_named_property(env, object, "failed", failed));
+    set_int(env, object, "reads", replica->reads);
+    set_int(env, object, "writes", replica->writes);
+    set_int(env, object, "errors", replica->errors);
+    // Latencies are in microseconds:
+    set_int(env, object, "latency", (int64_t) (replica->latency / 1000));
+    set_int(env, object, "p95", (int64_t) (volume_p95(replica) / 1000));
+    OK(napi_set_element(env, devices, (uint32_t) device, object));
+  }
+  OK(napi_set_named_property(env, result, "devices", devices));
+  set_int(env, result, "failovers", volume->failovers);
+  set_int(env, result, "hedges", volume->hedges);
+  set_int(env, result, "reconstructions", volume->reconstructions);
+  uv_mutex_unlock(&volume->mutex);
+  return result;
+}
+
+static napi_value volume_queue(
+  napi_env env,
+  napi_callback_info info,
+  int write
+) {
+  size_t argc = 7;
+  napi_value argv[7];
+  OK(napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+  struct volume* volume = NULL;
+  uint8_t* buffer = NULL;
+  size_t buffer_length = 0;
+  int offset = 0;
+  int length = 0;
+  int64_t position = 0;
+  if (
+    argc != 7 ||
+    !arg_volume(env, argv[0], &volume) ||
+    !arg_buffer(env, argv[1], &buffer, &buffer_length) ||
+    !arg_int(env, argv[2], &offset) ||
+    !arg_int(env, argv[3], &length) ||
+    !arg_int64(env, argv[4], &position) ||
+    !arg_object(env, argv[5]) ||
+    !arg_function(env, argv[6])
+  ) {
+    THROW(env,
+      "bad arguments, expected: "
+      "(volume, buffer, offset, length, position, options, callback)"
+    );
+  }
+  if ((size_t) offset > buffer_length) {
+    THROW(env, "offset must not be greater than buffer.length");
+  }
+  if ((size_t) length > buffer_length - (size_t) offset) {
+    THROW(env, "offset + length must not be greater than buffer.length");
+  }
+  if (position > volume->size || length > volume->size - position) {
+    THROW(env, "position + length must not be greater than the volume size");
+  }
+  // The replicas of a mirror are only failed on the main thread:
+  uint64_t available = 0;
+  int replicas = 0;
+  for (int device = 0; device < volume->count; device++) {
+    if (volume->layout != VOLUME_MIRROR) break;
+    if (volume->replicas[device].failed) continue;
+    available |= (uint64_t) 1 << device;
+    replicas++;
+  }
+  if (volume->layout == VOLUME_MIRROR && write && replicas < volume->quorum) {
+    THROW(env, "too few replicas are available for options.writeQuorum");
+  }
+  struct volume_io* io = calloc(1, sizeof(struct volume_io));
+  if (!io) THROW(env, "insufficient memory");
+  io->env = env;
+  io->volume = volume;
+  io->write = write;
+  io->buffer = buffer + offset;
+  io->source = io->buffer;
+  io->length = (size_t) length;
+  io->position = position;
+  io->winner = -1;
+  if (volume->layout == VOLUME_MIRROR && !write && volume_select(io) < 0) {
+    free(io);
+    THROW(env, "no replica is available");
+  }
+  if (volume->layout == VOLUME_MIRROR && write) {
+    io->entry = calloc(1, sizeof(struct volume_write));
+    // Once a quorum is written, the caller may reuse the buffer before the
+    // other replicas have been written:
+    if (io->entry && replicas > volume->quorum) {
+      io->source = bounce_alloc(io->length > 0 ? io->length : 1);
+    }
+    if (!io->entry || !io->source) {
+      free(io->entry);
+      free(io);
+      THROW(env, "insufficient memory");
+    }
+    if (io->source != io->buffer) memcpy(io->source, io->buffer, io->length);
+    io->entry->position = position;
+    io->entry->length = length;
+    io->entry->pending = available;
+    io->entry->next = volume->writes;
+    volume->writes = io->entry;
+  }
+  int mutex = uv_mutex_init(&io->mutex);
+  assert(mutex == 0);
+  OK(napi_create_reference(env, argv[0], 1, &io->ref_volume));
+  OK(napi_create_reference(env, argv[1], 1, &io->ref_buffer));
+  OK(napi_create_reference(env, argv[6], 1, &io->ref_callback));
+  if (volume->layout == VOLUME_MIRROR) {
+    if (write) {
+      for (int device = 0; device < volume->count; device++) {
+        if (available & ((uint64_t) 1 << device)) volume_issue(io, device);
+      }
+    } else {
+      volume_read_start(io);
+    }
+    return NULL;
+  }
+  if (volume->layout == VOLUME_ERASURE) {
+    int64_t width = volume->stripe * (volume->count - volume->parity);
+    int64_t rows = 1;
+    if (length > 0) {
+      rows = (position + length - 1) / width - position / width + 1;
+    }
+    io->parts_length = rows < volume->count ? (int) rows : volume->count;
+    for (int index = 0; index < io->parts_length; index++) {
+      volume_issue(io, index);
+    }
+    return NULL;
+  }
+  // Only the devices with stripes in the range have a part, but there is
+  // always at least one part to complete the request:
+  int64_t stripes = 1;
+  if (length > 0) {
+    stripes = (position + length - 1) / volume->stripe -
+      position / volume->stripe + 1;
+  }
+  int first = (int) (position / volume->stripe % volume->count);
+  int parts = stripes < volume->count ? (int) stripes : volume->count;
+  for (int index = 0; index < parts; index++) {
+    volume_issue(io, (first + index) % volume->count);
+  }
+  return NULL;
+}
+
+static napi_value volume_read(napi_env env, napi_callback_info info) {
+  return volume_queue(env, info, 0);
+}
+
+static napi_value volume_write(napi_env env, napi_callback_info info) {
+  return volume_queue(env, info, 1);
+}
+
+static napi_value write_buffer(napi_env env, napi_callback_info info) {
+  return io_queue(env, info, 1);
+}
+
+static uv_once_t init_once = UV_ONCE_INIT;
+
+static void init(void) {
+  cpu_init();
+  crc32c_init();
+  simd_init();
+  cdc_init();
+  aes_init();
+  gf_init();
+  int crypt_mutex_init = uv_mutex_init(&crypt_mutex);
+  assert(crypt_mutex_init == 0);
+  int scratch_mutex_init = uv_mutex_init(&scratch_mutex);
+  assert(scratch_mutex_init == 0);
+}
+
+static napi_value Init(napi_env env, napi_value exports) {
+  // We require assert() for safety (our asserts are not side-effect free):
+#ifdef NDEBUG
+  fprintf(stderr, "NDEBUG compile flag not supported\n");
+  abort();
+#endif
+  // We use an int to represent the size of an aligned buffer.
+  // INT_MAX must therefore be sufficient for Node's own buffer.kMaxLength:
+  assert(INT_MAX >= 2147483647);
+  uv_once(&init_once, init);
+  int o_direct = get_o_direct();
+  // On Windows, libuv maps these flags as follows:
+  // UV_FS_O_DIRECT > FILE_FLAG_NO_BUFFERING
+  // UV_FS_O_DSYNC  > FILE_FLAG_WRITE_THROUGH
+  // UV_FS_O_EXLOCK > SHARING MODE=0
+  // UV_FS_O_SYNC   > FILE_FLAG_WRITE_THROUGH
+  set_int(env, exports, "FORMAT_TRAILER", FORMAT_TRAILER);
+  set_int(env, exports, "O_DIRECT", o_direct);
+  set_int(env, exports, "O_DSYNC", UV_FS_O_DSYNC);
+  set_int(env, exports, "O_EXCL", UV_FS_O_EXCL);
+  set_int(env, exports, "O_EXLOCK", UV_FS_O_EXLOCK);
+  set_int(env, exports, "O_SYNC", UV_FS_O_SYNC);
+  napi_value simd_name;
+  OK(napi_create_string_utf8(env, simd.name, NAPI_AUTO_LENGTH, &simd_name));
+  OK(napi_set_named_property(env, exports, "SIMD", simd_name));
+  napi_value xts_value;
+  OK(napi_create_string_utf8(env, xts_name, NAPI_AUTO_LENGTH, &xts_value));
+  OK(napi_set_named_property(env, exports, "XTS", xts_value));
+  napi_value crc32c_value;
+  OK(napi_create_string_utf8(
+    env,
+    crc32c_name,
+    NAPI_AUTO_LENGTH,
+    &crc32c_value
+  ));
+  OK(napi_set_named_property(env, exports, "CRC32C", crc32c_value));
+  napi_value cdc_value;
+  OK(napi_create_string_utf8(env, cdc_name, NAPI_AUTO_LENGTH, &cdc_value));
+  OK(napi_set_named_property(env, exports, "CDC", cdc_value));
+  napi_value gf_value;
+  OK(napi_create_string_utf8(env, gf_name, NAPI_AUTO_LENGTH, &gf_value));
+  OK(napi_set_named_property(env, exports, "GF", gf_value));
+  set_method(env, exports, "allocatorAllocate", allocator_allocate);
+  set_method(env, exports, "allocatorFree", allocator_release);
+  set_method(env, exports, "allocatorOpen", allocator_open);
+  set_method(env, exports, "allocatorStats", allocator_stats);
+  set_method(env, exports, "allocatorSync", allocator_sync);
+  set_method(env, exports, "applyDelta", apply_delta);
+  set_method(env, exports, "arenaAllocate", arena_allocate);
+  set_method(env, exports, "arenaClose", arena_close);
+  set_method(env, exports, "arenaOpen", arena_open);
+  set_method(env, exports, "arenaRead", arena_read);
+  set_method(env, exports, "arenaRelease", arena_release);
+  set_method(env, exports, "arenaStats", arena_stats);
+  set_method(env, exports, "arenaWrite", arena_write);
+  set_method(env, exports, "blake3", blake3_buffer);
+  set_method(env, exports, "buildIndex", build_index);
+  set_method(env, exports, "chunkerCreate", chunker_create);
+  set_method(env, exports, "chunkerFinish", chunker_finish);
+  set_method(env, exports, "chunkerUpdate", chunker_push);
+  set_method(env, exports, "computeDelta", compute_delta);
+  set_method(env, exports, "containerAppend", container_append);
+  set_method(env, exports, "containerCreate", container_create);
+  set_method(env, exports, "containerFinish", container_finish);
+  set_method(env, exports, "containerInfo", container_info);
+  set_method(env, exports, "containerOpen", container_open);
+  set_method(env, exports, "containerRead", container_read);
+  set_method(env, exports, "containerScan", container_scan);
+  set_method(env, exports, "copyDevice", copy_device);
+  set_method(env, exports, "crc32c", crc32c_buffer);
+  set_method(env, exports, "doublewrite", doublewrite);
+  set_method(env, exports, "doublewriteRecover", doublewrite_recover);
+  set_method(env, exports, "equals", equals);
+  set_method(env, exports, "fill", fill);
+  set_method(env, exports, "fillRange", fill_range);
   set_method(env, exports, "getAlignedBuffer", get_aligned_buffer);
   set_method(env, exports, "getBlockDevice", get_block_device);
+  set_method(env, exports, "hashRange", hash_range);
+  set_method(env, exports, "imageDevice", image_device);
+  set_method(env, exports, "isZero", is_zero);
+  set_method(env, exports, "logAppend", log_append);
+  set_method(env, exports, "logOpen", log_open);
+  set_method(env, exports, "logRead", log_read);
+  set_method(env, exports, "logRelease", log_release);
+  set_method(env, exports, "logScan", log_scan);
+  set_method(env, exports, "logStatus", log_status);
+  set_method(env, exports, "merkleClose", merkle_close);
+  set_method(env, exports, "merkleNode", merkle_node_get);
+  set_method(env, exports, "merkleOpen", merkle_open_sidecar);
+  set_method(env, exports, "merkleRebuild", merkle_rebuild);
+  set_method(env, exports, "merkleRoot", merkle_root);
+  set_method(env, exports, "merkleSync", merkle_sync);
+  set_method(env, exports, "popcount", popcount);
+  set_method(env, exports, "read", read_buffer);
+  set_method(env, exports, "scrub", scrub);
+  set_method(env, exports, "setEncryption", set_encryption);
   set_method(env, exports, "setF_NOCACHE", set_f_nocache);
   set_method(env, exports, "setFlock", set_flock);
   set_method(env, exports, "setFSCTL_LOCK_VOLUME", set_fsctl_lock_volume);
+  set_method(env, exports, "slotAllocate", slot_allocate);
+  set_method(env, exports, "slotFree", slot_free);
+  set_method(env, exports, "slotGet", slot_get);
+  set_method(env, exports, "slotOpen", slot_open);
+  set_method(env, exports, "slotPut", slot_put);
+  set_method(env, exports, "slotStats", slot_stats);
+  set_method(env, exports, "volumeGeometry", volume_geometry);
+  set_method(env, exports, "volumeOpen", volume_open);
+  set_method(env, exports, "volumeRead", volume_read);
+  set_method(env, exports, "volumeStats", volume_stats);
+  set_method(env, exports, "volumeWrite", volume_write);
+  set_method(env, exports, "write", write_buffer);
+  set_method(env, exports, "xorInto", xor_into);
   return exports;
 }
 
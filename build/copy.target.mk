@@ -0,0 +1,32 @@
+# This file is generated by gyp; do not edit.
+
+TOOLSET := target
+TARGET := copy
+### Generated for copy rule.
+/root/repo/binding.node: TOOLSET := $(TOOLSET)
+/root/repo/binding.node: /root/repo/build/Release/binding.node FORCE_DO_CMD
+	$(call do_cmd,copy)
+
+all_deps += /root/repo/binding.node
+binding_gyp_copy_target_copies = /root/repo/binding.node
+
+### Rules for final target.
+# Build our special outputs first.
+$(obj).target/copy.stamp: | $(binding_gyp_copy_target_copies)
+
+# Preserve order dependency of special output on deps.
+$(binding_gyp_copy_target_copies): | $(builddir)/binding.node
+
+$(obj).target/copy.stamp: TOOLSET := $(TOOLSET)
+$(obj).target/copy.stamp: $(builddir)/binding.node FORCE_DO_CMD
+	$(call do_cmd,touch)
+
+all_deps += $(obj).target/copy.stamp
+# Add target alias
+.PHONY: copy
+copy: $(obj).target/copy.stamp
+
+# Add target alias to "all" target.
+.PHONY: all
+all: copy
+
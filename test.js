@@ -2,11 +2,15 @@ var assert = require('assert');
 var binding = require('.');
 
 var Node = {
+  crypto: require('crypto'),
   fs: require('fs'),
+  os: require('os'),
+  path: require('path'),
   process: process
 };
 
 [
+  'FORMAT_TRAILER',
   'O_DIRECT',
   'O_DSYNC',
   'O_EXCL',
@@ -36,11 +40,76 @@ assert(binding.O_DSYNC > 0);
 assert(binding.O_SYNC > 0);
 
 [
+  'allocatorAllocate',
+  'allocatorFree',
+  'allocatorOpen',
+  'allocatorStats',
+  'allocatorSync',
+  'applyDelta',
+  'arenaAllocate',
+  'arenaClose',
+  'arenaOpen',
+  'arenaRead',
+  'arenaRelease',
+  'arenaStats',
+  'arenaWrite',
+  'blake3',
+  'buildIndex',
+  'chunkerCreate',
+  'chunkerFinish',
+  'chunkerUpdate',
+  'computeDelta',
+  'containerAppend',
+  'containerCreate',
+  'containerFinish',
+  'containerInfo',
+  'containerOpen',
+  'containerRead',
+  'containerScan',
+  'copyDevice',
+  'crc32c',
+  'doublewrite',
+  'doublewriteRecover',
+  'equals',
+  'fill',
+  'fillRange',
   'getAlignedBuffer',
   'getBlockDevice',
+  'hashRange',
+  'imageDevice',
+  'isZero',
+  'logAppend',
+  'logOpen',
+  'logRead',
+  'logRelease',
+  'logScan',
+  'logStatus',
+  'merkleClose',
+  'merkleNode',
+  'merkleOpen',
+  'merkleRebuild',
+  'merkleRoot',
+  'merkleSync',
+  'popcount',
+  'read',
+  'scrub',
+  'setEncryption',
   'setF_NOCACHE',
   'setFlock',
-  'setFSCTL_LOCK_VOLUME'
+  'setFSCTL_LOCK_VOLUME',
+  'slotAllocate',
+  'slotFree',
+  'slotGet',
+  'slotOpen',
+  'slotPut',
+  'slotStats',
+  'volumeGeometry',
+  'volumeOpen',
+  'volumeRead',
+  'volumeStats',
+  'volumeWrite',
+  'write',
+  'xorInto'
 ].forEach(
   function(key) {
     var value = binding[key];
@@ -57,7 +126,12 @@ function exception(method, message, set) {
         function(arg) {
           if (arg === undefined) return 'undefined';
           if (typeof arg === 'function') return 'function';
-          return JSON.stringify(arg);
+          if (Buffer.isBuffer(arg)) return 'buffer';
+          return JSON.stringify(arg, function(key, value) {
+            // Buffers within objects are serialized by toJSON():
+            if (value && value.type === 'Buffer' && value.data) return 'buffer';
+            return value;
+          });
         }
       );
       var name = method + '(' + nameArgs.join(', ') + '): ';
@@ -129,178 +203,3580 @@ exception(
   ]
 );
 
+exception('crc32c', 'bad arguments, expected: (buffer, options={})', [
+  [],
+  [1],
+  ['string'],
+  [Buffer.alloc(1), 0],
+  [Buffer.alloc(1), {}, 0]
+]);
+exception('crc32c', 'options.kernel must be "table", "sse42" or "pclmul"', [
+  [Buffer.alloc(1), { kernel: 'crc32' }],
+  [Buffer.alloc(1), { kernel: 1 }]
+]);
+
+exception('isZero', 'bad arguments, expected: (buffer, threads=1..64)', [
+  [],
+  [1],
+  [Buffer.alloc(1), 0],
+  [Buffer.alloc(1), 65],
+  [Buffer.alloc(1), 1, 1]
+]);
+exception('popcount', 'bad arguments, expected: (buffer, threads=1..64)', [
+  [],
+  [Buffer.alloc(1), 1.5]
+]);
+exception(
+  'doublewrite',
+  'bad arguments, expected: (fd, pages, options, callback)',
+  [
+    [],
+    ['1', [], {}, function() {}],
+    [1, {}, {}, function() {}],
+    [1, [], null, function() {}],
+    [1, [], {}]
+  ]
+);
+exception('doublewrite', 'pages must not be empty', [
+  [1, [], {}, function() {}]
+]);
+exception(
+  'doublewrite',
+  'pages must be an array of { position, buffer } objects',
+  [
+    [1, [1], {}, function() {}],
+    [1, [{ position: 0 }], {}, function() {}],
+    [1, [{ position: -1, buffer: Buffer.alloc(16384) }], {}, function() {}],
+    [1, [{ position: 0, buffer: 'page' }], {}, function() {}]
+  ]
+);
+exception('doublewrite', 'page buffers must be options.pageSize bytes', [
+  [1, [{ position: 0, buffer: Buffer.alloc(4096) }], {}, function() {}]
+]);
+exception(
+  'doublewrite',
+  'page positions must be a multiple of options.pageSize',
+  [
+    [1, [{ position: 4096, buffer: Buffer.alloc(16384) }], {}, function() {}]
+  ]
+);
+exception('doublewrite', 'page positions must be unique', [
+  [
+    1,
+    [
+      { position: 16384, buffer: Buffer.alloc(16384) },
+      { position: 16384, buffer: Buffer.alloc(16384) }
+    ],
+    { areaFd: 2 },
+    function() {}
+  ]
+]);
+exception('doublewrite', 'pages must not overlap the doublewrite area', [
+  [
+    1,
+    [{ position: 16384, buffer: Buffer.alloc(16384) }],
+    {},
+    function() {}
+  ]
+]);
+exception(
+  'doublewrite',
+  'pages must fit in options.areaSize with their header',
+  [
+    [
+      1,
+      [
+        { position: 0, buffer: Buffer.alloc(16384) },
+        { position: 16384, buffer: Buffer.alloc(16384) }
+      ],
+      { areaFd: 2, areaSize: 32768 },
+      function() {}
+    ]
+  ]
+);
+exception(
+  'doublewriteRecover',
+  'bad arguments, expected: (fd, options, callback)',
+  [
+    [],
+    ['1', {}, function() {}],
+    [1, null, function() {}],
+    [1, {}]
+  ]
+);
+exception(
+  'doublewriteRecover',
+  'options.pageSize must be a power of 2 from 512 to 1048576',
+  [
+    [1, { pageSize: 256 }, function() {}],
+    [1, { pageSize: 10000 }, function() {}],
+    [1, { pageSize: 2097152 }, function() {}]
+  ]
+);
+exception('doublewriteRecover', 'options.areaFd must be a file descriptor', [
+  [1, { areaFd: -1 }, function() {}],
+  [1, { areaFd: '2' }, function() {}]
+]);
+exception(
+  'doublewriteRecover',
+  'options.areaOffset must be a multiple of options.pageSize',
+  [
+    [1, { areaOffset: 4096 }, function() {}],
+    [1, { areaOffset: -16384 }, function() {}]
+  ]
+);
+exception(
+  'doublewriteRecover',
+  'options.areaSize must be at least 2 pages of options.pageSize',
+  [
+    [1, { areaSize: 16384 }, function() {}],
+    [1, { areaSize: 40000 }, function() {}]
+  ]
+);
+exception(
+  'allocatorOpen',
+  'bad arguments, expected: (fd, options, callback)',
+  [
+    [],
+    ['1', {}, function() {}],
+    [1, null, function() {}],
+    [1, {}]
+  ]
+);
+exception('allocatorOpen', 'options.format must be a boolean', [
+  [1, { format: 1 }, function() {}]
+]);
+exception(
+  'allocatorOpen',
+  'options.size, options.unitSize and options.journalSize require ' +
+  'options.format',
+  [
+    [1, { size: 1048576 }, function() {}],
+    [1, { unitSize: 4096 }, function() {}],
+    [1, { format: false, journalSize: 16384 }, function() {}]
+  ]
+);
+exception(
+  'allocatorOpen',
+  'options.unitSize must be a power of 2 from 512 to 16777216',
+  [
+    [1, { format: true, unitSize: 256 }, function() {}],
+    [1, { format: true, unitSize: 6144 }, function() {}],
+    [1, { format: true, unitSize: 33554432 }, function() {}]
+  ]
+);
+exception(
+  'allocatorOpen',
+  'options.size must be a multiple of options.unitSize',
+  [
+    [1, { format: true, size: 1000 }, function() {}],
+    [1, { format: true, size: -4096 }, function() {}]
+  ]
+);
+exception(
+  'allocatorOpen',
+  'options.journalSize must be a multiple of 4096 of at least 16384',
+  [
+    [1, { format: true, journalSize: 8192 }, function() {}],
+    [1, { format: true, journalSize: 20000 }, function() {}]
+  ]
+);
+[
+  ['allocatorAllocate', '(allocator, length, options)', [{}, 4096, {}]],
+  ['allocatorFree', '(allocator, offset, length)', [{}, 0, 4096]],
+  ['allocatorStats', '(allocator)', [{}]],
+  ['allocatorSync', '(allocator, callback)', [{}, function() {}]]
+].forEach(function(test) {
+  exception(test[0], 'bad arguments, expected: ' + test[1], [[], test[2]]);
+});
+exception('arenaOpen', 'bad arguments, expected: (dir, options, callback)', [
+  [],
+  [1, {}, function() {}],
+  ['/tmp', null, function() {}],
+  ['/tmp', {}]
+]);
+exception(
+  'arenaOpen',
+  'options.blockSize must be a power of 2 from 4096 to 16777216',
+  [
+    ['/tmp', { blockSize: 2048 }, function() {}],
+    ['/tmp', { blockSize: 12288 }, function() {}],
+    ['/tmp', { blockSize: 33554432 }, function() {}]
+  ]
+);
+exception('arenaOpen', 'dir must not be empty', [
+  ['', {}, function() {}]
+]);
+[
+  ['arenaAllocate', '(arena, length)', [{}, 4096]],
+  ['arenaClose', '(arena)', [{}]],
+  [
+    'arenaRead',
+    '(arena, position, buffer, callback)',
+    [{}, 0, Buffer.alloc(1), function() {}]
+  ],
+  ['arenaRelease', '(arena, position, callback)', [{}, 0, function() {}]],
+  ['arenaStats', '(arena)', [{}]],
+  [
+    'arenaWrite',
+    '(arena, position, buffer, callback)',
+    [{}, 0, Buffer.alloc(1), function() {}]
+  ]
+].forEach(function(test) {
+  exception(test[0], 'bad arguments, expected: ' + test[1], [[], test[2]]);
+});
+exception('containerCreate', 'bad arguments, expected: (fd, options)', [
+  [],
+  ['1', {}],
+  [1, null]
+]);
+exception(
+  'containerCreate',
+  'options.sectorSize must be a power of 2 from 512 to 65536',
+  [
+    [1, { sectorSize: 256 }],
+    [1, { sectorSize: 6144 }],
+    [1, { sectorSize: 131072 }]
+  ]
+);
+exception('containerCreate', 'options.checksum must be a boolean', [
+  [1, { checksum: 1 }]
+]);
+exception('containerCreate', 'options.compress must be "lz4"', [
+  [1, { compress: 'zstd' }],
+  [1, { compress: true }]
+]);
+exception(
+  'containerOpen',
+  'bad arguments, expected: (fd, options, callback)',
+  [
+    [],
+    ['1', {}, function() {}],
+    [1, null, function() {}],
+    [1, {}]
+  ]
+);
+exception('containerOpen', 'options.depth must be from 1 to 64', [
+  [1, { depth: 0 }, function() {}],
+  [1, { depth: 65 }, function() {}]
+]);
+[
+  ['containerAppend', '(writer, buffers, callback)', [{}, [], function() {}]],
+  ['containerFinish', '(writer, callback)', [{}, function() {}]],
+  ['containerInfo', '(reader)', [{}]],
+  ['containerRead', '(reader, chunks, callback)', [{}, [0], function() {}]],
+  [
+    'containerScan',
+    '(reader, options, onChunk, callback)',
+    [{}, {}, function() {}, function() {}]
+  ]
+].forEach(function(test) {
+  exception(test[0], 'bad arguments, expected: ' + test[1], [[], test[2]]);
+});
+exception('slotOpen', 'bad arguments, expected: (fd, options, callback)', [
+  [],
+  ['1', {}, function() {}],
+  [1, null, function() {}],
+  [1, {}]
+]);
+exception('slotOpen', 'options.format must be a boolean', [
+  [1, { format: 'true' }, function() {}]
+]);
+exception(
+  'slotOpen',
+  'options.slotSize and options.slots require options.format',
+  [
+    [1, { slotSize: 4096 }, function() {}],
+    [1, { format: false, slots: 16 }, function() {}]
+  ]
+);
+exception(
+  'slotOpen',
+  'options.slotSize must be a power of 2 from 512 to 16777216',
+  [
+    [1, { format: true, slotSize: 256 }, function() {}],
+    [1, { format: true, slotSize: 3072 }, function() {}],
+    [1, { format: true, slotSize: 33554432 }, function() {}]
+  ]
+);
+exception('slotOpen', 'options.slots must be a positive integer', [
+  [1, { format: true, slots: -1 }, function() {}],
+  [1, { format: true, slots: 1.5 }, function() {}]
+]);
+exception('slotOpen', 'options.depth must be from 1 to 64', [
+  [1, { depth: 0 }, function() {}],
+  [1, { depth: 65 }, function() {}]
+]);
+[
+  ['slotAllocate', '(store)', [{}]],
+  ['slotFree', '(store, slots, callback)', [{}, [0], function() {}]],
+  ['slotGet', '(store, slots, callback)', [{}, [0], function() {}]],
+  ['slotPut', '(store, records, callback)', [{}, [], function() {}]],
+  ['slotStats', '(store)', [{}]]
+].forEach(function(test) {
+  exception(test[0], 'bad arguments, expected: ' + test[1], [[], test[2]]);
+});
+exception('equals', 'bad arguments, expected: (a, b, threads=1..64)', [
+  [Buffer.alloc(1)],
+  [Buffer.alloc(1), 1],
+  [Buffer.alloc(1), Buffer.alloc(1), 0]
+]);
+exception(
+  'xorInto',
+  'bad arguments, expected: (target, source, threads=1..64)',
+  [
+    [Buffer.alloc(1)],
+    [Buffer.alloc(1), Buffer.alloc(1), -1]
+  ]
+);
+exception('xorInto', 'target.length must equal source.length', [
+  [Buffer.alloc(1), Buffer.alloc(2)]
+]);
+exception(
+  'fill',
+  'bad arguments, expected: (buffer, value=0..255, threads=1..64)',
+  [
+    [Buffer.alloc(1)],
+    [Buffer.alloc(1), 256],
+    [Buffer.alloc(1), -1],
+    [Buffer.alloc(1), 1, 0]
+  ]
+);
+
+exception(
+  'scrub',
+  'bad arguments, expected: (fd, options, onProgress, callback)',
+  [
+    [],
+    [1, {}, null],
+    [-1, {}, null, function() {}],
+    [1, null, null, function() {}],
+    [1, {}, undefined, function() {}],
+    [1, {}, null, null]
+  ]
+);
+exception(
+  'scrub',
+  'options.blockSize must be a multiple of 512 up to 67108864',
+  [
+    [1, { blockSize: 511 }, null, function() {}],
+    [1, { blockSize: 513 }, null, function() {}],
+    [1, { blockSize: 128 * 1024 * 1024 }, null, function() {}]
+  ]
+);
+exception('scrub', 'options.depth must be from 1 to 64', [
+  [1, { depth: 0 }, null, function() {}],
+  [1, { depth: 65 }, null, function() {}]
+]);
+exception(
+  'scrub',
+  'options.end must be a safe integer not less than options.start',
+  [[1, { start: 4096, end: 0 }, null, function() {}]]
+);
+exception(
+  'scrub',
+  'options.format must be a power of 2 dividing options.blockSize',
+  [[1, { blockSize: 4096, format: 8192 }, null, function() {}]]
+);
+
+exception('blake3', 'bad arguments, expected: (buffer)', [
+  [],
+  ['abc'],
+  [Buffer.alloc(1), 1]
+]);
+['buildIndex', 'computeDelta'].forEach(
+  function(method) {
+    exception(
+      method,
+      'bad arguments, expected: (fd, indexFd, options, onProgress, callback)',
+      [
+        [],
+        [1, 2, {}, null],
+        [1, -1, {}, null, function() {}],
+        [1, 2, 'options', null, function() {}]
+      ]
+    );
+  }
+);
+exception('computeDelta', 'options.update must be a boolean', [
+  [1, 2, { update: 1 }, null, function() {}]
+]);
+exception(
+  'applyDelta',
+  'bad arguments, expected: ' +
+  '(srcFd, dstFd, ranges, options, onProgress, callback)',
+  [
+    [],
+    [1, 2, [], {}, null],
+    [1, 2, {}, {}, null, function() {}],
+    [1, 2, [], null, null, function() {}]
+  ]
+);
+exception(
+  'applyDelta',
+  'ranges must be an array of { offset, length } objects',
+  [
+    [1, 2, [null], {}, null, function() {}],
+    [1, 2, [{ offset: 0 }], {}, null, function() {}],
+    [1, 2, [{ offset: -1, length: 1 }], {}, null, function() {}]
+  ]
+);
+exception('applyDelta', 'options.dstDepth must be from 1 to 64', [
+  [1, 2, [], { dstDepth: 65 }, null, function() {}]
+]);
+
+exception(
+  'copyDevice',
+  'bad arguments, expected: (srcFd, dstFd, options, onProgress, callback)',
+  [
+    [],
+    [1, 2, {}, null],
+    [-1, 2, {}, null, function() {}],
+    [1, 2, undefined, null, function() {}],
+    [1, 2, {}, function() {}, 1]
+  ]
+);
+exception('copyDevice', 'options.srcDepth must be from 1 to 64', [
+  [1, 2, { srcDepth: 0 }, null, function() {}],
+  [1, 2, { srcDepth: 65 }, null, function() {}]
+]);
+exception('copyDevice', 'options.dstDepth must be from 1 to 64', [
+  [1, 2, { dstDepth: 0 }, null, function() {}]
+]);
+exception(
+  'copyDevice',
+  'options.resume must be a checkpoint within the range',
+  [
+    [1, 2, { offset: 4096, resume: 0 }, null, function() {}],
+    [1, 2, { offset: 0, length: 4096, resume: 8192 }, null, function() {}]
+  ]
+);
+exception('copyDevice', 'options.verify must be a boolean', [
+  [1, 2, { verify: 'yes' }, null, function() {}]
+]);
+
+exception(
+  'fillRange',
+  'bad arguments, expected: ' +
+  '(fd, offset, length, pattern, options, onProgress, callback)',
+  [
+    [],
+    [1, 0, 0, 0, {}, null],
+    [1, -1, 0, 0, {}, null, function() {}],
+    [1, 0, 0.5, 0, {}, null, function() {}],
+    [1, 0, 0, 256, {}, null, function() {}],
+    [1, 0, 0, 'a', {}, null, function() {}],
+    [1, 0, 0, 0, null, null, function() {}]
+  ]
+);
+exception('fillRange', 'pattern must not be empty', [
+  [1, 0, 0, Buffer.alloc(0), {}, null, function() {}]
+]);
+exception('fillRange', 'pattern length must divide options.blockSize', [
+  [1, 0, 0, Buffer.alloc(3), { blockSize: 4096 }, null, function() {}]
+]);
+
+exception(
+  'hashRange',
+  'bad arguments, expected: ' +
+  '(fd, offset, length, options, onProgress, callback)',
+  [
+    [],
+    [1, 0, 0, {}, null],
+    [1, -1, 0, {}, null, function() {}],
+    [1, 0, undefined, {}, null, function() {}],
+    [1, 0, null, null, null, function() {}]
+  ]
+);
+exception('hashRange', 'options.algo must be "blake3"', [
+  [1, 0, 0, { algo: 'sha256' }, null, function() {}]
+]);
+exception('hashRange', 'options.blockSize must be a power of 2 from 1024', [
+  [1, 0, 0, { blockSize: 512 }, null, function() {}],
+  [1, 0, 0, { blockSize: 3072 }, null, function() {}]
+]);
+exception('hashRange', 'options.leaves must be a boolean', [
+  [1, 0, 0, { leaves: 1 }, null, function() {}]
+]);
+
+exception(
+  'imageDevice',
+  'bad arguments, expected: (srcFd, dstFd, options, onProgress, callback)',
+  [
+    [],
+    [1, 2, {}, null],
+    [1, -1, {}, null, function() {}],
+    [1, 2, null, null, function() {}],
+    [1, 2, {}, null, null]
+  ]
+);
+exception('imageDevice', 'options.punch must be a boolean', [
+  [1, 2, { punch: 1 }, null, function() {}]
+]);
+
+exception('merkleOpen', 'bad arguments, expected: (fd, options)', [
+  [],
+  [-1, {}],
+  [1, null]
+]);
+exception('merkleOpen', 'options.size must be a positive safe integer', [
+  [1, {}],
+  [1, { size: 0 }]
+]);
+exception(
+  'merkleOpen',
+  'options.leafSize must be a power of 2 from 4096 to 1048576',
+  [
+    [1, { size: 1, leafSize: 2048 }],
+    [1, { size: 1, leafSize: 12288 }],
+    [1, { size: 1, leafSize: 2097152 }]
+  ]
+);
+['merkleClose', 'merkleRoot'].forEach(
+  function(method) {
+    exception(method, 'bad arguments, expected: (tree)', [
+      [],
+      [{}],
+      [Buffer.alloc(1)]
+    ]);
+  }
+);
+exception('merkleNode', 'bad arguments, expected: (tree, level, index)', [
+  [{}, 0, 0]
+]);
+exception('merkleSync', 'bad arguments, expected: (tree, callback)', [
+  [{}, function() {}]
+]);
+exception(
+  'merkleRebuild',
+  'bad arguments, expected: (fd, tree, options, onProgress, callback)',
+  [
+    [1, {}, {}, null, function() {}]
+  ]
+);
+
+exception('chunkerCreate', 'bad arguments, expected: (options)', [
+  [],
+  [null]
+]);
+exception(
+  'chunkerCreate',
+  'options.avgSize must be a power of 2 from 256 to 16777216',
+  [
+    [{ avgSize: 128 }],
+    [{ avgSize: 3000 }],
+    [{ avgSize: 33554432 }]
+  ]
+);
+exception(
+  'chunkerCreate',
+  'options.minSize must be from 64 to options.avgSize',
+  [
+    [{ minSize: 32 }],
+    [{ avgSize: 4096, minSize: 8192 }]
+  ]
+);
+exception(
+  'chunkerCreate',
+  'options.maxSize must be from options.avgSize to 268435456',
+  [
+    [{ avgSize: 4096, maxSize: 2048 }],
+    [{ maxSize: 536870912 }]
+  ]
+);
+exception(
+  'chunkerCreate',
+  'options.kernel must be "scalar", "avx2" or "avx512"',
+  [
+    [{ kernel: 'sse2' }],
+    [{ kernel: 1 }]
+  ]
+);
+exception(
+  'chunkerUpdate',
+  'bad arguments, expected: (chunker, buffer, callback)',
+  [
+    [],
+    [{}, Buffer.alloc(1), function() {}],
+    [binding.chunkerCreate({}), 'buffer', function() {}],
+    [binding.chunkerCreate({}), Buffer.alloc(1)]
+  ]
+);
+exception('chunkerFinish', 'bad arguments, expected: (chunker)', [
+  [],
+  [{}]
+]);
+(function() {
+  var chunker = binding.chunkerCreate({});
+  binding.chunkerUpdate(chunker, Buffer.alloc(1), function() {});
+  exception('chunkerUpdate', 'chunker is busy', [
+    [chunker, Buffer.alloc(1), function() {}]
+  ]);
+  exception('chunkerFinish', 'chunker is busy', [[chunker]]);
+})();
+
+exception('setEncryption', 'bad arguments, expected: (fd, key, options)', [
+  [],
+  [-1, null, {}],
+  [1, 'key', {}],
+  [1, null]
+]);
+exception('setEncryption', 'key must be 64 bytes', [
+  [1, Buffer.alloc(32), {}]
+]);
+exception('setEncryption', 'key halves must be different', [
+  [1, Buffer.alloc(64), {}]
+]);
+exception(
+  'setEncryption',
+  'options.sectorSize must be a power of 2 from 512 to 65536',
+  [
+    [1, Node.crypto.randomBytes(64), { sectorSize: 256 }],
+    [1, Node.crypto.randomBytes(64), { sectorSize: 1536 }]
+  ]
+);
+exception(
+  'setEncryption',
+  'options.kernel must be "scalar", "aesni" or "vaes"',
+  [
+    [1, Node.crypto.randomBytes(64), { kernel: 'aes' }],
+    [1, Node.crypto.randomBytes(64), { kernel: 1 }]
+  ]
+);
+
+exception('volumeOpen', 'bad arguments, expected: (fds, options, callback)', [
+  [],
+  [1, {}, function() {}],
+  [[1], null, function() {}],
+  [[1], {}]
+]);
+exception('volumeOpen', 'fds must be an array of 1 to 64 fds', [
+  [[], {}, function() {}],
+  [[1, -1], {}, function() {}],
+  [new Array(65).fill(1), {}, function() {}]
+]);
+exception(
+  'volumeOpen',
+  'options.stripeSize must be a power of 2 from 512 to 16777216',
+  [
+    [[1], { stripeSize: 256 }, function() {}],
+    [[1], { stripeSize: 65535 }, function() {}],
+    [[1], { stripeSize: 33554432 }, function() {}]
+  ]
+);
+exception(
+  'volumeOpen',
+  'options.layout must be "stripe", "mirror" or "erasure"',
+  [
+    [[1], { layout: 'raid5' }, function() {}],
+    [[1], { layout: 1 }, function() {}]
+  ]
+);
+exception(
+  'volumeOpen',
+  'options.stripeSize cannot be combined with a mirror layout',
+  [[[1, 2], { layout: 'mirror', stripeSize: 4096 }, function() {}]]
+);
+exception(
+  'volumeOpen',
+  'options.writeQuorum must be from 1 to the number of fds',
+  [
+    [[1, 2], { layout: 'mirror', writeQuorum: 0 }, function() {}],
+    [[1, 2], { layout: 'mirror', writeQuorum: 3 }, function() {}]
+  ]
+);
+exception(
+  'volumeOpen',
+  'options.parityDevices must be from 1 to the number of fds - 1',
+  [
+    [[1, 2], { layout: 'erasure' }, function() {}],
+    [[1, 2, 3], { layout: 'erasure', parityDevices: 0 }, function() {}],
+    [[1, 2, 3], { layout: 'erasure', parityDevices: 3 }, function() {}],
+    [[1, 2, 3], { layout: 'erasure', parityDevices: '1' }, function() {}]
+  ]
+);
+exception('volumeOpen', 'options.parityDevices requires an erasure layout', [
+  [[1, 2, 3], { parityDevices: 1 }, function() {}],
+  [[1, 2, 3], { layout: 'mirror', parityDevices: 1 }, function() {}]
+]);
+exception('volumeOpen', 'options.kernel requires an erasure layout', [
+  [[1, 2, 3], { kernel: 'scalar' }, function() {}],
+  [[1, 2, 3], { layout: 'mirror', kernel: 'scalar' }, function() {}]
+]);
+exception(
+  'volumeOpen',
+  'options.kernel must be "scalar", "ssse3", "avx2" or "avx512"',
+  [
+    [[1, 2, 3], { layout: 'erasure', parityDevices: 1, kernel: 'sse' },
+      function() {}],
+    [[1, 2, 3], { layout: 'erasure', parityDevices: 1, kernel: 1 },
+      function() {}]
+  ]
+);
+exception('volumeOpen', 'options.hedge must be a boolean', [
+  [[1, 2], { layout: 'mirror', hedge: 1 }, function() {}]
+]);
+exception('volumeOpen', 'options.hedgeDelay must be a non-negative integer', [
+  [[1, 2], { layout: 'mirror', hedgeDelay: -1 }, function() {}]
+]);
+exception(
+  'volumeOpen',
+  'options.writeQuorum, options.hedge and options.hedgeDelay ' +
+  'require a mirror layout',
+  [
+    [[1, 2], { writeQuorum: 1 }, function() {}],
+    [[1, 2], { layout: 'stripe', hedge: false }, function() {}]
+  ]
+);
+['volumeGeometry', 'volumeStats'].forEach(
+  function(method) {
+    exception(method, 'bad arguments, expected: (volume)', [
+      [],
+      [1],
+      [{}]
+    ]);
+  }
+);
+['volumeRead', 'volumeWrite'].forEach(
+  function(method) {
+    exception(
+      method,
+      'bad arguments, expected: ' +
+      '(volume, buffer, offset, length, position, options, callback)',
+      [
+        [],
+        [1, Buffer.alloc(8), 0, 8, 0, {}, function() {}],
+        [{}, Buffer.alloc(8), 0, 8, 0, {}, function() {}]
+      ]
+    );
+  }
+);
+
+exception('logOpen', 'bad arguments, expected: (fd, options, callback)', [
+  [],
+  ['1', {}, function() {}],
+  [1, null, function() {}],
+  [1, {}]
+]);
+exception(
+  'logOpen',
+  'options.blockSize must be a power of 2 from 512 to 65536',
+  [
+    [1, { blockSize: 256 }, function() {}],
+    [1, { blockSize: 4095 }, function() {}],
+    [1, { blockSize: 131072 }, function() {}]
+  ]
+);
+exception(
+  'logOpen',
+  'options.segmentSize must be a power of 2 from 65536 to 1073741824',
+  [
+    [1, { segmentSize: 32768 }, function() {}],
+    [1, { segmentSize: 100000 }, function() {}]
+  ]
+);
+exception('logOpen', 'options.segments must be from 2 to 1024', [
+  [1, { segments: 1 }, function() {}],
+  [1, { segments: 1025 }, function() {}]
+]);
+exception('logOpen', 'options.sync must be "fdatasync" or "dsync"', [
+  [1, { sync: 'fsync' }, function() {}],
+  [1, { sync: true }, function() {}]
+]);
+exception('logAppend', 'bad arguments, expected: (log, buffer, callback)', [
+  [],
+  [{}, Buffer.alloc(1), function() {}],
+  [1, Buffer.alloc(1), function() {}]
+]);
+exception('logRead', 'bad arguments, expected: (log, lsn, length, callback)', [
+  [],
+  [{}, 0, 0, function() {}]
+]);
+exception('logRelease', 'bad arguments, expected: (log, lsn)', [
+  [],
+  [{}, 0]
+]);
+exception(
+  'logScan',
+  'bad arguments, expected: (fd, options, onProgress, callback)',
+  [
+    [],
+    ['1', {}, null, function() {}],
+    [1, {}, {}, function() {}],
+    [1, {}, null]
+  ]
+);
+exception(
+  'logScan',
+  'options.ioSize must be a power of 2 from options.blockSize to 67108864',
+  [
+    [1, { ioSize: 2048 }, null, function() {}],
+    [1, { blockSize: 8192, ioSize: 4096 }, null, function() {}],
+    [1, { ioSize: 1000000 }, null, function() {}]
+  ]
+);
+exception('logScan', 'options.depth must be from 1 to 64', [
+  [1, { depth: 0 }, null, function() {}]
+]);
+exception('logStatus', 'bad arguments, expected: (log)', [
+  [],
+  [{}]
+]);
+['read', 'write'].forEach(
+  function(method) {
+    exception(
+      method,
+      'bad arguments, expected: ' +
+      '(fd, buffer, offset, length, position, options, callback)',
+      [
+        [],
+        [1, Buffer.alloc(8), 0, 8, 0, {}],
+        [-1, Buffer.alloc(8), 0, 8, 0, {}, function() {}],
+        [1, 'buffer', 0, 8, 0, {}, function() {}],
+        [1, Buffer.alloc(8), -1, 8, 0, {}, function() {}],
+        [1, Buffer.alloc(8), 0, 8.1, 0, {}, function() {}],
+        [1, Buffer.alloc(8), 0, 8, -1, {}, function() {}],
+        [1, Buffer.alloc(8), 0, 8, Math.pow(2, 53), {}, function() {}],
+        [1, Buffer.alloc(8), 0, 8, 0, null, function() {}],
+        [1, Buffer.alloc(8), 0, 8, 0, {}, {}]
+      ]
+    );
+    exception(
+      method,
+      'offset + length must not be greater than buffer.length',
+      [[1, Buffer.alloc(8), 1, 8, 0, {}, function() {}]]
+    );
+    exception(
+      method,
+      'options.crc32c must be a boolean',
+      [[1, Buffer.alloc(8), 0, 8, 0, { crc32c: 1 }, function() {}]]
+    );
+    exception(
+      method,
+      'options.format must be a power of 2 from 512 to 4194304',
+      [
+        [1, Buffer.alloc(8), 0, 8, 0, { format: 256 }, function() {}],
+        [1, Buffer.alloc(8), 0, 8, 0, { format: 4097 }, function() {}]
+      ]
+    );
+    exception(
+      method,
+      'length and position must be multiples of options.format',
+      [
+        [1, Buffer.alloc(4096), 0, 4096, 512, { format: 4096 }, function() {}],
+        [1, Buffer.alloc(4096), 0, 512, 0, { format: 4096 }, function() {}]
+      ]
+    );
+    if (method === 'read') {
+      exception(
+        method,
+        'options.fdatasync and options.verify are only for writes',
+        [
+          [1, Buffer.alloc(8), 0, 8, 0, { fdatasync: true }, function() {}],
+          [1, Buffer.alloc(8), 0, 8, 0, { verify: true }, function() {}]
+        ]
+      );
+    }
+    exception(
+      method,
+      'options.atomic must be a boolean',
+      [[1, Buffer.alloc(8), 0, 8, 0, { atomic: 1 }, function() {}]]
+    );
+    if (method === 'read') {
+      exception(
+        method,
+        'options.atomic is only for writes',
+        [[1, Buffer.alloc(8), 0, 8, 0, { atomic: true }, function() {}]]
+      );
+    } else {
+      exception(
+        method,
+        'length must be a power of 2 and position a multiple of length ' +
+        'for options.atomic',
+        [
+          [1, Buffer.alloc(8), 0, 0, 0, { atomic: true }, function() {}],
+          [1, Buffer.alloc(8), 0, 6, 0, { atomic: true }, function() {}],
+          [1, Buffer.alloc(8), 0, 8, 4, { atomic: true }, function() {}]
+        ]
+      );
+      exception(
+        method,
+        'options.compress cannot be combined with options.atomic',
+        [
+          [
+            1, Buffer.alloc(512), 0, 512, 0, { atomic: true, compress: 'lz4' },
+            function() {}
+          ]
+        ]
+      );
+    }
+    exception(
+      method,
+      'options.verify must be a boolean',
+      [[1, Buffer.alloc(8), 0, 8, 0, { verify: 1 }, function() {}]]
+    );
+    exception(
+      method,
+      'options.sequence requires options.format',
+      [[1, Buffer.alloc(8), 0, 8, 0, { sequence: 1 }, function() {}]]
+    );
+    exception(
+      method,
+      'options.expectCRC32C must be a uint32',
+      [
+        [1, Buffer.alloc(8), 0, 8, 0, { expectCRC32C: -1 }, function() {}],
+        [
+          1, Buffer.alloc(8), 0, 8, 0, { expectCRC32C: 4294967296 },
+          function() {}
+        ]
+      ]
+    );
+    exception(
+      method,
+      'options.compress must be "lz4"',
+      [
+        [1, Buffer.alloc(8), 0, 8, 0, { compress: true }, function() {}],
+        [1, Buffer.alloc(8), 0, 8, 0, { compress: 'zstd' }, function() {}]
+      ]
+    );
+    exception(
+      method,
+      'options.compress cannot be combined with options.format',
+      [
+        [
+          1, Buffer.alloc(512), 0, 512, 0, { compress: 'lz4', format: 512 },
+          function() {}
+        ]
+      ]
+    );
+    exception(
+      method,
+      'options.sectorSize must be a power of 2 from 512 to 65536',
+      [
+        [1, Buffer.alloc(8), 0, 8, 0, { sectorSize: 256 }, function() {}],
+        [1, Buffer.alloc(8), 0, 8, 0, { sectorSize: 3072 }, function() {}],
+        [1, Buffer.alloc(8), 0, 8, 0, { sectorSize: 131072 }, function() {}]
+      ]
+    );
+  }
+);
+
 if (Node.process.platform !== 'darwin') {
   exception('setF_NOCACHE', 'only supported on mac os', [[]]);
 }
 if (Node.process.platform === 'win32') {
   exception('setFlock', 'not supported on windows', [[]]);
 }
-if (Node.process.platform !== 'win32') {
-  exception('setFSCTL_LOCK_VOLUME', 'only supported on windows', [[]]);
+if (Node.process.platform !== 'win32') {
+  exception('setFSCTL_LOCK_VOLUME', 'only supported on windows', [[]]);
+}
+
+(function() {
+  var methods = [];
+  if (Node.process.platform === 'darwin') methods.push('setF_NOCACHE');
+  if (Node.process.platform !== 'win32') methods.push('setFlock');
+  if (Node.process.platform === 'win32') methods.push('setFSCTL_LOCK_VOLUME');
+  methods.forEach(
+    function(method) {
+      exception(
+        method,
+        'bad arguments, expected: (fd, value=0/1, callback)',
+        [
+          [],
+          [1],
+          
+          [undefined, 0, function() {}],
+          [undefined + 1, 0, function() {}],
+          [-1, 0, function() {}],
+          [1.1, 0, function() {}],
+          [Math.pow(2, 31), 0, function() {}],
+
+          [1, undefined, function() {}],
+          [1, undefined + 1, function() {}],
+          [1, -1, function() {}],
+          [1, 1.1, function() {}],
+          [1, 2, function() {}],
+          [1, Math.pow(2, 31), function() {}],
+
+          [1, 0],
+          [1, 0, {}],
+          [1, 0, null],
+          [1, 0, undefined],
+          [1, 0, function() {}, function() {}]
+        ]
+      );
+    }
+  );
+})();
+
+function getAlignedBuffer(size, alignment) {
+  var buffer = binding.getAlignedBuffer(size, alignment);
+  assert(Buffer.isBuffer(buffer));
+  assert(buffer.length === size);
+  var size = 0;
+  var zero = 0;
+  for (var index = 0, length = buffer.length; index < length; index++) {
+    size++;
+    zero += buffer[index];
+  }
+  assert(size === buffer.length);
+  assert(zero === 0);
+  // Force physical page allocation if only allocated virtually:
+  for (var page = 0, length = buffer.length; page < length; page += 4096) {
+    buffer[page] = 255;
+  }
+  console.log('PASS: getAlignedBuffer(' + size + ', ' + alignment + ')');
+}
+
+[1, 2, 3, 4, 5, 6, 7, 8, 4095, 4096, 4097, 1048576, 4194304].forEach(
+  function(size) {
+    [
+      8,
+      16,
+      32,
+      64,
+      128,
+      256,
+      512,
+      1024,
+      2048,
+      4096,
+      8192,
+      16384,
+      32768,
+      65536,
+      131072,
+      262144,
+      524288,
+      1048576,
+      2097152,
+      4194304
+    ].forEach(
+      function(alignment) {
+        getAlignedBuffer(size, alignment);
+      }
+    );
+  }
+);
+
+(function() {
+  if (Node.process.platform === 'win32') return;
+  var fd1 = Node.fs.openSync(module.filename, 'r');
+  binding.getBlockDevice(fd1,
+    function(error) {
+      assert(error !== undefined);
+      assert(error.message === 'fd is not a block or character device');
+      console.log(
+        'PASS: getBlockDevice(fd1): ' + JSON.stringify(error.message)
+      );
+    }
+  );
+})();
+
+(function() {
+  if (Node.process.platform !== 'darwin') return;
+  var fd1 = Node.fs.openSync(module.filename, 'r');
+  binding.setF_NOCACHE(fd1, 1,
+    function(error) {
+      assert(error === undefined);
+      console.log('PASS: setF_NOCACHE(fd1, 1)');
+      binding.setF_NOCACHE(fd1, 0,
+        function(error) {
+          assert(error === undefined);
+          console.log('PASS: setF_NOCACHE(fd1, 0)');
+        }
+      );
+    }
+  );
+})();
+
+(function() {
+  if (Node.process.platform === 'win32') return;
+  var fd1 = Node.fs.openSync(module.filename, 'r');
+  var fd2 = Node.fs.openSync(module.filename, 'r');
+  binding.setFlock(fd1, 0,
+    function(error) {
+      assert(error === undefined);
+      console.log('PASS: setFlock(fd1, 0)');
+      binding.setFlock(fd1, 1,
+        function(error) {
+          assert(error === undefined);
+          console.log('PASS: setFlock(fd1, 1)');
+          binding.setFlock(fd2, 1,
+            function(error) {
+              assert(error !== undefined);
+              assert(
+                error.message === 'EWOULDBLOCK, the file is already locked'
+              );
+              console.log(
+                'PASS: setFlock(fd2, 1): ' + JSON.stringify(error.message)
+              );
+              binding.setFlock(fd1, 0,
+                function(error) {
+                  assert(error === undefined);
+                  console.log('PASS: setFlock(fd1, 0)');
+                  binding.setFlock(fd2, 1,
+                    function(error) {
+                      assert(error === undefined);
+                      console.log('PASS: setFlock(fd2, 1)');
+                      binding.setFlock(fd2, 0,
+                        function(error) {
+                          assert(error === undefined);
+                          console.log('PASS: setFlock(fd2, 0)');
+                        }
+                      );
+                    }
+                  );
+                }
+              );
+            }
+          );
+        }
+      );
+    }
+  );
+})();
+
+function tmpPath(name) {
+  return Node.path.join(
+    Node.os.tmpdir(),
+    'direct-io-test-' + Node.process.pid + '-' + name
+  );
+}
+
+var CRC32C_TABLE = (function() {
+  var table = new Int32Array(256);
+  for (var index = 0; index < 256; index++) {
+    var crc = index;
+    for (var bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? ((crc >>> 1) ^ 0x82f63b78) : (crc >>> 1);
+    }
+    table[index] = crc;
+  }
+  return table;
+})();
+
+function crc32c(buffer) {
+  var crc = -1;
+  for (var index = 0, length = buffer.length; index < length; index++) {
+    crc = CRC32C_TABLE[(crc ^ buffer[index]) & 0xff] ^ (crc >>> 8);
+  }
+  return (crc ^ -1) >>> 0;
 }
 
 (function() {
-  var methods = [];
-  if (Node.process.platform === 'darwin') methods.push('setF_NOCACHE');
-  if (Node.process.platform !== 'win32') methods.push('setFlock');
-  if (Node.process.platform === 'win32') methods.push('setFSCTL_LOCK_VOLUME');
-  methods.forEach(
-    function(method) {
+  // Run the vectors through the default and through each kernel the CPU
+  // supports:
+  assert(['table', 'sse42', 'pclmul'].indexOf(binding.CRC32C) !== -1);
+  var names = ['table', 'sse42', 'pclmul'];
+  names = names.slice(0, names.indexOf(binding.CRC32C) + 1);
+  if (names.length < 3) {
+    exception('crc32c', 'options.kernel is not supported by this CPU', [
+      [Buffer.alloc(1), { kernel: 'pclmul' }]
+    ]);
+  }
+  [undefined].concat(names).forEach(
+    function(kernel) {
+      var options = kernel ? { kernel: kernel } : {};
+      var name = 'crc32c(' + (kernel ? '{ kernel: "' + kernel + '" }' : '');
+      assert(
+        binding.crc32c(Buffer.from('123456789', 'ascii'), options) ===
+        0xe3069283
+      );
+      assert(binding.crc32c(Buffer.alloc(0), options) === 0);
+      assert(binding.crc32c(Buffer.alloc(32, 0), options) === 0x8a9136aa);
+      assert(binding.crc32c(Buffer.alloc(32, 255), options) === 0x62a8ab43);
+      [
+        1, 7, 8, 9, 63, 767, 768, 769, 1000, 4096, 24575, 24576, 24577, 65536,
+        100003, 1048576
+      ].forEach(
+        function(size) {
+          var buffer = Node.crypto.randomBytes(size + 7);
+          // Exercise unaligned heads and tails:
+          [0, 1, 3, 7].forEach(
+            function(offset) {
+              var slice = buffer.slice(offset, offset + size);
+              assert(binding.crc32c(slice, options) === crc32c(slice));
+            }
+          );
+        }
+      );
+      console.log('PASS: ' + name + ')');
+    }
+  );
+})();
+
+(function() {
+  // Official test vectors, where the input is the byte sequence 0, 1, ... 250
+  // repeating:
+  [
+    [0, 'af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262'],
+    [1, '2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213'],
+    [63, 'e9bc37a594daad83be9470df7f7b3798297c3d834ce80ba85d6e207627b7db7b'],
+    [64, '4eed7141ea4a5cd4b788606bd23f46e212af9cacebacdc7d1f4c6dc7f2511b98'],
+    [65, 'de1e5fa0be70df6d2be8fffd0e99ceaa8eb6e8c93a63f2d8d1c30ecb6b263dee'],
+    [1023, '10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11'],
+    [1024, '42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7'],
+    [1025, 'd00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444'],
+    [2048, 'e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a'],
+    [2049, '5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030'],
+    [3072, 'b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2'],
+    [3073, '7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3'],
+    [4096, '015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969'],
+    [4097, '9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995'],
+    [5120, '9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833'],
+    [8192, 'aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63'],
+    [31744, '62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47'],
+    [102400, 'bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085']
+  ].forEach(
+    function(vector) {
+      var buffer = Buffer.alloc(vector[0]);
+      for (var index = 0; index < buffer.length; index++) {
+        buffer[index] = index % 251;
+      }
+      assert(binding.blake3(buffer).toString('hex') === vector[1]);
+      console.log('PASS: blake3(' + vector[0] + ')');
+    }
+  );
+})();
+
+(function() {
+  var path = tmpPath('crc32c');
+  var fd = Node.fs.openSync(path, 'w+');
+  var buffer = binding.getAlignedBuffer(65536, 4096);
+  Node.crypto.randomFillSync(buffer);
+  var expected = crc32c(buffer);
+  function close() {
+    Node.fs.closeSync(fd);
+    Node.fs.unlinkSync(path);
+  }
+  binding.write(fd, buffer, 0, buffer.length, 4096, { crc32c: true },
+    function(error, result) {
+      assert(error === undefined);
+      assert(result.bytes === buffer.length);
+      assert(result.crc32c === expected);
+      console.log('PASS: write({ crc32c: true })');
+      var target = binding.getAlignedBuffer(buffer.length, 4096);
+      var options = { expectCRC32C: expected };
+      binding.read(fd, target, 0, target.length, 4096, options,
+        function(error, result) {
+          assert(error === undefined);
+          assert(result.bytes === buffer.length);
+          assert(result.crc32c === expected);
+          assert(target.equals(buffer));
+          console.log('PASS: read({ expectCRC32C })');
+          var options = { expectCRC32C: (expected + 1) >>> 0 };
+          binding.read(fd, target, 0, target.length, 4096, options,
+            function(error) {
+              assert(error !== undefined);
+              assert(error.message === 'crc32c mismatch');
+              console.log('PASS: read({ expectCRC32C }): "crc32c mismatch"');
+              // A short read at EOF checksums only the bytes read:
+              binding.read(fd, target, 0, 8192, 65536, { crc32c: true },
+                function(error, result) {
+                  close();
+                  assert(error === undefined);
+                  assert(result.bytes === 4096);
+                  assert(result.crc32c === crc32c(buffer.slice(61440)));
+                  console.log('PASS: read({ crc32c: true }) at EOF');
+                }
+              );
+            }
+          );
+        }
+      );
+    }
+  );
+})();
+
+(function() {
+  var path = tmpPath('format');
+  var fd = Node.fs.openSync(path, 'w+');
+  var block = 4096;
+  var payload = block - binding.FORMAT_TRAILER;
+  var buffer = binding.getAlignedBuffer(block * 4, 4096);
+  var payloads = Node.crypto.randomBytes(payload * 4);
+  for (var index = 0; index < 4; index++) {
+    payloads.copy(
+      buffer,
+      index * block,
+      index * payload,
+      (index + 1) * payload
+    );
+  }
+  function read(position, options, end) {
+    var target = binding.getAlignedBuffer(block * 4, 4096);
+    binding.read(fd, target, 0, target.length, position, options,
+      function(error, result) {
+        end(error, result, target);
+      }
+    );
+  }
+  var options = { format: block, sequence: 7 };
+  binding.write(fd, buffer, 0, buffer.length, block, options,
+    function(error, result) {
+      assert(error === undefined);
+      assert(result.bytes === block * 4);
+      read(block, { format: block },
+        function(error, result, target) {
+          assert(error === undefined);
+          assert(result.payloadBytes === payload * 4);
+          assert(result.sequence === 7);
+          assert(target.slice(0, payload * 4).equals(payloads));
+          console.log('PASS: read({ format })');
+          read(block, { format: block, sequence: 8 },
+            function(error) {
+              assert(error.message === (
+                'block sequence mismatch, torn or stale write'
+              ));
+              console.log('PASS: read({ format, sequence }): stale write');
+              // A misdirected write, i.e. valid blocks at the wrong address:
+              Node.fs.writeSync(fd, buffer, 0, block, 0);
+              read(0, { format: block },
+                function(error) {
+                  assert(error.message === (
+                    'block address mismatch, misdirected write'
+                  ));
+                  console.log('PASS: read({ format }): misdirected write');
+                  // A torn write, i.e. only part of a block was written:
+                  Node.fs.writeSync(fd, Buffer.alloc(512), 0, 512, block * 3);
+                  read(block, { format: block },
+                    function(error) {
+                      Node.fs.closeSync(fd);
+                      Node.fs.unlinkSync(path);
+                      assert(error.message === (
+                        'block checksum mismatch, torn or corrupt write'
+                      ));
+                      console.log('PASS: read({ format }): torn write');
+                    }
+                  );
+                }
+              );
+            }
+          );
+        }
+      );
+    }
+  );
+})();
+
+(function() {
+  assert(['scalar', 'sse2', 'avx2', 'avx512'].indexOf(binding.SIMD) !== -1);
+  function popcount(buffer) {
+    var count = 0;
+    for (var index = 0; index < buffer.length; index++) {
+      var byte = buffer[index];
+      while (byte) {
+        count += byte & 1;
+        byte >>= 1;
+      }
+    }
+    return count;
+  }
+  [0, 1, 15, 63, 64, 255, 256, 257, 4096, 65537, 3 * 1048576 + 5].forEach(
+    function(size) {
+      var threads = size > 1048576 ? 3 : 1;
+      var buffer = Node.crypto.randomBytes(size + 1).slice(1);
+      var zero = Buffer.alloc(size + 1).slice(1);
+      assert(binding.isZero(zero, threads) === true);
+      if (size > 0) {
+        zero[size - 1] = 1;
+        assert(binding.isZero(zero, threads) === false);
+        zero[size - 1] = 0;
+        zero[0] = 128;
+        assert(binding.isZero(zero, threads) === false);
+      }
+      var copy = Buffer.from(buffer);
+      assert(binding.equals(buffer, copy, threads) === true);
+      if (size > 0) {
+        copy[size >> 1] ^= 1;
+        assert(binding.equals(buffer, copy, threads) === false);
+      }
+      assert(binding.equals(buffer, copy.slice(1)) === (size === 0));
+      assert(binding.popcount(buffer, threads) === popcount(buffer));
+      var target = Node.crypto.randomBytes(size);
+      var expected = Buffer.alloc(size);
+      for (var index = 0; index < size; index++) {
+        expected[index] = target[index] ^ buffer[index];
+      }
+      binding.xorInto(target, buffer, threads);
+      assert(target.equals(expected));
+      binding.fill(target, 170, threads);
+      assert(target.equals(Buffer.alloc(size, 170)));
+      console.log('PASS: ' + binding.SIMD + ' kernels(' + size + ')');
+    }
+  );
+})();
+
+(function() {
+  var path = tmpPath('verify');
+  var fd = Node.fs.openSync(path, 'w+');
+  var buffer = binding.getAlignedBuffer(3 * 1048576, 4096);
+  Node.crypto.randomFillSync(buffer);
+  var options = { fdatasync: true, verify: true };
+  binding.write(fd, buffer, 0, buffer.length, 0, options,
+    function(error, result) {
+      assert(error === undefined);
+      assert(result.bytes === buffer.length);
+      console.log('PASS: write({ fdatasync: true, verify: true })');
+      // Unaligned for direct I/O:
+      binding.write(fd, buffer, 1, 1000, 7, { verify: true },
+        function(error, result) {
+          Node.fs.closeSync(fd);
+          Node.fs.unlinkSync(path);
+          assert(error === undefined);
+          assert(result.bytes === 1000);
+          if (Node.process.platform === 'linux') {
+            assert(result.verifySynced === true);
+          }
+          console.log('PASS: write({ verify: true }) unaligned');
+        }
+      );
+    }
+  );
+})();
+
+(function() {
+  // A verify on an fd opened for direct I/O reads back without a sync:
+  if (Node.process.platform !== 'linux') return;
+  var path = tmpPath('verify-direct');
+  var fd = Node.fs.openSync(path, 'w+');
+  Node.fs.closeSync(fd);
+  try {
+    fd = Node.fs.openSync(path, Node.fs.constants.O_RDWR | binding.O_DIRECT);
+  } catch (error) {
+    // The filesystem does not support direct I/O:
+    Node.fs.unlinkSync(path);
+    return;
+  }
+  var buffer = binding.getAlignedBuffer(65536, 4096);
+  Node.crypto.randomFillSync(buffer);
+  binding.write(fd, buffer, 0, buffer.length, 0, { verify: true },
+    function(error, result) {
+      Node.fs.closeSync(fd);
+      Node.fs.unlinkSync(path);
+      assert(error === undefined);
+      assert(result.verifySynced === false);
+      console.log('PASS: write({ verify: true }) with O_DIRECT does not sync');
+    }
+  );
+})();
+
+(function() {
+  var path = tmpPath('scrub');
+  var fd = Node.fs.openSync(path, 'w+');
+  var block = 4096;
+  var blocks = 256;
+  var buffer = binding.getAlignedBuffer(block * blocks, 4096);
+  Node.crypto.randomFillSync(buffer);
+  binding.write(fd, buffer, 0, buffer.length, 0, { format: block },
+    function(error) {
+      assert(error === undefined);
+      // Corrupt two adjacent blocks and one other block:
+      var corrupt = Buffer.alloc(block * 2, 1);
+      Node.fs.writeSync(fd, corrupt, 0, corrupt.length, block * 10);
+      Node.fs.writeSync(fd, Buffer.alloc(100, 1), 0, 100, block * 200);
+      var reports = 0;
+      var options = {
+        blockSize: 65536,
+        depth: 3,
+        format: block,
+        progressInterval: 0
+      };
+      binding.scrub(fd, options,
+        function(progress) {
+          assert(progress.bytes >= 0 && progress.bytes <= buffer.length);
+          assert(progress.checkpoint <= buffer.length);
+          reports++;
+        },
+        function(error, result) {
+          assert(error === undefined);
+          assert(result.bytes === buffer.length);
+          assert(result.total === buffer.length);
+          assert(result.badBytes === block * 3);
+          assert.deepStrictEqual(result.badRanges, [
+            {
+              offset: block * 10,
+              length: block * 2,
+              error: 'block checksum mismatch, torn or corrupt write'
+            },
+            {
+              offset: block * 200,
+              length: block,
+              error: 'block checksum mismatch, torn or corrupt write'
+            }
+          ]);
+          assert(reports > 0);
+          console.log('PASS: scrub({ format })');
+          var options = { blockSize: 65536, rateLimit: 8 * 1048576 };
+          binding.scrub(fd, options, null,
+            function(error, result) {
+              Node.fs.closeSync(fd);
+              Node.fs.unlinkSync(path);
+              assert(error === undefined);
+              assert(result.bytes === buffer.length);
+              // The last block may start only after 15/16ths of 125ms:
+              assert(result.elapsed >= 100);
+              console.log('PASS: scrub({ rateLimit })');
+            }
+          );
+        }
+      );
+    }
+  );
+})();
+
+(function() {
+  var source = tmpPath('image-source');
+  var target = tmpPath('image-target');
+  var block = 65536;
+  var blocks = 64;
+  var buffer = Buffer.alloc(block * blocks);
+  // Data blocks, zero blocks, a data block with a single byte, and a trailing
+  // run of zero blocks which must still be imaged:
+  Node.crypto.randomFillSync(buffer, 0, block * 8);
+  Node.crypto.randomFillSync(buffer, block * 20, block * 4);
+  buffer[block * 30 + block - 1] = 1;
+  Node.fs.writeFileSync(source, buffer);
+  var fdSource = Node.fs.openSync(source, 'r');
+  var fdTarget = Node.fs.openSync(target, 'w+');
+  var options = { blockSize: block, depth: 4 };
+  binding.imageDevice(fdSource, fdTarget, options, null,
+    function(error, result) {
+      assert(error === undefined);
+      assert(result.bytes === buffer.length);
+      assert(result.dataBytes === block * 13);
+      assert(result.zeroBytes === block * 51);
+      assert(Node.fs.fstatSync(fdTarget).size === buffer.length);
+      assert(Node.fs.readFileSync(target).equals(buffer));
+      console.log('PASS: imageDevice()');
+      // Image a different source over the existing target, punching holes
+      // where the existing target has data:
+      var zeroes = Buffer.alloc(buffer.length);
+      Node.crypto.randomFillSync(zeroes, block * 40, block);
+      Node.fs.writeFileSync(source, zeroes);
+      var options = { blockSize: block, punch: true };
+      binding.imageDevice(fdSource, fdTarget, options, null,
+        function(error, result) {
+          assert(error === undefined);
+          assert(result.dataBytes === block);
+          assert(result.zeroBytes === block * 63);
+          assert(Node.fs.readFileSync(target).equals(zeroes));
+          console.log('PASS: imageDevice({ punch })');
+          // Without punch, zero blocks within the existing target are
+          // written rather than skipped, so that no stale data is left:
+          Node.fs.writeSync(fdTarget, buffer, 0, buffer.length, 0);
+          var options = { blockSize: block };
+          binding.imageDevice(fdSource, fdTarget, options, null,
+            function(error, result) {
+              Node.fs.closeSync(fdSource);
+              Node.fs.closeSync(fdTarget);
+              assert(error === undefined);
+              assert(result.dataBytes === block);
+              assert(result.zeroBytes === block * 63);
+              assert(Node.fs.readFileSync(target).equals(zeroes));
+              Node.fs.unlinkSync(source);
+              Node.fs.unlinkSync(target);
+              console.log('PASS: imageDevice() over an existing target');
+            }
+          );
+        }
+      );
+    }
+  );
+})();
+
+(function() {
+  var path = tmpPath('fill');
+  var fd = Node.fs.openSync(path, 'w+');
+  var size = 4 * 1048576;
+  Node.fs.ftruncateSync(fd, size);
+  var offset = 4096;
+  var length = size - 8192 - 100;
+  var options = { blockSize: 65536, depth: 8 };
+  binding.fillRange(fd, offset, length, 255, options, null,
+    function(error, result) {
+      assert(error === undefined);
+      assert(result.bytes === length);
+      assert(result.blockSize === 65536);
+      assert(result.throughput > 0);
+      var buffer = Node.fs.readFileSync(path);
+      assert(binding.isZero(buffer.slice(0, offset)));
+      assert(buffer.slice(offset, offset + length).equals(
+        Buffer.alloc(length, 255)
+      ));
+      assert(binding.isZero(buffer.slice(offset + length)));
+      console.log('PASS: fillRange(byte)');
+      var pattern = Buffer.from('0123456789abcdef');
+      binding.fillRange(fd, 0, size - 1, pattern, {}, null,
+        function(error, result) {
+          assert(error === undefined);
+          assert(result.bytes === size - 1);
+          var buffer = Node.fs.readFileSync(path);
+          for (var index = 0; index < size - 1; index++) {
+            if (buffer[index] !== pattern[index % pattern.length]) {
+              throw new Error('fillRange(pattern) mismatch at ' + index);
+            }
+          }
+          assert(buffer[size - 1] === 0);
+          Node.fs.closeSync(fd);
+          Node.fs.unlinkSync(path);
+          console.log('PASS: fillRange(pattern)');
+        }
+      );
+    }
+  );
+})();
+
+(function() {
+  var source = tmpPath('copy-source');
+  var target = tmpPath('copy-target');
+  var size = 8 * 1048576 + 4096;
+  var buffer = Node.crypto.randomBytes(size);
+  Node.fs.writeFileSync(source, buffer);
+  var fdSource = Node.fs.openSync(source, 'r');
+  var fdTarget = Node.fs.openSync(target, 'w+');
+  var options = {
+    blockSize: 262144,
+    srcDepth: 2,
+    dstDepth: 6,
+    verify: true,
+    progressInterval: 0
+  };
+  var checkpoints = [];
+  binding.copyDevice(fdSource, fdTarget, options,
+    function(progress) {
+      checkpoints.push(progress.checkpoint);
+    },
+    function(error, result) {
+      assert(error === undefined);
+      assert(result.bytes === size);
+      assert(result.total === size);
+      assert(result.verifiedBytes === size);
+      assert(checkpoints[checkpoints.length - 1] === size);
+      assert(Node.fs.readFileSync(target).equals(buffer));
+      console.log('PASS: copyDevice({ verify })');
+      // Copy a range to a different offset, resuming from a checkpoint past
+      // which the target has not yet been written:
+      var offset = 1048576;
+      var length = 4 * 1048576;
+      var resume = offset + 1048576;
+      Node.fs.ftruncateSync(fdTarget, 0);
+      var options = {
+        offset: offset,
+        length: length,
+        dstOffset: 4096,
+        resume: resume,
+        blockSize: 65536
+      };
+      binding.copyDevice(fdSource, fdTarget, options, null,
+        function(error, result) {
+          Node.fs.closeSync(fdSource);
+          Node.fs.closeSync(fdTarget);
+          assert(error === undefined);
+          assert(result.bytes === offset + length - resume);
+          assert(result.verifiedBytes === undefined);
+          var copied = Node.fs.readFileSync(target);
+          var skipped = resume - offset;
+          assert(copied.length === 4096 + length);
+          assert(binding.isZero(copied.slice(0, 4096 + skipped)));
+          assert(copied.slice(4096 + skipped).equals(
+            buffer.slice(resume, offset + length)
+          ));
+          Node.fs.unlinkSync(source);
+          Node.fs.unlinkSync(target);
+          console.log(
+            'PASS: copyDevice({ offset, length, dstOffset, resume })'
+          );
+        }
+      );
+    }
+  );
+})();
+
+(function() {
+  var source = tmpPath('delta-source');
+  var target = tmpPath('delta-target');
+  var index = tmpPath('delta-index');
+  var block = 65536;
+  var buffer = Node.crypto.randomBytes(block * 40 + 1000);
+  Node.fs.writeFileSync(source, buffer);
+  Node.fs.writeFileSync(target, buffer);
+  var fdSource = Node.fs.openSync(source, 'r+');
+  var fdTarget = Node.fs.openSync(target, 'r+');
+  var fdIndex = Node.fs.openSync(index, 'w+');
+  function close() {
+    Node.fs.closeSync(fdSource);
+    Node.fs.closeSync(fdTarget);
+    Node.fs.closeSync(fdIndex);
+    Node.fs.unlinkSync(source);
+    Node.fs.unlinkSync(target);
+    Node.fs.unlinkSync(index);
+  }
+  binding.computeDelta(fdSource, fdIndex, {}, null,
+    function(error) {
+      assert(error.message === 'index is invalid or corrupt');
+      console.log('PASS: computeDelta() without an index');
+      binding.buildIndex(fdSource, fdIndex, { blockSize: block }, null,
+        function(error, result) {
+          assert(error === undefined);
+          assert(result.bytes === buffer.length);
+          assert(result.blockSize === block);
+          assert(Node.fs.fstatSync(fdIndex).size === 4096 + 41 * 32);
+          var hashes = Node.fs.readFileSync(index).slice(4096);
+          assert(hashes.slice(32, 64).equals(
+            binding.blake3(buffer.slice(block, block * 2))
+          ));
+          assert(hashes.slice(40 * 32).equals(
+            binding.blake3(buffer.slice(block * 40))
+          ));
+          console.log('PASS: buildIndex()');
+          // Change a byte in block 3, blocks 10 and 11, the last block, and
+          // grow the source by a partial block, flipping bits so that every
+          // byte written differs from the random byte it replaces:
+          var flip = function(start, end) {
+            return buffer.slice(start, end).map(function(x) { return x ^ 1; });
+          };
+          var change = flip(block * 3 + 9, block * 3 + 10);
+          Node.fs.writeSync(fdSource, change, 0, 1, block * 3 + 9);
+          change = flip(block * 11 - 1, block * 12 + 1);
+          Node.fs.writeSync(fdSource, change, 0, block + 2, block * 11 - 1);
+          Node.fs.writeSync(fdSource, Buffer.alloc(block), 0, block,
+            block * 40
+          );
+          var size = block * 41;
+          var options = { depth: 3, update: true };
+          binding.computeDelta(fdSource, fdIndex, options, null,
+            function(error, result) {
+              assert(error === undefined);
+              assert(result.bytes === size);
+              assert(result.blockSize === block);
+              assert.deepStrictEqual(result.changedRanges, [
+                { offset: block * 3, length: block },
+                { offset: block * 10, length: block * 3 },
+                { offset: block * 40, length: block }
+              ]);
+              assert(result.changedBytes === block * 5);
+              console.log('PASS: computeDelta()');
+              var ranges = result.changedRanges;
+              var options = { blockSize: block * 2, verify: true };
+              binding.applyDelta(fdSource, fdTarget, ranges, options, null,
+                function(error, result) {
+                  assert(error === undefined);
+                  assert(result.bytes === block * 5);
+                  assert(result.verifiedBytes === block * 5);
+                  assert(Node.fs.readFileSync(target).equals(
+                    Node.fs.readFileSync(source)
+                  ));
+                  console.log('PASS: applyDelta()');
+                  // The index was updated, so there are no further changes:
+                  binding.computeDelta(fdTarget, fdIndex, {}, null,
+                    function(error, result) {
+                      assert(error === undefined);
+                      assert.deepStrictEqual(result.changedRanges, []);
+                      assert(result.changedBytes === 0);
+                      Node.fs.writeSync(fdIndex, Buffer.alloc(1), 0, 1, 4100);
+                      binding.computeDelta(fdTarget, fdIndex, {}, null,
+                        function(error) {
+                          close();
+                          assert(
+                            error.message === 'index is invalid or corrupt'
+                          );
+                          console.log('PASS: computeDelta({ update })');
+                        }
+                      );
+                    }
+                  );
+                }
+              );
+            }
+          );
+        }
+      );
+    }
+  );
+})();
+
+(function() {
+  var path = tmpPath('hash');
+  var buffer = Node.crypto.randomBytes(3 * 1048576 + 12345);
+  Node.fs.writeFileSync(path, buffer);
+  var fd = Node.fs.openSync(path, 'r');
+  // Every root must be the BLAKE3 hash of the range as a single message,
+  // whether the range is empty, within a block, or many blocks:
+  var ranges = [
+    [0, null, 1048576],
+    [0, 0, 1048576],
+    [0, 1000, 1048576],
+    [0, 1024, 1024],
+    [0, 1025, 1024],
+    [4096, 65536 * 3, 65536],
+    [4096, 65536 * 5 + 1, 65536],
+    [12345, 2 * 1048576 + 999, 4096],
+    [1048576, null, 262144]
+  ];
+  function next() {
+    if (ranges.length === 0) return leaves();
+    var range = ranges.shift();
+    var offset = range[0];
+    var length = range[1];
+    var options = { blockSize: range[2], depth: 7 };
+    binding.hashRange(fd, offset, length, options, null,
+      function(error, result) {
+        assert(error === undefined);
+        var end = length === null ? buffer.length : offset + length;
+        var expected = binding.blake3(buffer.slice(offset, end));
+        assert(result.hash.equals(expected));
+        assert(result.bytes === end - offset);
+        assert(result.leaves === undefined);
+        console.log(
+          'PASS: hashRange(' + offset + ', ' + length + ', ' + range[2] + ')'
+        );
+        next();
+      }
+    );
+  }
+  function leaves() {
+    var options = { blockSize: 65536, leaves: true };
+    binding.hashRange(fd, 0, 65536 * 4, options, null,
+      function(error, before) {
+        assert(error === undefined);
+        assert(before.leaves.length === 4 * 32);
+        Node.fs.closeSync(fd);
+        fd = Node.fs.openSync(path, 'r+');
+        Node.fs.writeSync(fd, Buffer.from([buffer[65536 * 2] ^ 1]), 0, 1,
+          65536 * 2
+        );
+        binding.hashRange(fd, 0, 65536 * 4, options, null,
+          function(error, after) {
+            Node.fs.closeSync(fd);
+            Node.fs.unlinkSync(path);
+            assert(error === undefined);
+            assert(!after.hash.equals(before.hash));
+            for (var index = 0; index < 4; index++) {
+              var a = before.leaves.slice(index * 32, index * 32 + 32);
+              var b = after.leaves.slice(index * 32, index * 32 + 32);
+              assert(a.equals(b) === (index !== 2));
+            }
+            console.log('PASS: hashRange({ leaves })');
+          }
+        );
+      }
+    );
+  }
+  next();
+})();
+
+(function() {
+  var path = tmpPath('merkle');
+  var sidecar = tmpPath('merkle-sidecar');
+  var leaf = 4096;
+  var size = leaf * 37 + 100;
+  var data = Buffer.alloc(size);
+  Node.fs.writeFileSync(path, data);
+  var fd = Node.fs.openSync(path, 'r+');
+  var fdSidecar = Node.fs.openSync(sidecar, 'w+');
+  // A reference implementation of the tree:
+  function root(data) {
+    var nodes = [];
+    for (var offset = 0; offset < data.length; offset += leaf) {
+      nodes.push(binding.blake3(Buffer.concat([
+        Buffer.from([0]),
+        data.slice(offset, offset + leaf)
+      ])));
+    }
+    while (nodes.length > 1) {
+      var parents = [];
+      for (var index = 0; index < nodes.length; index += 2) {
+        if (index + 1 === nodes.length) {
+          parents.push(nodes[index]);
+        } else {
+          parents.push(binding.blake3(Buffer.concat([
+            Buffer.from([1]),
+            nodes[index],
+            nodes[index + 1]
+          ])));
+        }
+      }
+      nodes = parents;
+    }
+    return nodes[0];
+  }
+  var tree = binding.merkleOpen(fdSidecar, { size: size, leafSize: leaf });
+  assert(binding.merkleRoot(tree).equals(root(data)));
+  assert(binding.merkleNode(tree, 0, 37).equals(
+    binding.blake3(Buffer.concat([Buffer.from([0]), data.slice(leaf * 37)]))
+  ));
+  assert(binding.merkleNode(tree, 6, 0).equals(binding.merkleRoot(tree)));
+  exception('merkleNode', 'level and index must address a node of the tree', [
+    [tree, 0, 38],
+    [tree, 7, 0]
+  ]);
+  exception('write', 'options.merkle must cover position + length', [
+    [fd, data, 0, 4096, size - 4095, { merkle: tree }, function() {}]
+  ]);
+  exception('read', 'options.merkle is only for writes', [
+    [fd, data, 0, 4096, 0, { merkle: tree }, function() {}]
+  ]);
+  exception('write', 'options.merkle must be a Merkle tree', [
+    [fd, data, 0, 4096, 0, { merkle: {} }, function() {}]
+  ]);
+  console.log('PASS: merkleOpen()');
+  // Writes of whole leaves, part of a leaf, and across leaves:
+  var writes = [
+    [0, leaf * 2],
+    [leaf * 5 + 10, 100],
+    [leaf * 9 - 7, leaf + 14],
+    [size - 50, 50]
+  ];
+  function next() {
+    if (writes.length === 0) return concurrent();
+    var write = writes.shift();
+    var buffer = Node.crypto.randomBytes(write[1]);
+    buffer.copy(data, write[0]);
+    binding.write(fd, buffer, 0, buffer.length, write[0], { merkle: tree },
+      function(error) {
+        assert(error === undefined);
+        assert(binding.merkleRoot(tree).equals(root(data)));
+        console.log('PASS: write({ merkle }) ' + JSON.stringify(write));
+        next();
+      }
+    );
+  }
+  function concurrent() {
+    // Disjoint writes in flight at once within the same leaves:
+    var pending = 32;
+    for (var index = 0; index < 32; index++) {
+      var position = leaf * 12 + index * 256;
+      var buffer = Node.crypto.randomBytes(256);
+      buffer.copy(data, position);
+      binding.write(fd, buffer, 0, 256, position, { merkle: tree },
+        function(error) {
+          assert(error === undefined);
+          if (--pending > 0) return;
+          assert(binding.merkleRoot(tree).equals(root(data)));
+          console.log('PASS: write({ merkle }) within a leaf concurrently');
+          reopen();
+        }
+      );
+    }
+  }
+  function reopen() {
+    binding.merkleSync(tree, function(error) {
+      assert(error === undefined);
+      binding.merkleClose(tree);
+      exception('merkleRoot', 'tree was closed', [[tree]]);
+      var options = { size: size, leafSize: leaf };
+      tree = binding.merkleOpen(fdSidecar, options);
+      assert(binding.merkleRoot(tree).equals(root(data)));
       exception(
-        method,
-        'bad arguments, expected: (fd, value=0/1, callback)',
-        [
-          [],
-          [1],
-          
-          [undefined, 0, function() {}],
-          [undefined + 1, 0, function() {}],
-          [-1, 0, function() {}],
-          [1.1, 0, function() {}],
-          [Math.pow(2, 31), 0, function() {}],
+        'merkleOpen',
+        'sidecar is invalid or does not match options',
+        [[fdSidecar, { size: size, leafSize: leaf * 2 }]]
+      );
+      console.log('PASS: merkleSync() and merkleOpen() of a sidecar');
+      rebuild();
+    });
+  }
+  function rebuild() {
+    // Change the file behind the tree's back:
+    Node.crypto.randomFillSync(data, leaf * 20, leaf * 3);
+    Node.fs.writeSync(fd, data, leaf * 20, leaf * 3, leaf * 20);
+    assert(!binding.merkleRoot(tree).equals(root(data)));
+    binding.merkleRebuild(fd, tree, { blockSize: 12288, depth: 3 }, null,
+      function(error, result) {
+        assert(error === undefined);
+        assert(result.bytes === size);
+        assert(binding.merkleRoot(tree).equals(root(data)));
+        binding.merkleClose(tree);
+        Node.fs.closeSync(fd);
+        Node.fs.closeSync(fdSidecar);
+        Node.fs.unlinkSync(path);
+        Node.fs.unlinkSync(sidecar);
+        console.log('PASS: merkleRebuild()');
+      }
+    );
+  }
+  next();
+})();
 
-          [1, undefined, function() {}],
-          [1, undefined + 1, function() {}],
-          [1, -1, function() {}],
-          [1, 1.1, function() {}],
-          [1, 2, function() {}],
-          [1, Math.pow(2, 31), function() {}],
+(function() {
+  // Content-defined chunking of a stream, pushed whole and in odd pieces:
+  var options = { minSize: 1024, avgSize: 4096, maxSize: 16384 };
+  var data = Node.crypto.randomBytes(1024 * 1024 + 333);
+  function chunk(pieces, end, kernel) {
+    var chunker = binding.chunkerCreate(
+      kernel ? Object.assign({ kernel: kernel }, options) : options
+    );
+    var chunks = [];
+    function next() {
+      if (pieces.length === 0) {
+        var last = binding.chunkerFinish(chunker);
+        if (last) chunks.push(last);
+        assert(binding.chunkerFinish(chunker) === null);
+        return end(chunks);
+      }
+      binding.chunkerUpdate(chunker, pieces.shift(), function(error, result) {
+        assert(error === undefined);
+        chunks.push.apply(chunks, result);
+        next();
+      });
+    }
+    next();
+  }
+  function split(buffer) {
+    var pieces = [];
+    var offset = 0;
+    while (offset < buffer.length) {
+      var length = Math.min(
+        buffer.length - offset,
+        1 + Math.floor(Math.random() * 40000)
+      );
+      pieces.push(buffer.slice(offset, offset + length));
+      offset += length;
+    }
+    return pieces;
+  }
+  function key(chunks) {
+    return chunks.map(
+      function(chunk) {
+        var hash = chunk.hash.toString('hex');
+        return chunk.offset + ':' + chunk.length + ':' + hash;
+      }
+    ).join(',');
+  }
+  function kernels(whole) {
+    // Each kernel the CPU supports must cut where the default does:
+    assert(['scalar', 'avx2', 'avx512'].indexOf(binding.CDC) !== -1);
+    var names = ['scalar', 'avx2', 'avx512'];
+    names = names.slice(0, names.indexOf(binding.CDC) + 1);
+    if (names.length < 3) {
+      exception(
+        'chunkerCreate',
+        'options.kernel is not supported by this CPU',
+        [[{ kernel: 'avx512' }]]
+      );
+    }
+    function next() {
+      if (names.length === 0) return;
+      var kernel = names.shift();
+      chunk(split(data), function(chunks) {
+        assert(key(chunks) === key(whole));
+        console.log('PASS: chunkerCreate({ kernel: "' + kernel + '" })');
+        next();
+      }, kernel);
+    }
+    next();
+  }
+  chunk([data], function(whole) {
+    var offset = 0;
+    whole.forEach(
+      function(chunk, index) {
+        assert(chunk.offset === offset);
+        assert(chunk.length <= options.maxSize);
+        if (index < whole.length - 1) assert(chunk.length >= options.minSize);
+        var slice = data.slice(chunk.offset, chunk.offset + chunk.length);
+        assert(chunk.hash.equals(binding.blake3(slice)));
+        offset += chunk.length;
+      }
+    );
+    assert(offset === data.length);
+    console.log('PASS: chunkerUpdate() ' + whole.length + ' chunks');
+    chunk(split(data), function(pieces) {
+      assert(key(pieces) === key(whole));
+      console.log('PASS: chunkerUpdate() across buffer boundaries');
+      // Boundaries resynchronize after an insertion near the start:
+      var edited = Buffer.concat([
+        data.slice(0, 100),
+        Buffer.from('inserted'),
+        data.slice(100)
+      ]);
+      chunk([edited], function(shifted) {
+        var hashes = {};
+        whole.forEach(
+          function(chunk) {
+            hashes[chunk.hash.toString('hex')] = true;
+          }
+        );
+        var shared = shifted.filter(
+          function(chunk) {
+            return hashes[chunk.hash.toString('hex')];
+          }
+        );
+        assert(shared.length >= shifted.length - 4);
+        console.log('PASS: chunkerUpdate() resynchronizes after an insert');
+        kernels(whole);
+      });
+    });
+  });
+})();
 
-          [1, 0],
-          [1, 0, {}],
-          [1, 0, null],
-          [1, 0, undefined],
-          [1, 0, function() {}, function() {}]
-        ]
+(function() {
+  // Compressed writes and reads of compressible, incompressible and empty data:
+  var path = tmpPath('compress');
+  var fd = Node.fs.openSync(path, 'w+');
+  var text = '';
+  while (text.length < 1500000) {
+    text += 'block ' + Math.floor(Math.random() * 100) + ' of a log file. ';
+  }
+  var buffers = [
+    Buffer.from(text),
+    Node.crypto.randomBytes(10000),
+    Buffer.alloc(0),
+    Buffer.alloc(65536, 1)
+  ];
+  var options = { compress: 'lz4', sectorSize: 4096 };
+  var frames = [];
+  var position = 0;
+  function write() {
+    if (frames.length === buffers.length) return read();
+    var buffer = buffers[frames.length];
+    binding.write(fd, buffer, 0, buffer.length, position, options,
+      function(error, result) {
+        assert(error === undefined);
+        assert(result.bytes % options.sectorSize === 0);
+        assert(result.bytes >= result.compressedBytes);
+        assert(result.bytes - result.compressedBytes < options.sectorSize);
+        frames.push({ position: position, result: result });
+        position += result.bytes;
+        write();
+      }
+    );
+  }
+  function read() {
+    var index = frames.length - buffers.length;
+    if (index === buffers.length) return corrupt();
+    frames.push(null);
+    var buffer = Buffer.alloc(buffers[index].length + 100);
+    var frame = frames[index];
+    binding.read(fd, buffer, 0, buffer.length, frame.position,
+      { compress: 'lz4', sectorSize: 4096, crc32c: true },
+      function(error, result) {
+        assert(error === undefined);
+        assert(result.bytes === buffers[index].length);
+        assert(result.compressedBytes === frame.result.compressedBytes);
+        assert(result.crc32c === crc32c(buffers[index]));
+        assert(buffer.slice(0, result.bytes).equals(buffers[index]));
+        console.log(
+          'PASS: write({ compress: "lz4" }) and read() ' +
+          buffers[index].length + ' bytes as ' + result.compressedBytes
+        );
+        read();
+      }
+    );
+  }
+  function corrupt() {
+    // Text compresses, random data is stored as is:
+    assert(frames[0].result.compressedBytes < buffers[0].length / 2);
+    assert(frames[1].result.compressedBytes === buffers[1].length + 16);
+    var small = Buffer.alloc(100);
+    binding.read(fd, small, 0, small.length, 0, options, function(error) {
+      assert(error.message === 'buffer is too small for the decompressed data');
+      var buffer = Buffer.alloc(buffers[0].length);
+      // The payload length of the first frame:
+      Node.fs.writeSync(fd, Buffer.alloc(4, 255), 0, 4, 8);
+      binding.read(fd, buffer, 0, buffer.length, 0, options, function(error) {
+        assert(error.message === 'compressed frame is corrupt');
+        Node.fs.closeSync(fd);
+        Node.fs.unlinkSync(path);
+        console.log('PASS: read({ compress: "lz4" }) of a corrupt frame');
+      });
+    });
+  }
+  write();
+})();
+
+(function() {
+  // AES-256-XTS encryption of sectors written and read through an fd:
+  var path = tmpPath('encryption');
+  var fd = Node.fs.openSync(path, 'w+');
+  var key = Node.crypto.randomBytes(64);
+  var sector = 4096;
+  var position = sector * 5;
+  var data = Node.crypto.randomBytes(sector * 16);
+  function xts(buffer, first) {
+    var result = Buffer.alloc(buffer.length);
+    for (var offset = 0; offset < buffer.length; offset += sector) {
+      var tweak = Buffer.alloc(16);
+      tweak.writeUInt32LE(first + offset / sector, 0);
+      var cipher = Node.crypto.createCipheriv('aes-256-xts', key, tweak);
+      cipher.update(buffer.slice(offset, offset + sector)).copy(result, offset);
+      cipher.final();
+    }
+    return result;
+  }
+  binding.setEncryption(fd, key, { sectorSize: sector });
+  exception('write', 'length and position must be multiples of ' +
+    'the encryption sector size', [
+    [fd, data, 0, 512, 0, {}, function() {}],
+    [fd, data, 0, sector, 512, {}, function() {}]
+  ]);
+  exception('read', 'options.sectorSize must be a multiple of ' +
+    'the encryption sector size', [
+    [fd, data, 0, sector, 0, { compress: 'lz4' }, function() {}]
+  ]);
+  var copy = Buffer.from(data);
+  binding.write(fd, data, 0, data.length, position, { verify: true },
+    function(error) {
+      assert(error === undefined);
+      // The caller's buffer is left as is:
+      assert(data.equals(copy));
+      var disk = Buffer.alloc(data.length);
+      Node.fs.readSync(fd, disk, 0, disk.length, position);
+      if (Node.crypto.getCiphers().indexOf('aes-256-xts') !== -1) {
+        assert(disk.equals(xts(data, position / sector)));
+      }
+      assert(!disk.equals(data));
+      var buffer = Buffer.alloc(data.length);
+      binding.read(fd, buffer, 0, buffer.length, position, { crc32c: true },
+        function(error, result) {
+          assert(error === undefined);
+          assert(result.crc32c === crc32c(data));
+          assert(buffer.equals(data));
+          console.log('PASS: setEncryption() write() and read()');
+          kernels(disk);
+        }
       );
     }
   );
+  function kernels(disk) {
+    // Each kernel the CPU supports must match the ciphertext of the default:
+    assert(['scalar', 'aesni', 'vaes'].indexOf(binding.XTS) !== -1);
+    var names = ['scalar', 'aesni', 'vaes'];
+    names = names.slice(0, names.indexOf(binding.XTS) + 1);
+    if (names.length < 3) {
+      exception(
+        'setEncryption',
+        'options.kernel is not supported by this CPU',
+        [[fd, key, { sectorSize: sector, kernel: 'vaes' }]]
+      );
+    }
+    function next() {
+      if (names.length === 0) {
+        binding.setEncryption(fd, key, { sectorSize: sector });
+        return compressed();
+      }
+      var kernel = names.shift();
+      binding.setEncryption(fd, key, { sectorSize: sector, kernel: kernel });
+      binding.write(fd, data, 0, data.length, position, {}, function(error) {
+        assert(error === undefined);
+        var buffer = Buffer.alloc(data.length);
+        Node.fs.readSync(fd, buffer, 0, buffer.length, position);
+        assert(buffer.equals(disk));
+        binding.read(fd, buffer, 0, buffer.length, position, {},
+          function(error) {
+            assert(error === undefined);
+            assert(buffer.equals(data));
+            console.log('PASS: setEncryption({ kernel: "' + kernel + '" })');
+            next();
+          }
+        );
+      });
+    }
+    next();
+  }
+  function compressed() {
+    var text = Buffer.alloc(100000, 'encrypted and compressed ');
+    var options = { compress: 'lz4', sectorSize: sector };
+    binding.write(fd, text, 0, text.length, 0, options,
+      function(error, result) {
+        assert(error === undefined);
+        assert(result.bytes % sector === 0);
+        var buffer = Buffer.alloc(text.length);
+        binding.read(fd, buffer, 0, buffer.length, 0, options,
+          function(error, result) {
+            assert(error === undefined);
+            assert(result.bytes === text.length);
+            assert(buffer.equals(text));
+            console.log('PASS: setEncryption() with { compress: "lz4" }');
+            removed();
+          }
+        );
+      }
+    );
+  }
+  function removed() {
+    binding.setEncryption(fd, null, {});
+    var buffer = Buffer.alloc(data.length);
+    binding.read(fd, buffer, 0, buffer.length, position, {},
+      function(error) {
+        assert(error === undefined);
+        assert(!buffer.equals(data));
+        Node.fs.closeSync(fd);
+        Node.fs.unlinkSync(path);
+        console.log('PASS: setEncryption(fd, null)');
+      }
+    );
+  }
 })();
 
-function getAlignedBuffer(size, alignment) {
-  var buffer = binding.getAlignedBuffer(size, alignment);
-  assert(Buffer.isBuffer(buffer));
-  assert(buffer.length === size);
-  var size = 0;
-  var zero = 0;
-  for (var index = 0, length = buffer.length; index < length; index++) {
-    size++;
-    zero += buffer[index];
+(function() {
+  // A volume striped across regular files:
+  var count = 3;
+  var stripe = 4096;
+  var paths = [];
+  var fds = [];
+  for (var index = 0; index < count; index++) {
+    paths.push(tmpPath('volume-' + index));
+    Node.fs.writeFileSync(paths[index], Buffer.alloc(stripe * 8 + 100));
+    fds.push(Node.fs.openSync(paths[index], 'r+'));
   }
-  assert(size === buffer.length);
-  assert(zero === 0);
-  // Force physical page allocation if only allocated virtually:
-  for (var page = 0, length = buffer.length; page < length; page += 4096) {
-    buffer[page] = 255;
+  binding.volumeOpen(fds, { stripeSize: stripe }, function(error, volume) {
+    assert(error === undefined);
+    var geometry = binding.volumeGeometry(volume);
+    assert(geometry.devices === count);
+    assert(geometry.stripeSize === stripe);
+    assert(geometry.size === stripe * 8 * count);
+    assert(geometry.logicalSectorSize === 512);
+    console.log('PASS: volumeOpen() and volumeGeometry()');
+    exception(
+      'volumeRead',
+      'position + length must not be greater than the volume size',
+      [[volume, Buffer.alloc(2), 0, 2, geometry.size - 1, {}, function() {}]]
+    );
+    var expect = Buffer.alloc(geometry.size);
+    var writes = [
+      [0, geometry.size],
+      [100, 10000],
+      [stripe - 1, 2],
+      [stripe * 7 + 5, stripe * 4],
+      [geometry.size - 10, 10],
+      [stripe * 3, 0]
+    ];
+    function next() {
+      if (writes.length === 0) return layout();
+      var write = writes.shift();
+      var data = Node.crypto.randomBytes(write[1]);
+      data.copy(expect, write[0]);
+      binding.volumeWrite(volume, data, 0, data.length, write[0], {},
+        function(error, result) {
+          assert(error === undefined);
+          assert(result.bytes === data.length);
+          var buffer = Buffer.alloc(data.length);
+          binding.volumeRead(volume, buffer, 0, buffer.length, write[0], {},
+            function(error, result) {
+              assert(error === undefined);
+              assert(result.bytes === data.length);
+              var end = write[0] + write[1];
+              assert(buffer.equals(expect.slice(write[0], end)));
+              console.log('PASS: volumeWrite() and volumeRead() ' +
+                JSON.stringify(write));
+              next();
+            }
+          );
+        }
+      );
+    }
+    function layout() {
+      // Stripe k is row k / count of device k % count:
+      for (var k = 0; k < geometry.size / stripe; k++) {
+        var buffer = Buffer.alloc(stripe);
+        var row = Math.floor(k / count);
+        Node.fs.readSync(fds[k % count], buffer, 0, stripe, row * stripe);
+        assert(buffer.equals(expect.slice(k * stripe, (k + 1) * stripe)));
+      }
+      fds.forEach(function(fd) { Node.fs.closeSync(fd); });
+      paths.forEach(function(path) { Node.fs.unlinkSync(path); });
+      console.log('PASS: volumeWrite() stripes across devices');
+    }
+    next();
+  });
+})();
+
+(function() {
+  // Two fds of the same file, or the same fd twice, are not distinct devices:
+  var path = tmpPath('volume-same');
+  Node.fs.writeFileSync(path, Buffer.alloc(65536));
+  var a = Node.fs.openSync(path, 'r+');
+  var b = Node.fs.openSync(path, 'r+');
+  var sets = [[a, a], [a, b]];
+  function next() {
+    if (sets.length === 0) {
+      Node.fs.closeSync(a);
+      Node.fs.closeSync(b);
+      Node.fs.unlinkSync(path);
+      console.log('PASS: volumeOpen() rejects the same device twice');
+      return;
+    }
+    binding.volumeOpen(sets.shift(), { stripeSize: 4096 }, function(error) {
+      assert(error.message === 'fds must be distinct devices');
+      next();
+    });
   }
-  console.log('PASS: getAlignedBuffer(' + size + ', ' + alignment + ')');
-}
+  next();
+})();
 
-[1, 2, 3, 4, 5, 6, 7, 8, 4095, 4096, 4097, 1048576, 4194304].forEach(
-  function(size) {
-    [
-      8,
-      16,
-      32,
-      64,
-      128,
-      256,
-      512,
-      1024,
-      2048,
-      4096,
-      8192,
-      16384,
-      32768,
-      65536,
-      131072,
-      262144,
-      524288,
-      1048576,
-      2097152,
-      4194304
-    ].forEach(
-      function(alignment) {
-        getAlignedBuffer(size, alignment);
+(function() {
+  // A volume mirrored across regular files:
+  var count = 3;
+  var size = 65536;
+  var paths = [];
+  var fds = [];
+  for (var index = 0; index < count; index++) {
+    paths.push(tmpPath('mirror-' + index));
+    Node.fs.writeFileSync(paths[index], Buffer.alloc(size + 100));
+    fds.push(Node.fs.openSync(paths[index], 'r+'));
+  }
+  var options = { layout: 'mirror', hedgeDelay: 0 };
+  binding.volumeOpen(fds, options, function(error, volume) {
+    assert(error === undefined);
+    var geometry = binding.volumeGeometry(volume);
+    assert(geometry.devices === count);
+    assert(geometry.layout === 'mirror');
+    assert(geometry.size === size);
+    assert(geometry.writeQuorum === count);
+    assert(geometry.stripeSize === undefined);
+    console.log('PASS: volumeOpen() mirror');
+    var expect = Node.crypto.randomBytes(size);
+    binding.volumeWrite(volume, expect, 0, size, 0, {},
+      function(error, result) {
+        assert(error === undefined);
+        assert(result.bytes === size);
+        fds.forEach(function(fd) {
+          var buffer = Buffer.alloc(size);
+          Node.fs.readSync(fd, buffer, 0, size, 0);
+          assert(buffer.equals(expect));
+        });
+        console.log('PASS: volumeWrite() writes every replica');
+        reads(32);
       }
     );
-  }
-);
+    // Every read is hedged immediately, and the first read to complete wins:
+    function reads(remaining) {
+      if (remaining === 0) {
+        var stats = binding.volumeStats(volume);
+        var total = 0;
+        stats.devices.forEach(function(device) {
+          assert(device.writes === 1);
+          assert(device.errors === 0);
+          assert(device.failed === false);
+          total += device.reads;
+        });
+        // A hedged read which loses may still be in flight:
+        assert(stats.hedges <= 32);
+        assert(total >= 32 && total <= 32 + stats.hedges);
+        assert(stats.failovers === 0);
+        fds.forEach(function(fd) { Node.fs.closeSync(fd); });
+        paths.forEach(function(path) { Node.fs.unlinkSync(path); });
+        console.log('PASS: volumeRead() hedges reads across replicas');
+        return;
+      }
+      var position = Math.floor(Math.random() * 64) * 512;
+      var length = Math.floor(Math.random() * (size - position));
+      var buffer = Buffer.alloc(length);
+      binding.volumeRead(volume, buffer, 0, length, position, {},
+        function(error, result) {
+          assert(error === undefined);
+          assert(result.bytes === length);
+          assert(result.device >= 0 && result.device < count);
+          assert(buffer.equals(expect.slice(position, position + length)));
+          reads(remaining - 1);
+        }
+      );
+    }
+  });
+})();
 
 (function() {
-  if (Node.process.platform === 'win32') return;
-  var fd1 = Node.fs.openSync(module.filename, 'r');
-  binding.getBlockDevice(fd1,
-    function(error) {
-      assert(error !== undefined);
-      assert(error.message === 'fd is not a block or character device');
-      console.log(
-        'PASS: getBlockDevice(fd1): ' + JSON.stringify(error.message)
+  // A replica which cannot be read fails over, and a replica which cannot be
+  // written is taken out of the mirror:
+  var size = 16384;
+  var paths = [tmpPath('failover-0'), tmpPath('failover-1')];
+  paths.forEach(function(path) {
+    Node.fs.writeFileSync(path, Buffer.alloc(size));
+  });
+  var fds = [
+    Node.fs.openSync(paths[0], Node.fs.constants.O_WRONLY),
+    Node.fs.openSync(paths[1], 'r')
+  ];
+  var options = { layout: 'mirror', writeQuorum: 1, hedge: false };
+  binding.volumeOpen(fds, options, function(error, volume) {
+    assert(error === undefined);
+    var data = Node.crypto.randomBytes(size);
+    binding.volumeWrite(volume, data, 0, size, 0, {},
+      function(error, result) {
+        assert(error === undefined);
+        assert(result.bytes === size);
+        assert(binding.volumeStats(volume).devices[0].writes === 1);
+        console.log('PASS: volumeWrite() succeeds with writeQuorum');
+        // The write may complete before the other replica fails:
+        (function wait() {
+          var stats = binding.volumeStats(volume);
+          if (!stats.devices[1].failed) return setTimeout(wait, 1);
+          assert(stats.devices[1].errors === 1);
+          assert(stats.devices[1].writes === 0);
+          read();
+        })();
+      }
+    );
+    function read() {
+      var buffer = Buffer.alloc(size);
+      // Only the replica which cannot be read remains:
+      binding.volumeRead(volume, buffer, 0, size, 0, {},
+        function(error) {
+          assert(error !== undefined);
+          var stats = binding.volumeStats(volume);
+          assert(stats.devices[0].errors === 1);
+          fds.forEach(function(fd) { Node.fs.closeSync(fd); });
+          failover();
+        }
       );
     }
-  );
+  });
+  function failover() {
+    var data = Node.crypto.randomBytes(size);
+    Node.fs.writeFileSync(paths[1], data);
+    var fds = [
+      Node.fs.openSync(paths[0], Node.fs.constants.O_WRONLY),
+      Node.fs.openSync(paths[1], 'r')
+    ];
+    var options = { layout: 'mirror', hedge: false };
+    binding.volumeOpen(fds, options, function(error, volume) {
+      assert(error === undefined);
+      var buffer = Buffer.alloc(size);
+      binding.volumeRead(volume, buffer, 0, size, 0, {},
+        function(error, result) {
+          assert(error === undefined);
+          assert(result.device === 1);
+          assert(buffer.equals(data));
+          var stats = binding.volumeStats(volume);
+          assert(stats.failovers === 1);
+          assert(stats.devices[0].errors === 1);
+          assert(stats.devices[1].reads === 1);
+          console.log('PASS: volumeRead() fails over to another replica');
+          quorum(volume, fds);
+        }
+      );
+    });
+  }
+  function quorum(volume, fds) {
+    var data = Buffer.alloc(512, 1);
+    binding.volumeWrite(volume, data, 0, data.length, 0, {},
+      function(error) {
+        assert(error !== undefined);
+        assert(binding.volumeStats(volume).devices[1].failed === true);
+        exception(
+          'volumeWrite',
+          'too few replicas are available for options.writeQuorum',
+          [[volume, data, 0, data.length, 0, {}, function() {}]]
+        );
+        fds.forEach(function(fd) { Node.fs.closeSync(fd); });
+        paths.forEach(function(path) { Node.fs.unlinkSync(path); });
+      }
+    );
+  }
 })();
 
 (function() {
-  if (Node.process.platform !== 'darwin') return;
-  var fd1 = Node.fs.openSync(module.filename, 'r');
-  binding.setF_NOCACHE(fd1, 1,
-    function(error) {
-      assert(error === undefined);
-      console.log('PASS: setF_NOCACHE(fd1, 1)');
-      binding.setF_NOCACHE(fd1, 0,
-        function(error) {
+  // An erasure volume of 4 data and 2 parity devices, where one device can be
+  // written but not read, so that every read of its chunks is reconstructed:
+  var count = 6;
+  var stripe = 4096;
+  var paths = [];
+  var fds = [];
+  for (var index = 0; index < count; index++) {
+    paths.push(tmpPath('erasure-' + index));
+    Node.fs.writeFileSync(paths[index], Buffer.alloc(stripe * 8));
+    var flags = index === 1 ? Node.fs.constants.O_WRONLY : 'r+';
+    fds.push(Node.fs.openSync(paths[index], flags));
+  }
+  var options = { layout: 'erasure', parityDevices: 2, stripeSize: stripe };
+  binding.volumeOpen(fds, options, function(error, volume) {
+    assert(error === undefined);
+    var geometry = binding.volumeGeometry(volume);
+    assert(geometry.layout === 'erasure');
+    assert(geometry.dataDevices === 4);
+    assert(geometry.parityDevices === 2);
+    assert(geometry.stripeSize === stripe);
+    assert(geometry.size === stripe * 8 * 4);
+    console.log('PASS: volumeOpen() erasure');
+    var expect = Buffer.alloc(geometry.size);
+    var writes = [
+      [0, geometry.size],
+      [512, 1024],
+      [stripe - 512, stripe * 2],
+      [stripe * 4 - 512, stripe * 5 + 1024],
+      [stripe * 5, stripe],
+      [geometry.size - 512, 512]
+    ];
+    function next() {
+      if (writes.length === 0) return parity();
+      var write = writes.shift();
+      var data = Node.crypto.randomBytes(write[1]);
+      data.copy(expect, write[0]);
+      binding.volumeWrite(volume, data, 0, data.length, write[0], {},
+        function(error, result) {
           assert(error === undefined);
-          console.log('PASS: setF_NOCACHE(fd1, 0)');
+          assert(result.bytes === data.length);
+          var buffer = Buffer.alloc(geometry.size);
+          binding.volumeRead(volume, buffer, 0, buffer.length, 0, {},
+            function(error, result) {
+              assert(error === undefined);
+              assert(result.bytes === buffer.length);
+              assert(buffer.equals(expect));
+              console.log('PASS: volumeWrite() and volumeRead() erasure ' +
+                JSON.stringify(write));
+              next();
+            }
+          );
         }
       );
     }
-  );
+    function parity() {
+      var stats = binding.volumeStats(volume);
+      assert(stats.reconstructions > 0);
+      assert(stats.devices[1].errors > 0);
+      assert(stats.devices[1].failed === false);
+      console.log('PASS: volumeRead() reconstructs an unreadable device');
+      unreadable(2, function(error, buffer) {
+        assert(error === undefined);
+        assert(buffer.equals(expect));
+        console.log('PASS: volumeRead() reconstructs 2 unreadable devices');
+        unreadable(3, function(error) {
+          assert(error !== undefined);
+          assert(error.message === 'too many devices have failed');
+          fds.forEach(function(fd) { Node.fs.closeSync(fd); });
+          paths.forEach(function(path) { Node.fs.unlinkSync(path); });
+          console.log('PASS: volumeRead() fails beyond parityDevices');
+        });
+      });
+    }
+    function unreadable(index, end) {
+      Node.fs.closeSync(fds[index]);
+      fds[index] = Node.fs.openSync(paths[index], Node.fs.constants.O_WRONLY);
+      binding.volumeOpen(fds, options, function(error, volume) {
+        assert(error === undefined);
+        var buffer = Buffer.alloc(geometry.size);
+        binding.volumeRead(volume, buffer, 0, buffer.length, 0, {},
+          function(error) {
+            end(error, buffer);
+          }
+        );
+      });
+    }
+    next();
+  });
 })();
 
 (function() {
-  if (Node.process.platform === 'win32') return;
-  var fd1 = Node.fs.openSync(module.filename, 'r');
-  var fd2 = Node.fs.openSync(module.filename, 'r');
-  binding.setFlock(fd1, 0,
-    function(error) {
+  // Every kernel supported by the CPU must encode the same parity, and must
+  // reconstruct the same data from it:
+  assert(['scalar', 'ssse3', 'avx2', 'avx512'].indexOf(binding.GF) !== -1);
+  var names = ['scalar', 'ssse3', 'avx2', 'avx512'];
+  names = names.slice(0, names.indexOf(binding.GF) + 1);
+  if (names.length < 4) {
+    exception('volumeOpen', 'options.kernel is not supported by this CPU', [
+      [[1, 2, 3], { layout: 'erasure', parityDevices: 1, kernel: 'avx512' },
+        function() {}]
+    ]);
+  }
+  var count = 6;
+  var stripe = 4096;
+  var size = stripe * 4 * 4;
+  var data = Node.crypto.randomBytes(size);
+  // A full write encodes the parity, and a partial write updates it:
+  var writes = [
+    [0, size],
+    [stripe - 100, stripe * 2 + 300],
+    [stripe * 9 + 7, 1000]
+  ];
+  var expect = Buffer.from(data);
+  writes.slice(1).forEach(function(write) {
+    data.copy(expect, write[0], size - write[1]);
+  });
+  var devices;
+  function next() {
+    if (names.length === 0) return;
+    var kernel = names.shift();
+    var paths = [];
+    var fds = [];
+    for (var index = 0; index < count; index++) {
+      paths.push(tmpPath('erasure-' + kernel + '-' + index));
+      Node.fs.writeFileSync(paths[index], Buffer.alloc(stripe * 4));
+      fds.push(Node.fs.openSync(paths[index], 'r+'));
+    }
+    var options = {
+      layout: 'erasure',
+      parityDevices: 2,
+      stripeSize: stripe,
+      kernel: kernel
+    };
+    binding.volumeOpen(fds, options, function(error, volume) {
       assert(error === undefined);
-      console.log('PASS: setFlock(fd1, 0)');
-      binding.setFlock(fd1, 1,
-        function(error) {
+      var pending = writes.slice();
+      function write() {
+        if (pending.length === 0) return compare();
+        var next = pending.shift();
+        var offset = next[0] === 0 ? 0 : size - next[1];
+        binding.volumeWrite(volume, data, offset, next[1], next[0], {},
+          function(error, result) {
+            assert(error === undefined);
+            assert(result.bytes === next[1]);
+            write();
+          }
+        );
+      }
+      function compare() {
+        var bytes = paths.map(function(path) {
+          return Node.fs.readFileSync(path);
+        });
+        if (devices === undefined) devices = bytes;
+        bytes.forEach(function(buffer, index) {
+          assert(buffer.equals(devices[index]));
+        });
+        console.log('PASS: volumeWrite({ kernel: "' + kernel + '" })');
+        // Two unreadable data devices leave only the parity to reconstruct
+        // their chunks:
+        [0, 2].forEach(function(index) {
+          Node.fs.closeSync(fds[index]);
+          fds[index] = Node.fs.openSync(
+            paths[index],
+            Node.fs.constants.O_WRONLY
+          );
+        });
+        binding.volumeOpen(fds, options, function(error, volume) {
           assert(error === undefined);
-          console.log('PASS: setFlock(fd1, 1)');
-          binding.setFlock(fd2, 1,
-            function(error) {
-              assert(error !== undefined);
-              assert(
-                error.message === 'EWOULDBLOCK, the file is already locked'
-              );
-              console.log(
-                'PASS: setFlock(fd2, 1): ' + JSON.stringify(error.message)
-              );
-              binding.setFlock(fd1, 0,
-                function(error) {
-                  assert(error === undefined);
-                  console.log('PASS: setFlock(fd1, 0)');
-                  binding.setFlock(fd2, 1,
-                    function(error) {
-                      assert(error === undefined);
-                      console.log('PASS: setFlock(fd2, 1)');
-                      binding.setFlock(fd2, 0,
-                        function(error) {
-                          assert(error === undefined);
-                          console.log('PASS: setFlock(fd2, 0)');
-                        }
-                      );
-                    }
-                  );
-                }
-              );
+          var buffer = Buffer.alloc(size);
+          binding.volumeRead(volume, buffer, 0, size, 0, {},
+            function(error, result) {
+              assert(error === undefined);
+              assert(result.bytes === size);
+              assert(buffer.equals(expect));
+              assert(binding.volumeStats(volume).reconstructions > 0);
+              fds.forEach(function(fd) { Node.fs.closeSync(fd); });
+              paths.forEach(function(path) { Node.fs.unlinkSync(path); });
+              console.log('PASS: volumeRead({ kernel: "' + kernel + '" })');
+              next();
             }
           );
+        });
+      }
+      write();
+    });
+  }
+  next();
+})();
+
+(function() {
+  // A log of 4 segments of 64 KiB, with records appended in bursts so that
+  // each burst is batched into one or two group commits:
+  var path = tmpPath('log');
+  var fd = Node.fs.openSync(path, 'w+');
+  var options = { blockSize: 4096, segmentSize: 65536, segments: 4 };
+  var records = [];
+  binding.logOpen(fd, options, function(error, log) {
+    assert(error === undefined);
+    var status = binding.logStatus(log);
+    assert(status.tail === 0);
+    assert(status.durable === 0);
+    assert(Node.fs.fstatSync(fd).size === 65536 * 4);
+    console.log('PASS: logOpen() preallocates segments');
+    exception('logAppend', 'buffer must not be empty', [
+      [log, Buffer.alloc(0), function() {}]
+    ]);
+    exception('logRelease', 'lsn must not be greater than the durable lsn', [
+      [log, 1]
+    ]);
+    var pending = 100;
+    for (var index = 0; index < 100; index++) {
+      // Some records span several blocks:
+      var length = index % 10 === 0 ? 10000 : 1 + index * 7;
+      var data = Node.crypto.randomBytes(length);
+      var lsn = binding.logAppend(log, data, function(error) {
+        assert(error === undefined);
+        if (--pending === 0) durable();
+      });
+      assert(records.length === 0 || lsn > records[records.length - 1].lsn);
+      records.push({ lsn: lsn, data: data });
+    }
+    function durable() {
+      var status = binding.logStatus(log);
+      assert(status.records === 100);
+      assert(status.commits >= 1 && status.commits <= 2);
+      assert(status.durable === status.tail);
+      assert(status.durable % 4096 === 0);
+      console.log('PASS: logAppend() group commits ' + status.commits);
+      binding.logRead(log, 0, 1e9, function(error, result) {
+        assert(error === undefined);
+        assert(result.records.length === records.length);
+        result.records.forEach(function(record, index) {
+          assert(record.lsn === records[index].lsn);
+          assert(record.data.equals(records[index].data));
+        });
+        assert(result.next === status.durable);
+        console.log('PASS: logRead() reads every record');
+        binding.logRead(log, records[50].lsn, 1, function(error, result) {
+          assert(error === undefined);
+          assert(result.records.length === 1);
+          assert(result.records[0].data.equals(records[50].data));
+          assert(result.next === records[51].lsn);
+          console.log('PASS: logRead() reads from an lsn up to a length');
+          torn(status);
+        });
+      });
+    }
+  });
+  function torn(status) {
+    // Zero the last block, tearing the last commit, which is discarded whole:
+    var last = records[records.length - 1];
+    Node.fs.writeSync(fd, Buffer.alloc(4096), 0, 4096, status.durable - 4096);
+    binding.logOpen(fd, options, function(error, log) {
+      assert(error === undefined);
+      var recovered = binding.logStatus(log);
+      assert(recovered.tail < status.durable);
+      assert(recovered.tail % 4096 === 0);
+      console.log('PASS: logOpen() recovers the tail');
+      var data = Buffer.from('after recovery');
+      var lsn = binding.logAppend(log, data, function(error) {
+        assert(error === undefined);
+        binding.logRead(log, 0, 1e9, function(error, result) {
+          assert(error === undefined);
+          var lsns = result.records.map(function(record) {
+            return record.lsn;
+          });
+          // Records torn by the crash are skipped:
+          assert(lsns.indexOf(last.lsn) === -1);
+          assert(lsns[lsns.length - 1] === lsn);
+          assert(result.records[lsns.length - 1].data.equals(data));
+          console.log('PASS: logRead() skips a torn record');
+          recycle(log);
+        });
+      });
+    });
+  }
+  function recycle(log) {
+    // Fill the ring several times over, releasing records when it is full:
+    var appended = 0;
+    var last = null;
+    function append() {
+      if (appended === 1000) return setTimeout(reopen, 10);
+      var data = Node.crypto.randomBytes(1000);
+      try {
+        var lsn = binding.logAppend(log, data, function(error) {
+          assert(error === undefined);
+        });
+      } catch (error) {
+        assert(/^log is full/.test(error.message));
+        binding.logRelease(log, binding.logStatus(log).durable);
+        return setTimeout(append, 1);
+      }
+      appended++;
+      last = { lsn: lsn, data: data };
+      setImmediate(append);
+    }
+    function reopen() {
+      var status = binding.logStatus(log);
+      assert(status.durable > 65536 * 4 * 3);
+      binding.logOpen(fd, options, function(error, log) {
+        assert(error === undefined);
+        var recovered = binding.logStatus(log);
+        assert(recovered.tail === status.durable);
+        binding.logRead(log, recovered.head, 1e9, function(error, result) {
+          assert(error === undefined);
+          var record = result.records[result.records.length - 1];
+          assert(record.lsn === last.lsn);
+          assert(record.data.equals(last.data));
+          Node.fs.closeSync(fd);
+          Node.fs.unlinkSync(path);
+          console.log('PASS: logAppend() recycles segments');
+        });
+      });
+    }
+    append();
+  }
+})();
+
+(function() {
+  // A commit torn by a crash, across the end of the first segment, which loses
+  // its first block but leaves its later blocks valid at their LSNs:
+  var path = tmpPath('log-torn');
+  var fd = Node.fs.openSync(path, 'w+');
+  var options = { blockSize: 4096, segmentSize: 65536, segments: 4 };
+  // The payload of a block is 4064 bytes, so that this fills 14 blocks:
+  var first = Buffer.alloc(13 * 4064 + 100, 1);
+  var after = Buffer.alloc(100, 3);
+  binding.logOpen(fd, options, function(error, log) {
+    assert(error === undefined);
+    binding.logAppend(log, first, function(error) {
+      assert(error === undefined);
+      var start = binding.logStatus(log).durable;
+      assert(start === 4096 * 14);
+      binding.logAppend(log, Buffer.alloc(12000, 2), function(error) {
+        assert(error === undefined);
+        assert(binding.logStatus(log).durable === start + 4096 * 3);
+        Node.fs.writeSync(fd, Buffer.alloc(4096), 0, 4096, start);
+        binding.logOpen(fd, options, function(error, log) {
+          assert(error === undefined);
+          assert(binding.logStatus(log).tail === start);
+          // A shorter commit from the same LSN must not adopt the rest:
+          binding.logAppend(log, after, function(error) {
+            assert(error === undefined);
+            binding.logOpen(fd, options, function(error, log) {
+              assert(error === undefined);
+              assert(binding.logStatus(log).tail === start + 4096);
+              binding.logRead(log, 0, 1e9, function(error, result) {
+                assert(error === undefined);
+                assert(result.records.length === 2);
+                assert(result.records[0].data.equals(first));
+                assert(result.records[1].data.equals(after));
+                binding.logScan(fd, options, null, function(error, result) {
+                  assert(error === undefined);
+                  assert(result.tail === start + 4096);
+                  assert(result.records === 2);
+                  Node.fs.closeSync(fd);
+                  Node.fs.unlinkSync(path);
+                  console.log('PASS: logOpen() discards a torn commit whole');
+                });
+              });
+            });
+          });
+        });
+      });
+    });
+  });
+})();
+
+(function() {
+  // Scan a log which has wrapped around its ring, with records which span
+  // chunks, segments and the end of the ring, and compare with logRead():
+  var path = tmpPath('log-scan');
+  var fd = Node.fs.openSync(path, 'w+');
+  var options = { blockSize: 4096, segmentSize: 65536, segments: 4 };
+  var scans = [
+    { depth: 1, ioSize: 4096 },
+    { depth: 4, ioSize: 16384 },
+    { depth: 8, ioSize: 1048576 }
+  ];
+  binding.logOpen(fd, options, function(error, log) {
+    assert(error === undefined);
+    binding.logScan(fd, options, null, function(error, result) {
+      assert(error === undefined);
+      assert(result.head === 0);
+      assert(result.tail === 0);
+      assert(result.lsns instanceof Float64Array);
+      assert(result.lengths instanceof Uint32Array);
+      assert(result.lsns.length === 0);
+      console.log('PASS: logScan() scans an empty log');
+      var appended = 0;
+      (function append() {
+        if (appended === 400) return setTimeout(scan.bind(null, log), 10);
+        var data = Node.crypto.randomBytes(1 + (appended * 7919) % 20000);
+        try {
+          binding.logAppend(log, data, function(error) {
+            assert(error === undefined);
+          });
+        } catch (error) {
+          binding.logRelease(log, binding.logStatus(log).durable);
+          return setTimeout(append, 1);
         }
+        appended++;
+        if (appended % 5 === 0) return setImmediate(append);
+        append();
+      })();
+    });
+  });
+  function scan(log, torn) {
+    var status = binding.logStatus(log);
+    assert(status.durable > 65536 * 4);
+    var pending = scans.length;
+    scans.forEach(function(scan) {
+      var scanOptions = Object.assign({}, options, scan);
+      binding.logScan(fd, scanOptions, null, function(error, result) {
+        assert(error === undefined);
+        assert(result.tail === status.durable);
+        // A torn commit may have overwritten the start of the oldest segment:
+        assert(torn || result.head % 65536 === 0);
+        assert(result.head >= status.durable - 65536 * 4);
+        assert(result.bytes === 65536 * 4);
+        // Records before the head of the open log have been released:
+        var from = Math.max(result.head, status.head);
+        var skip = 0;
+        while (result.lsns[skip] < from) skip++;
+        binding.logRead(log, from, 1e12, function(error, read) {
+          assert(error === undefined);
+          assert(read.records.length > 0);
+          assert(result.records === skip + read.records.length);
+          read.records.forEach(function(record, index) {
+            assert(result.lsns[skip + index] === record.lsn);
+            assert(result.lengths[skip + index] === record.data.length);
+          });
+          if (--pending > 0) return;
+          if (torn) {
+            Node.fs.closeSync(fd);
+            Node.fs.unlinkSync(path);
+            console.log('PASS: logScan() skips a torn record');
+          } else {
+            console.log('PASS: logScan() finds every record');
+            tear(status);
+          }
+        });
+      });
+    });
+  }
+  function tear(status) {
+    var position = (status.durable - 4096) % (65536 * 4);
+    Node.fs.writeSync(fd, Buffer.alloc(4096), 0, 4096, position);
+    binding.logOpen(fd, options, function(error, log) {
+      assert(error === undefined);
+      // The commit of the block is discarded whole:
+      assert(binding.logStatus(log).durable < status.durable);
+      scan(log, true);
+    });
+  }
+})();
+
+
+(function() {
+  // Doublewrite pages of a file, with the area at the start of the file, and
+  // repair a page torn after its batch was written to the area:
+  var path = tmpPath('doublewrite');
+  var fd = Node.fs.openSync(path, 'w+');
+  var options = { areaOffset: 0, areaSize: 65536, pageSize: 4096 };
+  var positions = [65536 + 4096 * 5, 65536, 65536 + 4096 * 2];
+  var pages = positions.map(function(position) {
+    return { position: position, buffer: Node.crypto.randomBytes(4096) };
+  });
+  function read(position) {
+    var buffer = Buffer.alloc(4096);
+    Node.fs.readSync(fd, buffer, 0, 4096, position);
+    return buffer;
+  }
+  binding.doublewriteRecover(fd, options, function(error, result) {
+    assert(error === undefined);
+    assert(result.pages === 0);
+    assert(result.repaired === 0);
+    console.log('PASS: doublewriteRecover() finds no batch');
+    binding.doublewrite(fd, pages, options, function(error, result) {
+      assert(error === undefined);
+      assert(result.pages === 3);
+      assert(Node.fs.fstatSync(fd).size === 65536 + 4096 * 6);
+      pages.forEach(function(page) {
+        assert(read(page.position).equals(page.buffer));
+      });
+      console.log('PASS: doublewrite() writes pages in place');
+      binding.doublewriteRecover(fd, options, function(error, result) {
+        assert(error === undefined);
+        assert(result.pages === 3);
+        assert(result.repaired === 0);
+        console.log('PASS: doublewriteRecover() repairs no intact page');
+        torn();
+      });
+    });
+  });
+  function torn() {
+    // Tear one page, and lose the write of another:
+    Node.fs.writeSync(fd, Buffer.alloc(2048, 1), 0, 2048, positions[0] + 2048);
+    Node.fs.writeSync(fd, Buffer.alloc(4096), 0, 4096, positions[1]);
+    binding.doublewriteRecover(fd, options, function(error, result) {
+      assert(error === undefined);
+      assert(result.pages === 3);
+      assert(result.repaired === 2);
+      pages.forEach(function(page) {
+        assert(read(page.position).equals(page.buffer));
+      });
+      console.log('PASS: doublewriteRecover() repairs torn pages');
+      tornArea();
+    });
+  }
+  function tornArea() {
+    // A batch torn in the area was never written in place, and is ignored:
+    var page = read(positions[2]);
+    Node.fs.writeSync(fd, Buffer.alloc(512, 1), 0, 512, 4096 + 512);
+    Node.fs.writeSync(fd, Buffer.alloc(4096), 0, 4096, positions[2]);
+    binding.doublewriteRecover(fd, options, function(error, result) {
+      assert(error === undefined);
+      assert(result.pages === 0);
+      assert(result.repaired === 0);
+      assert(read(positions[2]).equals(Buffer.alloc(4096)));
+      assert(!read(positions[2]).equals(page));
+      Node.fs.closeSync(fd);
+      Node.fs.unlinkSync(path);
+      console.log('PASS: doublewriteRecover() ignores a torn batch');
+    });
+  }
+})();
+
+(function() {
+  // An atomic write either completes in full, or fails before writing where
+  // the file or device does not support untorn writes:
+  var path = tmpPath('atomic');
+  var fd = Node.fs.openSync(path, 'w+');
+  var buffer = Node.crypto.randomBytes(4096);
+  binding.write(fd, buffer, 0, 4096, 8192, { atomic: true }, function(error) {
+    if (error) {
+      assert(
+        error.message ===
+        'atomic writes are not supported by this file or device'
       );
+      assert(Node.fs.fstatSync(fd).size === 0);
+    } else {
+      var target = Buffer.alloc(4096);
+      Node.fs.readSync(fd, target, 0, 4096, 8192);
+      assert(target.equals(buffer));
     }
-  );
+    Node.fs.closeSync(fd);
+    Node.fs.unlinkSync(path);
+    console.log('PASS: write() with options.atomic');
+  });
+})();
+
+(function() {
+  // Allocate aligned extents, free them, and find the bitmap persisted and
+  // repaired from the journal when the allocator is opened again:
+  var path = tmpPath('allocator');
+  var fd = Node.fs.openSync(path, 'w+');
+  var format = {
+    format: true,
+    size: 16777216,
+    unitSize: 4096,
+    journalSize: 16384
+  };
+  // The superblock, journal and bitmap block take the first 6 units:
+  var metadata = 4096 + 16384 + 4096;
+  binding.allocatorOpen(fd, {}, function(error) {
+    assert(
+      error.message === 'fd does not have an allocator, use options.format'
+    );
+    console.log('PASS: allocatorOpen() without options.format');
+    binding.allocatorOpen(fd, format, function(error, allocator) {
+      assert(error === undefined);
+      assert(Node.fs.fstatSync(fd).size === 16777216);
+      var stats = binding.allocatorStats(allocator);
+      assert(stats.size === 16777216);
+      assert(stats.metadataBytes === metadata);
+      assert(stats.freeBytes === 16777216 - metadata);
+      assert(stats.freeExtents === 1);
+      assert(stats.fragmentation === 0);
+      console.log('PASS: allocatorOpen() formats');
+      allocate(allocator);
+    });
+  });
+  function allocate(allocator) {
+    var a = binding.allocatorAllocate(allocator, 100, {});
+    assert(a === metadata);
+    var b = binding.allocatorAllocate(allocator, 65536, { alignment: 65536 });
+    assert(b === 65536);
+    var stats = binding.allocatorStats(allocator);
+    assert(stats.allocatedBytes === metadata + 4096 + 65536);
+    assert(stats.freeExtents === 2);
+    assert(stats.largestFreeExtent === 16777216 - 131072);
+    assert(stats.fragmentation > 0);
+    assert(stats.dirtyBlocks === 1);
+    console.log('PASS: allocatorAllocate() aligns extents');
+    exception('allocatorFree', 'range is not allocated', [
+      [allocator, a, b - a]
+    ]);
+    exception(
+      'allocatorFree',
+      'range must not overlap the metadata of the allocator',
+      [[allocator, 0, 4096]]
+    );
+    exception('allocatorFree', 'offset must be a multiple of the unit size', [
+      [allocator, 4097, 4096]
+    ]);
+    exception(
+      'allocatorFree',
+      'offset + length must not exceed the size of the allocator',
+      [[allocator, 16777216 - 4096, 8192]]
+    );
+    exception('allocatorAllocate', 'insufficient contiguous free space', [
+      [allocator, 16777216, {}]
+    ]);
+    binding.allocatorFree(allocator, a, 4096);
+    stats = binding.allocatorStats(allocator);
+    assert(stats.pendingBytes === 4096);
+    assert(stats.allocatedBytes === metadata + 65536);
+    // Space freed is not allocated again until the free is durable:
+    var c = binding.allocatorAllocate(allocator, 4096, {});
+    assert(c === a + 4096);
+    binding.allocatorSync(allocator, function(error) {
+      assert(error === undefined);
+      var stats = binding.allocatorStats(allocator);
+      assert(stats.pendingBytes === 0);
+      assert(stats.dirtyBlocks === 0);
+      assert(binding.allocatorAllocate(allocator, 4096, {}) === a);
+      binding.allocatorFree(allocator, a, 4096);
+      console.log('PASS: allocatorFree() reuses space after allocatorSync()');
+      binding.allocatorSync(allocator, function(error) {
+        assert(error === undefined);
+        reopen(binding.allocatorStats(allocator));
+      });
+    });
+  }
+  function reopen(expected) {
+    // Tear the bitmap block, to be repaired from the journal:
+    Node.fs.writeSync(fd, Buffer.alloc(2048), 0, 2048, 4096 + 16384);
+    binding.allocatorOpen(fd, {}, function(error, allocator) {
+      assert(error === undefined);
+      var stats = binding.allocatorStats(allocator);
+      assert(JSON.stringify(stats) === JSON.stringify(expected));
+      assert(binding.allocatorAllocate(allocator, 4096, {}) === metadata);
+      Node.fs.closeSync(fd);
+      Node.fs.unlinkSync(path);
+      console.log('PASS: allocatorOpen() repairs the bitmap from the journal');
+    });
+  }
+})();
+
+(function() {
+  // Put, get and free records in the slots of a file, and find the slots in
+  // use when the store is opened again:
+  var path = tmpPath('slots');
+  var fd = Node.fs.openSync(path, 'w+');
+  var format = { format: true, slotSize: 4096, slots: 64, depth: 3 };
+  binding.slotOpen(fd, {}, function(error) {
+    assert(
+      error.message === 'fd does not have a slot store, use options.format'
+    );
+    console.log('PASS: slotOpen() without options.format');
+    binding.slotOpen(fd, format, function(error, store) {
+      assert(error === undefined);
+      assert(Node.fs.fstatSync(fd).size === 65 * 4096);
+      var stats = binding.slotStats(store);
+      assert(stats.slots === 64);
+      assert(stats.recordSize === 4096 - 32);
+      assert(stats.freeSlots === 64);
+      console.log('PASS: slotOpen() formats');
+      put(store);
+    });
+  });
+  function put(store) {
+    var records = [];
+    for (var index = 0; index < 10; index++) {
+      records.push({
+        slot: binding.slotAllocate(store),
+        buffer: Node.crypto.randomBytes(index * 400)
+      });
+    }
+    assert(records[9].slot === 9);
+    var done = function() {};
+    exception('slotGet', 'slots must be allocated', [[store, [10], done]]);
+    exception('slotGet', 'slots must be less than the number of slots', [
+      [store, [64], done]
+    ]);
+    exception('slotGet', 'slots must not be empty', [[store, [], done]]);
+    exception('slotFree', 'slots must be unique', [[store, [1, 1], done]]);
+    exception(
+      'slotPut',
+      'buffers must be at most the slot size - 32 bytes',
+      [[store, [{ slot: 0, buffer: Buffer.alloc(4065) }], done]]
+    );
+    exception(
+      'slotPut',
+      'records must be an array of { slot, buffer } objects',
+      [[store, [{ slot: 0 }], done]]
+    );
+    binding.slotPut(store, records, function(error, result) {
+      assert(error === undefined);
+      assert(result.slots === 10);
+      // The scan on open reads the slots below the high-water mark only:
+      var stats = binding.slotStats(store);
+      assert(stats.scanSlots >= 10 && stats.scanSlots <= 12);
+      var slots = records.map(function(record) { return record.slot; });
+      binding.slotGet(store, slots, function(error, result) {
+        assert(error === undefined);
+        records.forEach(function(record, index) {
+          assert(result.buffers[index].equals(record.buffer));
+        });
+        assert(result.corrupt.length === 0);
+        console.log('PASS: slotPut() and slotGet()');
+        free(store, records);
+      });
+    });
+  }
+  function free(store, records) {
+    binding.slotFree(store, [2, 5], function(error) {
+      assert(error === undefined);
+      var stats = binding.slotStats(store);
+      assert(stats.usedSlots === 8);
+      assert(stats.frees === 2);
+      var scanSlots = stats.scanSlots;
+      // Corrupt the record in slot 7:
+      var byte = Buffer.alloc(1);
+      Node.fs.readSync(fd, byte, 0, 1, 4096 * 8 + 100);
+      byte[0] ^= 1;
+      Node.fs.writeSync(fd, byte, 0, 1, 4096 * 8 + 100);
+      // A slot which is allocated but never put is free once opened again:
+      assert(binding.slotAllocate(store) === 10);
+      binding.slotOpen(fd, {}, function(error, store) {
+        assert(error === undefined);
+        var stats = binding.slotStats(store);
+        assert(stats.usedSlots === 8);
+        assert(stats.corruptSlots === 1);
+        assert(stats.scanSlots === scanSlots);
+        binding.slotGet(store, [1, 7], function(error, result) {
+          assert(error === undefined);
+          assert(result.buffers[0].equals(records[1].buffer));
+          assert(result.buffers[1] === null);
+          assert(result.corrupt.length === 1);
+          assert(result.corrupt[0] === 7);
+          assert(binding.slotAllocate(store) === 2);
+          console.log('PASS: slotOpen() finds the slots in use');
+          binding.slotOpen(fd, format, function(error, store) {
+            assert(error === undefined);
+            assert(binding.slotStats(store).freeSlots === 64);
+            assert(binding.slotStats(store).scanSlots === 0);
+            Node.fs.closeSync(fd);
+            Node.fs.unlinkSync(path);
+            console.log('PASS: slotOpen() formats over a slot store');
+          });
+        });
+      });
+    });
+  }
+})();
+
+(function() {
+  // Write a container of compressible and random chunks, and read it back at
+  // random and in order:
+  var path = tmpPath('container');
+  var fd = Node.fs.openSync(path, 'w+');
+  var chunks = [];
+  for (var index = 0; index < 3000; index++) {
+    if (index % 3 === 0) {
+      chunks.push(Buffer.alloc(index * 7 % 20000, index % 251));
+    } else {
+      chunks.push(Node.crypto.randomBytes(index * 13 % 9000));
+    }
+  }
+  var writer = binding.containerCreate(fd, { compress: 'lz4' });
+  var done = function() {};
+  exception('containerAppend', 'buffers must not be empty', [
+    [writer, [], done]
+  ]);
+  exception('containerAppend', 'buffers must be an array of buffers', [
+    [writer, ['chunk'], done]
+  ]);
+  binding.containerAppend(writer, chunks.slice(0, 1000), function(error, r) {
+    assert(error === undefined);
+    assert(r.first === 0);
+    assert(r.chunks === 1000);
+    assert(r.bytes % 4096 === 0);
+    binding.containerAppend(writer, chunks.slice(1000), function(error, r) {
+      assert(error === undefined);
+      assert(r.first === 1000);
+      binding.containerFinish(writer, function(error, result) {
+        assert(error === undefined);
+        assert(result.chunks === 3000);
+        assert(result.size === Node.fs.fstatSync(fd).size);
+        assert(result.size % 4096 === 0);
+        exception('containerFinish', 'writer is finished', [[writer, done]]);
+        console.log('PASS: containerAppend() and containerFinish()');
+        open();
+      });
+    });
+    exception('containerAppend', 'writer is busy', [
+      [writer, [chunks[0]], done]
+    ]);
+  });
+  function open() {
+    binding.containerOpen(fd, {}, function(error, reader) {
+      assert(error === undefined);
+      var info = binding.containerInfo(reader);
+      assert(info.chunks === 3000);
+      assert(info.sectorSize === 4096);
+      assert(info.checksum === true);
+      assert(info.storedBytes % 4096 === 0);
+      var numbers = [2999, 0, 1, 1500, 3, 1500];
+      exception(
+        'containerRead',
+        'chunks must be an array of chunk numbers',
+        [[reader, [3000], done]]
+      );
+      binding.containerRead(reader, numbers, function(error, buffers) {
+        assert(error === undefined);
+        numbers.forEach(function(number, index) {
+          assert(buffers[index].equals(chunks[number]));
+        });
+        console.log('PASS: containerOpen() and containerRead()');
+        scan(reader);
+      });
+    });
+  }
+  function scan(reader) {
+    var next = 10;
+    var options = { first: 10, readahead: 65536 };
+    binding.containerScan(reader, options, function(buffer, index) {
+      assert(index === next++);
+      assert(buffer.equals(chunks[index]));
+    }, function(error, result) {
+      assert(error === undefined);
+      assert(next === 3000);
+      assert(result.chunks === 3000);
+      console.log('PASS: containerScan() reads chunks in order');
+      stop(reader);
+    });
+  }
+  function stop(reader) {
+    // An exception thrown by onChunk stops the scan, which calls back no more:
+    var thrown = new Error('onChunk');
+    var next = 0;
+    process.once('uncaughtException', function(error) {
+      if (error !== thrown) throw error;
+      setTimeout(function() {
+        assert(next === 6);
+        console.log('PASS: containerScan() stops when onChunk throws');
+        reorder(reader);
+      }, 100);
+    });
+    var options = { readahead: 65536 };
+    binding.containerScan(reader, options, function(buffer, index) {
+      assert(index === next++);
+      if (index === 5) throw thrown;
+    }, function() {
+      throw new Error('FAIL: containerScan() called back after onChunk threw');
+    });
+  }
+  function reorder(reader) {
+    // Swap the positions of chunks 0 and 1 in a copy of the container, with
+    // the checksums of the index and footer made good again:
+    var copy = Node.fs.readFileSync(path);
+    var footer = copy.slice(copy.length - 64);
+    var index = Number(footer.readBigUInt64LE(16));
+    var entries = copy.slice(index, index + 3000 * 24);
+    var position = Buffer.from(entries.slice(0, 8));
+    entries.copy(entries, 0, 24, 32);
+    position.copy(entries, 24);
+    footer.writeUInt32LE(binding.crc32c(entries), 36);
+    footer.writeUInt32LE(binding.crc32c(footer.slice(4)), 0);
+    var other = tmpPath('container-reorder');
+    Node.fs.writeFileSync(other, copy);
+    var fdOther = Node.fs.openSync(other, 'r');
+    binding.containerOpen(fdOther, {}, function(error) {
+      assert(error.message === 'container index is corrupt');
+      Node.fs.closeSync(fdOther);
+      Node.fs.unlinkSync(other);
+      console.log('PASS: containerOpen() rejects chunks out of order');
+      corrupt(reader);
+    });
+  }
+  function corrupt(reader) {
+    // Corrupt the 13 random bytes of chunk 1, after its 16-byte header:
+    var byte = Buffer.from([~chunks[1][5] & 255]);
+    Node.fs.writeSync(fd, byte, 0, 1, 4096 + 16 + 5);
+    binding.containerRead(reader, [1], function(error) {
+      assert(error.message === 'chunk failed its checksum');
+      var size = Node.fs.fstatSync(fd).size;
+      Node.fs.writeSync(fd, Buffer.alloc(1, 1), 0, 1, size - 1);
+      binding.containerOpen(fd, {}, function(error) {
+        assert(error.message === 'fd is not a container');
+        Node.fs.closeSync(fd);
+        Node.fs.unlinkSync(path);
+        console.log('PASS: containerRead() verifies checksums');
+      });
+    });
+  }
+})();
+
+(function() {
+  // Spill to an anonymous arena, and release extents for reuse:
+  var dir = Node.os.tmpdir();
+  function names() {
+    return Node.fs.readdirSync(dir).filter(function(name) {
+      return name.indexOf('.arena-') === 0;
+    });
+  }
+  var before = names().length;
+  binding.arenaOpen(dir, { blockSize: 4096 }, function(error, arena) {
+    assert(error === undefined);
+    // The file has no name, or has been unlinked:
+    assert(names().length === before);
+    var stats = binding.arenaStats(arena);
+    assert(stats.blockSize === 4096);
+    assert(stats.size === 0);
+    var a = binding.arenaAllocate(arena, 10000);
+    var b = binding.arenaAllocate(arena, 4096);
+    assert(a === 0);
+    assert(b === 12288);
+    var done = function() {};
+    var outside = 'position + buffer.length must be within an allocated extent';
+    exception('arenaWrite', 'position must be a multiple of 4096', [
+      [arena, 100, Buffer.alloc(1), done]
+    ]);
+    exception('arenaWrite', outside, [[arena, 8192, Buffer.alloc(4097), done]]);
+    exception('arenaRead', outside, [[arena, 16384, Buffer.alloc(1), done]]);
+    exception('arenaWrite', 'buffer must not be empty', [
+      [arena, 0, Buffer.alloc(0), done]
+    ]);
+    exception(
+      'arenaRelease',
+      'position must be the start of an allocated extent',
+      [[arena, 4096, done]]
+    );
+    exception('arenaAllocate', 'length must not be 0', [[arena, 0]]);
+    var source = Node.crypto.randomBytes(10000);
+    var aligned = binding.getAlignedBuffer(4096, 4096);
+    Node.crypto.randomFillSync(aligned);
+    binding.arenaWrite(arena, a, source, function(error, result) {
+      assert(error === undefined);
+      assert(result.bytes === 10000);
+      binding.arenaWrite(arena, b, aligned, function(error) {
+        assert(error === undefined);
+        var target = Buffer.alloc(10000);
+        binding.arenaRead(arena, a, target, function(error) {
+          assert(error === undefined);
+          assert(target.equals(source));
+          var copy = binding.getAlignedBuffer(4096, 4096);
+          binding.arenaRead(arena, b, copy, function(error) {
+            assert(error === undefined);
+            assert(copy.equals(aligned));
+            console.log('PASS: arenaWrite() and arenaRead()');
+            partial(arena, a, b, source);
+          });
+        });
+      });
+      exception('arenaClose', 'arena has I/O in flight', [[arena]]);
+      exception('arenaRelease', 'extent has I/O in flight', [[arena, b, done]]);
+    });
+  });
+  function partial(arena, a, b, source) {
+    // A write of a partial 4096 bytes keeps the rest of them:
+    var middle = Node.crypto.randomBytes(100);
+    binding.arenaWrite(arena, a + 4096, middle, function(error) {
+      assert(error === undefined);
+      middle.copy(source, 4096);
+      var target = Buffer.alloc(10000);
+      binding.arenaRead(arena, a, target, function(error) {
+        assert(error === undefined);
+        assert(target.equals(source));
+        console.log('PASS: arenaWrite() keeps the rest of a partial block');
+        release(arena, a, b);
+      });
+    });
+  }
+  function release(arena, a, b) {
+    binding.arenaRelease(arena, a, function(error, result) {
+      assert(error === undefined);
+      assert(result.bytes === 12288);
+      var stats = binding.arenaStats(arena);
+      assert(stats.allocatedBytes === 4096);
+      assert(stats.freeBytes === 12288);
+      assert(stats.extents === 1);
+      // The released space is reused, and reads as zeroes where holes are
+      // supported:
+      var c = binding.arenaAllocate(arena, 8192);
+      assert(c === a);
+      var target = Buffer.alloc(8192, 1);
+      binding.arenaRead(arena, c, target, function(error) {
+        assert(error === undefined);
+        if (Node.process.platform === 'linux') {
+          assert(target.equals(Buffer.alloc(8192)));
+        }
+        binding.arenaRelease(arena, b, function(error) {
+          assert(error === undefined);
+          assert(binding.arenaStats(arena).size === 8192);
+          binding.arenaClose(arena);
+          assert(binding.arenaStats(arena).closed === true);
+          try {
+            binding.arenaAllocate(arena, 4096);
+          } catch (error) {
+            assert(error.message === 'arena is closed');
+            console.log('PASS: arenaRelease() punches and reuses extents');
+            return;
+          }
+          throw new Error('FAIL: arenaAllocate() expected arena is closed');
+        });
+      });
+    });
+  }
 })();